@@ -5,14 +5,15 @@ balde_response_t*
 hello(balde_app_t *app, balde_request_t *request)
 {
     balde_response_t *rv;
-    if (request->authorization == NULL) {
+    const balde_authorization_t *auth = balde_request_get_authorization(request);
+    if (auth == NULL) {
         rv = balde_abort(app, 401);
         balde_response_set_header(rv, "WWW-Authenticate",
             "Basic realm=\"Password?! :P\"");
         return rv;
     }
     gchar *tmp = g_strdup_printf("Hello %s, your password is: %s",
-        request->authorization->username, request->authorization->password);
+        auth->username, auth->password);
     rv = balde_make_response(tmp);
     g_free(tmp);
     return rv;
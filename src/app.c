@@ -17,6 +17,7 @@
 #include "balde.h"
 #include "balde-private.h"
 #include "app.h"
+#include "arena.h"
 #include "exceptions.h"
 #include "resources.h"
 #include "routing.h"
@@ -89,11 +90,19 @@ balde_app_init(void)
     balde_app_t *app = g_new(balde_app_t, 1);
     app->priv = g_new(struct _balde_app_private_t, 1);
     app->priv->views = NULL;
+    app->priv->router = balde_url_router_new();
+    app->priv->endpoints = g_hash_table_new(g_str_hash, g_str_equal);
     app->priv->before_requests = NULL;
     app->priv->static_resources = NULL;
+    app->priv->static_resources_index = g_hash_table_new(g_str_hash, g_str_equal);
     app->priv->user_data = NULL;
     app->priv->user_data_destroy_func = NULL;
     app->priv->config = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    app->priv->frozen = FALSE;
+    app->priv->freeze_once = 0;
+    app->priv->before_request_funcs = NULL;
+    app->priv->queued = 0;
+    app->priv->shed = 0;
     app->copy = FALSE;
     app->error = NULL;
     balde_app_add_url_rule(app, "static", "/static/<path:file>", BALDE_HTTP_GET,
@@ -113,15 +122,12 @@ balde_app_copy(balde_app_t *app)
 }
 
 
-G_LOCK_DEFINE_STATIC(config);
-
 BALDE_API void
 balde_app_set_config(balde_app_t *app, const gchar *name, const gchar *value)
 {
     BALDE_APP_READ_ONLY(app);
-    G_LOCK(config);
+    BALDE_APP_NOT_FROZEN(app);
     g_hash_table_replace(app->priv->config, g_utf8_strdown(name, -1), g_strdup(value));
-    G_UNLOCK(config);
 }
 
 
@@ -130,6 +136,7 @@ balde_app_set_config_from_envvar(balde_app_t *app, const gchar *name,
     const gchar *env_name, gboolean silent)
 {
     BALDE_APP_READ_ONLY(app);
+    BALDE_APP_NOT_FROZEN(app);
     const gchar *value = g_getenv(env_name);
     if (value == NULL && !silent) {
         gchar *msg = g_strdup_printf("%s environment variable must be set",
@@ -208,8 +215,12 @@ balde_app_free(balde_app_t *app)
     if (app == NULL)
         return;
     if (!app->copy) {
+        balde_url_router_free(app->priv->router);
+        g_hash_table_destroy(app->priv->endpoints);
         g_slist_free_full(app->priv->views, (GDestroyNotify) balde_app_free_views);
         g_slist_free_full(app->priv->before_requests, g_free);
+        g_free(app->priv->before_request_funcs);
+        g_hash_table_destroy(app->priv->static_resources_index);
         g_slist_free_full(app->priv->static_resources, (GDestroyNotify) balde_resource_free);
         g_hash_table_destroy(app->priv->config);
         balde_app_free_user_data(app);
@@ -220,13 +231,12 @@ balde_app_free(balde_app_t *app)
 }
 
 
-G_LOCK_DEFINE_STATIC(views);
-
 BALDE_API void
 balde_app_add_url_rule(balde_app_t *app, const gchar *endpoint, const gchar *rule,
     const balde_http_method_t method, balde_view_func_t view_func)
 {
     BALDE_APP_READ_ONLY(app);
+    BALDE_APP_NOT_FROZEN(app);
     GError *tmp_error = NULL;
     balde_view_t *view = g_new(balde_view_t, 1);
     view->url_rule = g_new(balde_url_rule_t, 1);
@@ -238,39 +248,81 @@ balde_app_add_url_rule(balde_app_t *app, const gchar *endpoint, const gchar *rul
         balde_app_free_views(view);
         return;
     }
+    if (g_strv_length(view->url_rule->match->args) > BALDE_URL_MAX_ARGS) {
+        gchar *msg = g_strdup_printf("URL rule has more than %d variables: %s",
+            BALDE_URL_MAX_ARGS, rule);
+        balde_abort_set_error_with_description(app, 500, msg);
+        g_free(msg);
+        balde_app_free_views(view);
+        return;
+    }
+    if (balde_url_rule_has_empty_choices(view->url_rule->match)) {
+        gchar *msg = g_strdup_printf("URL rule has an empty any() choice: %s",
+            rule);
+        balde_abort_set_error_with_description(app, 500, msg);
+        g_free(msg);
+        balde_app_free_views(view);
+        return;
+    }
     view->url_rule->method = method | BALDE_HTTP_OPTIONS;
     if (view->url_rule->method & BALDE_HTTP_GET)
         view->url_rule->method |= BALDE_HTTP_HEAD;
     view->view_func = view_func;
-    G_LOCK(views);
     app->priv->views = g_slist_append(app->priv->views, view);
-    G_UNLOCK(views);
-}
+    balde_url_router_add(app->priv->router, view->url_rule->match, view);
 
+    // url_for() always used the first view registered for an endpoint
+    if (!g_hash_table_contains(app->priv->endpoints, endpoint))
+        g_hash_table_insert(app->priv->endpoints, (gchar*) endpoint, view);
+}
 
-G_LOCK_DEFINE_STATIC(before_requests);
 
 BALDE_API void
 balde_app_add_before_request(balde_app_t *app, balde_before_request_func_t hook_func)
 {
     BALDE_APP_READ_ONLY(app);
+    BALDE_APP_NOT_FROZEN(app);
     balde_before_request_t *func = g_new(balde_before_request_t, 1);
     func->before_request_func = hook_func;
-    G_LOCK(before_requests);
     app->priv->before_requests = g_slist_append(app->priv->before_requests, func);
-    G_UNLOCK(before_requests);
+}
+
+
+BALDE_API void
+balde_app_freeze(balde_app_t *app)
+{
+    BALDE_APP_READ_ONLY(app);
+
+    // applications frozen lazily may get their first requests from several
+    // threads at once. the losers wait for the snapshot to be ready.
+    if (!g_once_init_enter(&(app->priv->freeze_once)))
+        return;
+
+    // the setup functions are single-threaded, and can't be called anymore
+    // after this point, so request handlers can read the application context
+    // from any thread without locking.
+    guint n_hooks = g_slist_length(app->priv->before_requests);
+    app->priv->before_request_funcs = g_new(balde_before_request_func_t,
+        n_hooks + 1);
+    guint i = 0;
+    for (GSList *tmp = app->priv->before_requests; tmp != NULL;
+            tmp = g_slist_next(tmp), i++) {
+        balde_before_request_t *hook = tmp->data;
+        app->priv->before_request_funcs[i] = hook->before_request_func;
+    }
+    app->priv->before_request_funcs[i] = NULL;
+
+    app->priv->frozen = TRUE;
+    g_once_init_leave(&(app->priv->freeze_once), 1);
 }
 
 
 balde_view_t*
 balde_app_get_view_from_endpoint(balde_app_t *app, const gchar *endpoint)
 {
-    for (GSList *tmp = app->priv->views; tmp != NULL; tmp = g_slist_next(tmp)) {
-        balde_view_t *view = tmp->data;
-        if (0 == g_strcmp0(view->url_rule->endpoint, endpoint))
-            return view;
-    }
-    return NULL;
+    if (endpoint == NULL)
+        return NULL;
+    return g_hash_table_lookup(app->priv->endpoints, endpoint);
 }
 
 
@@ -286,24 +338,40 @@ balde_app_url_for(balde_app_t *app, balde_request_t *request,
 }
 
 
+BALDE_API gboolean
+balde_app_url_for_append(GString *str, balde_app_t *app,
+    balde_request_t *request, const gchar *endpoint, gboolean external, ...)
+{
+    va_list params;
+    va_start(params, external);
+    gboolean rv = balde_app_url_for_appendv(str, app, request, endpoint, params);
+    va_end(params);
+    return rv;
+}
+
+
 gchar*
 balde_app_url_forv(balde_app_t *app, balde_request_t *request,
     const gchar *endpoint, va_list params)
 {
-    balde_view_t *view = balde_app_get_view_from_endpoint(app, endpoint);
-    if (view == NULL)
+    GString *rv = g_string_new(NULL);
+    if (!balde_app_url_for_appendv(rv, app, request, endpoint, params)) {
+        g_string_free(rv, TRUE);
         return NULL;
-    const gchar *script_name = request->script_name;
-    GString *p = g_string_new(script_name == NULL ? "" : script_name);
-    for (guint i = 0; view->url_rule->match->pieces[i] != NULL; i++) {
-        g_string_append(p, view->url_rule->match->pieces[i]);
-        if (view->url_rule->match->pieces[i + 1] != NULL)
-            g_string_append(p, va_arg(params, const gchar*));
     }
-    gchar *tmp = g_string_free(p, FALSE);
-    gchar *rv = g_uri_escape_string(tmp, "/:", TRUE);
-    g_free(tmp);
-    return rv;
+    return g_string_free(rv, FALSE);
+}
+
+
+gboolean
+balde_app_url_for_appendv(GString *str, balde_app_t *app,
+    balde_request_t *request, const gchar *endpoint, va_list params)
+{
+    balde_view_t *view = balde_app_get_view_from_endpoint(app, endpoint);
+    if (view == NULL)
+        return FALSE;
+    balde_url_build(str, request->script_name, view->url_rule->match, params);
+    return TRUE;
 }
 
 
@@ -324,6 +392,56 @@ static GOptionEntry entries[] =
 };
 
 
+gboolean
+balde_app_admission_enter(balde_app_t *app, guint max_queued)
+{
+    // max_queued == 0 means unbounded.
+    gint queued = g_atomic_int_add(&(app->priv->queued), 1);
+    if (max_queued > 0 && queued >= max_queued) {
+        g_atomic_int_add(&(app->priv->queued), -1);
+        g_atomic_int_inc(&(app->priv->shed));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+gint64
+balde_app_admission_deadline(gint64 timeout)
+{
+    // timeout == 0 means no deadline.
+    return timeout > 0 ? g_get_monotonic_time() + timeout : 0;
+}
+
+
+gboolean
+balde_app_admission_leave(balde_app_t *app, gint64 deadline)
+{
+    // a request that waited past its deadline is refused, the client most
+    // likely gave up already.
+    g_atomic_int_add(&(app->priv->queued), -1);
+    if (deadline > 0 && g_get_monotonic_time() > deadline) {
+        g_atomic_int_inc(&(app->priv->shed));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+BALDE_API guint
+balde_app_get_queued_requests(balde_app_t *app)
+{
+    return g_atomic_int_get(&(app->priv->queued));
+}
+
+
+BALDE_API guint
+balde_app_get_shed_requests(balde_app_t *app)
+{
+    return g_atomic_int_get(&(app->priv->shed));
+}
+
+
 BALDE_API void
 balde_app_run(balde_app_t *app, gint argc, gchar **argv)
 {
@@ -333,6 +451,7 @@ balde_app_run(balde_app_t *app, gint argc, gchar **argv)
     g_option_context_add_main_entries(context, entries, NULL);
 
     balde_sapi_init(context);
+    balde_sapi_set_argv(argv);
 
     g_option_context_set_help_enabled(context, FALSE);
 
@@ -355,70 +474,107 @@ balde_app_run(balde_app_t *app, gint argc, gchar **argv)
         g_printerr("%s\n", PACKAGE_STRING);
     }
     else {
+        balde_app_freeze(app);
         balde_sapi_run(app, context);
     }
 
     g_option_context_free(context);
     g_free(log_level);
+    balde_sapi_set_argv(NULL);
+}
+
+
+static GString*
+balde_app_stream_response(balde_app_t *app, balde_request_t *request,
+    balde_response_t *response, balde_response_render_t render,
+    gboolean with_body, balde_response_writer_t writer, gpointer writer_data)
+{
+    // headers (and whatever body the view appended already) go first. each
+    // chunk is handed to the SAPI as soon as the generator appends it.
+    GString *str = render(response, with_body);
+    gboolean more = with_body;
+    gboolean ok = writer(g_string_free_to_bytes(str), writer_data);
+    g_string_truncate(response->priv->body, 0);
+    while (ok && more) {
+        more = balde_response_stream_next(app, request, response);
+        if (response->priv->body->len > 0) {
+            ok = writer(g_string_free_to_bytes(response->priv->body),
+                writer_data);
+            response->priv->body = g_string_new(NULL);
+        }
+    }
+    return g_string_new(NULL);
 }
 
 
 GString*
 balde_app_main_loop(balde_app_t *app, balde_request_env_t *env,
     balde_response_render_t render, balde_http_exception_code_t *status_code)
+{
+    return balde_app_main_loop_stream(app, env, render, NULL, NULL,
+        status_code);
+}
+
+
+GString*
+balde_app_main_loop_stream(balde_app_t *app, balde_request_env_t *env,
+    balde_response_render_t render, balde_response_writer_t writer,
+    gpointer writer_data, balde_http_exception_code_t *status_code)
 {
     balde_request_t *request = NULL;
     balde_response_t *response = NULL;
     balde_response_t *error_response = NULL;
-    gchar *endpoint = NULL;
+    balde_app_t *app_copy = NULL;
     gboolean with_body = TRUE;
     GString *rv = NULL;
 
+    // request and response objects are allocated from a per-thread arena,
+    // released at once when the request is done. the rendered response
+    // string is still allocated from the heap, because it is owned by the
+    // SAPI.
+    balde_arena_t *arena = balde_arena_get_thread_default();
+    balde_arena_set_current(arena);
+
     // render startup error, if any
     if (app->error != NULL) {
         error_response = balde_make_response_from_exception(app->error);
-        rv = render(error_response, with_body);
-        if (status_code != NULL)
-            *status_code = error_response->status_code;
-        balde_response_free(error_response);
 
         // free env, because it should be free'd by main loop and will not be
         // used anymore.
         balde_request_env_free(env);
 
-        return rv;
+        goto point1;
     }
 
+    // applications not started with balde_app_run() (e.g. tests) are frozen
+    // when handling their first request.
+    balde_app_freeze(app);
+
     request = balde_make_request(app, env);
 
     with_body = ! (request->method & BALDE_HTTP_HEAD);
 
-    for (GSList *tmp = app->priv->before_requests; tmp != NULL; tmp = g_slist_next(tmp)) {
-        balde_before_request_t *hook = tmp->data;
-        hook->before_request_func(app, request);
-
-        if (app->error != NULL) {
-            error_response = balde_make_response_from_exception(app->error);
-            rv = render(error_response, with_body);
-            if (status_code != NULL)
-                *status_code = error_response->status_code;
-            balde_response_free(error_response);
-            g_clear_error(&app->error);
-            return rv;
+    // errors are per-request, hooks and views shouldn't touch the shared
+    // application context.
+    app_copy = balde_app_copy(app);
+
+    for (guint i = 0; app->priv->before_request_funcs[i] != NULL; i++) {
+        app->priv->before_request_funcs[i](app_copy, request);
+
+        if (app_copy->error != NULL) {
+            error_response = balde_make_response_from_exception(app_copy->error);
+            goto point1;
         }
     }
 
-    balde_app_t *app_copy = balde_app_copy(app);
-
     // get the view
-    endpoint = balde_dispatch_from_path(app_copy->priv->views, request->path,
-        &(request->priv->view_args));
-    if (endpoint == NULL) {  // no view found! :(
+    balde_view_t *view = balde_dispatch_from_path(app_copy->priv->router,
+        request->path, request->priv->view_args, &(request->priv->n_view_args));
+    if (view == NULL) {  // no view found! :(
         balde_abort_set_error(app_copy, 404);
     }
     else {
         // validate http method
-        balde_view_t *view = balde_app_get_view_from_endpoint(app_copy, endpoint);
         if (request->method & view->url_rule->method) {
             // answer OPTIONS automatically
             if (request->method == BALDE_HTTP_OPTIONS) {
@@ -436,27 +592,42 @@ balde_app_main_loop(balde_app_t *app, balde_request_env_t *env,
         else {
             balde_abort_set_error(app_copy, 405);
         }
-        g_free(endpoint);
     }
 
-    balde_request_free(request);
-
-    if (app_copy->error != NULL) {
+    if (app_copy->error != NULL)
         error_response = balde_make_response_from_exception(app_copy->error);
+
+point1:
+    if (error_response != NULL) {
         rv = render(error_response, with_body);
         if (status_code != NULL)
             *status_code = error_response->status_code;
-        balde_response_free(response);
-        balde_response_free(error_response);
-        balde_app_free(app_copy);
-        return rv;
+    }
+    else if (response != NULL && response->priv->stream_func != NULL &&
+        writer != NULL)
+    {
+        if (status_code != NULL)
+            *status_code = response->status_code;
+        rv = balde_app_stream_response(app_copy, request, response, render,
+            with_body, writer, writer_data);
+    }
+    else {
+        // SAPIs that can't stream get the whole body.
+        while (response != NULL &&
+            balde_response_stream_next(app_copy, request, response));
+        rv = render(response, with_body);
+        if (status_code != NULL && response != NULL)
+            *status_code = response->status_code;
     }
 
-    rv = render(response, with_body);
-    if (status_code != NULL)
-        *status_code = response->status_code;
+    balde_request_free(request);
     balde_response_free(response);
-    balde_app_free(app_copy);
+    balde_response_free(error_response);
+    if (app_copy != NULL)
+        balde_app_free(app_copy);
+
+    balde_arena_set_current(NULL);
+    balde_arena_reset(arena);
 
     return rv;
 }
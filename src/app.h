@@ -18,23 +18,39 @@
 #define BALDE_APP_READ_ONLY(app)                                            \
     if ((app)->copy)                                                        \
         g_error(                                                            \
-            "You called `%s()' from a view. This is unsupported! You may "  \
-            "want to move this code to a \"before request\" hook.",         \
+            "You called `%s()' from a view or a \"before request\" hook. "  \
+            "This is unsupported! You may want to move this code to the "   \
+            "application setup, before calling `balde_app_run()'.",         \
             __FUNCTION__)
 
+#define BALDE_APP_NOT_FROZEN(app)                                           \
+    if ((app)->priv->frozen)                                                \
+        g_error(                                                            \
+            "You called `%s()' after the application started running. "     \
+            "This is unsupported! All the setup should be done before "     \
+            "calling `balde_app_run()'.", __FUNCTION__)
+
 struct _balde_app_private_t {
     GSList *views;
+    balde_url_router_t *router;
+    GHashTable *endpoints;
     GSList *before_requests;
     GSList *static_resources;
+    GHashTable *static_resources_index;
     GHashTable *config;
     gpointer user_data;
     GDestroyNotify user_data_destroy_func;
-};
 
-typedef struct {
-    balde_url_rule_t *url_rule;
-    balde_view_func_t view_func;
-} balde_view_t;
+    // read-only snapshot, built by balde_app_freeze()
+    gboolean frozen;
+    gsize freeze_once;
+    balde_before_request_func_t *before_request_funcs;
+
+    // requests waiting for an application thread, and requests refused
+    // because of load. updated atomically by the server apis.
+    gint queued;
+    gint shed;
+};
 
 typedef struct {
     balde_before_request_func_t before_request_func;
@@ -42,13 +58,24 @@ typedef struct {
 
 typedef GString* (*balde_response_render_t) (balde_response_t*, const gboolean);
 
+// takes ownership of the data. returns FALSE if the client is gone.
+typedef gboolean (*balde_response_writer_t) (GBytes*, gpointer);
+
 balde_app_t* balde_app_copy(balde_app_t *app);
 void balde_app_free_views(balde_view_t *view);
 balde_view_t* balde_app_get_view_from_endpoint(balde_app_t *app,
     const gchar *endpoint);
 gchar* balde_app_url_forv(balde_app_t *app, balde_request_t *request,
     const gchar *endpoint, va_list params);
+gboolean balde_app_url_for_appendv(GString *str, balde_app_t *app,
+    balde_request_t *request, const gchar *endpoint, va_list params);
+gboolean balde_app_admission_enter(balde_app_t *app, guint max_queued);
+gint64 balde_app_admission_deadline(gint64 timeout);
+gboolean balde_app_admission_leave(balde_app_t *app, gint64 deadline);
 GString* balde_app_main_loop(balde_app_t *app, balde_request_env_t *env,
     balde_response_render_t render, balde_http_exception_code_t *status_code);
+GString* balde_app_main_loop_stream(balde_app_t *app, balde_request_env_t *env,
+    balde_response_render_t render, balde_response_writer_t writer,
+    gpointer writer_data, balde_http_exception_code_t *status_code);
 
 #endif /* _BALDE_APP_PRIVATE_H */
@@ -0,0 +1,229 @@
+/*
+ * balde: A microframework for C based on GLib and bad intentions.
+ * Copyright (C) 2013-2017 Rafael G. Martins <rafael@rafaelmartins.eng.br>
+ *
+ * This program can be distributed under the terms of the LGPL-2 License.
+ * See the file COPYING.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <glib.h>
+#include <string.h>
+#include "arena.h"
+
+/*
+ * Bump-pointer allocator for memory that lives exactly as long as a request.
+ *
+ * Every function accepts a NULL arena, and falls back to the GLib allocator
+ * in that case, so code paths shared with tests and with objects created
+ * outside of balde_app_main_loop() keep working unchanged.
+ */
+
+#define BALDE_ARENA_ALIGN (2 * sizeof(gpointer))
+#define BALDE_ARENA_ALIGN_SIZE(s) \
+    (((s) + BALDE_ARENA_ALIGN - 1) & ~(BALDE_ARENA_ALIGN - 1))
+#define BALDE_ARENA_HEADER_SIZE BALDE_ARENA_ALIGN_SIZE(sizeof(balde_arena_chunk_t))
+
+
+static balde_arena_chunk_t*
+balde_arena_chunk_new(gsize size)
+{
+    balde_arena_chunk_t *chunk = g_malloc(BALDE_ARENA_HEADER_SIZE + size);
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+
+balde_arena_t*
+balde_arena_new(void)
+{
+    balde_arena_t *arena = g_new(balde_arena_t, 1);
+    arena->chunks = balde_arena_chunk_new(BALDE_ARENA_CHUNK_SIZE);
+    arena->cached = NULL;
+    arena->n_cached = 0;
+    return arena;
+}
+
+
+gpointer
+balde_arena_alloc(balde_arena_t *arena, gsize size)
+{
+    if (arena == NULL)
+        return g_malloc(size);
+    size = BALDE_ARENA_ALIGN_SIZE(size);
+    balde_arena_chunk_t *chunk = arena->chunks;
+    if (chunk->size - chunk->used < size) {
+        if (size > BALDE_ARENA_CHUNK_SIZE / 4) {
+            // big blocks get a chunk of their own, behind the current one, so
+            // the free space of the current chunk isn't wasted.
+            balde_arena_chunk_t *big = balde_arena_chunk_new(size);
+            big->used = size;
+            big->next = chunk->next;
+            chunk->next = big;
+            return (guint8*) big + BALDE_ARENA_HEADER_SIZE;
+        }
+        if (arena->cached != NULL) {
+            chunk = arena->cached;
+            arena->cached = chunk->next;
+            arena->n_cached--;
+        }
+        else {
+            chunk = balde_arena_chunk_new(BALDE_ARENA_CHUNK_SIZE);
+        }
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+    gpointer rv = (guint8*) chunk + BALDE_ARENA_HEADER_SIZE + chunk->used;
+    chunk->used += size;
+    return rv;
+}
+
+
+gpointer
+balde_arena_alloc0(balde_arena_t *arena, gsize size)
+{
+    if (arena == NULL)
+        return g_malloc0(size);
+    return memset(balde_arena_alloc(arena, size), 0, size);
+}
+
+
+gchar*
+balde_arena_strndup(balde_arena_t *arena, const gchar *str, gsize len)
+{
+    if (str == NULL)
+        return NULL;
+    if (arena == NULL)
+        return g_strndup(str, len);
+    gchar *rv = balde_arena_alloc(arena, len + 1);
+    memcpy(rv, str, len);
+    rv[len] = '\0';
+    return rv;
+}
+
+
+gchar*
+balde_arena_strdup(balde_arena_t *arena, const gchar *str)
+{
+    if (str == NULL)
+        return NULL;
+    return balde_arena_strndup(arena, str, strlen(str));
+}
+
+
+gchar*
+balde_arena_ascii_strdown(balde_arena_t *arena, const gchar *str)
+{
+    gchar *rv = balde_arena_strdup(arena, str);
+    if (rv == NULL)
+        return NULL;
+    for (gchar *c = rv; *c != '\0'; c++)
+        *c = g_ascii_tolower(*c);
+    return rv;
+}
+
+
+void
+balde_arena_release(balde_arena_t *arena, gpointer mem)
+{
+    // arena memory is only released as a whole, by balde_arena_reset()
+    if (arena == NULL)
+        g_free(mem);
+}
+
+
+GDestroyNotify
+balde_arena_destroy_notify(balde_arena_t *arena)
+{
+    return arena == NULL ? g_free : NULL;
+}
+
+
+void
+balde_arena_reset(balde_arena_t *arena)
+{
+    if (arena == NULL)
+        return;
+
+    // keep one chunk in place, and a few more around for the next request, so
+    // steady-state request handling doesn't touch malloc. big chunks go away.
+    balde_arena_chunk_t *base = NULL;
+    balde_arena_chunk_t *chunk = arena->chunks;
+    while (chunk != NULL) {
+        balde_arena_chunk_t *tmp = chunk;
+        chunk = chunk->next;
+        if (tmp->size != BALDE_ARENA_CHUNK_SIZE) {
+            g_free(tmp);
+        }
+        else if (base == NULL) {
+            base = tmp;
+        }
+        else if (arena->n_cached < BALDE_ARENA_MAX_CACHED_CHUNKS) {
+            tmp->used = 0;
+            tmp->next = arena->cached;
+            arena->cached = tmp;
+            arena->n_cached++;
+        }
+        else {
+            g_free(tmp);
+        }
+    }
+    base->next = NULL;
+    base->used = 0;
+    arena->chunks = base;
+}
+
+
+void
+balde_arena_free(balde_arena_t *arena)
+{
+    if (arena == NULL)
+        return;
+    balde_arena_chunk_t *tmp;
+    while (arena->chunks != NULL) {
+        tmp = arena->chunks;
+        arena->chunks = tmp->next;
+        g_free(tmp);
+    }
+    while (arena->cached != NULL) {
+        tmp = arena->cached;
+        arena->cached = tmp->next;
+        g_free(tmp);
+    }
+    g_free(arena);
+}
+
+
+static GPrivate thread_default = G_PRIVATE_INIT((GDestroyNotify) balde_arena_free);
+static GPrivate current = G_PRIVATE_INIT(NULL);
+
+
+balde_arena_t*
+balde_arena_get_thread_default(void)
+{
+    balde_arena_t *arena = g_private_get(&thread_default);
+    if (arena == NULL) {
+        arena = balde_arena_new();
+        g_private_set(&thread_default, arena);
+    }
+    return arena;
+}
+
+
+balde_arena_t*
+balde_arena_get_current(void)
+{
+    return g_private_get(&current);
+}
+
+
+void
+balde_arena_set_current(balde_arena_t *arena)
+{
+    g_private_set(&current, arena);
+}
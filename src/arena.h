@@ -0,0 +1,43 @@
+/*
+ * balde: A microframework for C based on GLib and bad intentions.
+ * Copyright (C) 2013-2017 Rafael G. Martins <rafael@rafaelmartins.eng.br>
+ *
+ * This program can be distributed under the terms of the LGPL-2 License.
+ * See the file COPYING.
+ */
+
+#ifndef _BALDE_ARENA_PRIVATE_H
+#define _BALDE_ARENA_PRIVATE_H
+
+#include <glib.h>
+
+#define BALDE_ARENA_CHUNK_SIZE 8192
+#define BALDE_ARENA_MAX_CACHED_CHUNKS 8
+
+typedef struct _balde_arena_chunk_t {
+    struct _balde_arena_chunk_t *next;
+    gsize size;
+    gsize used;
+} balde_arena_chunk_t;
+
+typedef struct {
+    balde_arena_chunk_t *chunks;
+    balde_arena_chunk_t *cached;
+    guint n_cached;
+} balde_arena_t;
+
+balde_arena_t* balde_arena_new(void);
+gpointer balde_arena_alloc(balde_arena_t *arena, gsize size);
+gpointer balde_arena_alloc0(balde_arena_t *arena, gsize size);
+gchar* balde_arena_strdup(balde_arena_t *arena, const gchar *str);
+gchar* balde_arena_strndup(balde_arena_t *arena, const gchar *str, gsize len);
+gchar* balde_arena_ascii_strdown(balde_arena_t *arena, const gchar *str);
+void balde_arena_release(balde_arena_t *arena, gpointer mem);
+GDestroyNotify balde_arena_destroy_notify(balde_arena_t *arena);
+void balde_arena_reset(balde_arena_t *arena);
+void balde_arena_free(balde_arena_t *arena);
+balde_arena_t* balde_arena_get_thread_default(void);
+balde_arena_t* balde_arena_get_current(void);
+void balde_arena_set_current(balde_arena_t *arena);
+
+#endif /* _BALDE_ARENA_PRIVATE_H */
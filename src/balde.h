@@ -296,6 +296,17 @@ typedef balde_response_t* (*balde_view_func_t) (balde_app_t*, balde_request_t*);
  */
 typedef void (*balde_before_request_func_t) (balde_app_t*, balde_request_t*);
 
+/**
+ * Response body generator type definition
+ *
+ * Each generator should accept the application context, the request context,
+ * the response context and the user data, append the next chunk of the body
+ * to the response, and return FALSE after appending the last chunk.
+ *
+ */
+typedef gboolean (*balde_stream_func_t) (balde_app_t*, balde_request_t*,
+    balde_response_t*, gpointer);
+
 /**
  * Initializes the application context
  *
@@ -420,6 +431,35 @@ gchar* balde_app_url_for(balde_app_t *app, balde_request_t *request,
     const gchar *endpoint, gboolean external, ...);
 
 
+/**
+ * Appends the URL for a given endpoint to a string.
+ *
+ * Works like balde_app_url_for(), but writes to a caller-supplied string
+ * instead of allocating a new one. Returns FALSE if the endpoint wasn't found.
+ *
+ * Added in balde 0.2.
+ *
+ */
+gboolean balde_app_url_for_append(GString *str, balde_app_t *app,
+    balde_request_t *request, const gchar *endpoint, gboolean external, ...);
+
+
+/**
+ * Freezes the application context.
+ *
+ * After this call the views, hooks, configuration and static resources are
+ * read-only, and can be used by many request handlers concurrently without
+ * locking. Any further call to a setup function aborts the program.
+ *
+ * This function is called by balde_app_run(), so it is only needed by
+ * applications that dispatch requests some other way.
+ *
+ * Added in balde 0.2.
+ *
+ */
+void balde_app_freeze(balde_app_t *app);
+
+
 /**
  * Application main loop.
  *
@@ -430,6 +470,27 @@ gchar* balde_app_url_for(balde_app_t *app, balde_request_t *request,
 void balde_app_run(balde_app_t *app, gint argc, gchar **argv);
 
 
+/**
+ * Returns the number of requests waiting for an application thread.
+ *
+ * Only the embedded FastCGI, SCGI and HTTP servers queue requests. It is safe
+ * to call this function from views, e.g. to export metrics.
+ *
+ * Added in balde 0.2.
+ */
+guint balde_app_get_queued_requests(balde_app_t *app);
+
+
+/**
+ * Returns the number of requests refused because the server was overloaded,
+ * either because the queue was full or because they waited too long for an
+ * application thread.
+ *
+ * Added in balde 0.2.
+ */
+guint balde_app_get_shed_requests(balde_app_t *app);
+
+
 /**
  * Sets a response header.
  *
@@ -478,6 +539,24 @@ void balde_response_append_body_len(balde_response_t *response,
 void balde_response_truncate_body(balde_response_t *response);
 
 
+/**
+ * Streams the response body from a generator function.
+ *
+ * The generator is called repeatedly after the view returns, and each chunk
+ * is sent to the client as soon as it is appended, when the SAPI supports it
+ * (FastCGI and the embedded HTTP server, that uses chunked transfer encoding
+ * for HTTP/1.1 clients). Streamed responses don't include a Content-Length
+ * header. Other SAPIs collect the whole body before sending the response. The
+ * destroy function, if any, is called with the user data when the response is
+ * freed.
+ *
+ * Added in balde 0.2.
+ *
+ */
+void balde_response_set_stream(balde_response_t *response,
+    balde_stream_func_t func, gpointer user_data, GDestroyNotify destroy);
+
+
 /**
  * Initialize a response context.
  *
@@ -598,6 +677,19 @@ const gchar* balde_request_get_form(balde_request_t *request, const gchar *name)
 const balde_file_t* balde_request_get_file(balde_request_t *request, const gchar *name);
 
 
+/**
+ * Gets the authorization data received from the client.
+ *
+ * Same as `request->authorization`. Returns NULL if no supported authorization
+ * data was sent.
+ *
+ * Added in balde 0.2.
+ *
+ */
+const balde_authorization_t* balde_request_get_authorization(
+    balde_request_t *request);
+
+
 /**
  * Gets a view argument.
  *
@@ -608,6 +700,49 @@ const gchar* balde_request_get_view_arg(balde_request_t *request,
     const gchar *name);
 
 
+/**
+ * Gets a view argument captured by the `int` converter.
+ *
+ * The argument name *IS* case-sensitive. The value is converted when the URL
+ * rule matches, and paths with values that don't fit in a gint64 don't match
+ * the rule. Returns FALSE, leaving value untouched, if there's no such
+ * argument, or if it wasn't captured by the `int` converter.
+ *
+ * Added in balde 0.2.
+ *
+ */
+gboolean balde_request_get_view_arg_int(balde_request_t *request,
+    const gchar *name, gint64 *value);
+
+
+/**
+ * Gets a view argument captured by the `float` converter.
+ *
+ * The argument name *IS* case-sensitive. The value is converted when the URL
+ * rule matches. Returns FALSE, leaving value untouched, if there's no such
+ * argument, or if it wasn't captured by the `float` converter.
+ *
+ * Added in balde 0.2.
+ *
+ */
+gboolean balde_request_get_view_arg_float(balde_request_t *request,
+    const gchar *name, gdouble *value);
+
+
+/**
+ * Gets a view argument captured by the `uuid` converter, as 16 bytes.
+ *
+ * The argument name *IS* case-sensitive. The value is converted when the URL
+ * rule matches. Returns FALSE, leaving value untouched, if there's no such
+ * argument, or if it wasn't captured by the `uuid` converter.
+ *
+ * Added in balde 0.2.
+ *
+ */
+gboolean balde_request_get_view_arg_uuid(balde_request_t *request,
+    const gchar *name, guint8 value[16]);
+
+
 /**
  * Gets a cookie.
  *
@@ -626,6 +761,29 @@ const gchar* balde_request_get_cookie(balde_request_t *request, const gchar *nam
 const GString* balde_request_get_body(balde_request_t *request);
 
 
+/**
+ * Returns TRUE if the client aborted the request.
+ *
+ * Long running views may check it from time to time, and give up early. The
+ * response of an aborted request is discarded. Only the embedded FastCGI
+ * server reports aborted requests.
+ *
+ * Added in balde 0.2.
+ */
+gboolean balde_request_is_aborted(balde_request_t *request);
+
+
+/**
+ * Gets a GCancellable, cancelled when the client aborts the request.
+ *
+ * It can be passed to GIO calls made by views. It returns \c NULL if the
+ * server doesn't report aborted requests.
+ *
+ * Added in balde 0.2.
+ */
+GCancellable* balde_request_get_cancellable(balde_request_t *request);
+
+
 /**
  * Saves a file to disk.
  *
@@ -740,4 +898,17 @@ void balde_resources_load(balde_app_t *app, GResource *resources);
 gchar* balde_tmpl_url_for(balde_app_t *app, balde_request_t *request,
     const gchar *endpoint, gboolean external, ...);
 
+
+/**
+ * Template helper to append the URL for a given endpoint to a string.
+ *
+ * This is what the generated templates call for url_for(), to avoid
+ * allocating a string per link.
+ *
+ * Added in balde 0.2.
+ *
+ */
+void balde_tmpl_url_for_append(GString *str, balde_app_t *app,
+    balde_request_t *request, const gchar *endpoint, gboolean external, ...);
+
 #endif /* _BALDE_H */
@@ -14,6 +14,7 @@
 #include <string.h>
 #include "balde.h"
 #include "balde-private.h"
+#include "arena.h"
 #include "multipart.h"
 #include "routing.h"
 #include "requests.h"
@@ -37,43 +38,120 @@ balde_parse_header_name_from_envvar(const gchar *env_name)
 }
 
 
+static const gint8 hex_values[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+
+gboolean
+balde_urldecode_len(gchar *dest, const gchar *src, gsize len, gsize *dest_len)
+{
+    // dest may be src itself, the decoded string is never longer. it must
+    // have room for len + 1 bytes, though, because it is NUL-terminated.
+    gsize j = 0;
+    gsize i = 0;
+    while (i < len) {
+
+        // copy runs of plain characters at once
+        gsize start = i;
+        while (i < len && src[i] != '%' && src[i] != '+')
+            i++;
+        if (i > start) {
+            if (dest + j != src + start)
+                memmove(dest + j, src + start, i - start);
+            j += i - start;
+        }
+        if (i == len)
+            break;
+
+        if (src[i] == '+') {
+            dest[j++] = ' ';
+            i++;
+            continue;
+        }
+
+        // invalid escapes and NUL bytes are rejected, like
+        // g_uri_unescape_string() does.
+        if (len - i < 3)
+            return FALSE;
+        gint8 h = hex_values[(guchar) src[i + 1]];
+        gint8 l = hex_values[(guchar) src[i + 2]];
+        if (h < 0 || l < 0 || (h == 0 && l == 0))
+            return FALSE;
+        dest[j++] = (gchar) ((h << 4) | l);
+        i += 3;
+    }
+    dest[j] = '\0';
+    if (dest_len != NULL)
+        *dest_len = j;
+    return TRUE;
+}
+
+
 gchar*
-balde_urldecode(const gchar* str)
+balde_urldecode_arena(balde_arena_t *arena, const gchar *str, gsize len)
 {
-    // corner case: + -> ' '
-    GRegex *re_space = g_regex_new("\\+", 0, 0, NULL);
-    gchar *new_str = g_regex_replace_literal(re_space, str, -1, 0, "%20", 0, NULL);
-    g_regex_unref(re_space);
-    gchar *rv = g_uri_unescape_string(new_str, NULL);
-    g_free(new_str);
+    gchar *rv = balde_arena_alloc(arena, len + 1);
+    if (!balde_urldecode_len(rv, str, len, NULL)) {
+        balde_arena_release(arena, rv);
+        return NULL;
+    }
     return rv;
 }
 
 
+gchar*
+balde_urldecode(const gchar* str)
+{
+    return balde_urldecode_arena(NULL, str, strlen(str));
+}
+
+
 GHashTable*
 balde_parse_query_string(const gchar *query_string)
 {
-    GHashTable *qs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    balde_arena_t *arena = balde_arena_get_current();
+    GHashTable *qs = g_hash_table_new_full(g_str_hash, g_str_equal,
+        balde_arena_destroy_notify(arena), balde_arena_destroy_notify(arena));
     if (query_string == NULL)
-        goto point1;
-    gchar **kv = g_strsplit(query_string, "&", 0);
-    for (guint i = 0; kv[i] != NULL; i++) {
-        gchar **pieces = g_strsplit(kv[i], "=", 2);
-        if (g_strv_length(pieces) != 2)
-            goto point2;
-        gchar *key = balde_urldecode(pieces[0]);
-        gchar *value = balde_urldecode(pieces[1]);
-        if (key == NULL || value == NULL) {
-            g_free(key);
-            g_free(value);
-            goto point2;
+        return qs;
+    const gchar *kv = query_string;
+    while (*kv != '\0') {
+        const gchar *end = strchr(kv, '&');
+        if (end == NULL)
+            end = kv + strlen(kv);
+        const gchar *eq = memchr(kv, '=', end - kv);
+        if (eq == NULL)
+            goto point1;
+        gchar *key = balde_urldecode_arena(arena, kv, eq - kv);
+        if (key == NULL)
+            goto point1;
+        gchar *value = balde_urldecode_arena(arena, eq + 1, end - eq - 1);
+        if (value == NULL) {
+            balde_arena_release(arena, key);
+            goto point1;
         }
         g_hash_table_replace(qs, key, value);
-point2:
-        g_strfreev(pieces);
-    }
-    g_strfreev(kv);
 point1:
+        if (*end == '\0')
+            break;
+        kv = end + 1;
+    }
     return qs;
 }
 
@@ -81,7 +159,9 @@ point1:
 GHashTable*
 balde_parse_cookies(const gchar *cookie_header)
 {
-    GHashTable *c = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    balde_arena_t *arena = balde_arena_get_current();
+    GHashTable *c = g_hash_table_new_full(g_str_hash, g_str_equal,
+        balde_arena_destroy_notify(arena), balde_arena_destroy_notify(arena));
     if (cookie_header == NULL)
         goto point1;
     gchar **kv = g_strsplit(cookie_header, ";", 0);
@@ -95,7 +175,8 @@ balde_parse_cookies(const gchar *cookie_header)
             value[len_value - 1] = '\0';
             value++;
         }
-        g_hash_table_replace(c, g_strdup(g_strstrip(pieces[0])), g_strdup(value));
+        g_hash_table_replace(c, balde_arena_strdup(arena, g_strstrip(pieces[0])),
+            balde_arena_strdup(arena, value));
 point2:
         g_strfreev(pieces);
     }
@@ -106,7 +187,7 @@ point1:
 
 
 balde_authorization_t*
-balde_parse_authorization(const gchar *authorization)
+balde_parse_authorization(balde_arena_t *arena, const gchar *authorization)
 {
     if (authorization == NULL)
         return NULL;
@@ -126,9 +207,9 @@ balde_parse_authorization(const gchar *authorization)
             g_strfreev(b);
             goto point2;
         }
-        rv = g_new(balde_authorization_t, 1);
-        rv->username = g_strdup(b[0]);
-        rv->password = g_strdup(b[1]);
+        rv = balde_arena_alloc(arena, sizeof(balde_authorization_t));
+        rv->username = balde_arena_strdup(arena, b[0]);
+        rv->password = balde_arena_strdup(arena, b[1]);
         g_strfreev(b);
     }
     /*
@@ -137,10 +218,6 @@ balde_parse_authorization(const gchar *authorization)
         //
     }
     */
-    else {
-        g_free(rv);
-        rv = NULL;
-    }
 point2:
     g_free(type);
 point1:
@@ -150,22 +227,29 @@ point1:
 
 
 void
-balde_authorization_free(balde_authorization_t *authorization)
+balde_authorization_free(balde_arena_t *arena,
+    balde_authorization_t *authorization)
 {
     if (authorization == NULL)
         return;
-    g_free((gchar*) authorization->username);
-    g_free((gchar*) authorization->password);
-    g_free(authorization);
+    balde_arena_release(arena, (gchar*) authorization->username);
+    balde_arena_release(arena, (gchar*) authorization->password);
+    balde_arena_release(arena, authorization);
 }
 
 
 balde_request_t*
 balde_make_request(balde_app_t *app, balde_request_env_t *request_env)
 {
-    balde_request_t *request = g_new(balde_request_t, 1);
-    request->priv = g_new(struct _balde_request_private_t, 1);
-    request->priv->view_args = NULL;
+    balde_arena_t *arena = balde_arena_get_current();
+    balde_request_t *request = balde_arena_alloc(arena, sizeof(balde_request_t));
+    request->priv = balde_arena_alloc(arena,
+        sizeof(struct _balde_request_private_t));
+    request->priv->arena = arena;
+    request->priv->parsed = 0;
+    request->priv->n_view_args = 0;
+    request->priv->args = NULL;
+    request->priv->cookies = NULL;
     request->priv->body = NULL;
     request->priv->form = NULL;
     request->priv->files = NULL;
@@ -180,39 +264,57 @@ balde_make_request(balde_app_t *app, balde_request_env_t *request_env)
     request->method = balde_http_method_str2enum(request_env->request_method);
     request->https = request_env->https;
     request->priv->headers = request_env->headers;
-    request->priv->args = balde_parse_query_string(request_env->query_string);
-    request->priv->cookies = balde_parse_cookies(
-        balde_request_get_header(request, "cookie"));
-    request->authorization = balde_parse_authorization(
-        balde_request_get_header(request, "authorization"));
-    if (request->method & (BALDE_HTTP_POST | BALDE_HTTP_PUT | BALDE_HTTP_PATCH)) {
+
+    // authorization is a public member, and views read it directly. it is
+    // cheap, and rarely sent.
+    request->authorization = balde_parse_authorization(arena,
+        g_hash_table_lookup(request->priv->headers, "authorization"));
+
+    // query string, cookies and form data are only parsed when the
+    // application asks for them.
+    request->priv->query_string = request_env->query_string;
+    if (request->method & (BALDE_HTTP_POST | BALDE_HTTP_PUT | BALDE_HTTP_PATCH))
         request->priv->body = request_env->body;
-        const gchar *ct = g_hash_table_lookup(request->priv->headers, "content-type");
-        if (ct != NULL && g_str_has_prefix(ct, "multipart/form-data;")) {
-            gchar *boundary = balde_multipart_parse_boundary(ct);
-            balde_multipart_data_t *data = balde_multipart_parse(boundary,
-                request->priv->body);
-            g_free(boundary);
-            if (data != NULL) {
-                request->priv->files = data->files;
-                request->priv->form = data->form;
-            }
-            g_free(data);
-        }
-        else {
-            gchar *tmp = NULL;
-            if (request->priv->body != NULL)
-                tmp = request->priv->body->str;
-            request->priv->form = balde_parse_query_string(tmp);
-        }
-    }
-    g_free(request_env->query_string);
-    g_free(request_env->request_method);
+    else if (request_env->body != NULL)
+        g_string_free(request_env->body, TRUE);
+    request->priv->storage = request_env->storage;
+    request->priv->cancellable = request_env->cancellable;
+    if (request_env->storage == NULL)
+        g_free(request_env->request_method);
     g_free(request_env);
     return request;
 }
 
 
+static void
+balde_request_parse_form(balde_request_t *request)
+{
+    if (request->priv->parsed & BALDE_REQUEST_PARSED_FORM)
+        return;
+    request->priv->parsed |= BALDE_REQUEST_PARSED_FORM;
+    if (!(request->method & (BALDE_HTTP_POST | BALDE_HTTP_PUT | BALDE_HTTP_PATCH)))
+        return;
+    const gchar *ct = g_hash_table_lookup(request->priv->headers, "content-type");
+    if (ct != NULL && g_str_has_prefix(ct, "multipart/form-data;")) {
+        gchar *boundary = balde_multipart_parse_boundary(ct);
+        balde_multipart_data_t *data = balde_multipart_parse(boundary,
+            request->priv->body);
+        g_free(boundary);
+        if (data != NULL) {
+            request->priv->files = data->files;
+            request->priv->form = data->form;
+        }
+        g_free(data);
+    }
+    else {
+        gchar *tmp = NULL;
+        if (request->priv->body != NULL)
+            tmp = request->priv->body->str;
+        request->priv->form = balde_parse_query_string(tmp);
+    }
+}
+
+
 BALDE_API const gchar*
 balde_request_get_header(balde_request_t *request, const gchar *name)
 {
@@ -226,6 +328,11 @@ balde_request_get_header(balde_request_t *request, const gchar *name)
 BALDE_API const gchar*
 balde_request_get_arg(balde_request_t *request, const gchar *name)
 {
+    if (!(request->priv->parsed & BALDE_REQUEST_PARSED_ARGS)) {
+        request->priv->parsed |= BALDE_REQUEST_PARSED_ARGS;
+        request->priv->args = balde_parse_query_string(
+            request->priv->query_string);
+    }
     return g_hash_table_lookup(request->priv->args, name);
 }
 
@@ -233,6 +340,7 @@ balde_request_get_arg(balde_request_t *request, const gchar *name)
 BALDE_API const gchar*
 balde_request_get_form(balde_request_t *request, const gchar *name)
 {
+    balde_request_parse_form(request);
     if (request->priv->form == NULL)
         return NULL;
     return g_hash_table_lookup(request->priv->form, name);
@@ -242,26 +350,90 @@ balde_request_get_form(balde_request_t *request, const gchar *name)
 BALDE_API const balde_file_t*
 balde_request_get_file(balde_request_t *request, const gchar *name)
 {
+    balde_request_parse_form(request);
     if (request->priv->files == NULL)
         return NULL;
     return g_hash_table_lookup(request->priv->files, name);
 }
 
 
+BALDE_API const balde_authorization_t*
+balde_request_get_authorization(balde_request_t *request)
+{
+    return request->authorization;
+}
+
+
 BALDE_API const gchar*
 balde_request_get_view_arg(balde_request_t *request, const gchar *name)
 {
-    if (request->priv->view_args == NULL)
+    return balde_view_args_lookup(request->priv->view_args,
+        request->priv->n_view_args, request->path, name);
+}
+
+
+static balde_view_arg_t*
+balde_request_get_view_arg_converted(balde_request_t *request,
+    const gchar *name, balde_url_converter_t converter)
+{
+    balde_view_arg_t *arg = balde_view_args_find(request->priv->view_args,
+        request->priv->n_view_args, name);
+    if (arg == NULL || arg->converter != converter)
         return NULL;
-    return g_hash_table_lookup(request->priv->view_args, name);
+    return arg;
+}
+
+
+BALDE_API gboolean
+balde_request_get_view_arg_int(balde_request_t *request, const gchar *name,
+    gint64 *value)
+{
+    balde_view_arg_t *arg = balde_request_get_view_arg_converted(request, name,
+        BALDE_URL_CONVERTER_INT);
+    if (arg == NULL)
+        return FALSE;
+    if (value != NULL)
+        *value = arg->converted.i;
+    return TRUE;
+}
+
+
+BALDE_API gboolean
+balde_request_get_view_arg_float(balde_request_t *request, const gchar *name,
+    gdouble *value)
+{
+    balde_view_arg_t *arg = balde_request_get_view_arg_converted(request, name,
+        BALDE_URL_CONVERTER_FLOAT);
+    if (arg == NULL)
+        return FALSE;
+    if (value != NULL)
+        *value = arg->converted.f;
+    return TRUE;
+}
+
+
+BALDE_API gboolean
+balde_request_get_view_arg_uuid(balde_request_t *request, const gchar *name,
+    guint8 value[16])
+{
+    balde_view_arg_t *arg = balde_request_get_view_arg_converted(request, name,
+        BALDE_URL_CONVERTER_UUID);
+    if (arg == NULL)
+        return FALSE;
+    if (value != NULL)
+        memcpy(value, arg->converted.uuid, 16);
+    return TRUE;
 }
 
 
 BALDE_API const gchar*
 balde_request_get_cookie(balde_request_t *request, const gchar *name)
 {
-    if (request->priv->cookies == NULL)
-        return NULL;
+    if (!(request->priv->parsed & BALDE_REQUEST_PARSED_COOKIES)) {
+        request->priv->parsed |= BALDE_REQUEST_PARSED_COOKIES;
+        request->priv->cookies = balde_parse_cookies(
+            g_hash_table_lookup(request->priv->headers, "cookie"));
+    }
     return g_hash_table_lookup(request->priv->cookies, name);
 }
 
@@ -273,18 +445,39 @@ balde_request_get_body(balde_request_t *request)
 }
 
 
+BALDE_API gboolean
+balde_request_is_aborted(balde_request_t *request)
+{
+    return request->priv->cancellable != NULL &&
+        g_cancellable_is_cancelled(request->priv->cancellable);
+}
+
+
+BALDE_API GCancellable*
+balde_request_get_cancellable(balde_request_t *request)
+{
+    return request->priv->cancellable;
+}
+
+
 void
 balde_request_free(balde_request_t *request)
 {
     if (request == NULL)
         return;
-    g_free((gchar*) request->path);
-    g_free((gchar*) request->server_name);
-    g_free((gchar*) request->script_name);
+    if (request->priv->storage != NULL) {
+        g_bytes_unref(request->priv->storage);
+    }
+    else {
+        g_free((gchar*) request->path);
+        g_free((gchar*) request->server_name);
+        g_free((gchar*) request->script_name);
+        g_free(request->priv->query_string);
+    }
     g_hash_table_destroy(request->priv->headers);
-    g_hash_table_destroy(request->priv->args);
-    if (request->priv->view_args != NULL)
-        g_hash_table_destroy(request->priv->view_args);
+    if (request->priv->args != NULL)
+        g_hash_table_destroy(request->priv->args);
+    balde_view_args_clear(request->priv->view_args, request->priv->n_view_args);
     if (request->priv->body != NULL)
         g_string_free(request->priv->body, TRUE);
     if (request->priv->form != NULL)
@@ -293,23 +486,37 @@ balde_request_free(balde_request_t *request)
         g_hash_table_destroy(request->priv->files);
     if (request->priv->cookies != NULL)
         g_hash_table_destroy(request->priv->cookies);
-    balde_authorization_free(request->authorization);
-    g_free(request->priv);
-    g_free(request);
+    if (request->priv->cancellable != NULL)
+        g_object_unref(request->priv->cancellable);
+    if (request->priv->arena == NULL) {
+        // memory owned by the arena is released by balde_app_main_loop()
+        balde_authorization_free(NULL, request->authorization);
+        g_free(request->priv);
+        g_free(request);
+    }
 }
 
 
 void
 balde_request_env_free(balde_request_env_t *request)
 {
-    g_free(request->server_name);
-    g_free(request->script_name);
-    g_free(request->path_info);
-    g_free(request->request_method);
-    g_free(request->query_string);
+    if (request == NULL)
+        return;
+    if (request->storage != NULL) {
+        g_bytes_unref(request->storage);
+    }
+    else {
+        g_free(request->server_name);
+        g_free(request->script_name);
+        g_free(request->path_info);
+        g_free(request->request_method);
+        g_free(request->query_string);
+    }
     g_hash_table_destroy(request->headers);
     if (request->body != NULL)
         g_string_free(request->body, TRUE);
+    if (request->cancellable != NULL)
+        g_object_unref(request->cancellable);
     g_free(request);
 }
 
@@ -11,6 +11,8 @@
 
 #include <glib.h>
 #include "balde.h"
+#include "arena.h"
+#include "routing.h"
 #include "sessions.h"
 
 typedef struct {
@@ -22,25 +24,49 @@ typedef struct {
     GHashTable *headers;
     GString *body;
     gboolean https;
+
+    // if set, the strings above and the headers are slices of this buffer,
+    // instead of allocated one by one.
+    GBytes *storage;
+    // cancelled by the server api when the client aborts the request. only
+    // set by server apis that can tell.
+    GCancellable *cancellable;
 } balde_request_env_t;
 
+typedef enum {
+    BALDE_REQUEST_PARSED_ARGS = 1 << 0,
+    BALDE_REQUEST_PARSED_COOKIES = 1 << 1,
+    BALDE_REQUEST_PARSED_FORM = 1 << 2,
+} balde_request_parsed_t;
+
 struct _balde_request_private_t {
+    gchar *query_string;
     GHashTable *args;
     GHashTable *form;
     GHashTable *files;
-    GHashTable *view_args;
+    balde_view_arg_t view_args[BALDE_URL_MAX_ARGS];
+    guint n_view_args;
     GHashTable *headers;
     GHashTable *cookies;
     GString *body;
     balde_session_t *session;
+    balde_arena_t *arena;
+    GBytes *storage;
+    GCancellable *cancellable;
+    balde_request_parsed_t parsed;
 };
 
 gchar* balde_parse_header_name_from_envvar(const gchar *env_name);
+gboolean balde_urldecode_len(gchar *dest, const gchar *src, gsize len,
+    gsize *dest_len);
+gchar* balde_urldecode_arena(balde_arena_t *arena, const gchar *str, gsize len);
 gchar* balde_urldecode(const gchar* str);
 GHashTable* balde_parse_query_string(const gchar *query_string);
 GHashTable* balde_parse_cookies(const gchar *cookie_header);
-balde_authorization_t* balde_parse_authorization(const gchar *authorization);
-void balde_authorization_free(balde_authorization_t *authorization);
+balde_authorization_t* balde_parse_authorization(balde_arena_t *arena,
+    const gchar *authorization);
+void balde_authorization_free(balde_arena_t *arena,
+    balde_authorization_t *authorization);
 balde_request_t* balde_make_request(balde_app_t *app, balde_request_env_t *env);
 void balde_request_free(balde_request_t *request);
 void balde_request_env_free(balde_request_env_t *request);
@@ -79,16 +79,16 @@ balde_resource_free(balde_resource_t *resource)
     g_free(resource->type);
     g_free(resource->hash_name);
     g_free(resource->hash_content);
+    g_free(resource->etag);
     g_free(resource);
 }
 
 
-G_LOCK_DEFINE_STATIC(resources);
-
 BALDE_API void
 balde_resources_load(balde_app_t *app, GResource *resources)
 {
     BALDE_APP_READ_ONLY(app);
+    BALDE_APP_NOT_FROZEN(app);
     g_return_if_fail(app->error == NULL);
     GError *tmp_error = NULL;
     gchar **resources_list = balde_resources_list_files(resources, &tmp_error);
@@ -114,9 +114,11 @@ balde_resources_load(balde_app_t *app, GResource *resources)
         resource->hash_name = g_compute_checksum_for_string(G_CHECKSUM_MD5,
             resources_list[i], strlen(resources_list[i]));
         resource->hash_content = g_compute_checksum_for_bytes(G_CHECKSUM_MD5, b);
-        G_LOCK(resources);
+        resource->etag = g_strdup_printf("\"balde-%s-%s\"", resource->hash_name,
+            resource->hash_content);
         app->priv->static_resources = g_slist_append(app->priv->static_resources, resource);
-        G_UNLOCK(resources);
+        g_hash_table_replace(app->priv->static_resources_index, resource->name,
+            resource);
         g_bytes_unref(b);
     }
     g_strfreev(resources_list);
@@ -127,44 +129,38 @@ balde_response_t*
 balde_make_response_from_static_resource(balde_app_t *app, balde_request_t *request,
     const gchar *name)
 {
-    if (app->priv->static_resources == NULL)
+    balde_resource_t *resource = g_hash_table_lookup(
+        app->priv->static_resources_index, name);
+    if (resource == NULL)
         return balde_abort(app, 404);
-    for (GSList *tmp = app->priv->static_resources; tmp != NULL; tmp = g_slist_next(tmp)) {
-        balde_resource_t *resource = tmp->data;
-        if (0 == g_strcmp0(name, resource->name)) {
-            balde_response_t *response = balde_make_response("");
-
-            gint64 cache_timeout = 60 * 60 * 12;
-            gchar *cache_control = g_strdup_printf("public, max-age=%" G_GINT64_FORMAT,
-                cache_timeout);
-            balde_response_set_header(response, "Cache-Control", cache_control);
-            g_free(cache_control);
-
-            GDateTime *now = g_date_time_new_now_utc();
-            GDateTime *expires_dt = g_date_time_add(now, G_TIME_SPAN_SECOND * cache_timeout);
-            g_date_time_unref(now);
-            gchar *expires = balde_datetime_rfc5322(expires_dt);
-            g_date_time_unref(expires_dt);
-            balde_response_set_header(response, "Expires", expires);
-            g_free(expires);
-
-            gchar *etag = g_strdup_printf("\"balde-%s-%s\"", resource->hash_name,
-                resource->hash_content);
-            balde_response_set_header(response, "Etag", etag);
-            const gchar *if_none_match = balde_request_get_header(request,
-                "If-None-Match");
-            if (if_none_match != NULL && (g_strcmp0(if_none_match, etag) == 0))
-                response->status_code = 304;
-            else
-                balde_response_append_body_len(response, resource->content->str,
-                    resource->content->len);
-            g_free(etag);
-            if (resource->type != NULL)
-                balde_response_set_header(response, "Content-Type", resource->type);
-            return response;
-        }
-    }
-    return balde_abort(app, 404);
+
+    balde_response_t *response = balde_make_response("");
+
+    gint64 cache_timeout = 60 * 60 * 12;
+    gchar *cache_control = g_strdup_printf("public, max-age=%" G_GINT64_FORMAT,
+        cache_timeout);
+    balde_response_set_header(response, "Cache-Control", cache_control);
+    g_free(cache_control);
+
+    GDateTime *now = g_date_time_new_now_utc();
+    GDateTime *expires_dt = g_date_time_add(now, G_TIME_SPAN_SECOND * cache_timeout);
+    g_date_time_unref(now);
+    gchar *expires = balde_datetime_rfc5322(expires_dt);
+    g_date_time_unref(expires_dt);
+    balde_response_set_header(response, "Expires", expires);
+    g_free(expires);
+
+    balde_response_set_header(response, "Etag", resource->etag);
+    const gchar *if_none_match = balde_request_get_header(request,
+        "If-None-Match");
+    if (if_none_match != NULL && (g_strcmp0(if_none_match, resource->etag) == 0))
+        response->status_code = 304;
+    else
+        balde_response_append_body_len(response, resource->content->str,
+            resource->content->len);
+    if (resource->type != NULL)
+        balde_response_set_header(response, "Content-Type", resource->type);
+    return response;
 }
 
 
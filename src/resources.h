@@ -19,6 +19,7 @@ typedef struct {
     gchar *type;
     gchar *hash_name;
     gchar *hash_content;
+    gchar *etag;
 } balde_resource_t;
 
 gchar** balde_resources_list_files(GResource *resources, GError **error);
@@ -14,6 +14,7 @@
 #include <string.h>
 #include "balde.h"
 #include "balde-private.h"
+#include "arena.h"
 #include "datetime.h"
 #include "exceptions.h"
 #include "routing.h"
@@ -26,15 +27,17 @@ BALDE_API void
 balde_response_set_header(balde_response_t *response, const gchar *name,
     const gchar *value)
 {
+    balde_arena_t *arena = response->priv->arena;
+
     // http header name is ascii
-    gchar *new_name = g_ascii_strdown(name, -1);
+    gchar *new_name = balde_arena_ascii_strdown(arena, name);
     GSList *values = g_hash_table_lookup(response->priv->headers, new_name);
     GSList *tmp = values;
-    values = g_slist_append(values, g_strdup(value));
+    values = g_slist_append(values, balde_arena_strdup(arena, value));
     if (tmp == NULL)
         g_hash_table_insert(response->priv->headers, new_name, values);
     else
-        g_free(new_name);
+        balde_arena_release(arena, new_name);
 }
 
 
@@ -67,17 +70,33 @@ balde_response_headers_free(gpointer l)
 }
 
 
+static void
+balde_response_headers_free_list(gpointer l)
+{
+    // values are owned by the arena
+    g_slist_free(l);
+}
+
+
 balde_response_t*
 balde_make_response_from_gstring(GString *content)
 {
-    balde_response_t *response = g_new(balde_response_t, 1);
-    response->priv = g_new(struct _balde_response_private_t, 1);
+    balde_arena_t *arena = balde_arena_get_current();
+    balde_response_t *response = balde_arena_alloc(arena,
+        sizeof(balde_response_t));
+    response->priv = balde_arena_alloc(arena,
+        sizeof(struct _balde_response_private_t));
+    response->priv->arena = arena;
     response->status_code = 200;
     response->priv->headers = g_hash_table_new_full(g_str_hash, g_str_equal,
-        g_free, balde_response_headers_free);
+        balde_arena_destroy_notify(arena), arena == NULL ?
+        balde_response_headers_free : balde_response_headers_free_list);
     response->priv->template_ctx = g_hash_table_new_full(g_str_hash, g_str_equal,
-        g_free, g_free);
+        balde_arena_destroy_notify(arena), balde_arena_destroy_notify(arena));
     response->priv->body = content;
+    response->priv->stream_func = NULL;
+    response->priv->stream_data = NULL;
+    response->priv->stream_destroy = NULL;
     return response;
 }
 
@@ -100,7 +119,9 @@ BALDE_API void
 balde_response_set_tmpl_var(balde_response_t *response, const gchar *name,
     const gchar *value)
 {
-    g_hash_table_replace(response->priv->template_ctx, g_strdup(name), g_strdup(value));
+    g_hash_table_replace(response->priv->template_ctx,
+        balde_arena_strdup(response->priv->arena, name),
+        balde_arena_strdup(response->priv->arena, value));
 }
 
 
@@ -176,16 +197,47 @@ balde_response_delete_cookie(balde_response_t *response, const gchar *name,
 }
 
 
+BALDE_API void
+balde_response_set_stream(balde_response_t *response, balde_stream_func_t func,
+    gpointer user_data, GDestroyNotify destroy)
+{
+    if (response->priv->stream_destroy != NULL)
+        response->priv->stream_destroy(response->priv->stream_data);
+    response->priv->stream_func = func;
+    response->priv->stream_data = user_data;
+    response->priv->stream_destroy = destroy;
+}
+
+
+gboolean
+balde_response_stream_next(balde_app_t *app, balde_request_t *request,
+    balde_response_t *response)
+{
+    if (response->priv->stream_func == NULL)
+        return FALSE;
+    if (response->priv->stream_func(app, request, response,
+            response->priv->stream_data))
+        return TRUE;
+
+    // the stream is done. the response is now a regular one.
+    balde_response_set_stream(response, NULL, NULL, NULL);
+    return FALSE;
+}
+
+
 void
 balde_response_free(balde_response_t *response)
 {
     if (response == NULL)
         return;
+    if (response->priv->stream_destroy != NULL)
+        response->priv->stream_destroy(response->priv->stream_data);
     g_hash_table_destroy(response->priv->headers);
     g_hash_table_destroy(response->priv->template_ctx);
     g_string_free(response->priv->body, TRUE);
-    g_free(response->priv);
-    g_free(response);
+    balde_arena_t *arena = response->priv->arena;
+    balde_arena_release(arena, response->priv);
+    balde_arena_release(arena, response);
 }
 
 
@@ -288,9 +340,12 @@ balde_response_render(balde_response_t *response, const gboolean with_body)
         g_string_append_printf(str, "Status: %d %s\r\n", response->status_code, n);
         g_free(n);
     }
-    gchar *len = g_strdup_printf("%zu", response->priv->body->len);
-    balde_response_set_header(response, "Content-Length", len);
-    g_free(len);
+    // the length of streamed responses is unknown.
+    if (response->priv->stream_func == NULL) {
+        gchar *len = g_strdup_printf("%zu", response->priv->body->len);
+        balde_response_set_header(response, "Content-Length", len);
+        g_free(len);
+    }
     if (g_hash_table_lookup(response->priv->headers, "content-type") == NULL)
         balde_response_set_header(response, "Content-Type", "text/html; charset=utf-8");
     g_hash_table_foreach(response->priv->headers, (GHFunc) balde_header_render, str);
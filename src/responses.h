@@ -11,11 +11,16 @@
 
 #include <glib.h>
 #include "balde.h"
+#include "arena.h"
 
 struct _balde_response_private_t {
     GHashTable *headers;
     GHashTable *template_ctx;
     GString *body;
+    balde_arena_t *arena;
+    balde_stream_func_t stream_func;
+    gpointer stream_data;
+    GDestroyNotify stream_destroy;
 };
 
 void balde_response_headers_free(gpointer l);
@@ -25,6 +30,8 @@ balde_response_t* balde_make_response_from_exception(GError *error);
 void balde_fix_header_name(gchar *name);
 void balde_header_render(const gchar *key, GSList *value, GString *str);
 gchar* balde_response_generate_etag(balde_response_t *response, gboolean weak);
+gboolean balde_response_stream_next(balde_app_t *app, balde_request_t *request,
+    balde_response_t *response);
 GString* balde_response_render(balde_response_t *response,
     const gboolean with_body);
 void balde_response_print(GString *response);
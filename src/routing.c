@@ -11,14 +11,83 @@
 #endif /* HAVE_CONFIG_H */
 
 #include <glib.h>
+#include <string.h>
 #include "balde.h"
 #include "app.h"
 #include "routing.h"
 
 
+static gboolean
+balde_url_converter_int_parse(const gchar *str, gsize len, gint64 *rv)
+{
+    // digits only, as matched by the converter.
+    gint64 value = 0;
+    for (gsize i = 0; i < len; i++) {
+        gint digit = str[i] - '0';
+        if (value > (G_MAXINT64 - digit) / 10)
+            return FALSE;
+        value = value * 10 + digit;
+    }
+    if (rv != NULL)
+        *rv = value;
+    return TRUE;
+}
+
+
+static gboolean
+balde_url_converter_int_fits(const gchar *str)
+{
+    // if the run of digits starting at str doesn't fit in a gint64, the
+    // variable doesn't match there, even if a shorter capture would fit.
+    gsize len = 0;
+    while (g_ascii_isdigit(str[len]))
+        len++;
+    return balde_url_converter_int_parse(str, len, NULL);
+}
+
+
+static gboolean
+balde_view_arg_convert(balde_view_arg_t *arg, balde_url_converter_t converter,
+    const gchar *path)
+{
+    const gchar *start = path + arg->offset;
+    gchar buf[64];
+    gchar *tmp;
+    arg->converter = converter;
+    switch (converter) {
+        case BALDE_URL_CONVERTER_INT:
+            if (!balde_url_converter_int_fits(start))
+                return FALSE;
+            return balde_url_converter_int_parse(start, arg->len,
+                &(arg->converted.i));
+        case BALDE_URL_CONVERTER_FLOAT:
+            // the slice isn't terminated, and may be followed by digits.
+            // only absurdly long captures need the heap.
+            tmp = arg->len < sizeof(buf) ? buf : g_malloc(arg->len + 1);
+            memcpy(tmp, start, arg->len);
+            tmp[arg->len] = '\0';
+            arg->converted.f = g_ascii_strtod(tmp, NULL);
+            if (tmp != buf)
+                g_free(tmp);
+            break;
+        case BALDE_URL_CONVERTER_UUID:
+            for (guint i = 0, j = 0; i < 16; i++, j += 2) {
+                if (start[j] == '-')
+                    j++;
+                arg->converted.uuid[i] = (g_ascii_xdigit_value(start[j]) << 4) |
+                    g_ascii_xdigit_value(start[j + 1]);
+            }
+            break;
+        default:
+            break;
+    }
+    return TRUE;
+}
+
+
 const gboolean
 balde_url_match(const gchar *path, const balde_url_rule_match_t *rule,
-    GHashTable **matches)
+    balde_view_arg_t *args, guint *n_args)
 {
     g_return_val_if_fail(rule != NULL, FALSE);
     if (path == NULL || path[0] == '\0')
@@ -29,12 +98,23 @@ balde_url_match(const gchar *path, const balde_url_rule_match_t *rule,
         rv = FALSE;
         goto point1;
     }
-    *matches = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
-    for (guint i = 0; rule->args[i] != NULL; i++) {
-        gchar *value = g_match_info_fetch_named(info, rule->args[i]);
-        gchar *escaped_value = balde_urldecode(value);
-        g_free(value);
-        g_hash_table_insert(*matches, g_strdup(rule->args[i]), escaped_value);
+    *n_args = 0;
+    for (guint i = 0; rule->args[i] != NULL && i < BALDE_URL_MAX_ARGS; i++) {
+        gint start;
+        gint end;
+        // variables with unknown converters aren't captured
+        if (!g_match_info_fetch_named_pos(info, rule->args[i], &start, &end) ||
+            start < 0)
+            continue;
+        args[*n_args].name = rule->args[i];
+        args[*n_args].offset = start;
+        args[*n_args].len = end - start;
+        args[*n_args].value = NULL;
+        if (!balde_view_arg_convert(&(args[*n_args]), rule->converters[i], path)) {
+            rv = FALSE;
+            goto point1;
+        }
+        (*n_args)++;
     }
 point1:
     g_match_info_free(info);
@@ -42,18 +122,449 @@ point1:
 }
 
 
-gchar*
-balde_dispatch_from_path(GSList *views, const gchar *path, GHashTable **matches)
+/*
+ * The URL router is a radix tree built from the parsed URL rules. Static
+ * pieces of the rules are stored as compressed edges, and variables are
+ * stored as special children, one per converter, that consume the path
+ * following the same rules as the regexes generated for each rule. Each
+ * node knows the lowest rule index available in its subtree, so we can stop
+ * walking the tree as soon as a better (earlier registered) rule was found,
+ * keeping the "first registered rule wins" semantics. Rules that can't be
+ * represented in the tree are matched using their regexes.
+ */
+
+static balde_url_router_node_t*
+balde_url_router_node_new(const gchar *prefix, gsize prefix_len)
+{
+    balde_url_router_node_t *node = g_new(balde_url_router_node_t, 1);
+    node->prefix = g_strndup(prefix, prefix_len);
+    node->prefix_len = prefix_len;
+    node->children = NULL;
+    node->variables = NULL;
+    node->converter = 0;
+    node->converter_args = NULL;
+    node->rule = NULL;
+    node->data = NULL;
+    node->index = G_MAXUINT;
+    node->min_index = G_MAXUINT;
+    return node;
+}
+
+
+static void
+balde_url_router_node_free(balde_url_router_node_t *node)
+{
+    if (node == NULL)
+        return;
+    if (node->children != NULL)
+        g_ptr_array_free(node->children, TRUE);
+    if (node->variables != NULL)
+        g_ptr_array_free(node->variables, TRUE);
+    g_strfreev(node->converter_args);
+    g_free(node->prefix);
+    g_free(node);
+}
+
+
+static balde_url_router_node_t*
+balde_url_router_node_get_child(const balde_url_router_node_t *node, gchar c)
+{
+    if (node->children == NULL)
+        return NULL;
+    for (guint i = 0; i < node->children->len; i++) {
+        balde_url_router_node_t *child = g_ptr_array_index(node->children, i);
+        if (child->prefix[0] == c)
+            return child;
+    }
+    return NULL;
+}
+
+
+static balde_url_router_node_t*
+balde_url_router_node_add_static(balde_url_router_node_t *node,
+    const gchar *str, guint index)
+{
+    while (str[0] != '\0') {
+        balde_url_router_node_t *child = balde_url_router_node_get_child(node,
+            str[0]);
+        if (child == NULL) {
+            child = balde_url_router_node_new(str, strlen(str));
+            if (node->children == NULL)
+                node->children = g_ptr_array_new_with_free_func(
+                    (GDestroyNotify) balde_url_router_node_free);
+            g_ptr_array_add(node->children, child);
+            child->min_index = index;
+            return child;
+        }
+        gsize i = 0;
+        while (i < child->prefix_len && str[i] == child->prefix[i])
+            i++;
+        if (i < child->prefix_len) {
+            // split the edge: the current child keeps the common prefix, and
+            // everything else is moved to a new node below it.
+            balde_url_router_node_t *tail = balde_url_router_node_new(
+                child->prefix + i, child->prefix_len - i);
+            tail->children = child->children;
+            tail->variables = child->variables;
+            tail->rule = child->rule;
+            tail->data = child->data;
+            tail->index = child->index;
+            tail->min_index = child->min_index;
+            child->prefix[i] = '\0';
+            child->prefix_len = i;
+            child->children = g_ptr_array_new_with_free_func(
+                (GDestroyNotify) balde_url_router_node_free);
+            g_ptr_array_add(child->children, tail);
+            child->variables = NULL;
+            child->rule = NULL;
+            child->data = NULL;
+            child->index = G_MAXUINT;
+        }
+        child->min_index = MIN(child->min_index, index);
+        node = child;
+        str += i;
+    }
+    return node;
+}
+
+
+static gboolean
+balde_url_converter_args_equal(gchar **a, gchar **b)
+{
+    if (a == NULL || b == NULL)
+        return a == b;
+    guint i;
+    for (i = 0; a[i] != NULL && b[i] != NULL; i++)
+        if (0 != g_strcmp0(a[i], b[i]))
+            return FALSE;
+    return a[i] == b[i];
+}
+
+
+static balde_url_router_node_t*
+balde_url_router_node_add_variable(balde_url_router_node_t *node,
+    balde_url_converter_t converter, gchar **converter_args, guint index)
+{
+    balde_url_router_node_t *child = NULL;
+    if (node->variables == NULL)
+        node->variables = g_ptr_array_new_with_free_func(
+            (GDestroyNotify) balde_url_router_node_free);
+    for (guint i = 0; i < node->variables->len; i++) {
+        balde_url_router_node_t *tmp = g_ptr_array_index(node->variables, i);
+        if (tmp->converter == converter &&
+            balde_url_converter_args_equal(tmp->converter_args, converter_args)) {
+            child = tmp;
+            break;
+        }
+    }
+    if (child == NULL) {
+        child = balde_url_router_node_new("", 0);
+        child->converter = converter;
+        child->converter_args = g_strdupv(converter_args);
+        g_ptr_array_add(node->variables, child);
+    }
+    child->min_index = MIN(child->min_index, index);
+    return child;
+}
+
+
+balde_url_router_t*
+balde_url_router_new(void)
+{
+    balde_url_router_t *router = g_new(balde_url_router_t, 1);
+    router->root = balde_url_router_node_new("", 0);
+    router->fallbacks = NULL;
+    router->n_rules = 0;
+    return router;
+}
+
+
+void
+balde_url_router_add(balde_url_router_t *router,
+    const balde_url_rule_match_t *rule, gpointer data)
+{
+    g_return_if_fail(router != NULL);
+    g_return_if_fail(rule != NULL);
+    guint index = router->n_rules++;
+    guint n_args = g_strv_length(rule->args);
+    g_return_if_fail(n_args <= BALDE_URL_MAX_ARGS);
+    for (guint i = 0; i < n_args; i++) {
+        if (rule->converters[i] == BALDE_URL_CONVERTER_UNKNOWN) {
+            balde_url_router_fallback_t *fb = g_new(balde_url_router_fallback_t, 1);
+            fb->rule = rule;
+            fb->data = data;
+            fb->index = index;
+            router->fallbacks = g_slist_append(router->fallbacks, fb);
+            return;
+        }
+    }
+    balde_url_router_node_t *node = router->root;
+    node->min_index = MIN(node->min_index, index);
+    for (guint i = 0; rule->pieces[i] != NULL; i++) {
+        node = balde_url_router_node_add_static(node, rule->pieces[i], index);
+        if (rule->pieces[i + 1] == NULL)
+            break;
+        node = balde_url_router_node_add_variable(node, rule->converters[i],
+            rule->converter_args[i], index);
+    }
+    if (node->index == G_MAXUINT) {
+        node->index = index;
+        node->rule = rule;
+        node->data = data;
+    }
+}
+
+
+typedef struct {
+    const gchar *path;
+    gsize len;
+    gsize captures[2 * BALDE_URL_MAX_ARGS];
+    gsize best_captures[2 * BALDE_URL_MAX_ARGS];
+    const balde_url_router_node_t *best;
+    guint best_index;
+} balde_url_router_state_t;
+
+
+static gboolean
+balde_url_converter_uuid_match(const gchar *str, gsize len)
+{
+    // [A-Fa-f0-9]{8}-[A-Fa-f0-9]{4}-[A-Fa-f0-9]{4}-[A-Fa-f0-9]{4}-[A-Fa-f0-9]{12}
+    if (len < 36)
+        return FALSE;
+    for (guint i = 0; i < 36; i++) {
+        if (i == 8 || i == 13 || i == 18 || i == 23) {
+            if (str[i] != '-')
+                return FALSE;
+        }
+        else if (!g_ascii_isxdigit(str[i])) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+
+static void
+balde_url_router_node_match(const balde_url_router_node_t *node,
+    balde_url_router_state_t *state, gsize pos, guint depth);
+
+
+static inline void
+balde_url_router_node_match_variable(const balde_url_router_node_t *node,
+    balde_url_router_state_t *state, gsize start, gsize end, guint depth)
+{
+    state->captures[2 * depth] = start;
+    state->captures[2 * depth + 1] = end;
+    balde_url_router_node_match(node, state, end, depth + 1);
+}
+
+
+static void
+balde_url_router_node_match(const balde_url_router_node_t *node,
+    balde_url_router_state_t *state, gsize pos, guint depth)
+{
+    if (node->min_index >= state->best_index)
+        return;
+
+    const gchar *path = state->path;
+    gsize len = state->len;
+
+    if (pos == len && node->index < state->best_index) {
+        state->best = node;
+        state->best_index = node->index;
+        memcpy(state->best_captures, state->captures, 2 * depth * sizeof(gsize));
+    }
+
+    if (pos == len)
+        return;
+
+    balde_url_router_node_t *child = balde_url_router_node_get_child(node,
+        path[pos]);
+    if (child != NULL && child->prefix_len <= len - pos &&
+        0 == memcmp(child->prefix, path + pos, child->prefix_len))
+        balde_url_router_node_match(child, state, pos + child->prefix_len, depth);
+
+    if (node->variables == NULL)
+        return;
+
+    for (guint i = 0; i < node->variables->len; i++) {
+        balde_url_router_node_t *var = g_ptr_array_index(node->variables, i);
+        gsize end = pos;
+
+        // each converter tries its possible captures in the same order as
+        // the regex generated for it would do.
+        switch (var->converter) {
+
+            // [^/]+, greedy
+            case BALDE_URL_CONVERTER_STRING:
+                while (end < len && path[end] != '/')
+                    end++;
+                for (; end > pos; end--)
+                    balde_url_router_node_match_variable(var, state, pos, end, depth);
+                break;
+
+            // [^/].*?, lazy
+            case BALDE_URL_CONVERTER_PATH:
+                if (path[pos] == '/')
+                    break;
+                for (end = pos + 1; end <= len; end++) {
+                    balde_url_router_node_match_variable(var, state, pos, end, depth);
+                    if (path[end] == '\n')
+                        break;
+                }
+                break;
+
+            // \d+, greedy, as long as it fits in a gint64
+            case BALDE_URL_CONVERTER_INT:
+                if (!balde_url_converter_int_fits(path + pos))
+                    break;
+                while (end < len && g_ascii_isdigit(path[end]))
+                    end++;
+                for (; end > pos; end--)
+                    balde_url_router_node_match_variable(var, state, pos, end, depth);
+                break;
+
+            // \d+\.\d+, greedy
+            case BALDE_URL_CONVERTER_FLOAT:
+                while (end < len && g_ascii_isdigit(path[end]))
+                    end++;
+                if (end == pos || end == len || path[end] != '.')
+                    break;
+                gsize dot = end++;
+                while (end < len && g_ascii_isdigit(path[end]))
+                    end++;
+                for (; end > dot + 1; end--)
+                    balde_url_router_node_match_variable(var, state, pos, end, depth);
+                break;
+
+            case BALDE_URL_CONVERTER_UUID:
+                if (balde_url_converter_uuid_match(path + pos, len - pos))
+                    balde_url_router_node_match_variable(var, state, pos, pos + 36,
+                        depth);
+                break;
+
+            // choices are tried in the order they were declared
+            case BALDE_URL_CONVERTER_ANY:
+                for (guint j = 0; var->converter_args[j] != NULL; j++) {
+                    gsize l = strlen(var->converter_args[j]);
+                    if (l > 0 && l <= len - pos &&
+                        0 == memcmp(var->converter_args[j], path + pos, l))
+                        balde_url_router_node_match_variable(var, state, pos,
+                            pos + l, depth);
+                }
+                break;
+
+            default:
+                g_assert_not_reached();
+        }
+    }
+}
+
+
+gpointer
+balde_url_router_match(const balde_url_router_t *router, const gchar *path,
+    balde_view_arg_t *args, guint *n_args)
 {
-    for (GSList *tmp = views; tmp != NULL; tmp = g_slist_next(tmp)) {
-        balde_view_t *view = tmp->data;
-        if (balde_url_match(path, view->url_rule->match, matches))
-            return g_strdup(view->url_rule->endpoint);
+    g_return_val_if_fail(router != NULL, NULL);
+    if (path == NULL || path[0] == '\0')
+        path = "/";
+    balde_url_router_state_t state;
+    state.path = path;
+    state.len = strlen(path);
+    state.best = NULL;
+    state.best_index = G_MAXUINT;
+    balde_url_router_node_match(router->root, &state, 0, 0);
+
+    for (GSList *tmp = router->fallbacks; tmp != NULL; tmp = g_slist_next(tmp)) {
+        balde_url_router_fallback_t *fb = tmp->data;
+        if (fb->index >= state.best_index)
+            break;
+        if (balde_url_match(path, fb->rule, args, n_args))
+            return fb->data;
     }
+
+    if (state.best == NULL)
+        return NULL;
+
+    guint i;
+    for (i = 0; state.best->rule->args[i] != NULL; i++) {
+        args[i].name = state.best->rule->args[i];
+        args[i].offset = state.best_captures[2 * i];
+        args[i].len = state.best_captures[2 * i + 1] - state.best_captures[2 * i];
+        args[i].value = NULL;
+        balde_view_arg_convert(&(args[i]), state.best->rule->converters[i], path);
+    }
+    *n_args = i;
+    return state.best->data;
+}
+
+
+void
+balde_url_router_free(balde_url_router_t *router)
+{
+    if (router == NULL)
+        return;
+    balde_url_router_node_free(router->root);
+    g_slist_free_full(router->fallbacks, g_free);
+    g_free(router);
+}
+
+
+balde_view_t*
+balde_dispatch_from_path(const balde_url_router_t *router, const gchar *path,
+    balde_view_arg_t *args, guint *n_args)
+{
+    return balde_url_router_match(router, path, args, n_args);
+}
+
+
+balde_view_arg_t*
+balde_view_args_find(balde_view_arg_t *args, guint n_args, const gchar *name)
+{
+    for (guint i = 0; i < n_args; i++)
+        if (0 == g_strcmp0(args[i].name, name))
+            return &(args[i]);
     return NULL;
 }
 
 
+const gchar*
+balde_view_args_lookup(balde_view_arg_t *args, guint n_args, const gchar *path,
+    const gchar *name)
+{
+    if (path == NULL || path[0] == '\0')
+        path = "/";
+    balde_view_arg_t *arg = balde_view_args_find(args, n_args, name);
+    if (arg == NULL)
+        return NULL;
+    if (arg->value != NULL)
+        return arg->value;
+    const gchar *start = path + arg->offset;
+    gboolean escaped = memchr(start, '%', arg->len) != NULL ||
+        memchr(start, '+', arg->len) != NULL;
+
+    // slices at the end of the path are already NUL-terminated
+    if (!escaped && start[arg->len] == '\0')
+        return start;
+
+    if (escaped)
+        arg->value = balde_urldecode_arena(NULL, start, arg->len);
+    else
+        arg->value = g_strndup(start, arg->len);
+    return arg->value;
+}
+
+
+void
+balde_view_args_clear(balde_view_arg_t *args, guint n_args)
+{
+    for (guint i = 0; i < n_args; i++) {
+        g_free(args[i].value);
+        args[i].value = NULL;
+    }
+}
+
+
 const balde_http_method_t
 balde_http_method_str2enum(const gchar *method)
 {
@@ -105,22 +616,87 @@ balde_list_allowed_methods(const balde_http_method_t method)
 }
 
 
+static balde_url_converter_t
+balde_url_converter_from_string(const gchar *converter, const gchar *args,
+    gchar ***converter_args)
+{
+    if (converter_args != NULL)
+        *converter_args = NULL;
+    if (args == NULL || args[0] == '\0') {
+        if (0 == g_strcmp0(converter, ""))  // string, default
+            return BALDE_URL_CONVERTER_STRING;
+        if (0 == g_strcmp0(converter, "path"))
+            return BALDE_URL_CONVERTER_PATH;
+        if (0 == g_strcmp0(converter, "int"))
+            return BALDE_URL_CONVERTER_INT;
+        if (0 == g_strcmp0(converter, "float"))
+            return BALDE_URL_CONVERTER_FLOAT;
+        if (0 == g_strcmp0(converter, "uuid"))
+            return BALDE_URL_CONVERTER_UUID;
+        return BALDE_URL_CONVERTER_UNKNOWN;
+    }
+    if (0 != g_strcmp0(converter, "any"))
+        return BALDE_URL_CONVERTER_UNKNOWN;
+    if (converter_args != NULL) {
+        // args are still wrapped in parenthesis, e.g. "(foo, bar)"
+        gchar *tmp = g_strndup(args + 1, strlen(args) - 2);
+        *converter_args = g_strsplit(tmp, ",", 0);
+        g_free(tmp);
+        for (guint i = 0; (*converter_args)[i] != NULL; i++)
+            g_strstrip((*converter_args)[i]);
+    }
+    return BALDE_URL_CONVERTER_ANY;
+}
+
+
 static gboolean
 replace_url_rule_variables_cb(const GMatchInfo *info, GString *res, gpointer data)
 {
     gchar *converter = g_match_info_fetch(info, 2);
-    gchar *name = g_match_info_fetch(info, 3);
+    gchar *args = g_match_info_fetch(info, 3);
+    gchar *name = g_match_info_fetch(info, 5);
     GSList **tmp = (GSList**) data;
     *tmp = g_slist_append(*tmp, (gchar*) g_strdup(name));
     data = tmp;
     gboolean rv = FALSE;
-    if (0 == g_strcmp0(converter, ""))  // string, default
-        g_string_append_printf(res, "(?P<%s>[^/]+)", name);
-    else if (0 == g_strcmp0(converter, "path"))  // path
-        g_string_append_printf(res, "(?P<%s>[^/].*?)", name);
-    else
-        rv = TRUE;
+    gchar *tmp_choices;
+    gchar **choices;
+    switch (balde_url_converter_from_string(converter, args, NULL)) {
+        case BALDE_URL_CONVERTER_STRING:
+            g_string_append_printf(res, "(?P<%s>[^/]+)", name);
+            break;
+        case BALDE_URL_CONVERTER_PATH:
+            g_string_append_printf(res, "(?P<%s>[^/].*?)", name);
+            break;
+        case BALDE_URL_CONVERTER_INT:
+            g_string_append_printf(res, "(?P<%s>\\d+)", name);
+            break;
+        case BALDE_URL_CONVERTER_FLOAT:
+            g_string_append_printf(res, "(?P<%s>\\d+\\.\\d+)", name);
+            break;
+        case BALDE_URL_CONVERTER_UUID:
+            g_string_append_printf(res, "(?P<%s>[A-Fa-f0-9]{8}-[A-Fa-f0-9]{4}-"
+                "[A-Fa-f0-9]{4}-[A-Fa-f0-9]{4}-[A-Fa-f0-9]{12})", name);
+            break;
+        case BALDE_URL_CONVERTER_ANY:
+            // the rule is already regex-escaped, choices included.
+            tmp_choices = g_match_info_fetch(info, 4);
+            choices = g_strsplit(tmp_choices, ",", 0);
+            g_string_append_printf(res, "(?P<%s>", name);
+            for (guint i = 0; choices[i] != NULL; i++) {
+                if (i > 0)
+                    g_string_append_c(res, '|');
+                g_string_append(res, g_strstrip(choices[i]));
+            }
+            g_string_append_c(res, ')');
+            g_strfreev(choices);
+            g_free(tmp_choices);
+            break;
+        default:
+            rv = TRUE;
+    }
     g_free(name);
+    g_free(args);
     g_free(converter);
     return rv;
 }
@@ -132,16 +708,26 @@ balde_parse_url_rule(const gchar *rule, GError **error)
     g_return_val_if_fail(rule != NULL, NULL);
     GError *tmp_error = NULL;
     balde_url_rule_match_t *rv = NULL;
-    GRegex *regex_variables = g_regex_new("<(([a-z]+):)?([a-zA-Z_][a-zA-Z0-9_]*)>",
-        0, 0, &tmp_error);
+    GRegex *regex_variables = g_regex_new(
+        "<(([a-z]+)(\\((.*?)\\))?:)?([a-zA-Z_][a-zA-Z0-9_]*)>", 0, 0,
+        &tmp_error);
+    if (tmp_error != NULL) {
+        g_propagate_error(error, tmp_error);
+        goto point1;
+    }
+    GRegex *regex_escaped_variables = g_regex_new(
+        "<(([a-z]+)(\\\\\\((.*?)\\\\\\))?:)?([a-zA-Z_][a-zA-Z0-9_]*)>", 0, 0,
+        &tmp_error);
     if (tmp_error != NULL) {
         g_propagate_error(error, tmp_error);
         goto point1;
     }
     GSList *args = NULL;
     gchar *escaped_rule = g_regex_escape_string(rule, -1);
-    gchar *pattern = g_regex_replace_eval(regex_variables, escaped_rule, -1, 0, 0,
-        (GRegexEvalCallback) replace_url_rule_variables_cb, &args, &tmp_error);
+    gchar *pattern = g_regex_replace_eval(regex_escaped_variables, escaped_rule,
+        -1, 0, 0, (GRegexEvalCallback) replace_url_rule_variables_cb, &args,
+        &tmp_error);
+    g_regex_unref(regex_escaped_variables);
     if (tmp_error != NULL) {
         g_propagate_error(error, tmp_error);
         goto point2;
@@ -152,10 +738,20 @@ balde_parse_url_rule(const gchar *rule, GError **error)
         g_propagate_error(error, tmp_error);
         goto point3;
     }
-    gchar **rule_pieces_arr = g_regex_split(regex_variables, escaped_rule, 0);
+    gchar **rule_pieces_arr = g_regex_split(regex_variables, rule, 0);
     GSList *rule_pieces = NULL;
-    for (guint i = 0; i < g_strv_length(rule_pieces_arr); i += 4)
+    GSList *converters = NULL;
+    GSList *converter_args = NULL;
+    for (guint i = 0; i < g_strv_length(rule_pieces_arr); i += 6) {
         rule_pieces = g_slist_append(rule_pieces, g_strdup(rule_pieces_arr[i]));
+        if (rule_pieces_arr[i + 1] == NULL)
+            break;
+        gchar **c_args = NULL;
+        balde_url_converter_t converter = balde_url_converter_from_string(
+            rule_pieces_arr[i + 2], rule_pieces_arr[i + 3], &c_args);
+        converters = g_slist_append(converters, GINT_TO_POINTER(converter));
+        converter_args = g_slist_append(converter_args, c_args);
+    }
     g_strfreev(rule_pieces_arr);
     rule_pieces_arr = g_new(gchar*, g_slist_length(rule_pieces) + 1);
     guint i = 0;
@@ -167,10 +763,32 @@ balde_parse_url_rule(const gchar *rule, GError **error)
     rv->regex = regex_final;
     rv->args = g_new(gchar*, g_slist_length(args) + 1);
     rv->pieces = rule_pieces_arr;
+
+    // static pieces are escaped once, balde_url_build() only escapes the
+    // arguments.
+    rv->url_pieces = g_new(gchar*, i + 1);
+    rv->url_pieces_len = 0;
+    for (guint j = 0; j < i; j++) {
+        rv->url_pieces[j] = g_uri_escape_string(rule_pieces_arr[j], "/:", TRUE);
+        rv->url_pieces_len += strlen(rv->url_pieces[j]);
+    }
+    rv->url_pieces[i] = NULL;
+    rv->converters = g_new(balde_url_converter_t, g_slist_length(converters) + 1);
+    rv->converter_args = g_new(gchar**, g_slist_length(converter_args) + 1);
     i = 0;
     for (GSList *tmp = args; tmp != NULL; tmp = g_slist_next(tmp), i++)
         rv->args[i] = (gchar*) tmp->data;
     rv->args[i] = NULL;
+    i = 0;
+    for (GSList *tmp = converters; tmp != NULL; tmp = g_slist_next(tmp), i++)
+        rv->converters[i] = GPOINTER_TO_INT(tmp->data);
+    rv->converters[i] = 0;
+    g_slist_free(converters);
+    i = 0;
+    for (GSList *tmp = converter_args; tmp != NULL; tmp = g_slist_next(tmp), i++)
+        rv->converter_args[i] = (gchar**) tmp->data;
+    rv->converter_args[i] = NULL;
+    g_slist_free(converter_args);
 point3:
     g_free(tmp_pattern);
 point2:
@@ -183,13 +801,71 @@ point1:
 }
 
 
+gboolean
+balde_url_rule_has_empty_choices(const balde_url_rule_match_t *match)
+{
+    // the regex would match an empty string for these, the router would
+    // match nothing.
+    for (guint i = 0; match->converters[i] != 0; i++) {
+        if (match->converters[i] != BALDE_URL_CONVERTER_ANY)
+            continue;
+        gchar **choices = match->converter_args[i];
+        if (choices == NULL || choices[0] == NULL)
+            return TRUE;
+        for (guint j = 0; choices[j] != NULL; j++)
+            if (choices[j][0] == '\0')
+                return TRUE;
+    }
+    return FALSE;
+}
+
+
 void
 balde_free_url_rule_match(balde_url_rule_match_t *match)
 {
     if (match == NULL)
         return;
     g_strfreev(match->pieces);
+    g_strfreev(match->url_pieces);
     g_strfreev(match->args);
+    for (guint i = 0; match->converters[i] != 0; i++)
+        g_strfreev(match->converter_args[i]);
+    g_free(match->converters);
+    g_free(match->converter_args);
     g_regex_unref(match->regex);
     g_free(match);
 }
+
+
+void
+balde_url_build(GString *str, const gchar *script_name,
+    const balde_url_rule_match_t *match, va_list params)
+{
+    // pre-size the string, assuming that nothing dynamic needs escaping.
+    // GString has no way to reserve memory, then grow it and truncate back.
+    gsize len = match->url_pieces_len;
+    if (script_name != NULL)
+        len += strlen(script_name);
+    va_list tmp_params;
+    va_copy(tmp_params, params);
+    for (guint i = 0; match->url_pieces[i] != NULL && match->url_pieces[i + 1] != NULL; i++) {
+        const gchar *arg = va_arg(tmp_params, const gchar*);
+        if (arg != NULL)
+            len += strlen(arg);
+    }
+    va_end(tmp_params);
+    gsize orig_len = str->len;
+    g_string_set_size(str, orig_len + len);
+    g_string_truncate(str, orig_len);
+
+    if (script_name != NULL)
+        g_string_append_uri_escaped(str, script_name, "/:", TRUE);
+    for (guint i = 0; match->url_pieces[i] != NULL; i++) {
+        g_string_append(str, match->url_pieces[i]);
+        if (match->url_pieces[i + 1] != NULL) {
+            const gchar *arg = va_arg(params, const gchar*);
+            if (arg != NULL)
+                g_string_append_uri_escaped(str, arg, "/:", TRUE);
+        }
+    }
+}
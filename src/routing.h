@@ -12,10 +12,26 @@
 #include <glib.h>
 #include "balde.h"
 
+#define BALDE_URL_MAX_ARGS 16
+
+typedef enum {
+    BALDE_URL_CONVERTER_STRING = 1,
+    BALDE_URL_CONVERTER_PATH,
+    BALDE_URL_CONVERTER_INT,
+    BALDE_URL_CONVERTER_FLOAT,
+    BALDE_URL_CONVERTER_UUID,
+    BALDE_URL_CONVERTER_ANY,
+    BALDE_URL_CONVERTER_UNKNOWN,
+} balde_url_converter_t;
+
 typedef struct {
     GRegex *regex;
     gchar **args;
     gchar **pieces;
+    balde_url_converter_t *converters;
+    gchar ***converter_args;
+    gchar **url_pieces;
+    gsize url_pieces_len;
 } balde_url_rule_match_t;
 
 
@@ -26,13 +42,75 @@ typedef struct {
     balde_http_method_t method;
 } balde_url_rule_t;
 
+typedef struct {
+    balde_url_rule_t *url_rule;
+    balde_view_func_t view_func;
+} balde_view_t;
+
+// a view argument is a slice of the request path, that is only copied and
+// decoded when the view asks for it. arguments captured by the int, float and
+// uuid converters are converted when matched.
+typedef struct {
+    const gchar *name;
+    gsize offset;
+    gsize len;
+    gchar *value;
+    balde_url_converter_t converter;
+    union {
+        gint64 i;
+        gdouble f;
+        guint8 uuid[16];
+    } converted;
+} balde_view_arg_t;
+
+typedef struct _balde_url_router_node_t balde_url_router_node_t;
+
+struct _balde_url_router_node_t {
+    gchar *prefix;
+    gsize prefix_len;
+    GPtrArray *children;
+    GPtrArray *variables;
+    balde_url_converter_t converter;
+    gchar **converter_args;
+    const balde_url_rule_match_t *rule;
+    gpointer data;
+    guint index;
+    guint min_index;
+};
+
+typedef struct {
+    const balde_url_rule_match_t *rule;
+    gpointer data;
+    guint index;
+} balde_url_router_fallback_t;
+
+typedef struct {
+    balde_url_router_node_t *root;
+    GSList *fallbacks;
+    guint n_rules;
+} balde_url_router_t;
+
 const gboolean balde_url_match(const gchar *path, const balde_url_rule_match_t *rule,
-    GHashTable **matches);
-gchar* balde_dispatch_from_path(GSList *views, const gchar *path,
-    GHashTable **matches);
+    balde_view_arg_t *args, guint *n_args);
+balde_url_router_t* balde_url_router_new(void);
+void balde_url_router_add(balde_url_router_t *router,
+    const balde_url_rule_match_t *rule, gpointer data);
+gpointer balde_url_router_match(const balde_url_router_t *router,
+    const gchar *path, balde_view_arg_t *args, guint *n_args);
+void balde_url_router_free(balde_url_router_t *router);
+balde_view_t* balde_dispatch_from_path(const balde_url_router_t *router,
+    const gchar *path, balde_view_arg_t *args, guint *n_args);
+balde_view_arg_t* balde_view_args_find(balde_view_arg_t *args, guint n_args,
+    const gchar *name);
+const gchar* balde_view_args_lookup(balde_view_arg_t *args, guint n_args,
+    const gchar *path, const gchar *name);
+void balde_view_args_clear(balde_view_arg_t *args, guint n_args);
 const balde_http_method_t balde_http_method_str2enum(const gchar *method);
 gchar* balde_list_allowed_methods(const balde_http_method_t method);
 balde_url_rule_match_t* balde_parse_url_rule(const gchar *rule, GError **error);
+gboolean balde_url_rule_has_empty_choices(const balde_url_rule_match_t *match);
+void balde_url_build(GString *str, const gchar *script_name,
+    const balde_url_rule_match_t *match, va_list params);
 void balde_free_url_rule_match(balde_url_rule_match_t *match);
 
 #endif /* _BALDE_ROUTING_PRIVATE_H */
@@ -29,6 +29,9 @@ static balde_sapi_t *sapis[] = {
     NULL,
 };
 
+// the command line the app was started with, to start it again on reload.
+static gchar **sapi_argv = NULL;
+
 
 void
 balde_sapi_init(GOptionContext *context)
@@ -69,3 +72,18 @@ balde_sapi_run(balde_app_t *app, GOptionContext *context)
 
     return 3;
 }
+
+
+void
+balde_sapi_set_argv(gchar **argv)
+{
+    g_strfreev(sapi_argv);
+    sapi_argv = g_strdupv(argv);
+}
+
+
+gchar**
+balde_sapi_get_argv(void)
+{
+    return sapi_argv;
+}
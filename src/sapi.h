@@ -25,5 +25,7 @@ typedef struct {
 
 void balde_sapi_init(GOptionContext *context);
 gint balde_sapi_run(balde_app_t *app, GOptionContext *context);
+void balde_sapi_set_argv(gchar **argv);
+gchar** balde_sapi_get_argv(void);
 
 #endif /* _BALDE_SAPI_PRIVATE_H */
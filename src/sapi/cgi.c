@@ -12,11 +12,54 @@
 
 #include <glib.h>
 #include <stdio.h>
+#include <string.h>
 #include "../balde.h"
 #include "../app.h"
 #include "cgi.h"
 
 
+balde_sapi_cgi_param_t
+balde_sapi_cgi_param_lookup(const gchar *key, guint32 len)
+{
+    // used by the server apis that receive CGI variables from the webserver.
+    // switching on the length first leaves at most three candidates to
+    // compare.
+    switch (len) {
+        case 5:
+            if (0 == memcmp(key, "HTTPS", 5))
+                return CGI_PARAM_HTTPS;
+            break;
+        case 9:
+            if (0 == memcmp(key, "PATH_INFO", 9))
+                return CGI_PARAM_PATH_INFO;
+            break;
+        case 11:
+            if (0 == memcmp(key, "SERVER_NAME", 11))
+                return CGI_PARAM_SERVER_NAME;
+            if (0 == memcmp(key, "SCRIPT_NAME", 11))
+                return CGI_PARAM_SCRIPT_NAME;
+            if (0 == memcmp(key, "REQUEST_URI", 11))
+                return CGI_PARAM_REQUEST_URI;
+            break;
+        case 12:
+            if (0 == memcmp(key, "QUERY_STRING", 12))
+                return CGI_PARAM_QUERY_STRING;
+            if (0 == memcmp(key, "CONTENT_TYPE", 12))
+                return CGI_PARAM_CONTENT_TYPE;
+            break;
+        case 14:
+            if (0 == memcmp(key, "REQUEST_METHOD", 14))
+                return CGI_PARAM_REQUEST_METHOD;
+            if (0 == memcmp(key, "CONTENT_LENGTH", 14))
+                return CGI_PARAM_CONTENT_LENGTH;
+            break;
+    }
+    if (len >= 5 && 0 == memcmp(key, "HTTP_", 5))
+        return CGI_PARAM_HEADER;
+    return CGI_PARAM_UNKNOWN;
+}
+
+
 guint64
 balde_sapi_cgi_parse_content_length(const gchar *str)
 {
@@ -74,6 +117,8 @@ balde_sapi_cgi_parse_request(balde_app_t *app)
     rv->headers = balde_sapi_cgi_request_headers();
     rv->body = balde_sapi_cgi_stdin_read(app);
     rv->https = g_getenv("HTTPS") != NULL;
+    rv->storage = NULL;
+    rv->cancellable = NULL;
     return rv;
 }
 
@@ -14,6 +14,22 @@
 #include "../requests.h"
 #include "../sapi.h"
 
+typedef enum {
+    CGI_PARAM_UNKNOWN,
+    CGI_PARAM_SERVER_NAME,
+    CGI_PARAM_SCRIPT_NAME,
+    CGI_PARAM_PATH_INFO,
+    CGI_PARAM_REQUEST_METHOD,
+    CGI_PARAM_REQUEST_URI,
+    CGI_PARAM_QUERY_STRING,
+    CGI_PARAM_CONTENT_LENGTH,
+    CGI_PARAM_CONTENT_TYPE,
+    CGI_PARAM_HTTPS,
+    CGI_PARAM_HEADER,
+} balde_sapi_cgi_param_t;
+
+balde_sapi_cgi_param_t balde_sapi_cgi_param_lookup(const gchar *key,
+    guint32 len);
 guint64 balde_sapi_cgi_parse_content_length(const gchar *str);
 GString* balde_sapi_cgi_stdin_read(balde_app_t *app);
 GHashTable* balde_sapi_cgi_request_headers(void);
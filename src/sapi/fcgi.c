@@ -12,6 +12,7 @@
 
 #include <glib.h>
 #include <gio/gio.h>
+#include <string.h>
 
 #include "../balde.h"
 #include "../app.h"
@@ -20,6 +21,12 @@
 #include "../sapi.h"
 #include "cgi.h"
 #include "fcgi.h"
+#include "prefork.h"
+#include "server.h"
+
+#define FCGI_VERSION_1 1
+#define FCGI_HEADER_LEN 8
+#define FCGI_KEEP_CONN 1
 
 typedef enum {
     FCGI_BEGIN_REQUEST = 1,
@@ -57,11 +64,6 @@ typedef struct {
     guint8 reserved;
 } balde_sapi_fcgi_header_t;
 
-typedef struct {
-    balde_sapi_fcgi_header_t *header;
-    guint8 buffer[0xffff + 0xff];
-} balde_sapi_fcgi_record_t;
-
 typedef struct {
     guint16 role;
     guint8 flags;
@@ -69,66 +71,31 @@ typedef struct {
 } balde_sapi_fcgi_begin_request_body_t;
 
 typedef struct {
-    GOutputStream *ostream;
-    GHashTable *requests;
-    GMutex mutex;
-    GMutex mutex_cond;
-    GCond cond;
+    GHashTable *requests;  // being received, only used by the I/O thread
+    GHashTable *running;   // handed to the application threads
+    GMutex mutex;          // protects running
 } balde_sapi_fcgi_connection_t;
 
 typedef struct {
     guint16 id;
     guint8 flags;
     GByteArray *params;
-    GByteArray *body;
-    gboolean processed;
+    GString *body;
+    balde_server_connection_t *connection;
+    GCancellable *cancellable;
+    gint64 deadline;
 } balde_sapi_fcgi_request_t;
 
 typedef struct {
     balde_app_t *app;
     GThreadPool *pool;
+    guint max_queued;
+    gint64 queue_timeout;
 } balde_sapi_fcgi_user_data_t;
 
-typedef struct {
-    balde_sapi_fcgi_connection_t *connection;
-    balde_sapi_fcgi_request_t *request;
-} balde_sapi_fcgi_thread_user_data_t;
-
 static const guint8 padding[8] = {0, 0, 0, 0, 0, 0, 0, 0};
 
 
-static balde_sapi_fcgi_header_t*
-balde_sapi_fcgi_read_header(GInputStream *istream)
-{
-    GError *err = NULL;
-
-    balde_sapi_fcgi_header_t *rv = g_new(balde_sapi_fcgi_header_t, 1);
-    gsize r;
-    if (!g_input_stream_read_all(istream, rv, sizeof(balde_sapi_fcgi_header_t),
-        &r, NULL, &err))
-    {
-        g_printerr("fcgi: error: received invalid FastCGI header, dropping "
-            "connection.\n");
-        g_free(rv);
-        return NULL;
-    }
-
-    // as this is the first read we do to get any record, this usually means
-    // that we got EOF because the server sent keep_conn, but closed connection.
-    // no need to make noise about this :)
-    if (r == 0) {
-        g_free(rv);
-        return NULL;
-    }
-
-    // fix byte order
-    rv->request_id = g_ntohs(rv->request_id);
-    rv->content_length = g_ntohs(rv->content_length);
-
-    return rv;
-}
-
-
 static void
 balde_sapi_fcgi_request_free(balde_sapi_fcgi_request_t *r)
 {
@@ -137,27 +104,38 @@ balde_sapi_fcgi_request_free(balde_sapi_fcgi_request_t *r)
     if (r->params != NULL)
         g_byte_array_free(r->params, TRUE);
     if (r->body != NULL)
-        g_byte_array_free(r->body, TRUE);
+        g_string_free(r->body, TRUE);
+    g_object_unref(r->cancellable);
+    balde_server_connection_unref(r->connection);
     g_free(r);
 }
 
 
-static void
-balde_sapi_fcgi_record_free(balde_sapi_fcgi_record_t *r)
+static gboolean
+balde_sapi_fcgi_read_length(const guint8 *data, gsize len, gsize *pos,
+    guint32 *rv)
 {
-    if (r == NULL)
-        return;
-    g_free(r->header);
-    g_free(r);
+    if (*pos >= len)
+        return FALSE;
+    if (data[*pos] >> 7 == 0) {
+        *rv = data[(*pos)++];
+        return TRUE;
+    }
+    if (len - *pos < 4)
+        return FALSE;
+    *rv =
+        ((guint32) (data[*pos] & 0x7f) << 24) |
+                   (data[*pos + 1] << 16) |
+                   (data[*pos + 2] << 8) |
+                    data[*pos + 3];
+    *pos += 4;
+    return TRUE;
 }
 
 
 balde_request_env_t*
-balde_sapi_fcgi_parse_request(GByteArray *params, GByteArray *body)
+balde_sapi_fcgi_parse_request(GByteArray *params, GString *body)
 {
-    if (params == NULL || body == NULL)
-        return NULL;
-
     balde_request_env_t *rv = g_new(balde_request_env_t, 1);
     rv->server_name = NULL;
     rv->script_name = NULL;
@@ -165,105 +143,100 @@ balde_sapi_fcgi_parse_request(GByteArray *params, GByteArray *body)
     rv->request_method = NULL;
     rv->query_string = NULL;
     rv->https = FALSE;
-    rv->headers = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    rv->headers = g_hash_table_new(g_str_hash, g_str_equal);
     rv->body = NULL;
-
-    gint i = 0;
-    gint key_len;
-    gint value_len;
-
-    while (i < params->len) {
-
-        // key length
-        if (params->data[i] >> 7 == 0) {
-            key_len = params->data[i];
-            i++;
-        }
-        else {
-            if ((params->len - i) < 4) {
-                balde_request_env_free(rv);
-                return NULL;
-            }
-            key_len =
-                ((params->data[i] & 0x7f) << 24) +
-                 (params->data[i + 1] << 16) +
-                 (params->data[i + 2] << 8) +
-                  params->data[i + 3];
-            i += 4;
-        }
-
-        if (i >= params->len) {
-            balde_request_env_free(rv);
-            return NULL;
+    rv->storage = NULL;
+    rv->cancellable = NULL;
+
+    // params are decoded in place, and the request keeps the buffer. the
+    // length bytes before each pair leave room for the nul terminators, and
+    // header names only get shorter when normalized, so the decoded strings
+    // never overtake the data still to be decoded.
+    gchar *data = (gchar*) params->data;
+    gsize len = params->len;
+    gsize pos = 0;
+    gsize w = 0;
+    guint32 key_len;
+    guint32 value_len;
+
+    while (pos < len) {
+        if (!balde_sapi_fcgi_read_length(params->data, len, &pos, &key_len) ||
+            !balde_sapi_fcgi_read_length(params->data, len, &pos, &value_len) ||
+            len - pos < (guint64) key_len + value_len)
+            goto point1;
+
+        gchar *key = data + pos;
+        gchar *value = key + key_len;
+        pos += (gsize) key_len + value_len;
+
+        balde_sapi_cgi_param_t param = balde_sapi_cgi_param_lookup(key,
+            key_len);
+        if (param == CGI_PARAM_UNKNOWN)
+            continue;
+        if (param == CGI_PARAM_HTTPS) {
+            rv->https = TRUE;
+            continue;
         }
 
-        // value length
-        if (params->data[i] >> 7 == 0) {
-            value_len = params->data[i];
-            i++;
-        }
-        else {
-            if ((params->len - i) < 4) {
-                balde_request_env_free(rv);
-                return NULL;
-            }
-            value_len =
-                ((params->data[i] & 0x7f) << 24) +
-                 (params->data[i + 1] << 16) +
-                 (params->data[i + 2] << 8) +
-                  params->data[i + 3];
-            i += 4;
+        gchar *name = NULL;
+        if (param == CGI_PARAM_HEADER) {
+            name = data + w;
+            for (guint32 i = 5; i < key_len; i++)
+                data[w++] = key[i] == '_' ? '-' : g_ascii_tolower(key[i]);
+            data[w++] = '\0';
         }
+        gchar *v = memmove(data + w, value, value_len);
+        w += value_len;
+        data[w++] = '\0';
 
-        char *key = g_strdup_printf("%.*s", key_len, params->data + i);
-        i += key_len;
-        char *value = g_strdup_printf("%.*s", value_len, params->data + i);
-        i += value_len;
-
-        if (0 == g_strcmp0(key, "SERVER_NAME")) {
-            rv->server_name = value;
-            g_free(key);
-        }
-        else if (0 == g_strcmp0(key, "SCRIPT_NAME")) {
-            rv->script_name = value;
-            g_free(key);
-        }
-        else if (0 == g_strcmp0(key, "PATH_INFO")) {
-            rv->path_info = value;
-            g_free(key);
-        }
-        else if (0 == g_strcmp0(key, "REQUEST_METHOD")) {
-            rv->request_method = value;
-            g_free(key);
-        }
-        else if (0 == g_strcmp0(key, "QUERY_STRING")) {
-            rv->query_string = value;
-            g_free(key);
-        }
-        else if (0 == g_strcmp0(key, "HTTPS")) {
-            rv->https = TRUE;
-            g_free(key);
-            g_free(value);
-        }
-        else {
-            char *header_key = balde_parse_header_name_from_envvar(key);
-            if (header_key != NULL) {
-                g_hash_table_replace(rv->headers, header_key, value);
-            }
-            else {
-                g_free(value);
-            }
-            g_free(key);
+        switch (param) {
+            case CGI_PARAM_SERVER_NAME:
+                rv->server_name = v;
+                break;
+            case CGI_PARAM_SCRIPT_NAME:
+                rv->script_name = v;
+                break;
+            case CGI_PARAM_PATH_INFO:
+                rv->path_info = v;
+                break;
+            case CGI_PARAM_REQUEST_METHOD:
+                rv->request_method = v;
+                break;
+            case CGI_PARAM_QUERY_STRING:
+                rv->query_string = v;
+                break;
+            case CGI_PARAM_CONTENT_LENGTH:
+                g_hash_table_replace(rv->headers, "content-length", v);
+                break;
+            case CGI_PARAM_CONTENT_TYPE:
+                g_hash_table_replace(rv->headers, "content-type", v);
+                break;
+            case CGI_PARAM_HEADER:
+                g_hash_table_replace(rv->headers, name, v);
+                break;
+            default:
+                break;
         }
     }
 
     const char *clen_str = g_hash_table_lookup(rv->headers, "content-length");
     guint64 clen = balde_sapi_cgi_parse_content_length(clen_str);
     if (clen > 0 && clen <= body->len) {
-        rv->body = g_string_new_len((char*) body->data, clen);
+        g_string_truncate(body, clen);
+        rv->body = body;
     }
-
+    else {
+        g_string_free(body, TRUE);
+    }
+    rv->storage = g_byte_array_free_to_bytes(params);
     return rv;
+
+point1:
+    g_hash_table_destroy(rv->headers);
+    g_free(rv);
+    g_byte_array_free(params, TRUE);
+    g_string_free(body, TRUE);
+    return NULL;
 }
 
 
@@ -294,12 +267,8 @@ balde_sapi_fcgi_add_record(GByteArray *ba, guint16 request_id, guint8 type,
 
 
 static void
-balde_sapi_fcgi_send_eof(GOutputStream *stream, GByteArray *ba, guint16 request_id,
-    guint8 status)
+balde_sapi_fcgi_add_end_request(GByteArray *ba, guint16 request_id, guint8 status)
 {
-    if (ba == NULL)
-        ba = g_byte_array_new();
-
     guint8 body[] = {
         0,       // app status FIXME!
         0,       // app status FIXME!
@@ -311,32 +280,78 @@ balde_sapi_fcgi_send_eof(GOutputStream *stream, GByteArray *ba, guint16 request_
         0,       // reserved
     };
     balde_sapi_fcgi_add_record(ba, request_id, FCGI_END_REQUEST, body, sizeof(body));
-    g_output_stream_write_all(stream, ba->data, ba->len, NULL, NULL, NULL);
-    g_byte_array_free(ba, TRUE);
 }
 
 
 static void
-balde_sapi_fcgi_send_get_values_result(GOutputStream *stream)
+balde_sapi_fcgi_send_end_request(balde_server_connection_t *conn,
+    guint16 request_id, guint8 status)
 {
     GByteArray *ba = g_byte_array_new();
+    balde_sapi_fcgi_add_end_request(ba, request_id, status);
+    balde_server_connection_write_stream(conn, request_id,
+        g_byte_array_free_to_bytes(ba));
+}
 
-    guint8 body[] = {
-        15,  // key length
-        1,   // value length
 
-        // body
-        'F', 'C', 'G', 'I', '_', 'M', 'P', 'X', 'S', '_', 'C', 'O', 'N', 'N',
-        'S', '1',
-    };
-    balde_sapi_fcgi_add_record(ba, 0, FCGI_GET_VALUES_RESULT, body, sizeof(body));
-    g_output_stream_write_all(stream, ba->data, ba->len, NULL, NULL, NULL);
-    g_byte_array_free(ba, TRUE);
+static void
+balde_sapi_fcgi_add_value(GByteArray *ba, const gchar *name, guint value)
+{
+    gchar *v = g_strdup_printf("%u", value);
+    guint8 len[2] = {strlen(name), strlen(v)};
+    g_byte_array_append(ba, len, 2);
+    g_byte_array_append(ba, (guint8*) name, len[0]);
+    g_byte_array_append(ba, (guint8*) v, len[1]);
+    g_free(v);
+}
+
+
+static gboolean
+balde_sapi_fcgi_send_get_values_result(balde_server_connection_t *conn,
+    const guint8 *content, guint16 len)
+{
+    balde_sapi_fcgi_user_data_t *ud = balde_server_get_user_data(conn->server);
+
+    // requests are multiplexed and connections aren't limited, so every
+    // request that can be handled without being shed may come in a
+    // connection of its own. with an unbounded queue only the application
+    // threads count.
+    guint max_reqs = g_thread_pool_get_max_threads(ud->pool) + ud->max_queued;
+
+    GByteArray *body = g_byte_array_new();
+    gsize pos = 0;
+    while (pos < len) {
+        guint32 name_len, value_len;
+        if (!balde_sapi_fcgi_read_length(content, len, &pos, &name_len) ||
+            !balde_sapi_fcgi_read_length(content, len, &pos, &value_len) ||
+            len - pos < (gsize) name_len + value_len)
+        {
+            g_byte_array_free(body, TRUE);
+            return FALSE;
+        }
+        const gchar *name = (const gchar*) content + pos;
+        pos += name_len + value_len;
+
+        // unknown names are left out of the answer.
+        if (name_len == 14 && 0 == memcmp(name, "FCGI_MAX_CONNS", 14))
+            balde_sapi_fcgi_add_value(body, "FCGI_MAX_CONNS", max_reqs);
+        else if (name_len == 13 && 0 == memcmp(name, "FCGI_MAX_REQS", 13))
+            balde_sapi_fcgi_add_value(body, "FCGI_MAX_REQS", max_reqs);
+        else if (name_len == 15 && 0 == memcmp(name, "FCGI_MPXS_CONNS", 15))
+            balde_sapi_fcgi_add_value(body, "FCGI_MPXS_CONNS", 1);
+    }
+
+    GByteArray *ba = g_byte_array_new();
+    balde_sapi_fcgi_add_record(ba, 0, FCGI_GET_VALUES_RESULT, body->data,
+        body->len);
+    balde_server_connection_write(conn, g_byte_array_free_to_bytes(ba));
+    g_byte_array_free(body, TRUE);
+    return TRUE;
 }
 
 
 static void
-balde_sapi_fcgi_send_unknown_type(GOutputStream *stream, guint8 type)
+balde_sapi_fcgi_send_unknown_type(balde_server_connection_t *conn, guint8 type)
 {
     GByteArray *ba = g_byte_array_new();
 
@@ -351,249 +366,390 @@ balde_sapi_fcgi_send_unknown_type(GOutputStream *stream, guint8 type)
         0,     // reserved
     };
     balde_sapi_fcgi_add_record(ba, 0, FCGI_UNKNOWN_TYPE, body, sizeof(body));
-    g_output_stream_write_all(stream, ba->data, ba->len, NULL, NULL, NULL);
-    g_byte_array_free(ba, TRUE);
+    balde_server_connection_write(conn, g_byte_array_free_to_bytes(ba));
 }
 
 
-static void
-balde_handle_request(balde_sapi_fcgi_thread_user_data_t *data, balde_app_t *app)
+static gboolean
+balde_sapi_fcgi_write_stdout(GBytes *data, balde_sapi_fcgi_request_t *request)
 {
-    balde_sapi_fcgi_request_t *request = data->request;
-    balde_sapi_fcgi_connection_t *connection = data->connection;
-
-    balde_request_env_t* env = balde_sapi_fcgi_parse_request(request->params,
-        request->body);
-    if (env == NULL)
-        balde_abort_set_error(app, 400);
-
-    GString *response = balde_app_main_loop(app, env, balde_response_render, NULL);
-
-    GByteArray *ba = g_byte_array_new();
+    // blocks the application thread while the client is slower than the
+    // response being produced. nobody reads the response of an aborted
+    // request.
+    if (g_cancellable_is_cancelled(request->cancellable) ||
+        !balde_server_connection_wait_writable(request->connection))
+    {
+        g_bytes_unref(data);
+        return FALSE;
+    }
 
+    // records are made of a header and a slice of the data, without copying
+    // it. every record is written as a unit of the request stream, so records
+    // of concurrent requests are interleaved on the connection.
+    gsize len;
+    g_bytes_get_data(data, &len);
     gsize current = 0;
-    while (current < response->len) {
-        gsize to_send = response->len - current;
-        to_send = to_send > 0xffff ? 0xffff : to_send;
-        balde_sapi_fcgi_add_record(ba, request->id, FCGI_STDOUT,
-            (guint8*) response->str + current, to_send);
+    while (current < len) {
+        guint16 to_send = MIN(len - current, 0xffff);
+        guint8 padding_len = (8 - to_send % 8) % 8;
+        guint8 header[] = {
+            FCGI_VERSION_1,
+            FCGI_STDOUT,
+            (guint8) (request->id >> 8) & 0xff,
+            (guint8)  request->id       & 0xff,
+            (guint8) (to_send     >> 8) & 0xff,
+            (guint8)  to_send           & 0xff,
+            padding_len,
+            0,
+        };
+        GBytes *record[3];
+        guint n = 0;
+        record[n++] = g_bytes_new(header, sizeof(header));
+        record[n++] = g_bytes_new_from_bytes(data, current, to_send);
+        if (padding_len > 0)
+            record[n++] = g_bytes_new_static(padding, padding_len);
+        balde_server_connection_writev_stream(request->connection, request->id,
+            record, n);
         current += to_send;
     }
-    g_string_free(response, TRUE);
+    g_bytes_unref(data);
+    return TRUE;
+}
+
+
+static void
+balde_sapi_fcgi_handle_request(balde_sapi_fcgi_request_t *request,
+    balde_sapi_fcgi_user_data_t *ud)
+{
+    balde_app_t *app = ud->app;
+    balde_sapi_fcgi_connection_t *fconn = request->connection->data;
+    guint8 status = FCGI_REQUEST_COMPLETE;
+    GByteArray *ba;
+    GString *response;
+
+    if (!balde_app_admission_leave(app, request->deadline)) {
+        status = FCGI_OVERLOADED;
+        goto point1;
+    }
 
-    balde_sapi_fcgi_add_record(ba, request->id, FCGI_STDOUT, NULL, 0);
+    // aborted while waiting for a thread.
+    if (g_cancellable_is_cancelled(request->cancellable))
+        goto point1;
 
-    g_mutex_lock(&(connection->mutex));
-    balde_sapi_fcgi_send_eof(connection->ostream, ba, request->id,
-        FCGI_REQUEST_COMPLETE);
-    g_hash_table_remove(connection->requests, GINT_TO_POINTER(request->id));
-    g_mutex_unlock(&(connection->mutex));
+    // the request env takes over the buffers.
+    balde_request_env_t* env = balde_sapi_fcgi_parse_request(request->params,
+        request->body);
+    request->params = NULL;
+    request->body = NULL;
+    if (env == NULL) {
+        // errors are per-request, the shared application context can't be
+        // touched.
+        balde_app_t *app_copy = balde_app_copy(app);
+        balde_abort_set_error(app_copy, 400);
+        response = balde_app_main_loop(app_copy, NULL, balde_response_render,
+            NULL);
+        balde_app_free(app_copy);
+    }
+    else {
+        env->cancellable = g_object_ref(request->cancellable);
 
-    g_mutex_lock(&(connection->mutex_cond));
-    request->processed = TRUE;
-    g_cond_signal(&(connection->cond));
-    g_mutex_unlock(&(connection->mutex_cond));
+        // streamed responses are written by the main loop, as produced.
+        response = balde_app_main_loop_stream(app, env, balde_response_render,
+            (balde_response_writer_t) balde_sapi_fcgi_write_stdout, request,
+            NULL);
+    }
+    balde_sapi_fcgi_write_stdout(g_string_free_to_bytes(response), request);
+
+point1:
+    // done before ending the request, the webserver may reuse its id as soon
+    // as it is ended.
+    g_mutex_lock(&(fconn->mutex));
+    g_hash_table_remove(fconn->running, GINT_TO_POINTER(request->id));
+    g_mutex_unlock(&(fconn->mutex));
+
+    ba = g_byte_array_sized_new(3 * FCGI_HEADER_LEN);
+    if (status == FCGI_REQUEST_COMPLETE)
+        balde_sapi_fcgi_add_record(ba, request->id, FCGI_STDOUT, NULL, 0);
+    balde_sapi_fcgi_add_end_request(ba, request->id, status);
+    balde_server_connection_write_stream(request->connection, request->id,
+        g_byte_array_free_to_bytes(ba));
+
+    // without FCGI_KEEP_CONN, the application closes the connection after
+    // answering the request.
+    if (!(request->flags & FCGI_KEEP_CONN))
+        balde_server_connection_close(request->connection);
 
-    g_free(data);
+    balde_sapi_fcgi_request_free(request);
 }
 
 
 static gboolean
-balde_incoming_callback(GThreadedSocketService *service,
-    GSocketConnection *connection, GObject *source_object, gpointer user_data)
+balde_sapi_fcgi_handle_record(balde_server_connection_t *conn,
+    balde_sapi_fcgi_header_t *header, guint8 *content)
 {
-    GError *error = NULL;
+    balde_sapi_fcgi_connection_t *fconn = conn->data;
+    balde_sapi_fcgi_user_data_t *ud = balde_server_get_user_data(conn->server);
 
-    GInputStream *istream = g_io_stream_get_input_stream(G_IO_STREAM(connection));
-    GOutputStream *ostream = g_io_stream_get_output_stream(G_IO_STREAM(connection));
+    balde_sapi_fcgi_request_t *request = g_hash_table_lookup(fconn->requests,
+        GINT_TO_POINTER(header->request_id));
 
-    balde_sapi_fcgi_user_data_t *ud = user_data;
+    if ((request == NULL) &&
+        (header->type != FCGI_BEGIN_REQUEST) &&
+        (header->type != FCGI_ABORT_REQUEST) &&
+        (header->type != FCGI_GET_VALUES))
+    {
+        g_printerr("fcgi: error: unexpected FastCGI record type %d, dropping "
+            "connection.\n", header->type);
+        return FALSE;
+    }
 
-    GHashTable *requests = g_hash_table_new_full(g_direct_hash, g_direct_equal,
-        NULL, (GDestroyNotify) balde_sapi_fcgi_request_free);
+    balde_sapi_fcgi_begin_request_body_t *brb = NULL;
 
-    balde_sapi_fcgi_connection_t *conn = g_new(balde_sapi_fcgi_connection_t, 1);
-    conn->requests = requests;
-    conn->ostream = ostream;
-    g_mutex_init(&(conn->mutex));
-    g_mutex_init(&(conn->mutex_cond));
-    g_cond_init(&(conn->cond));
+    switch ((balde_sapi_fcgi_record_type_t) header->type) {
 
-    balde_sapi_fcgi_record_t *record = NULL;
-    balde_sapi_fcgi_request_t *request = NULL;
-    balde_sapi_fcgi_begin_request_body_t *brb = NULL;
+        case FCGI_BEGIN_REQUEST:
+            if (request != NULL) {
+                g_printerr("fcgi: error: unexpected FastCGI record type "
+                    "BEGIN_REQUEST during request %d, dropping connection.\n",
+                    request->id);
+                return FALSE;
+            }
 
-    while (TRUE) {
+            if (header->content_length != 8) {
+                g_printerr("fcgi: error: invalid data size for FastCGI "
+                    "record type BEGIN_REQUEST: %d, dropping connection.\n",
+                    header->content_length);
+                return FALSE;
+            }
 
-        record = g_new(balde_sapi_fcgi_record_t, 1);
+            brb = (balde_sapi_fcgi_begin_request_body_t*) content;
+            switch (g_ntohs(brb->role)) {
+
+                case FCGI_RESPONDER:
+                    request = g_new(balde_sapi_fcgi_request_t, 1);
+                    request->id = header->request_id;
+                    request->flags = brb->flags;
+                    request->params = g_byte_array_new();
+                    request->body = g_string_new(NULL);
+                    request->connection = NULL;
+                    request->cancellable = g_cancellable_new();
+                    request->deadline = 0;
+                    g_hash_table_insert(fconn->requests,
+                        GINT_TO_POINTER(header->request_id), request);
+                    break;
+
+                // the following roles are not supported.
+                default:
+                    balde_sapi_fcgi_send_end_request(conn, header->request_id,
+                        FCGI_UNKNOWN_ROLE);
+                    if (!(brb->flags & FCGI_KEEP_CONN))
+                        balde_server_connection_close(conn);
+            }
+            break;
 
-        record->header = balde_sapi_fcgi_read_header(istream);
-        if (record->header == NULL) {
-            goto cleanup;
-        }
+        case FCGI_PARAMS:
+            g_byte_array_append(request->params, content, header->content_length);
+            break;
 
-        gsize count = record->header->content_length + record->header->padding_length;
-        gsize read;
-        if (!g_input_stream_read_all(istream, record->buffer, count, &read, NULL, NULL)) {
-            g_printerr("fcgi: error: failed to read FastCGI data, dropping connection.\n");
-            goto cleanup;
-        }
+        case FCGI_STDIN:
+            if (header->content_length > 0) {
+                g_string_append_len(request->body, (gchar*) content,
+                    header->content_length);
+                break;
+            }
 
-        if (count != read) {
-            g_printerr("fcgi: error: failed to read FastCGI data. invalid data size, "
-                "dropping connection.\n");
-            goto cleanup;
-        }
+            // request is complete, hand it to the application threads, unless
+            // too many requests are waiting for them already.
+            g_hash_table_steal(fconn->requests, GINT_TO_POINTER(request->id));
+            if (!balde_app_admission_enter(ud->app, ud->max_queued)) {
+                balde_sapi_fcgi_send_end_request(conn, request->id,
+                    FCGI_OVERLOADED);
+                if (!(request->flags & FCGI_KEEP_CONN))
+                    balde_server_connection_close(conn);
+                balde_sapi_fcgi_request_free(request);
+                break;
+            }
+            request->deadline = balde_app_admission_deadline(ud->queue_timeout);
+            request->connection = balde_server_connection_ref(conn);
+            g_mutex_lock(&(fconn->mutex));
+            g_hash_table_insert(fconn->running,
+                GINT_TO_POINTER(request->id), request);
+            g_mutex_unlock(&(fconn->mutex));
+            g_thread_pool_push(ud->pool, request, NULL);
+            break;
+
+        case FCGI_ABORT_REQUEST:
+            if (request != NULL) {
+                // still being received, the application never saw it.
+                guint8 flags = request->flags;
+                g_hash_table_remove(fconn->requests,
+                    GINT_TO_POINTER(header->request_id));
+                balde_sapi_fcgi_send_end_request(conn, header->request_id,
+                    FCGI_REQUEST_COMPLETE);
+                if (!(flags & FCGI_KEEP_CONN))
+                    balde_server_connection_close(conn);
+                break;
+            }
+
+            // the application thread ends the request, dropping whatever
+            // response is left. aborts of finished requests are ignored.
+            GCancellable *cancellable = NULL;
+            g_mutex_lock(&(fconn->mutex));
+            request = g_hash_table_lookup(fconn->running,
+                GINT_TO_POINTER(header->request_id));
+            if (request != NULL)
+                cancellable = g_object_ref(request->cancellable);
+            g_mutex_unlock(&(fconn->mutex));
+            if (cancellable != NULL) {
+                g_cancellable_cancel(cancellable);
+                g_object_unref(cancellable);
+            }
+            break;
+
+        case FCGI_GET_VALUES:
+            if (!balde_sapi_fcgi_send_get_values_result(conn, content,
+                    header->content_length))
+            {
+                g_printerr("fcgi: error: invalid data for FastCGI record type "
+                    "GET_VALUES, dropping connection.\n");
+                return FALSE;
+            }
+            break;
 
-        g_mutex_lock(&(conn->mutex));
-        request = g_hash_table_lookup(requests,
-            GINT_TO_POINTER(record->header->request_id));
-        g_mutex_unlock(&(conn->mutex));
+        case FCGI_DATA:
+            return FALSE;
 
-        if ((request == NULL) &&
-            (record->header->type != FCGI_BEGIN_REQUEST) &&
-            (record->header->type != FCGI_GET_VALUES))
-        {
-            g_printerr("fcgi: error: unexpected FastCGI record type %d, dropping "
-                "connection.\n", record->header->type);
-            goto cleanup;
+        default:
+            balde_sapi_fcgi_send_unknown_type(conn, header->type);
+            balde_server_connection_close(conn);
+    }
+
+    return TRUE;
+}
+
+
+static gboolean
+balde_sapi_fcgi_read(balde_server_connection_t *conn)
+{
+    balde_server_buffer_t *input = &(conn->input);
+
+    // parse every complete record available, in place.
+    while (input->end - input->start >= FCGI_HEADER_LEN) {
+        guint8 *data = input->data + input->start;
+        balde_sapi_fcgi_header_t header = {
+            .version = data[0],
+            .type = data[1],
+            .request_id = (data[2] << 8) | data[3],
+            .content_length = (data[4] << 8) | data[5],
+            .padding_length = data[6],
+            .reserved = data[7],
+        };
+        if (header.version != FCGI_VERSION_1) {
+            g_printerr("fcgi: error: received invalid FastCGI header, dropping "
+                "connection.\n");
+            return FALSE;
         }
+        guint size = FCGI_HEADER_LEN + header.content_length +
+            header.padding_length;
+        if (input->end - input->start < size)
+            break;
+        if (!balde_sapi_fcgi_handle_record(conn, &header, data + FCGI_HEADER_LEN))
+            return FALSE;
+        input->start += size;
+    }
 
-        guint8 keep_conn = 1;
-
-        switch ((balde_sapi_fcgi_record_type_t) record->header->type) {
-
-            case FCGI_BEGIN_REQUEST:
-                if (request != NULL) {
-                    g_printerr("fcgi: error: unexpected FastCGI record type "
-                        "BEGIN_REQUEST during request %d, dropping connection.\n",
-                        request->id);
-                    goto cleanup;
-                }
-
-                if (record->header->content_length != 8) {
-                    g_printerr("fcgi: error: invalid data size for FastCGI "
-                        "record type BEGIN_REQUEST: %d, dropping connection.\n",
-                        record->header->content_length);
-                    goto cleanup;
-                }
-
-                brb = (balde_sapi_fcgi_begin_request_body_t*) record->buffer;
-                switch (g_ntohs(brb->role)) {
-
-                    case FCGI_RESPONDER:
-                        balde_sapi_fcgi_request_free(request);
-                        request = g_new(balde_sapi_fcgi_request_t, 1);
-                        request->id = record->header->request_id;
-                        request->flags = brb->flags;
-                        request->params = g_byte_array_new();
-                        request->body = g_byte_array_new();
-                        request->processed = FALSE;
-
-                        g_mutex_lock(&(conn->mutex));
-                        g_hash_table_insert(requests,
-                            GINT_TO_POINTER(record->header->request_id),
-                            request);
-                        g_mutex_unlock(&(conn->mutex));
-                        break;
-
-                    // the following roles are not supported.
-                    case FCGI_AUTHORIZER:
-                    case FCGI_FILTER:
-                        g_mutex_lock(&(conn->mutex));
-                        balde_sapi_fcgi_send_eof(ostream, NULL, request->id,
-                            FCGI_UNKNOWN_ROLE);
-                        g_mutex_unlock(&(conn->mutex));
-                        goto cleanup;
-
-                }
-                break;
+    return TRUE;
+}
 
-            case FCGI_PARAMS:
-                g_byte_array_append(request->params, record->buffer,
-                    record->header->content_length);
-                break;
 
-            case FCGI_STDIN:
-                if (record->header->content_length > 0) {
-                    g_byte_array_append(request->body, record->buffer,
-                        record->header->content_length);
-                }
-                else {
-                    balde_sapi_fcgi_thread_user_data_t *tud =
-                        g_new(balde_sapi_fcgi_thread_user_data_t, 1);
-                    tud->connection = conn;
-                    tud->request = request;
-                    keep_conn &= request->flags;
-                    g_thread_pool_push(ud->pool, tud, NULL);
-                    if (keep_conn == 0) {
-                        g_mutex_lock(&(conn->mutex_cond));
-                        while (!request->processed)
-                            g_cond_wait(&(conn->cond), &(conn->mutex_cond));
-                        g_mutex_unlock(&(conn->mutex_cond));
-                        request = NULL;
-                        goto cleanup;
-                    }
-                    request = NULL;
-                }
-                break;
+static gpointer
+balde_sapi_fcgi_connection_new(balde_server_connection_t *conn)
+{
+    balde_sapi_fcgi_connection_t *fconn = g_new(balde_sapi_fcgi_connection_t, 1);
+    fconn->requests = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+        NULL, (GDestroyNotify) balde_sapi_fcgi_request_free);
+    fconn->running = g_hash_table_new(g_direct_hash, g_direct_equal);
+    g_mutex_init(&(fconn->mutex));
+    return fconn;
+}
 
-            case FCGI_GET_VALUES:
-                g_mutex_lock(&(conn->mutex));
-                balde_sapi_fcgi_send_get_values_result(ostream);
-                g_mutex_unlock(&(conn->mutex));
-                goto cleanup;
 
-            case FCGI_DATA:
-                goto cleanup;
+static void
+balde_sapi_fcgi_connection_free(balde_sapi_fcgi_connection_t *fconn)
+{
+    g_hash_table_destroy(fconn->requests);
+    g_hash_table_destroy(fconn->running);
+    g_mutex_clear(&(fconn->mutex));
+    g_free(fconn);
+}
 
-            case FCGI_ABORT_REQUEST:
-                // we don't support aborting requests from the webserver
-                // because this can't be implemented for the other SAPIs.
 
-            default:
-                g_mutex_lock(&(conn->mutex));
-                balde_sapi_fcgi_send_unknown_type(ostream, record->header->type);
-                g_mutex_unlock(&(conn->mutex));
-                goto cleanup;
-        }
+static gboolean
+balde_sapi_fcgi_idle(balde_server_connection_t *conn)
+{
+    // requests still being received count as in progress too.
+    balde_sapi_fcgi_connection_t *fconn = conn->data;
+    g_mutex_lock(&(fconn->mutex));
+    gboolean rv = g_hash_table_size(fconn->requests) == 0 &&
+        g_hash_table_size(fconn->running) == 0;
+    g_mutex_unlock(&(fconn->mutex));
+    return rv;
+}
 
-        balde_sapi_fcgi_record_free(record);
-        record = NULL;
-    }
 
-cleanup:
+static const balde_server_protocol_t fcgi_protocol = {
+    .connection_new = balde_sapi_fcgi_connection_new,
+    .read = balde_sapi_fcgi_read,
+    .connection_free = (void (*) (gpointer)) balde_sapi_fcgi_connection_free,
+    .idle = balde_sapi_fcgi_idle,
+};
+
 
-    balde_sapi_fcgi_request_free(request);
-    balde_sapi_fcgi_record_free(record);
-
-    // this is a hack, to wait on the locks to be released before trying to
-    // release resources.
-    g_mutex_lock(&(conn->mutex_cond));
-    g_mutex_unlock(&(conn->mutex_cond));
-    g_mutex_clear(&(conn->mutex_cond));
-    g_mutex_lock(&(conn->mutex));
-    g_mutex_unlock(&(conn->mutex));
-    g_mutex_clear(&(conn->mutex));
-
-    g_cond_clear(&(conn->cond));
-    g_free(conn);
-
-    g_io_stream_close(G_IO_STREAM(connection), NULL, &error);
-    if (error != NULL) {
-        g_printerr("Failed to close connection: %s\n", error->message);
-        g_error_free(error);
+balde_server_t*
+balde_sapi_fcgi_server_new(balde_app_t *app, guint io_threads,
+    guint app_threads, guint max_queued, guint queue_timeout, GError **error)
+{
+    balde_sapi_fcgi_user_data_t *ud = g_new(balde_sapi_fcgi_user_data_t, 1);
+    ud->app = app;
+    ud->max_queued = max_queued;
+    ud->queue_timeout = (gint64) queue_timeout * 1000;
+    ud->pool = g_thread_pool_new((GFunc) balde_sapi_fcgi_handle_request, ud,
+        app_threads, FALSE, error);
+    if (ud->pool == NULL) {
+        g_free(ud);
+        return NULL;
     }
+    return balde_server_new(&fcgi_protocol, ud, io_threads);
+}
 
-    return TRUE;
+
+void
+balde_sapi_fcgi_server_free(balde_server_t *server)
+{
+    if (server == NULL)
+        return;
+    balde_sapi_fcgi_user_data_t *ud = balde_server_get_user_data(server);
+
+    // application threads hold connection references, stop them first.
+    balde_server_stop(server);
+    g_thread_pool_free(ud->pool, FALSE, TRUE);
+    balde_server_free(server);
+    g_free(ud);
 }
 
 
 static gboolean runfcgi = FALSE;
 static gchar *host = NULL;
 static gint port = 9000;
-static gint max_threads_server = 10;
+static gchar *socket_path = NULL;
+static gchar *socket_mode = NULL;
+static gchar *socket_owner = NULL;
+static gint max_threads_server = 2;
 static gint max_threads_app = 10;
+static gint max_queued = 1024;
+static gint queue_timeout = 0;
+static gint workers = 1;
+static gint drain_timeout = 30;
 
 static GOptionEntry entries_fcgi[] =
 {
@@ -603,10 +759,28 @@ static GOptionEntry entries_fcgi[] =
         "Embedded FastCGI server host. (default: 127.0.0.1)", "HOST"},
     {"fcgi-port", 0, 0, G_OPTION_ARG_INT, &port,
         "Embedded FastCGI server port. (default: 9000)", "PORT"},
+    {"fcgi-socket", 0, 0, G_OPTION_ARG_FILENAME, &socket_path,
+        "Embedded FastCGI server unix socket, instead of host and port.", "PATH"},
+    {"fcgi-socket-mode", 0, 0, G_OPTION_ARG_STRING, &socket_mode,
+        "Embedded FastCGI server unix socket permissions. (default: 0660)",
+        "MODE"},
+    {"fcgi-socket-owner", 0, 0, G_OPTION_ARG_STRING, &socket_owner,
+        "Embedded FastCGI server unix socket owner.", "USER[:GROUP]"},
     {"fcgi-max-threads-server", 0, 0, G_OPTION_ARG_INT, &max_threads_server,
-        "Embedded FastCGI max server threads. (default: 10)", "THREADS"},
+        "Embedded FastCGI server I/O threads. (default: 2)", "THREADS"},
     {"fcgi-max-threads-app", 0, 0, G_OPTION_ARG_INT, &max_threads_app,
         "Embedded FastCGI max application threads. (default: 10)", "THREADS"},
+    {"fcgi-max-queue", 0, 0, G_OPTION_ARG_INT, &max_queued,
+        "Embedded FastCGI max requests waiting for application threads, 0 for "
+        "unbounded. (default: 1024)", "REQUESTS"},
+    {"fcgi-queue-timeout", 0, 0, G_OPTION_ARG_INT, &queue_timeout,
+        "Embedded FastCGI max time a request waits for application threads, "
+        "0 for unbounded. (default: 0)", "MILLISECONDS"},
+    {"fcgi-workers", 0, 0, G_OPTION_ARG_INT, &workers,
+        "Embedded FastCGI server worker processes. (default: 1)", "WORKERS"},
+    {"fcgi-drain-timeout", 0, 0, G_OPTION_ARG_INT, &drain_timeout,
+        "Embedded FastCGI server time to finish requests when stopping "
+        "gracefully. (default: 30)", "SECONDS"},
     {NULL}
 };
 
@@ -628,57 +802,89 @@ balde_sapi_fcgi_supported(void)
 }
 
 
+typedef struct {
+    balde_app_t *app;
+    balde_server_endpoint_t *endpoint;
+} balde_sapi_fcgi_worker_t;
+
+
 static gint
-balde_sapi_fcgi_run(balde_app_t *app)
+balde_sapi_fcgi_worker(balde_sapi_fcgi_worker_t *worker)
 {
-    // TODO: add unix socket support
     GError *error = NULL;
-    const gchar *final_host = host != NULL ? host : "127.0.0.1";
-    g_printerr(" * Running FastCGI on %s:%d (server threads: %d, app threads: %d)\n",
-        final_host, port, max_threads_server, max_threads_app);
-
-    GSocketService *service = g_threaded_socket_service_new(max_threads_server);
-    GInetAddress* addr_host = g_inet_address_new_from_string(final_host);
-    GSocketAddress *address = g_inet_socket_address_new(addr_host, port);
+    gint rv = 0;
+    balde_server_t *server = balde_sapi_fcgi_server_new(worker->app,
+        max_threads_server, max_threads_app, max_queued, queue_timeout, &error);
+    if (server == NULL) {
+        g_printerr("Failed to create app thread pool: %s\n", error->message);
+        g_error_free(error);
+        return 3;
+    }
 
-    g_socket_listener_add_address(G_SOCKET_LISTENER(service), address,
-        G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_TCP, NULL, NULL, &error);
-    if (error != NULL) {
+    GSList *sockets = balde_server_endpoint_get_sockets(worker->endpoint,
+        &error);
+    if (sockets == NULL) {
         g_printerr("Failed to listen: %s\n", error->message);
         g_error_free(error);
-        g_object_unref(service);
-        g_object_unref(addr_host);
-        g_object_unref(address);
-        g_free(host);
-        return 3;
+        rv = 3;
+        goto point1;
     }
+    for (GSList *l = sockets; l != NULL; l = g_slist_next(l))
+        balde_server_listen_socket(server, l->data);
+    g_slist_free_full(sockets, g_object_unref);
 
-    balde_sapi_fcgi_user_data_t *ud = g_new(balde_sapi_fcgi_user_data_t, 1);
-    ud->app = app;
-    ud->pool = g_thread_pool_new((GFunc) balde_handle_request, app,
-        max_threads_app, FALSE, &error);
-    if (error != NULL) {
-        g_printerr("Failed to create app thread pool: %s\n", error->message);
+    if (!balde_server_start(server, &error)) {
+        g_printerr("Failed to start server: %s\n", error->message);
         g_error_free(error);
-        g_object_unref(service);
-        g_object_unref(addr_host);
-        g_object_unref(address);
-        g_free(host);
-        g_free(ud);
-        return 3;
+        rv = 3;
+        goto point1;
     }
 
-    g_signal_connect(service, "run", G_CALLBACK(balde_incoming_callback), ud);
-    g_socket_service_start(service);
-    g_object_unref(service);
-    g_object_unref(addr_host);
-    g_object_unref(address);
-    GMainLoop *loop = g_main_loop_new(NULL, FALSE);
-    g_main_loop_run(loop);
-    g_thread_pool_free(ud->pool, TRUE, TRUE);
-    g_free(ud);
+    if (balde_sapi_prefork_wait(worker->endpoint))
+        balde_server_drain(server, (gint64) drain_timeout * G_USEC_PER_SEC);
+
+point1:
+    balde_sapi_fcgi_server_free(server);
+    return rv;
+}
+
+
+static gint
+balde_sapi_fcgi_run(balde_app_t *app)
+{
+    GError *error = NULL;
+    gint rv = 0;
+    const gchar *final_host = host != NULL ? host : "127.0.0.1";
+    if (socket_path != NULL)
+        g_printerr(" * Running FastCGI on unix:%s (workers: %d, server threads: "
+            "%d, app threads: %d)\n", socket_path, workers, max_threads_server,
+            max_threads_app);
+    else
+        g_printerr(" * Running FastCGI on %s:%d (workers: %d, server threads: "
+            "%d, app threads: %d)\n", final_host, port, workers,
+            max_threads_server, max_threads_app);
+
+    // opened before forking, so a bad address fails right away.
+    balde_sapi_fcgi_worker_t worker = {.app = app};
+    worker.endpoint = balde_server_endpoint_new(final_host, port, socket_path,
+        socket_mode, socket_owner, workers > 1, &error);
+    if (worker.endpoint == NULL) {
+        g_printerr("Failed to listen: %s\n", error->message);
+        g_error_free(error);
+        rv = 3;
+        goto point1;
+    }
+
+    rv = balde_sapi_prefork_run(workers, worker.endpoint,
+        (balde_prefork_func_t) balde_sapi_fcgi_worker, &worker);
+
+    balde_server_endpoint_free(worker.endpoint);
+point1:
     g_free(host);
-    return 0;
+    g_free(socket_path);
+    g_free(socket_mode);
+    g_free(socket_owner);
+    return rv;
 }
 
 
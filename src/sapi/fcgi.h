@@ -11,10 +11,14 @@
 
 #include <glib.h>
 #include "../requests.h"
+#include "server.h"
 
 balde_request_env_t* balde_sapi_fcgi_parse_request(GByteArray *params,
-    GByteArray *body);
+    GString *body);
 void balde_sapi_fcgi_add_record(GByteArray *ba, guint16 request_id, guint8 type,
     guint8 *data, guint16 data_len);
+balde_server_t* balde_sapi_fcgi_server_new(balde_app_t *app, guint io_threads,
+    guint app_threads, guint max_queued, guint queue_timeout, GError **error);
+void balde_sapi_fcgi_server_free(balde_server_t *server);
 
 #endif /* _BALDE_SAPI_FCGI_PRIVATE_H */
@@ -12,6 +12,8 @@
 
 #include <glib.h>
 #include <gio/gio.h>
+#include <string.h>
+#include <sys/socket.h>
 
 #include "../balde.h"
 #include "../app.h"
@@ -21,77 +23,144 @@
 #include "../responses.h"
 #include "../sapi.h"
 #include "httpd.h"
+#include "prefork.h"
+#include "server.h"
 
 
-balde_sapi_httpd_parser_data_t*
-balde_sapi_httpd_parse_request(balde_app_t *app, GInputStream *istream)
+static gchar*
+balde_sapi_httpd_split_line(gchar *line)
 {
-    GDataInputStream *data = g_data_input_stream_new(istream);
-    g_data_input_stream_set_newline_type(data, G_DATA_STREAM_NEWLINE_TYPE_ANY);
-    gchar *line = g_data_input_stream_read_line(data, NULL, NULL, NULL);
+    // terminates the line in place, and returns the next one.
+    gchar *eol = strchr(line, '\n');
+    if (eol == NULL)
+        eol = line + strlen(line);
+    gchar *next = *eol == '\n' ? eol + 1 : eol;
+    if (eol > line && *(eol - 1) == '\r')
+        eol--;
+    *eol = '\0';
+    return next;
+}
 
-    if (line == NULL) {
-        g_object_unref(data);
-        return NULL;
+
+static gboolean
+balde_sapi_httpd_parse_content_length(const gchar *str, guint64 *rv)
+{
+    gsize len = strlen(str);
+    if (len == 0 || len > 18)
+        return FALSE;
+    *rv = 0;
+    for (gsize i = 0; i < len; i++) {
+        if (!g_ascii_isdigit(str[i]))
+            return FALSE;
+        *rv = *rv * 10 + (str[i] - '0');
+    }
+    return TRUE;
+}
+
+
+static gboolean
+balde_sapi_httpd_parse_chunk_size(const gchar *line, guint64 *rv)
+{
+    // chunk extensions are ignored.
+    gsize i;
+    *rv = 0;
+    for (i = 0; g_ascii_isxdigit(line[i]); i++) {
+        if (i >= 15)
+            return FALSE;
+        *rv = *rv * 16 + g_ascii_xdigit_value(line[i]);
     }
+    if (i == 0)
+        return FALSE;
+    while (line[i] == ' ' || line[i] == '\t')
+        i++;
+    return line[i] == '\0' || line[i] == ';';
+}
 
+
+balde_sapi_httpd_parser_data_t*
+balde_sapi_httpd_parse_headers(gchar *data, gsize len)
+{
+    // takes the buffer, with the request line and the header fields, up to
+    // the empty line, nul-terminated. they are split in place, and header
+    // names are lowercased over themselves.
+    GHashTable *headers = NULL;
+    gchar *line = data;
+    gchar *next = balde_sapi_httpd_split_line(line);
     gchar *request_line = g_strdup(line);
-    gchar *request_method = NULL;
-    gchar *path_info = NULL;
-    gchar *query_string = NULL;
-    gchar *key = NULL;
-    gchar *value = NULL;
-    GString *body = NULL;
-    GHashTable *headers = g_hash_table_new_full(g_str_hash, g_str_equal,
-        g_free, g_free);
-    gchar **pieces = g_strsplit(line, " ", 3);
-    g_free(line);
-
-    if (g_strv_length(pieces) == 3 && g_str_has_prefix(pieces[2], "HTTP/1.")) {
-        request_method = g_strdup(pieces[0]);
-        gchar **pieces2 = g_strsplit(pieces[1], "?", 2);
-        path_info = g_strdup(pieces2[0]);
-        query_string = g_strdup(pieces2[1] == NULL ? "" : pieces2[1]);
-        g_strfreev(pieces2);
-    }
-    g_strfreev(pieces);
-
-    line = g_data_input_stream_read_line(data, NULL, NULL, NULL);
-    while (line[0] != '\0') {
-        pieces = g_strsplit(line, ":", 2);
-        g_free(line);
-        if (g_strv_length(pieces) != 2)
-            continue;  // just ignore wrong headers :/
-        key = g_ascii_strdown(g_strstrip(pieces[0]), -1);
-        value = g_strdup(g_strstrip(pieces[1]));
-        g_hash_table_insert(headers, key, value);
-        g_strfreev(pieces);
-        line = g_data_input_stream_read_line(data, NULL, NULL, NULL);
-    }
-    g_free(line);
+
+    gchar *request_method = line;
+    gchar *path_info = strchr(request_method, ' ');
+    if (path_info == NULL)
+        goto point1;
+    *(path_info++) = '\0';
+    gchar *version = strchr(path_info, ' ');
+    if (version == NULL)
+        goto point1;
+    *(version++) = '\0';
+    if (request_method[0] == '\0' || path_info[0] == '\0' ||
+        !g_str_has_prefix(version, "HTTP/1.") || strlen(version) != 8)
+        goto point1;
+    gchar *query_string = strchr(path_info, '?');
+    if (query_string != NULL)
+        *(query_string++) = '\0';
+    else
+        query_string = path_info + strlen(path_info);
+
+    headers = g_hash_table_new(g_str_hash, g_str_equal);
+    for (line = next; ; line = next) {
+        next = balde_sapi_httpd_split_line(line);
+        if (line[0] == '\0')
+            break;
+
+        // obsolete line folding is a request smuggling vector.
+        if (line[0] == ' ' || line[0] == '\t')
+            goto point1;
+
+        // just ignore wrong headers :/
+        gchar *value = strchr(line, ':');
+        if (value == NULL)
+            continue;
+        *(value++) = '\0';
+        gchar *key = g_strstrip(line);
+        for (gchar *c = key; *c != '\0'; c++)
+            *c = g_ascii_tolower(*c);
+        g_hash_table_replace(headers, key, g_strstrip(value));
+    }
 
     guint64 content_length = 0;
-    const gchar* clen_str = g_hash_table_lookup(headers, "content-length");
-    if (clen_str != NULL)
-        content_length = g_ascii_strtoull(clen_str, NULL, 10);
-
-    if (content_length > 0) {
-        gchar body_[1024];
-        gssize real_content_length = 0;
-        gssize size;
-        gssize to_read = sizeof(body_);
-        body = g_string_new(NULL);
-        while (real_content_length < content_length) {
-            if (content_length - real_content_length < to_read)
-                to_read = content_length - real_content_length;
-            size = g_input_stream_read(G_INPUT_STREAM(data), body_, to_read,
-                NULL, NULL);
-            g_string_append_len(body, body_, size);
-            real_content_length += size;
-        }
+    const gchar *clen_str = g_hash_table_lookup(headers, "content-length");
+    if (clen_str != NULL &&
+        !balde_sapi_httpd_parse_content_length(clen_str, &content_length))
+        goto point1;
+
+    // a body delimited both ways is a request smuggling vector too, and
+    // HTTP/1.0 has no transfer codings at all. chunked is the only coding
+    // supported, other ones are refused later.
+    gboolean http_1_0 = g_strcmp0(version, "HTTP/1.0") == 0;
+    gboolean chunked = FALSE;
+    const gchar *te = g_hash_table_lookup(headers, "transfer-encoding");
+    if (te != NULL) {
+        if (clen_str != NULL || http_1_0)
+            goto point1;
+        chunked = g_ascii_strcasecmp(te, "chunked") == 0;
     }
 
-    g_object_unref(data);
+    // HTTP/1.1 connections are persistent unless told otherwise, HTTP/1.0
+    // ones are closed unless told otherwise.
+    gboolean closing = FALSE;
+    gboolean keep_alive = FALSE;
+    const gchar *connection = g_hash_table_lookup(headers, "connection");
+    if (connection != NULL) {
+        gchar **tokens = g_strsplit(connection, ",", 0);
+        for (guint i = 0; tokens[i] != NULL; i++) {
+            g_strstrip(tokens[i]);
+            if (g_ascii_strcasecmp(tokens[i], "close") == 0)
+                closing = TRUE;
+            else if (g_ascii_strcasecmp(tokens[i], "keep-alive") == 0)
+                keep_alive = TRUE;
+        }
+        g_strfreev(tokens);
+    }
 
     balde_request_env_t *env = g_new(balde_request_env_t, 1);
     env->server_name = NULL;
@@ -100,14 +169,37 @@ balde_sapi_httpd_parse_request(balde_app_t *app, GInputStream *istream)
     env->request_method = request_method;
     env->query_string = query_string;
     env->headers = headers;
-    env->body = body;
+    env->body = NULL;
     env->https = FALSE;
+    env->storage = g_bytes_new_take(data, len + 1);
+    env->cancellable = NULL;
 
-    balde_sapi_httpd_parser_data_t *parser_data = g_new(balde_sapi_httpd_parser_data_t, 1);
-    parser_data->env = env;
-    parser_data->request_line = request_line;
+    balde_sapi_httpd_parser_data_t *rv = g_new(balde_sapi_httpd_parser_data_t, 1);
+    rv->env = env;
+    rv->request_line = request_line;
+    rv->content_length = content_length;
+    rv->chunked = chunked;
+    rv->http_1_0 = http_1_0;
+    rv->keep_alive = !closing && (!http_1_0 || keep_alive);
+    return rv;
 
-    return parser_data;
+point1:
+    if (headers != NULL)
+        g_hash_table_destroy(headers);
+    g_free(request_line);
+    g_free(data);
+    return NULL;
+}
+
+
+void
+balde_sapi_httpd_parser_data_free(balde_sapi_httpd_parser_data_t *data)
+{
+    if (data == NULL)
+        return;
+    balde_request_env_free(data->env);
+    g_free(data->request_line);
+    g_free(data);
 }
 
 
@@ -119,17 +211,21 @@ balde_sapi_httpd_response_render(balde_response_t *response, const gboolean with
     GString *str = g_string_new("");
     gchar *n = g_ascii_strup(
         balde_exception_get_name_from_code(response->status_code), -1);
-    g_string_append_printf(str, "HTTP/1.0 %d %s\r\n", response->status_code, n);
+    g_string_append_printf(str, "HTTP/1.1 %d %s\r\n", response->status_code, n);
     g_free(n);
-    gchar *len = g_strdup_printf("%zu", response->priv->body->len);
     GDateTime *dt = g_date_time_new_now_utc();
     gchar *date = balde_datetime_rfc5322(dt);
     g_date_time_unref(dt);
     balde_response_set_header(response, "Date", date);
-    balde_response_set_header(response, "Connection", "close");
-    balde_response_set_header(response, "Content-Length", len);
     g_free(date);
-    g_free(len);
+
+    // the length of streamed responses is unknown. they are framed by the
+    // connection, that knows what the client understands.
+    if (response->priv->stream_func == NULL) {
+        gchar *len = g_strdup_printf("%zu", response->priv->body->len);
+        balde_response_set_header(response, "Content-Length", len);
+        g_free(len);
+    }
     if (g_hash_table_lookup(response->priv->headers, "content-type") == NULL)
         balde_response_set_header(response, "Content-Type", "text/html; charset=utf-8");
     g_hash_table_foreach(response->priv->headers, (GHFunc) balde_header_render, str);
@@ -141,79 +237,737 @@ balde_sapi_httpd_response_render(balde_response_t *response, const gboolean with
 }
 
 
-static gboolean
-balde_incoming_callback(GThreadedSocketService *service,
-    GSocketConnection *connection, GObject *source_object, gpointer user_data)
+typedef enum {
+    BALDE_SAPI_HTTPD_CHUNK_SIZE = 0,
+    BALDE_SAPI_HTTPD_CHUNK_DATA,
+    BALDE_SAPI_HTTPD_CHUNK_END,
+    BALDE_SAPI_HTTPD_CHUNK_TRAILER,
+} balde_sapi_httpd_chunk_state_t;
+
+typedef struct {
+    balde_sapi_httpd_parser_data_t *parser_data;  // NULL for bad requests
+    balde_http_exception_code_t error;  // answered instead of the request
+    balde_server_connection_t *connection;
+    gint64 deadline;
+
+    // chunked request body, I/O thread only.
+    balde_sapi_httpd_chunk_state_t chunk_state;
+    guint64 chunk_size;
+    gsize trailer_size;
+
+    // streamed response, application thread only.
+    gboolean head;
+    gboolean streaming;
+    gboolean chunked;
+    gboolean keep_alive;
+} balde_sapi_httpd_request_t;
+
+typedef struct {
+    balde_sapi_httpd_request_t *request;  // being received, I/O thread only
+    gsize scanned;                        // searched for the end of headers
+    gboolean done;                        // no more requests, I/O thread only
+    GQueue waiting;                       // received, waiting for their turn
+    gboolean running;
+    gboolean closing;                     // answered without keep-alive
+    GMutex mutex;                         // protects waiting, running, closing
+    gchar *remote_ip;
+} balde_sapi_httpd_connection_t;
+
+typedef struct {
+    balde_app_t *app;
+    GThreadPool *pool;
+    guint max_queued;
+    gint64 queue_timeout;
+    gsize max_header_size;
+    guint64 max_body_size;
+} balde_sapi_httpd_user_data_t;
+
+static const gchar continue_response[] = "HTTP/1.1 100 Continue\r\n\r\n";
+static const gchar last_chunk[] = "0\r\n\r\n";
+static const gchar crlf[] = "\r\n";
+
+
+static void
+balde_sapi_httpd_request_free(balde_sapi_httpd_request_t *r)
 {
-    GError *error = NULL;
-    gchar *remote_ip = NULL;
-    GSocketAddress *remote_socket = g_socket_connection_get_remote_address(
-        connection, NULL);
-    GInetAddress *remote_addr;
-    switch (g_socket_address_get_family(remote_socket)) {
-        case G_SOCKET_FAMILY_IPV4:
-        case G_SOCKET_FAMILY_IPV6:
-            remote_addr = g_inet_socket_address_get_address(
-                (GInetSocketAddress*) remote_socket);
-            remote_ip = g_inet_address_to_string(remote_addr);
-            break;
-        case G_SOCKET_FAMILY_UNIX:
-        case G_SOCKET_FAMILY_INVALID:
-            // -EDONTCARE
-            break;
-    }
-    g_object_unref(remote_socket);
-    balde_app_t *app = user_data;
-    GInputStream *istream = g_io_stream_get_input_stream(G_IO_STREAM(connection));
-    balde_sapi_httpd_parser_data_t *parser_data = balde_sapi_httpd_parse_request(app, istream);
-    if (parser_data == NULL)
-        goto point2;
-    balde_http_exception_code_t status_code = BALDE_HTTP_INTERNAL_SERVER_ERROR;
-    GString *response = balde_app_main_loop(app, parser_data->env,
-        balde_sapi_httpd_response_render, &status_code);
-    GOutputStream *ostream = g_io_stream_get_output_stream(G_IO_STREAM(connection));
-    g_output_stream_write_all(ostream, response->str, response->len, NULL, NULL, &error);
-    g_string_free(response, TRUE);
-    if (error != NULL) {
-        g_printerr("Failed to send: %s\n", error->message);
-        g_error_free(error);
-        goto point1;
+    if (r == NULL)
+        return;
+    balde_sapi_httpd_parser_data_free(r->parser_data);
+    balde_server_connection_unref(r->connection);
+    g_free(r);
+}
+
+
+static GString*
+balde_sapi_httpd_render_error(balde_app_t *app, balde_http_exception_code_t code)
+{
+    // errors are per-request, the shared application context can't be
+    // touched.
+    balde_app_t *app_copy = balde_app_copy(app);
+    balde_abort_set_error(app_copy, code);
+    GString *rv = balde_app_main_loop(app_copy, NULL,
+        balde_sapi_httpd_response_render, NULL);
+    balde_app_free(app_copy);
+    return rv;
+}
+
+
+static void
+balde_sapi_httpd_write_head(balde_sapi_httpd_request_t *request,
+    GString *response, gboolean keep_alive)
+{
+    // the connection header goes right after the status line. HTTP/1.1 is
+    // persistent by default, HTTP/1.0 is not.
+    const gchar *connection = NULL;
+    if (!keep_alive)
+        connection = "Connection: close\r\n";
+    else if (request->parser_data->http_1_0)
+        connection = "Connection: keep-alive\r\n";
+    if (connection != NULL) {
+        gchar *eol = strstr(response->str, "\r\n");
+        g_string_insert(response, eol - response->str + 2, connection);
     }
+    balde_server_connection_write(request->connection,
+        g_string_free_to_bytes(response));
+}
+
+
+static void
+balde_sapi_httpd_close(balde_server_connection_t *conn)
+{
+    // the requests pipelined after the one that closes the connection would
+    // run for nothing, their responses can't be sent anymore.
+    balde_sapi_httpd_connection_t *hconn = conn->data;
+    g_mutex_lock(&(hconn->mutex));
+    hconn->closing = TRUE;
+    GQueue waiting = hconn->waiting;
+    g_queue_init(&(hconn->waiting));
+    g_mutex_unlock(&(hconn->mutex));
+    g_queue_foreach(&waiting, (GFunc) balde_sapi_httpd_request_free, NULL);
+    g_queue_clear(&waiting);
+    balde_server_connection_close(conn);
+}
+
+
+static void
+balde_sapi_httpd_respond(balde_sapi_httpd_request_t *request,
+    GString *response, balde_http_exception_code_t status_code,
+    gboolean keep_alive)
+{
+    // streamed responses were written (or dropped) by the writer already,
+    // response is NULL.
+    balde_server_connection_t *conn = request->connection;
+    balde_sapi_httpd_connection_t *hconn = conn->data;
+    balde_sapi_httpd_parser_data_t *parser_data = request->parser_data;
+
+    if (response != NULL)
+        balde_sapi_httpd_write_head(request, response, keep_alive);
+    if (!keep_alive)
+        balde_sapi_httpd_close(conn);
+
     GDateTime *dt = g_date_time_new_now_local();
     gchar *dt_format = balde_datetime_logging(dt);
     g_date_time_unref(dt);
-    g_printerr("%s - - [%s] \"%s\" %d\n", remote_ip, dt_format,
-        parser_data->request_line, status_code);
+    g_printerr("%s - - [%s] \"%s\" %d\n",
+        hconn->remote_ip != NULL ? hconn->remote_ip : "-", dt_format,
+        parser_data != NULL ? parser_data->request_line : "-", status_code);
     g_free(dt_format);
-    g_io_stream_close(G_IO_STREAM(connection), NULL, &error);
-    if (error != NULL) {
-        g_printerr("Failed to close connection: %s\n", error->message);
-        g_error_free(error);
+}
+
+
+static void
+balde_sapi_httpd_dispatch(balde_server_connection_t *conn, gboolean finished)
+{
+    // hands the next request of the connection to the application threads,
+    // unless one is running already. pipelined requests are answered one at
+    // a time, in the order they were received.
+    balde_sapi_httpd_connection_t *hconn = conn->data;
+    balde_sapi_httpd_user_data_t *ud = balde_server_get_user_data(conn->server);
+
+    while (TRUE) {
+        balde_sapi_httpd_request_t *request = NULL;
+        g_mutex_lock(&(hconn->mutex));
+        if (finished)
+            hconn->running = FALSE;
+        if (!hconn->running && !hconn->closing) {
+            request = g_queue_pop_head(&(hconn->waiting));
+            hconn->running = request != NULL;
+        }
+        g_mutex_unlock(&(hconn->mutex));
+        if (request == NULL)
+            return;
+
+        request->connection = balde_server_connection_ref(conn);
+        if (balde_app_admission_enter(ud->app, ud->max_queued)) {
+            request->deadline = balde_app_admission_deadline(ud->queue_timeout);
+            g_thread_pool_push(ud->pool, request, NULL);
+            return;
+        }
+
+        // too many requests are waiting for the application threads already.
+        balde_sapi_httpd_respond(request,
+            balde_sapi_httpd_render_error(ud->app, 503), 503, FALSE);
+        balde_sapi_httpd_request_free(request);
+        finished = TRUE;
     }
-point1:
-    g_free(parser_data->request_line);
-    g_free(parser_data);
-    g_free(remote_ip);
-point2:
+}
+
+
+static gboolean
+balde_sapi_httpd_write_body(GBytes *data, balde_sapi_httpd_request_t *request)
+{
+    // the response belongs to the writer from its first piece on, even if
+    // the client is gone before the headers go out.
+    gboolean first = !request->streaming;
+    request->streaming = TRUE;
+
+    // blocks the application thread while the client is slower than the
+    // response being produced.
+    balde_server_connection_t *conn = request->connection;
+    if (!balde_server_connection_wait_writable(conn)) {
+        g_bytes_unref(data);
+        return FALSE;
+    }
+
+    gsize len;
+    const gchar *str = g_bytes_get_data(data, &len);
+    if (first) {
+        // the first piece is the header block, rendered without a length,
+        // and whatever body came with it. HTTP/1.0 clients know nothing
+        // about chunks, the body ends with the connection.
+        request->chunked = !request->parser_data->http_1_0;
+        request->keep_alive = request->parser_data->keep_alive &&
+            (request->chunked || request->head);
+        gsize head_len = g_strstr_len(str, len, "\r\n\r\n") - str + 4;
+        GString *head = g_string_new_len(str, head_len - 2);
+        if (request->chunked)
+            g_string_append(head, "Transfer-Encoding: chunked\r\n");
+        g_string_append(head, "\r\n");
+        balde_sapi_httpd_write_head(request, head, request->keep_alive);
+        GBytes *body = g_bytes_new_from_bytes(data, head_len, len - head_len);
+        g_bytes_unref(data);
+        data = body;
+        len -= head_len;
+    }
+
+    if (len == 0) {
+        g_bytes_unref(data);
+        return TRUE;
+    }
+    if (!request->chunked) {
+        balde_server_connection_write(conn, data);
+        return TRUE;
+    }
+
+    // the chunk is written around the data, without copying it.
+    gchar *size = g_strdup_printf("%zx\r\n", len);
+    GBytes *chunk[] = {
+        g_bytes_new_take(size, strlen(size)),
+        data,
+        g_bytes_new_static(crlf, sizeof(crlf) - 1),
+    };
+    balde_server_connection_writev_stream(conn, 0, chunk, G_N_ELEMENTS(chunk));
+    return TRUE;
+}
+
+
+static void
+balde_sapi_httpd_handle_request(balde_sapi_httpd_request_t *request,
+    balde_sapi_httpd_user_data_t *ud)
+{
+    balde_server_connection_t *conn = request->connection;
+    balde_http_exception_code_t status_code = BALDE_HTTP_INTERNAL_SERVER_ERROR;
+    gboolean keep_alive = FALSE;
+    GString *response;
+
+    if (!balde_app_admission_leave(ud->app, request->deadline)) {
+        status_code = BALDE_HTTP_SERVICE_UNAVAILABLE;
+        response = balde_sapi_httpd_render_error(ud->app, status_code);
+    }
+    else if (request->error != 0) {
+        status_code = request->error;
+        response = balde_sapi_httpd_render_error(ud->app, status_code);
+    }
+    else {
+        // the main loop takes the env. streamed responses are written as
+        // produced, and the main loop returns an empty string.
+        balde_sapi_httpd_parser_data_t *parser_data = request->parser_data;
+        keep_alive = parser_data->keep_alive;
+        request->head = g_strcmp0(parser_data->env->request_method, "HEAD") == 0;
+        response = balde_app_main_loop_stream(ud->app, parser_data->env,
+            balde_sapi_httpd_response_render,
+            (balde_response_writer_t) balde_sapi_httpd_write_body, request,
+            &status_code);
+        parser_data->env = NULL;
+        if (request->streaming) {
+            g_string_free(response, TRUE);
+            response = NULL;
+            keep_alive = request->keep_alive;
+            if (request->chunked && !request->head)
+                balde_server_connection_write(conn, g_bytes_new_static(
+                    last_chunk, sizeof(last_chunk) - 1));
+        }
+    }
+    balde_sapi_httpd_respond(request, response, status_code, keep_alive);
+    balde_sapi_httpd_dispatch(conn, TRUE);
+    balde_sapi_httpd_request_free(request);
+}
+
+
+static void
+balde_sapi_httpd_queue(balde_server_connection_t *conn,
+    balde_sapi_httpd_request_t *request)
+{
+    balde_sapi_httpd_connection_t *hconn = conn->data;
+
+    // the connection is closed after this one. after a bad request, the rest
+    // of the stream can't be trusted.
+    if (request->error != 0 || !request->parser_data->keep_alive)
+        hconn->done = TRUE;
+
+    g_mutex_lock(&(hconn->mutex));
+    gboolean closing = hconn->closing;
+    if (!closing)
+        g_queue_push_tail(&(hconn->waiting), request);
+    g_mutex_unlock(&(hconn->mutex));
+
+    // a response closed the connection already.
+    if (closing) {
+        hconn->done = TRUE;
+        balde_sapi_httpd_request_free(request);
+        return;
+    }
+    balde_sapi_httpd_dispatch(conn, FALSE);
+}
+
+
+static gsize
+balde_sapi_httpd_find_headers_end(const gchar *data, gsize len, gsize *scanned)
+{
+    // returns the size of the header block, including the empty line, or 0
+    // if it isn't complete yet. the search starts where the last one stopped.
+    const gchar *end = data + len;
+    const gchar *c = data + *scanned;
+    while ((c = memchr(c, '\n', end - c)) != NULL) {
+        c++;
+        if (c < end && *c == '\n')
+            return c - data + 1;
+        if (c + 1 < end && *c == '\r' && *(c + 1) == '\n')
+            return c - data + 2;
+    }
+    *scanned = len > 2 ? len - 2 : 0;
+    return 0;
+}
+
+
+static balde_sapi_httpd_request_t*
+balde_sapi_httpd_read_headers(balde_server_connection_t *conn)
+{
+    // returns the request, once the header block is complete.
+    balde_sapi_httpd_connection_t *hconn = conn->data;
+    balde_sapi_httpd_user_data_t *ud = balde_server_get_user_data(conn->server);
+    balde_server_buffer_t *input = &(conn->input);
+
+    // empty lines before a request are ignored.
+    while (input->start < input->end &&
+        (input->data[input->start] == '\r' || input->data[input->start] == '\n'))
+    {
+        input->start++;
+    }
+
+    gchar *data = (gchar*) input->data + input->start;
+    gsize available = input->end - input->start;
+    gsize len = balde_sapi_httpd_find_headers_end(data, available,
+        &(hconn->scanned));
+    if (len == 0 && available < ud->max_header_size)
+        return NULL;
+
+    balde_sapi_httpd_request_t *rv = g_new0(balde_sapi_httpd_request_t, 1);
+    if (len == 0 || len > ud->max_header_size) {
+        rv->error = memchr(data, '\n', MIN(available, ud->max_header_size)) == NULL ?
+            BALDE_HTTP_REQUEST_URI_TOO_LONG :
+            BALDE_HTTP_REQUEST_HEADER_FIELDS_TOO_LARGE;
+        return rv;
+    }
+
+    gchar *headers = g_malloc(len + 1);
+    memcpy(headers, data, len);
+    headers[len] = '\0';
+    input->start += len;
+    hconn->scanned = 0;
+    rv->parser_data = balde_sapi_httpd_parse_headers(headers, len);
+    if (rv->parser_data == NULL) {
+        rv->error = BALDE_HTTP_BAD_REQUEST;
+        return rv;
+    }
+
+    balde_sapi_httpd_parser_data_t *parser_data = rv->parser_data;
+    const gchar *expect = g_hash_table_lookup(parser_data->env->headers,
+        "expect");
+    if (!parser_data->chunked &&
+        g_hash_table_lookup(parser_data->env->headers, "transfer-encoding") != NULL)
+    {
+        rv->error = BALDE_HTTP_NOT_IMPLEMENTED;
+    }
+    else if (ud->max_body_size > 0 &&
+        parser_data->content_length > ud->max_body_size)
+    {
+        rv->error = BALDE_HTTP_REQUEST_ENTITY_TOO_LARGE;
+    }
+    else if (expect != NULL && g_ascii_strcasecmp(expect, "100-continue") != 0) {
+        rv->error = BALDE_HTTP_EXPECTATION_FAILED;
+    }
+    else if (parser_data->content_length > 0 || parser_data->chunked) {
+        // it only grows past the first chunk as the data arrives, so a bogus
+        // Content-Length can't allocate it all up front.
+        parser_data->env->body = g_string_sized_new(MIN(
+            parser_data->chunked ? 0 : parser_data->content_length,
+            BALDE_SAPI_HTTPD_BODY_CHUNK_SIZE));
+
+        // the interim response can't get in the way of the responses still
+        // being produced, so clients waiting for it behind pipelined
+        // requests just wait a bit longer.
+        g_mutex_lock(&(hconn->mutex));
+        gboolean busy = hconn->running || !g_queue_is_empty(&(hconn->waiting));
+        g_mutex_unlock(&(hconn->mutex));
+        if (expect != NULL && !parser_data->http_1_0 && !busy &&
+            input->start == input->end)
+        {
+            balde_server_connection_write(conn, g_bytes_new_static(
+                continue_response, sizeof(continue_response) - 1));
+        }
+    }
+    return rv;
+}
+
+
+static gchar*
+balde_sapi_httpd_take_line(balde_server_buffer_t *input)
+{
+    // terminates the next line in place, and consumes it. returns NULL if it
+    // isn't complete yet.
+    gchar *line = (gchar*) input->data + input->start;
+    gchar *eol = memchr(line, '\n', input->end - input->start);
+    if (eol == NULL)
+        return NULL;
+    input->start += eol - line + 1;
+    if (eol > line && *(eol - 1) == '\r')
+        eol--;
+    *eol = '\0';
+    return line;
+}
+
+
+static gboolean
+balde_sapi_httpd_read_chunked_body(balde_server_connection_t *conn,
+    balde_sapi_httpd_request_t *request)
+{
+    // decodes whatever is available of the body. returns TRUE once the
+    // request is complete, or failed.
+    balde_sapi_httpd_user_data_t *ud = balde_server_get_user_data(conn->server);
+    balde_server_buffer_t *input = &(conn->input);
+    GString *body = request->parser_data->env->body;
+
+    while (TRUE) {
+        if (request->chunk_state == BALDE_SAPI_HTTPD_CHUNK_DATA) {
+            gsize to_copy = MIN(input->end - input->start, request->chunk_size);
+            g_string_append_len(body, (gchar*) input->data + input->start,
+                to_copy);
+            input->start += to_copy;
+            request->chunk_size -= to_copy;
+            if (request->chunk_size > 0)
+                return FALSE;
+            request->chunk_state = BALDE_SAPI_HTTPD_CHUNK_END;
+        }
+
+        // chunk size lines and trailer fields are bounded like the header
+        // block.
+        gsize available = input->end - input->start;
+        gchar *line = balde_sapi_httpd_take_line(input);
+        if (line == NULL) {
+            if (available < ud->max_header_size)
+                return FALSE;
+            request->error = BALDE_HTTP_BAD_REQUEST;
+            return TRUE;
+        }
+
+        switch (request->chunk_state) {
+            case BALDE_SAPI_HTTPD_CHUNK_SIZE:
+                if (!balde_sapi_httpd_parse_chunk_size(line,
+                        &(request->chunk_size)))
+                {
+                    request->error = BALDE_HTTP_BAD_REQUEST;
+                    return TRUE;
+                }
+                if (ud->max_body_size > 0 &&
+                    request->chunk_size > ud->max_body_size - body->len)
+                {
+                    request->error = BALDE_HTTP_REQUEST_ENTITY_TOO_LARGE;
+                    return TRUE;
+                }
+                request->chunk_state = request->chunk_size > 0 ?
+                    BALDE_SAPI_HTTPD_CHUNK_DATA : BALDE_SAPI_HTTPD_CHUNK_TRAILER;
+                break;
+            case BALDE_SAPI_HTTPD_CHUNK_END:
+                if (line[0] != '\0') {
+                    request->error = BALDE_HTTP_BAD_REQUEST;
+                    return TRUE;
+                }
+                request->chunk_state = BALDE_SAPI_HTTPD_CHUNK_SIZE;
+                break;
+            case BALDE_SAPI_HTTPD_CHUNK_TRAILER:
+                // trailer fields are ignored.
+                if (line[0] == '\0')
+                    return TRUE;
+                request->trailer_size += strlen(line) + 2;
+                if (request->trailer_size > ud->max_header_size) {
+                    request->error = BALDE_HTTP_REQUEST_HEADER_FIELDS_TOO_LARGE;
+                    return TRUE;
+                }
+                break;
+            case BALDE_SAPI_HTTPD_CHUNK_DATA:
+                break;
+        }
+    }
+}
+
+
+static gboolean
+balde_sapi_httpd_read(balde_server_connection_t *conn)
+{
+    balde_sapi_httpd_connection_t *hconn = conn->data;
+    balde_server_buffer_t *input = &(conn->input);
+
+    while (!hconn->done) {
+        if (hconn->request == NULL) {
+            hconn->request = balde_sapi_httpd_read_headers(conn);
+            if (hconn->request == NULL)
+                break;
+        }
+
+        balde_sapi_httpd_request_t *request = hconn->request;
+        if (request->error == 0 && request->parser_data->chunked) {
+            if (!balde_sapi_httpd_read_chunked_body(conn, request))
+                break;
+        }
+        else if (request->error == 0 && request->parser_data->env->body != NULL) {
+            GString *body = request->parser_data->env->body;
+            gsize to_copy = MIN(input->end - input->start,
+                request->parser_data->content_length - body->len);
+            g_string_append_len(body, (gchar*) input->data + input->start,
+                to_copy);
+            input->start += to_copy;
+            if (body->len < request->parser_data->content_length)
+                break;
+        }
+
+        balde_sapi_httpd_queue(conn, request);
+        hconn->request = NULL;
+    }
+
+    // whatever comes after the last request is ignored.
+    if (hconn->done)
+        input->start = input->end;
+
     return TRUE;
 }
 
 
+static gpointer
+balde_sapi_httpd_connection_new(balde_server_connection_t *conn)
+{
+    balde_sapi_httpd_connection_t *hconn = g_new0(balde_sapi_httpd_connection_t, 1);
+    g_queue_init(&(hconn->waiting));
+    g_mutex_init(&(hconn->mutex));
+
+    // for logging.
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getpeername(conn->fd, (struct sockaddr*) &addr, &addr_len) == 0) {
+        GSocketAddress *remote_socket = g_socket_address_new_from_native(&addr,
+            addr_len);
+        if (remote_socket == NULL)
+            return hconn;
+        switch (g_socket_address_get_family(remote_socket)) {
+            case G_SOCKET_FAMILY_IPV4:
+            case G_SOCKET_FAMILY_IPV6:
+                hconn->remote_ip = g_inet_address_to_string(
+                    g_inet_socket_address_get_address(
+                        (GInetSocketAddress*) remote_socket));
+                break;
+            case G_SOCKET_FAMILY_UNIX:
+            case G_SOCKET_FAMILY_INVALID:
+                // -EDONTCARE
+                break;
+        }
+        g_object_unref(remote_socket);
+    }
+    return hconn;
+}
+
+
+static void
+balde_sapi_httpd_connection_free(balde_sapi_httpd_connection_t *hconn)
+{
+    balde_sapi_httpd_request_free(hconn->request);
+    g_queue_foreach(&(hconn->waiting), (GFunc) balde_sapi_httpd_request_free,
+        NULL);
+    g_queue_clear(&(hconn->waiting));
+    g_mutex_clear(&(hconn->mutex));
+    g_free(hconn->remote_ip);
+    g_free(hconn);
+}
+
+
+static void
+balde_sapi_httpd_eof(balde_server_connection_t *conn)
+{
+    // a request that isn't complete yet won't ever be. the ones received
+    // already are still answered.
+    balde_sapi_httpd_connection_t *hconn = conn->data;
+    balde_sapi_httpd_request_free(hconn->request);
+    hconn->request = NULL;
+    hconn->done = TRUE;
+}
+
+
+static gboolean
+balde_sapi_httpd_idle(balde_server_connection_t *conn)
+{
+    // requests still being received count as in progress too.
+    balde_sapi_httpd_connection_t *hconn = conn->data;
+    g_mutex_lock(&(hconn->mutex));
+    gboolean rv = hconn->request == NULL && conn->input.start == conn->input.end &&
+        !hconn->running && g_queue_is_empty(&(hconn->waiting));
+    g_mutex_unlock(&(hconn->mutex));
+    return rv;
+}
+
+
+static gboolean
+balde_sapi_httpd_waiting(balde_server_connection_t *conn)
+{
+    // idle keep-alive connections, and requests arriving too slowly. requests
+    // waiting for the application don't time out.
+    balde_sapi_httpd_connection_t *hconn = conn->data;
+    g_mutex_lock(&(hconn->mutex));
+    gboolean rv = !hconn->running && g_queue_is_empty(&(hconn->waiting));
+    g_mutex_unlock(&(hconn->mutex));
+    return rv;
+}
+
+
+static const balde_server_protocol_t httpd_protocol = {
+    .connection_new = balde_sapi_httpd_connection_new,
+    .read = balde_sapi_httpd_read,
+    .connection_free = (void (*) (gpointer)) balde_sapi_httpd_connection_free,
+    .idle = balde_sapi_httpd_idle,
+    .eof = balde_sapi_httpd_eof,
+    .waiting = balde_sapi_httpd_waiting,
+};
+
+
+balde_server_t*
+balde_sapi_httpd_server_new(balde_app_t *app, guint io_threads,
+    guint app_threads, guint max_queued, guint queue_timeout, GError **error)
+{
+    balde_sapi_httpd_user_data_t *ud = g_new(balde_sapi_httpd_user_data_t, 1);
+    ud->app = app;
+    ud->max_queued = max_queued;
+    ud->queue_timeout = (gint64) queue_timeout * 1000;
+    ud->max_header_size = BALDE_SAPI_HTTPD_MAX_HEADER_SIZE;
+    ud->max_body_size = BALDE_SAPI_HTTPD_MAX_BODY_SIZE;
+    ud->pool = g_thread_pool_new((GFunc) balde_sapi_httpd_handle_request, ud,
+        app_threads, FALSE, error);
+    if (ud->pool == NULL) {
+        g_free(ud);
+        return NULL;
+    }
+    return balde_server_new(&httpd_protocol, ud, io_threads);
+}
+
+
+void
+balde_sapi_httpd_server_set_limits(balde_server_t *server,
+    gsize max_header_size, guint64 max_body_size)
+{
+    // must be set before starting the server. 0 leaves the body unbounded.
+    balde_sapi_httpd_user_data_t *ud = balde_server_get_user_data(server);
+    ud->max_header_size = max_header_size;
+    ud->max_body_size = max_body_size;
+}
+
+
+void
+balde_sapi_httpd_server_free(balde_server_t *server)
+{
+    if (server == NULL)
+        return;
+    balde_sapi_httpd_user_data_t *ud = balde_server_get_user_data(server);
+
+    // application threads hold connection references, stop them first.
+    balde_server_stop(server);
+    g_thread_pool_free(ud->pool, FALSE, TRUE);
+    balde_server_free(server);
+    g_free(ud);
+}
+
+
 static gboolean runserver = FALSE;
 static gchar *host = NULL;
 static gint port = 8080;
+static gchar *socket_path = NULL;
+static gchar *socket_mode = NULL;
+static gchar *socket_owner = NULL;
+static gint max_threads_server = 2;
 static gint max_threads = 10;
+static gint max_queued = 1024;
+static gint queue_timeout = 0;
+static gint workers = 1;
+static gint drain_timeout = 30;
+static gint timeout = BALDE_SAPI_HTTPD_TIMEOUT;
+static gint max_header_size = BALDE_SAPI_HTTPD_MAX_HEADER_SIZE;
+static gint max_body_size = BALDE_SAPI_HTTPD_MAX_BODY_SIZE;
 
 static GOptionEntry entries_http[] =
 {
     {"runserver", 's', 0, G_OPTION_ARG_NONE, &runserver,
-        "Run embedded HTTP server. NOT production ready!", NULL},
+        "Run embedded HTTP server.", NULL},
     {"http-host", 0, 0, G_OPTION_ARG_STRING, &host,
         "Embedded HTTP server host. (default: 127.0.0.1)", "HOST"},
     {"http-port", 0, 0, G_OPTION_ARG_INT, &port,
         "Embedded HTTP server port. (default: 8080)", "PORT"},
+    {"http-socket", 0, 0, G_OPTION_ARG_FILENAME, &socket_path,
+        "Embedded HTTP server unix socket, instead of host and port.", "PATH"},
+    {"http-socket-mode", 0, 0, G_OPTION_ARG_STRING, &socket_mode,
+        "Embedded HTTP server unix socket permissions. (default: 0660)", "MODE"},
+    {"http-socket-owner", 0, 0, G_OPTION_ARG_STRING, &socket_owner,
+        "Embedded HTTP server unix socket owner.", "USER[:GROUP]"},
+    {"http-max-threads-server", 0, 0, G_OPTION_ARG_INT, &max_threads_server,
+        "Embedded HTTP server I/O threads. (default: 2)", "THREADS"},
     {"http-max-threads", 0, 0, G_OPTION_ARG_INT, &max_threads,
-        "Embedded HTTP server max threads. (default: 10)", "THREADS"},
+        "Embedded HTTP server max application threads. (default: 10)",
+        "THREADS"},
+    {"http-max-queue", 0, 0, G_OPTION_ARG_INT, &max_queued,
+        "Embedded HTTP server max requests waiting for application threads, "
+        "0 for unbounded. (default: 1024)", "REQUESTS"},
+    {"http-queue-timeout", 0, 0, G_OPTION_ARG_INT, &queue_timeout,
+        "Embedded HTTP server max time a request waits for application "
+        "threads, 0 for unbounded. (default: 0)", "MILLISECONDS"},
+    {"http-timeout", 0, 0, G_OPTION_ARG_INT, &timeout,
+        "Embedded HTTP server max time waiting for clients to send requests "
+        "or read responses, 0 for unbounded. (default: 30)", "SECONDS"},
+    {"http-max-header-size", 0, 0, G_OPTION_ARG_INT, &max_header_size,
+        "Embedded HTTP server max size of request line and headers. "
+        "(default: 32768)", "BYTES"},
+    {"http-max-body-size", 0, 0, G_OPTION_ARG_INT, &max_body_size,
+        "Embedded HTTP server max size of request bodies, 0 for unbounded. "
+        "(default: 10485760)", "BYTES"},
+    {"http-workers", 0, 0, G_OPTION_ARG_INT, &workers,
+        "Embedded HTTP server worker processes. (default: 1)", "WORKERS"},
+    {"http-drain-timeout", 0, 0, G_OPTION_ARG_INT, &drain_timeout,
+        "Embedded HTTP server time to finish requests when stopping "
+        "gracefully. (default: 30)", "SECONDS"},
     {NULL}
 };
 
@@ -235,38 +989,90 @@ balde_sapi_httpd_supported(void)
 }
 
 
+typedef struct {
+    balde_app_t *app;
+    balde_server_endpoint_t *endpoint;
+} balde_sapi_httpd_worker_t;
+
+
+static gint
+balde_sapi_httpd_worker(balde_sapi_httpd_worker_t *worker)
+{
+    GError *error = NULL;
+    gint rv = 0;
+    balde_server_t *server = balde_sapi_httpd_server_new(worker->app,
+        max_threads_server, max_threads, max_queued, queue_timeout, &error);
+    if (server == NULL) {
+        g_printerr("Failed to create app thread pool: %s\n", error->message);
+        g_error_free(error);
+        return 3;
+    }
+    balde_sapi_httpd_server_set_limits(server, max_header_size, max_body_size);
+    balde_server_set_timeout(server, (gint64) timeout * G_USEC_PER_SEC);
+
+    GSList *sockets = balde_server_endpoint_get_sockets(worker->endpoint,
+        &error);
+    if (sockets == NULL) {
+        g_printerr("Failed to listen: %s\n", error->message);
+        g_error_free(error);
+        rv = 3;
+        goto point1;
+    }
+    for (GSList *l = sockets; l != NULL; l = g_slist_next(l))
+        balde_server_listen_socket(server, l->data);
+    g_slist_free_full(sockets, g_object_unref);
+
+    if (!balde_server_start(server, &error)) {
+        g_printerr("Failed to start server: %s\n", error->message);
+        g_error_free(error);
+        rv = 3;
+        goto point1;
+    }
+
+    if (balde_sapi_prefork_wait(worker->endpoint))
+        balde_server_drain(server, (gint64) drain_timeout * G_USEC_PER_SEC);
+
+point1:
+    balde_sapi_httpd_server_free(server);
+    return rv;
+}
+
+
 static gint
 balde_sapi_httpd_run(balde_app_t *app)
 {
     GError *error = NULL;
+    gint rv = 0;
     const gchar *final_host = host != NULL ? host : "127.0.0.1";
-    g_printerr("!!! WARNING !!! - Use this HTTP server only for development, "
-        "it is NOT production-ready!\n\n");
-    g_printerr(" * Running on http://%s:%d/ (threads: %d)\n", final_host, port,
-        max_threads);
-    GSocketService *service = g_threaded_socket_service_new(max_threads);
-    GInetAddress* addr_host = g_inet_address_new_from_string(final_host);
-    GSocketAddress *address = g_inet_socket_address_new(addr_host, port);
-    g_socket_listener_add_address(G_SOCKET_LISTENER(service), address,
-        G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_TCP, NULL, NULL, &error);
-    if (error != NULL) {
+    if (socket_path != NULL)
+        g_printerr(" * Running on unix:%s (workers: %d, server threads: %d, "
+            "app threads: %d)\n", socket_path, workers, max_threads_server,
+            max_threads);
+    else
+        g_printerr(" * Running on http://%s:%d/ (workers: %d, server threads: "
+            "%d, app threads: %d)\n", final_host, port, workers,
+            max_threads_server, max_threads);
+
+    balde_sapi_httpd_worker_t worker = {.app = app};
+    worker.endpoint = balde_server_endpoint_new(final_host, port, socket_path,
+        socket_mode, socket_owner, workers > 1, &error);
+    if (worker.endpoint == NULL) {
         g_printerr("Failed to listen: %s\n", error->message);
         g_error_free(error);
-        g_object_unref(service);
-        g_object_unref(addr_host);
-        g_object_unref(address);
-        g_free(host);
-        return 3;
+        rv = 3;
+        goto point1;
     }
-    g_signal_connect(service, "run", G_CALLBACK(balde_incoming_callback), app);
-    g_socket_service_start(service);
-    g_object_unref(service);
-    g_object_unref(addr_host);
-    g_object_unref(address);
-    GMainLoop *loop = g_main_loop_new(NULL, FALSE);
-    g_main_loop_run(loop);
+
+    rv = balde_sapi_prefork_run(workers, worker.endpoint,
+        (balde_prefork_func_t) balde_sapi_httpd_worker, &worker);
+
+    balde_server_endpoint_free(worker.endpoint);
+point1:
     g_free(host);
-    return 0;
+    g_free(socket_path);
+    g_free(socket_mode);
+    g_free(socket_owner);
+    return rv;
 }
 
 
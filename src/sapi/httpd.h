@@ -14,15 +14,31 @@
 #include "../balde.h"
 #include "../requests.h"
 #include "../responses.h"
+#include "server.h"
+
+#define BALDE_SAPI_HTTPD_MAX_HEADER_SIZE (32 * 1024)
+#define BALDE_SAPI_HTTPD_MAX_BODY_SIZE (10 * 1024 * 1024)
+#define BALDE_SAPI_HTTPD_BODY_CHUNK_SIZE (1024 * 1024)
+#define BALDE_SAPI_HTTPD_TIMEOUT 30
 
 typedef struct {
     balde_request_env_t *env;
     gchar *request_line;
+    guint64 content_length;
+    gboolean chunked;
+    gboolean http_1_0;
+    gboolean keep_alive;
 } balde_sapi_httpd_parser_data_t;
 
-balde_sapi_httpd_parser_data_t* balde_sapi_httpd_parse_request(balde_app_t *app,
-    GInputStream *io_stream);
+balde_sapi_httpd_parser_data_t* balde_sapi_httpd_parse_headers(gchar *data,
+    gsize len);
+void balde_sapi_httpd_parser_data_free(balde_sapi_httpd_parser_data_t *data);
 GString* balde_sapi_httpd_response_render(balde_response_t *response,
     const gboolean with_body);
+balde_server_t* balde_sapi_httpd_server_new(balde_app_t *app, guint io_threads,
+    guint app_threads, guint max_queued, guint queue_timeout, GError **error);
+void balde_sapi_httpd_server_set_limits(balde_server_t *server,
+    gsize max_header_size, guint64 max_body_size);
+void balde_sapi_httpd_server_free(balde_server_t *server);
 
 #endif /* _BALDE_SAPI_HTTPD_PRIVATE_H */
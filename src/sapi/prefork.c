@@ -0,0 +1,376 @@
+/*
+ * balde: A microframework for C based on GLib and bad intentions.
+ * Copyright (C) 2013-2017 Rafael G. Martins <rafael@rafaelmartins.eng.br>
+ *
+ * This program can be distributed under the terms of the LGPL-2 License.
+ * See the file COPYING.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <glib.h>
+#include <glib-unix.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif /* __linux__ */
+
+#include "../sapi.h"
+#include "prefork.h"
+#include "server.h"
+
+/*
+ * Process management for the socket SAPIs.
+ *
+ * The master process is the one that initialized the app and opened the
+ * listening endpoint. It forks the workers, that inherit both copy-on-write,
+ * and then just waits for signals:
+ *
+ * - SIGINT and SIGTERM stop the workers right away.
+ * - SIGQUIT stops them gracefully: they stop accepting connections and
+ *   finish the requests in progress.
+ * - SIGHUP and SIGUSR2 reload: the binary is started again, taking over the
+ *   listening socket, and this process stops gracefully once it is ready.
+ *
+ * Dead workers are respawned. With a single worker, there's no master, and
+ * the process handles the signals itself.
+ *
+ * Signals are blocked before any thread is started, and waited for
+ * synchronously, so each worker starts its own thread pools from scratch.
+ */
+
+typedef struct {
+    pid_t pid;
+    gint64 started;
+    gint64 respawn_at;
+} balde_prefork_worker_t;
+
+static gboolean is_worker = FALSE;
+
+
+static void
+balde_prefork_get_signals(sigset_t *set)
+{
+    sigemptyset(set);
+    sigaddset(set, SIGCHLD);
+    sigaddset(set, SIGINT);
+    sigaddset(set, SIGTERM);
+    sigaddset(set, SIGQUIT);
+    sigaddset(set, SIGHUP);
+    sigaddset(set, SIGUSR2);
+}
+
+
+static void
+balde_prefork_notify_ready(void)
+{
+    // tells the process that started us on reload that it can go away.
+    const gchar *fd_str = g_getenv(BALDE_PREFORK_READY_FD_ENV);
+    if (fd_str == NULL)
+        return;
+    gint fd = g_ascii_strtoll(fd_str, NULL, 10);
+    g_unsetenv(BALDE_PREFORK_READY_FD_ENV);
+    if (fd <= 2)
+        return;
+    while (write(fd, "", 1) < 0 && errno == EINTR);
+    close(fd);
+}
+
+
+static gboolean
+balde_prefork_reload(balde_server_endpoint_t *endpoint)
+{
+    gchar **argv = balde_sapi_get_argv();
+    if (endpoint == NULL || argv == NULL || argv[0] == NULL) {
+        g_printerr("prefork: error: can't reload, command line unknown\n");
+        return FALSE;
+    }
+    gchar *path = g_find_program_in_path(argv[0]);
+    if (path == NULL) {
+        g_printerr("prefork: error: can't reload, executable not found: %s\n",
+            argv[0]);
+        return FALSE;
+    }
+    gint ready[2];
+    if (!g_unix_open_pipe(ready, FD_CLOEXEC, NULL)) {
+        g_printerr("prefork: error: can't reload, failed to create pipe: %s\n",
+            g_strerror(errno));
+        g_free(path);
+        return FALSE;
+    }
+
+    // everything the new process needs is prepared before forking, because
+    // we may have threads running.
+    gint fd = balde_server_endpoint_get_fd(endpoint);
+    gchar **envp = g_get_environ();
+    gchar *tmp = g_strdup_printf("%d", fd);
+    envp = g_environ_setenv(envp, BALDE_SERVER_LISTEN_FD_ENV, tmp, TRUE);
+    g_free(tmp);
+    tmp = g_strdup_printf("%d", ready[1]);
+    envp = g_environ_setenv(envp, BALDE_PREFORK_READY_FD_ENV, tmp, TRUE);
+    g_free(tmp);
+    sigset_t empty;
+    sigemptyset(&empty);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        sigprocmask(SIG_SETMASK, &empty, NULL);
+        fcntl(fd, F_SETFD, 0);
+        fcntl(ready[1], F_SETFD, 0);
+        execve(path, argv, envp);
+        _exit(127);
+    }
+    close(ready[1]);
+    g_free(path);
+    g_strfreev(envp);
+
+    gboolean rv = FALSE;
+    if (pid < 0) {
+        g_printerr("prefork: error: can't reload, failed to fork: %s\n",
+            g_strerror(errno));
+        goto point1;
+    }
+
+    struct pollfd pfd = {.fd = ready[0], .events = POLLIN};
+    gchar c;
+    gint n;
+    while ((n = poll(&pfd, 1, BALDE_PREFORK_READY_TIMEOUT)) < 0 && errno == EINTR);
+    if (n > 0 && read(ready[0], &c, 1) == 1) {
+        g_printerr(" * Reloaded, new process: %d\n", pid);
+        rv = TRUE;
+        goto point1;
+    }
+
+    // keep serving, a broken build must not take the site down.
+    g_printerr("prefork: error: new process %d failed to start, not "
+        "reloading\n", pid);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+
+point1:
+    close(ready[0]);
+    return rv;
+}
+
+
+gboolean
+balde_sapi_prefork_wait(balde_server_endpoint_t *endpoint)
+{
+    // waits for a signal to stop. returns TRUE if the requests in progress
+    // should be finished first.
+    sigset_t set;
+    balde_prefork_get_signals(&set);
+    while (TRUE) {
+        switch (sigwaitinfo(&set, NULL)) {
+            case SIGINT:
+            case SIGTERM:
+                return FALSE;
+            case SIGQUIT:
+                return TRUE;
+            case SIGHUP:
+            case SIGUSR2:
+                // reloading is up to the master, if any.
+                if (is_worker || !balde_prefork_reload(endpoint))
+                    break;
+                balde_server_endpoint_release(endpoint);
+                return TRUE;
+        }
+    }
+}
+
+
+static pid_t
+balde_prefork_spawn(balde_prefork_worker_t *worker, balde_prefork_func_t func,
+    gpointer user_data)
+{
+    pid_t parent = getpid();
+    pid_t pid = fork();
+    if (pid < 0) {
+        g_printerr("prefork: error: failed to fork worker: %s\n",
+            g_strerror(errno));
+        return pid;
+    }
+    if (pid == 0) {
+#ifdef PR_SET_PDEATHSIG
+        // don't outlive a master killed with SIGKILL.
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif /* PR_SET_PDEATHSIG */
+        if (getppid() != parent)
+            _exit(0);
+        is_worker = TRUE;
+        _exit(func(user_data));
+    }
+    worker->pid = pid;
+    worker->started = g_get_monotonic_time();
+    worker->respawn_at = 0;
+    return pid;
+}
+
+
+static void
+balde_prefork_reap(balde_prefork_worker_t *workers, guint n_workers,
+    gboolean stopping, gint *rv)
+{
+    gint status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        balde_prefork_worker_t *worker = NULL;
+        for (guint i = 0; i < n_workers; i++) {
+            if (workers[i].pid == pid) {
+                worker = &(workers[i]);
+                break;
+            }
+        }
+        if (worker == NULL)
+            continue;
+        worker->pid = 0;
+        if (stopping)
+            continue;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == BALDE_PREFORK_FATAL) {
+            *rv = BALDE_PREFORK_FATAL;
+            continue;
+        }
+        if (WIFSIGNALED(status))
+            g_printerr("prefork: error: worker %d killed by signal %d\n", pid,
+                WTERMSIG(status));
+        else
+            g_printerr("prefork: error: worker %d exited with status %d\n", pid,
+                WEXITSTATUS(status));
+
+        // a worker that dies right away will probably do it again, so give it
+        // some time, instead of forking in a loop.
+        gint64 now = g_get_monotonic_time();
+        worker->respawn_at = now;
+        if (now - worker->started < BALDE_PREFORK_MIN_UPTIME)
+            worker->respawn_at += BALDE_PREFORK_RESPAWN_DELAY;
+    }
+}
+
+
+static void
+balde_prefork_stop(balde_prefork_worker_t *workers, guint n_workers, gint sig)
+{
+    for (guint i = 0; i < n_workers; i++)
+        if (workers[i].pid > 0)
+            kill(workers[i].pid, sig);
+}
+
+
+static gint
+balde_prefork_master(guint workers, balde_server_endpoint_t *endpoint,
+    balde_prefork_func_t func, gpointer user_data)
+{
+    gint rv = 0;
+    sigset_t set;
+    balde_prefork_get_signals(&set);
+
+    balde_prefork_worker_t *w = g_new0(balde_prefork_worker_t, workers);
+    for (guint i = 0; i < workers; i++) {
+        if (balde_prefork_spawn(&(w[i]), func, user_data) < 0) {
+            rv = BALDE_PREFORK_FATAL;
+            break;
+        }
+    }
+
+    gboolean stopping = FALSE;
+    while (TRUE) {
+        if (rv != 0 && !stopping) {
+            stopping = TRUE;
+            balde_prefork_stop(w, workers, SIGTERM);
+        }
+
+        gint64 now = g_get_monotonic_time();
+        gint64 timeout = -1;
+        guint alive = 0;
+        for (guint i = 0; i < workers; i++) {
+            if (w[i].pid > 0) {
+                alive++;
+                continue;
+            }
+            if (stopping || w[i].respawn_at == 0)
+                continue;
+            if (w[i].respawn_at <= now) {
+                if (balde_prefork_spawn(&(w[i]), func, user_data) > 0) {
+                    alive++;
+                    continue;
+                }
+                w[i].respawn_at = now + BALDE_PREFORK_RESPAWN_DELAY;
+            }
+            if (timeout < 0 || w[i].respawn_at - now < timeout)
+                timeout = w[i].respawn_at - now;
+        }
+        if (stopping && alive == 0)
+            break;
+
+        gint sig;
+        if (timeout >= 0) {
+            struct timespec ts = {
+                .tv_sec = timeout / G_USEC_PER_SEC,
+                .tv_nsec = (timeout % G_USEC_PER_SEC) * 1000,
+            };
+            sig = sigtimedwait(&set, NULL, &ts);
+        }
+        else {
+            sig = sigwaitinfo(&set, NULL);
+        }
+
+        switch (sig) {
+            case SIGCHLD:
+                balde_prefork_reap(w, workers, stopping, &rv);
+                break;
+            case SIGINT:
+            case SIGTERM:
+                // also hurries up a graceful stop.
+                stopping = TRUE;
+                balde_prefork_stop(w, workers, SIGTERM);
+                break;
+            case SIGHUP:
+            case SIGUSR2:
+                if (stopping || !balde_prefork_reload(endpoint))
+                    break;
+                balde_server_endpoint_release(endpoint);
+                // fall through
+            case SIGQUIT:
+                if (!stopping) {
+                    stopping = TRUE;
+                    balde_prefork_stop(w, workers, SIGQUIT);
+                }
+                break;
+        }
+    }
+
+    g_free(w);
+    return rv;
+}
+
+
+gint
+balde_sapi_prefork_run(guint workers, balde_server_endpoint_t *endpoint,
+    balde_prefork_func_t func, gpointer user_data)
+{
+    sigset_t set, old_set;
+    balde_prefork_get_signals(&set);
+    sigprocmask(SIG_BLOCK, &set, &old_set);
+
+    // the endpoint is listening already, connections wait for the workers.
+    balde_prefork_notify_ready();
+
+    gint rv;
+    if (workers <= 1)
+        rv = func(user_data);
+    else
+        rv = balde_prefork_master(workers, endpoint, func, user_data);
+
+    sigprocmask(SIG_SETMASK, &old_set, NULL);
+    return rv;
+}
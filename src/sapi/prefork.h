@@ -0,0 +1,30 @@
+/*
+ * balde: A microframework for C based on GLib and bad intentions.
+ * Copyright (C) 2013-2017 Rafael G. Martins <rafael@rafaelmartins.eng.br>
+ *
+ * This program can be distributed under the terms of the LGPL-2 License.
+ * See the file COPYING.
+ */
+
+#ifndef _BALDE_SAPI_PREFORK_PRIVATE_H
+#define _BALDE_SAPI_PREFORK_PRIVATE_H
+
+#include <glib.h>
+#include "server.h"
+
+// exit status of a worker that can't serve at all. the master gives up
+// instead of respawning it.
+#define BALDE_PREFORK_FATAL 3
+
+#define BALDE_PREFORK_MIN_UPTIME G_USEC_PER_SEC
+#define BALDE_PREFORK_RESPAWN_DELAY G_USEC_PER_SEC
+#define BALDE_PREFORK_READY_TIMEOUT 30000
+#define BALDE_PREFORK_READY_FD_ENV "BALDE_READY_FD"
+
+typedef gint (*balde_prefork_func_t) (gpointer user_data);
+
+gint balde_sapi_prefork_run(guint workers, balde_server_endpoint_t *endpoint,
+    balde_prefork_func_t func, gpointer user_data);
+gboolean balde_sapi_prefork_wait(balde_server_endpoint_t *endpoint);
+
+#endif /* _BALDE_SAPI_PREFORK_PRIVATE_H */
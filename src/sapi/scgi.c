@@ -12,6 +12,7 @@
 
 #include <glib.h>
 #include <gio/gio.h>
+#include <string.h>
 
 #include "../balde.h"
 #include "../app.h"
@@ -21,214 +22,455 @@
 #include "../sapi.h"
 #include "cgi.h"
 #include "scgi.h"
+#include "prefork.h"
+#include "server.h"
+
+
+typedef struct {
+    balde_request_env_t *env;  // NULL for requests that can't be parsed
+    guint64 content_length;
+    balde_server_connection_t *connection;
+    gint64 deadline;
+} balde_sapi_scgi_request_t;
+
+typedef struct {
+    balde_sapi_scgi_request_t *request;  // being received, I/O thread only
+    gboolean done;                       // no more requests, I/O thread only
+    GQueue waiting;                      // received, waiting for their turn
+    gboolean running;
+    GMutex mutex;                        // protects waiting and running
+} balde_sapi_scgi_connection_t;
+
+typedef struct {
+    balde_app_t *app;
+    GThreadPool *pool;
+    guint max_queued;
+    gint64 queue_timeout;
+    gboolean persistent;
+} balde_sapi_scgi_user_data_t;
 
 
-static gboolean
-balde_incoming_callback(GThreadedSocketService *service,
-    GSocketConnection *connection, GObject *source_object, gpointer user_data)
+balde_request_env_t*
+balde_sapi_scgi_parse_headers(gchar *data, gsize len)
 {
-    GError *error = NULL;
+    // takes the buffer. keys and values are nul-terminated already, so they
+    // are used in place, and header names are normalized over their keys, as
+    // they only get shorter.
+    balde_request_env_t *rv = g_new(balde_request_env_t, 1);
+    rv->server_name = NULL;
+    rv->script_name = NULL;
+    rv->path_info = NULL;
+    rv->request_method = NULL;
+    rv->query_string = NULL;
+    rv->https = FALSE;
+    rv->headers = g_hash_table_new(g_str_hash, g_str_equal);
+    rv->body = NULL;
+    rv->storage = NULL;
+    rv->cancellable = NULL;
+
+    if (len == 0 || data[len - 1] != '\0')
+        goto point1;
+
+    gchar *request_uri = NULL;
+    gsize pos = 0;
+    while (pos < len) {
+        gchar *key = data + pos;
+        gsize key_len = strlen(key);
+        pos += key_len + 1;
+        if (pos >= len)  // key without value
+            goto point1;
+        gchar *value = data + pos;
+        pos += strlen(value) + 1;
+
+        switch (balde_sapi_cgi_param_lookup(key, key_len)) {
+            case CGI_PARAM_SERVER_NAME:
+                rv->server_name = value;
+                break;
+            case CGI_PARAM_SCRIPT_NAME:
+                rv->script_name = value;
+                break;
+            case CGI_PARAM_PATH_INFO:
+                rv->path_info = value;
+                break;
+            case CGI_PARAM_REQUEST_METHOD:
+                rv->request_method = value;
+                break;
+            case CGI_PARAM_REQUEST_URI:
+                request_uri = value;
+                break;
+            case CGI_PARAM_QUERY_STRING:
+                rv->query_string = value;
+                break;
+            case CGI_PARAM_CONTENT_LENGTH:
+                g_hash_table_replace(rv->headers, "content-length", value);
+                break;
+            case CGI_PARAM_CONTENT_TYPE:
+                g_hash_table_replace(rv->headers, "content-type", value);
+                break;
+            case CGI_PARAM_HTTPS:
+                rv->https = TRUE;
+                break;
+            case CGI_PARAM_HEADER:
+                for (gsize i = 5; i <= key_len; i++)
+                    key[i - 5] = key[i] == '_' ? '-' : g_ascii_tolower(key[i]);
+                g_hash_table_replace(rv->headers, key, value);
+                break;
+            default:
+                break;
+        }
+    }
 
-    GInputStream *istream = g_io_stream_get_input_stream(G_IO_STREAM(connection));
-    balde_app_t *app = user_data;
+    if (rv->path_info == NULL && request_uri != NULL) {
+        // this is dumb, but its how nginx works
+        rv->path_info = request_uri;
+        rv->query_string = strchr(request_uri, '?');
+        if (rv->query_string != NULL)
+            *(rv->query_string++) = '\0';
+    }
 
-    balde_request_env_t *env = balde_sapi_scgi_parse_request(app, istream);
-    if (env == NULL)
-        balde_abort_set_error(app, 400);
+    rv->storage = g_bytes_new_take(data, len);
+    return rv;
 
-    GString *response = balde_app_main_loop(app, env, balde_response_render,
-        NULL);
+point1:
+    g_hash_table_destroy(rv->headers);
+    g_free(rv);
+    g_free(data);
+    return NULL;
+}
 
-    GOutputStream *ostream = g_io_stream_get_output_stream(G_IO_STREAM(connection));
 
-    g_output_stream_write_all(ostream, response->str, response->len, NULL, NULL, &error);
-    g_string_free(response, TRUE);
-    if (error != NULL) {
-        g_printerr("Failed to send: %s\n", error->message);
-        g_error_free(error);
-        error = NULL;
+static gboolean
+balde_sapi_scgi_parse_length(const gchar *str, gsize len, gsize *rv)
+{
+    // the netstring length, up to 7 digits.
+    if (len == 0 || len > 7)
+        return FALSE;
+    *rv = 0;
+    for (gsize i = 0; i < len; i++) {
+        if (!g_ascii_isdigit(str[i]))
+            return FALSE;
+        *rv = *rv * 10 + (str[i] - '0');
     }
+    return *rv <= BALDE_SAPI_SCGI_MAX_HEADERS_SIZE;
+}
 
-    g_io_stream_close(G_IO_STREAM(connection), NULL, &error);
-    if (error != NULL) {
-        g_printerr("Failed to close connection: %s\n", error->message);
-        g_error_free(error);
+
+balde_request_env_t*
+balde_sapi_scgi_parse_netstring(gchar *data, gsize len)
+{
+    // takes the buffer, with the netstring contents followed by its comma.
+    if (data[len] != ',') {
+        g_free(data);
+        return NULL;
     }
 
-    return TRUE;
+    // the last value should be nul-terminated, but the old parser didn't mind
+    // if it wasn't. the comma makes room for the terminator.
+    data[len] = '\0';
+    if (len > 0 && data[len - 1] != '\0')
+        len++;
+    return balde_sapi_scgi_parse_headers(data, len);
 }
 
 
 static void
-balde_filter_headers(gchar* key, gchar* value, GHashTable *headers)
+balde_sapi_scgi_request_free(balde_sapi_scgi_request_t *r)
+{
+    if (r == NULL)
+        return;
+    balde_request_env_free(r->env);
+    balde_server_connection_unref(r->connection);
+    g_free(r);
+}
+
+
+static GString*
+balde_sapi_scgi_render_error(balde_app_t *app, guint code)
 {
-    gchar *key2 = balde_parse_header_name_from_envvar(key);
-    if (key2 != NULL)
-        g_hash_table_insert(headers, key2, g_strdup(value));
+    // errors are per-request, the shared application context can't be
+    // touched.
+    balde_app_t *app_copy = balde_app_copy(app);
+    balde_abort_set_error(app_copy, code);
+    GString *rv = balde_app_main_loop(app_copy, NULL, balde_response_render,
+        NULL);
+    balde_app_free(app_copy);
+    return rv;
 }
 
 
-typedef enum {
-    NETSTRING_LEN = 1,
-    NETSTRING_HEADER_KEY,
-    NETSTRING_HEADER_VALUE,
-} balde_scgi_netstring_state_t;
+static void
+balde_sapi_scgi_respond(balde_sapi_scgi_request_t *request, GString *response,
+    gboolean bad_request)
+{
+    balde_sapi_scgi_user_data_t *ud = balde_server_get_user_data(
+        request->connection->server);
+    balde_server_connection_write(request->connection,
+        g_string_free_to_bytes(response));
+
+    // plain SCGI responses end when the connection is closed. persistent
+    // connections rely on the Content-Length header instead, that is always
+    // there, as responses aren't streamed. after a bad request, there's no
+    // way to tell where the next one starts.
+    if (!ud->persistent || bad_request)
+        balde_server_connection_close(request->connection);
+}
 
 
-balde_request_env_t*
-balde_sapi_scgi_parse_request(balde_app_t *app, GInputStream *istream)
+static void
+balde_sapi_scgi_dispatch(balde_server_connection_t *conn, gboolean finished)
 {
-    GDataInputStream *data = g_data_input_stream_new(istream);
+    // hands the next request of the connection to the application threads,
+    // unless one is running already. requests are answered one at a time, in
+    // the order they were received.
+    balde_sapi_scgi_connection_t *sconn = conn->data;
+    balde_sapi_scgi_user_data_t *ud = balde_server_get_user_data(conn->server);
 
-    gchar *key = NULL;
-    gchar *value = NULL;
-    GString *buf = g_string_new("");
-    GHashTable *env = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
-        g_free);
+    while (TRUE) {
+        balde_sapi_scgi_request_t *request = NULL;
+        g_mutex_lock(&(sconn->mutex));
+        if (finished)
+            sconn->running = FALSE;
+        if (!sconn->running) {
+            request = g_queue_pop_head(&(sconn->waiting));
+            sconn->running = request != NULL;
+        }
+        g_mutex_unlock(&(sconn->mutex));
+        if (request == NULL)
+            return;
+
+        request->connection = balde_server_connection_ref(conn);
+        if (balde_app_admission_enter(ud->app, ud->max_queued)) {
+            request->deadline = balde_app_admission_deadline(ud->queue_timeout);
+            g_thread_pool_push(ud->pool, request, NULL);
+            return;
+        }
 
-    balde_scgi_netstring_state_t state = NETSTRING_LEN;
+        // too many requests are waiting for the application threads already.
+        balde_sapi_scgi_respond(request,
+            balde_sapi_scgi_render_error(ud->app, 503), request->env == NULL);
+        balde_sapi_scgi_request_free(request);
+        finished = TRUE;
+    }
+}
 
-    guchar c = 0;
-    guint64 netstring_len = 0;
-    guint64 start = 0;
-    guint64 current = 0;
 
-    while (TRUE) {
-        c = g_data_input_stream_read_byte(data, NULL, NULL);
-        g_string_append_c(buf, c);
+static void
+balde_sapi_scgi_handle_request(balde_sapi_scgi_request_t *request,
+    balde_sapi_scgi_user_data_t *ud)
+{
+    balde_server_connection_t *conn = request->connection;
+    gboolean bad_request = request->env == NULL;
+    GString *response;
 
-        switch(state) {
+    if (!balde_app_admission_leave(ud->app, request->deadline)) {
+        response = balde_sapi_scgi_render_error(ud->app, 503);
+    }
+    else if (bad_request) {
+        response = balde_sapi_scgi_render_error(ud->app, 400);
+    }
+    else {
+        // the main loop takes the env.
+        response = balde_app_main_loop(ud->app, request->env,
+            balde_response_render, NULL);
+        request->env = NULL;
+    }
+    balde_sapi_scgi_respond(request, response, bad_request);
+    balde_sapi_scgi_dispatch(conn, TRUE);
+    balde_sapi_scgi_request_free(request);
+}
 
-            case NETSTRING_LEN:
-                if (c >= '0' && c <= '9')
-                    break;
-                if (c != ':') {
-                    g_free(key);
-                    g_free(value);
-                    g_string_free(buf, TRUE);
-                    return NULL;
-                }
-                key = g_strndup(buf->str + start, buf->len - start);
-                netstring_len = g_ascii_strtoull(key, NULL, 10);
-                g_free(key);
-                key = NULL;
-                state = NETSTRING_HEADER_KEY;
-                start = buf->len;
-                break;
 
-            case NETSTRING_HEADER_KEY:
-                if (c != '\0')
-                    break;
-                key = g_strndup(buf->str + start, buf->len - start);
-                state = NETSTRING_HEADER_VALUE;
-                start = buf->len;
-                break;
+static void
+balde_sapi_scgi_queue(balde_server_connection_t *conn,
+    balde_sapi_scgi_request_t *request)
+{
+    balde_sapi_scgi_connection_t *sconn = conn->data;
+    balde_sapi_scgi_user_data_t *ud = balde_server_get_user_data(conn->server);
+
+    // plain SCGI connections carry a single request. after a bad request,
+    // the rest of the stream can't be trusted.
+    if (!ud->persistent || request->env == NULL)
+        sconn->done = TRUE;
+
+    g_mutex_lock(&(sconn->mutex));
+    g_queue_push_tail(&(sconn->waiting), request);
+    g_mutex_unlock(&(sconn->mutex));
+    balde_sapi_scgi_dispatch(conn, FALSE);
+}
 
-            case NETSTRING_HEADER_VALUE:
-                if (c != '\0' && current != netstring_len)
-                    break;
-                value = g_strndup(buf->str + start, buf->len - start);
-                g_hash_table_replace(env, key, value);
-                key = NULL;
-                value = NULL;
-                state = NETSTRING_HEADER_KEY;
-                start = buf->len;
-                break;
 
+static gboolean
+balde_sapi_scgi_read(balde_server_connection_t *conn)
+{
+    balde_sapi_scgi_connection_t *sconn = conn->data;
+    balde_server_buffer_t *input = &(conn->input);
+
+    while (!sconn->done) {
+        gchar *data = (gchar*) input->data + input->start;
+        gsize available = input->end - input->start;
+
+        if (sconn->request == NULL) {
+            // wait for the whole netstring, and parse it at once.
+            gchar *colon = memchr(data, ':', MIN(available, 8));
+            if (colon == NULL && available < 8)
+                break;
+            gsize len;
+            balde_request_env_t *env = NULL;
+            if (colon != NULL &&
+                balde_sapi_scgi_parse_length(data, colon - data, &len))
+            {
+                gsize size = colon - data + len + 2;
+                if (available < size)
+                    break;
+                gchar *headers = g_malloc(len + 1);
+                memcpy(headers, colon + 1, len + 1);
+                env = balde_sapi_scgi_parse_netstring(headers, len);
+                input->start += size;
+                available -= size;
+                data += size;
+            }
+            sconn->request = g_new0(balde_sapi_scgi_request_t, 1);
+            sconn->request->env = env;
+            if (env != NULL) {
+                sconn->request->content_length =
+                    balde_sapi_cgi_parse_content_length(
+                        g_hash_table_lookup(env->headers, "content-length"));
+
+                // it only grows past the first chunk as the data arrives,
+                // so a bogus CONTENT_LENGTH can't allocate it all up front.
+                if (sconn->request->content_length > 0)
+                    env->body = g_string_sized_new(MIN(
+                        sconn->request->content_length,
+                        BALDE_SAPI_SCGI_BODY_CHUNK_SIZE));
+            }
         }
 
-        if (state != NETSTRING_LEN) {
-            if (current == netstring_len)
+        balde_request_env_t *env = sconn->request->env;
+        if (env != NULL && env->body != NULL) {
+            gsize to_copy = MIN(available,
+                sconn->request->content_length - env->body->len);
+            g_string_append_len(env->body, data, to_copy);
+            input->start += to_copy;
+            if (env->body->len < sconn->request->content_length)
                 break;
-            current++;
         }
+
+        balde_sapi_scgi_queue(conn, sconn->request);
+        sconn->request = NULL;
     }
 
-    g_free(key);
-    g_free(value);
-    g_string_free(buf, TRUE);
+    // whatever comes after the last request is ignored.
+    if (sconn->done)
+        input->start = input->end;
 
-    if (',' != g_data_input_stream_read_byte(data, NULL, NULL)) {
-        return NULL;
-    }
+    return TRUE;
+}
 
-    GString *body = NULL;
-    GHashTable *headers = g_hash_table_new_full(g_str_hash, g_str_equal,
-        g_free, g_free);
 
-    g_hash_table_foreach(env, (GHFunc) balde_filter_headers, headers);
+static gpointer
+balde_sapi_scgi_connection_new(balde_server_connection_t *conn)
+{
+    balde_sapi_scgi_connection_t *sconn = g_new0(balde_sapi_scgi_connection_t, 1);
+    g_queue_init(&(sconn->waiting));
+    g_mutex_init(&(sconn->mutex));
+    return sconn;
+}
 
-    guint64 content_length = 0;
-    gchar *clen_str = g_hash_table_lookup(env, "CONTENT_LENGTH");
 
-    if (clen_str != NULL) {
-        g_hash_table_replace(headers, g_strdup("content-length"),
-            g_strdup(clen_str));
-        content_length = balde_sapi_cgi_parse_content_length(clen_str);
-    }
+static void
+balde_sapi_scgi_connection_free(balde_sapi_scgi_connection_t *sconn)
+{
+    balde_sapi_scgi_request_free(sconn->request);
+    g_queue_foreach(&(sconn->waiting), (GFunc) balde_sapi_scgi_request_free,
+        NULL);
+    g_queue_clear(&(sconn->waiting));
+    g_mutex_clear(&(sconn->mutex));
+    g_free(sconn);
+}
 
-    gchar *ctype_str = g_hash_table_lookup(env, "CONTENT_TYPE");
-    if (ctype_str != NULL)
-        g_hash_table_replace(headers, g_strdup("content-type"),
-            g_strdup(ctype_str));
-
-    if (content_length > 0) {
-        gchar body_[1024];
-        gssize real_content_length = 0;
-        gssize size;
-        gssize to_read = sizeof(body_);
-        body = g_string_new(NULL);
-        while (real_content_length < content_length) {
-            if (content_length - real_content_length < to_read)
-                to_read = content_length - real_content_length;
-            size = g_input_stream_read(G_INPUT_STREAM(data), body_, to_read,
-                NULL, NULL);
-            g_string_append_len(body, body_, size);
-            real_content_length += size;
-        }
-    }
 
-    g_object_unref(data);
-
-    balde_request_env_t *req_env = g_new(balde_request_env_t, 1);
-    req_env->server_name = g_strdup(g_hash_table_lookup(env, "SERVER_NAME"));
-    req_env->script_name = g_strdup(g_hash_table_lookup(env, "SCRIPT_NAME"));
-    gchar *path_info = g_strdup(g_hash_table_lookup(env, "PATH_INFO"));
-    req_env->query_string = NULL;
-    if (path_info == NULL) {  // this is dumb, but its how nginx works
-        path_info = g_strdup(g_hash_table_lookup(env, "REQUEST_URI"));
-
-        gchar **pieces = g_strsplit(path_info, "?", 2);
-        req_env->path_info = g_strdup(pieces[0]);
-        if (pieces[1] != NULL)
-            req_env->query_string = g_strdup(pieces[1]);
-        // FIXME: we could just g_free(pieces) here, and avoid the g_strdup
-        // calls above, but I'm afraid of memory leak due to weird memory
-        // optimizations from glib.
-        g_strfreev(pieces);
-    }
-    else {
-        req_env->path_info = path_info;
-        char *qs = g_hash_table_lookup(env, "QUERY_STRING");
-        if (qs != NULL)
-            req_env->query_string = g_strdup(qs);
-    }
+static void
+balde_sapi_scgi_eof(balde_server_connection_t *conn)
+{
+    // a request that isn't complete yet won't ever be. the ones received
+    // already are still answered.
+    balde_sapi_scgi_connection_t *sconn = conn->data;
+    balde_sapi_scgi_request_free(sconn->request);
+    sconn->request = NULL;
+    sconn->done = TRUE;
+}
+
+
+static gboolean
+balde_sapi_scgi_idle(balde_server_connection_t *conn)
+{
+    // requests still being received count as in progress too.
+    balde_sapi_scgi_connection_t *sconn = conn->data;
+    g_mutex_lock(&(sconn->mutex));
+    gboolean rv = sconn->request == NULL && !sconn->running &&
+        g_queue_is_empty(&(sconn->waiting));
+    g_mutex_unlock(&(sconn->mutex));
+    return rv;
+}
+
 
-    req_env->request_method = g_strdup(g_hash_table_lookup(env, "REQUEST_METHOD"));
-    req_env->headers = headers;
-    req_env->body = body;
-    req_env->https = g_hash_table_lookup(env, "HTTPS") != NULL;
+static const balde_server_protocol_t scgi_protocol = {
+    .connection_new = balde_sapi_scgi_connection_new,
+    .read = balde_sapi_scgi_read,
+    .connection_free = (void (*) (gpointer)) balde_sapi_scgi_connection_free,
+    .idle = balde_sapi_scgi_idle,
+    .eof = balde_sapi_scgi_eof,
+};
+
+
+balde_server_t*
+balde_sapi_scgi_server_new(balde_app_t *app, guint io_threads,
+    guint app_threads, guint max_queued, guint queue_timeout,
+    gboolean persistent, GError **error)
+{
+    balde_sapi_scgi_user_data_t *ud = g_new(balde_sapi_scgi_user_data_t, 1);
+    ud->app = app;
+    ud->max_queued = max_queued;
+    ud->queue_timeout = (gint64) queue_timeout * 1000;
+    ud->persistent = persistent;
+    ud->pool = g_thread_pool_new((GFunc) balde_sapi_scgi_handle_request, ud,
+        app_threads, FALSE, error);
+    if (ud->pool == NULL) {
+        g_free(ud);
+        return NULL;
+    }
+    return balde_server_new(&scgi_protocol, ud, io_threads);
+}
 
-    g_hash_table_destroy(env);
 
-    return req_env;
+void
+balde_sapi_scgi_server_free(balde_server_t *server)
+{
+    if (server == NULL)
+        return;
+    balde_sapi_scgi_user_data_t *ud = balde_server_get_user_data(server);
+
+    // application threads hold connection references, stop them first.
+    balde_server_stop(server);
+    g_thread_pool_free(ud->pool, FALSE, TRUE);
+    balde_server_free(server);
+    g_free(ud);
 }
 
 
 static gboolean runscgi = FALSE;
 static gchar *host = NULL;
 static gint port = 9000;
+static gchar *socket_path = NULL;
+static gchar *socket_mode = NULL;
+static gchar *socket_owner = NULL;
+static gint max_threads_server = 2;
 static gint max_threads = 10;
+static gint max_queued = 1024;
+static gint queue_timeout = 0;
+static gint workers = 1;
+static gint drain_timeout = 30;
+static gboolean persistent = FALSE;
 
 static GOptionEntry entries_scgi[] =
 {
@@ -238,8 +480,30 @@ static GOptionEntry entries_scgi[] =
         "Embedded SCGI server host. (default: 127.0.0.1)", "HOST"},
     {"scgi-port", 0, 0, G_OPTION_ARG_INT, &port,
         "Embedded SCGI server port. (default: 9000)", "PORT"},
+    {"scgi-socket", 0, 0, G_OPTION_ARG_FILENAME, &socket_path,
+        "Embedded SCGI server unix socket, instead of host and port.", "PATH"},
+    {"scgi-socket-mode", 0, 0, G_OPTION_ARG_STRING, &socket_mode,
+        "Embedded SCGI server unix socket permissions. (default: 0660)", "MODE"},
+    {"scgi-socket-owner", 0, 0, G_OPTION_ARG_STRING, &socket_owner,
+        "Embedded SCGI server unix socket owner.", "USER[:GROUP]"},
+    {"scgi-max-threads-server", 0, 0, G_OPTION_ARG_INT, &max_threads_server,
+        "Embedded SCGI server I/O threads. (default: 2)", "THREADS"},
     {"scgi-max-threads", 0, 0, G_OPTION_ARG_INT, &max_threads,
-        "Embedded SCGI server max threads. (default: 10)", "THREADS"},
+        "Embedded SCGI max application threads. (default: 10)", "THREADS"},
+    {"scgi-max-queue", 0, 0, G_OPTION_ARG_INT, &max_queued,
+        "Embedded SCGI max requests waiting for application threads, 0 for "
+        "unbounded. (default: 1024)", "REQUESTS"},
+    {"scgi-queue-timeout", 0, 0, G_OPTION_ARG_INT, &queue_timeout,
+        "Embedded SCGI max time a request waits for application threads, 0 "
+        "for unbounded. (default: 0)", "MILLISECONDS"},
+    {"scgi-workers", 0, 0, G_OPTION_ARG_INT, &workers,
+        "Embedded SCGI server worker processes. (default: 1)", "WORKERS"},
+    {"scgi-drain-timeout", 0, 0, G_OPTION_ARG_INT, &drain_timeout,
+        "Embedded SCGI server time to finish requests when stopping "
+        "gracefully. (default: 30)", "SECONDS"},
+    {"scgi-persistent", 0, 0, G_OPTION_ARG_NONE, &persistent,
+        "Keep SCGI connections open after responses, for front ends that "
+        "reuse them.", NULL},
     {NULL}
 };
 
@@ -261,37 +525,89 @@ balde_sapi_scgi_supported(void)
 }
 
 
+typedef struct {
+    balde_app_t *app;
+    balde_server_endpoint_t *endpoint;
+} balde_sapi_scgi_worker_t;
+
+
+static gint
+balde_sapi_scgi_worker(balde_sapi_scgi_worker_t *worker)
+{
+    GError *error = NULL;
+    gint rv = 0;
+    balde_server_t *server = balde_sapi_scgi_server_new(worker->app,
+        max_threads_server, max_threads, max_queued, queue_timeout, persistent,
+        &error);
+    if (server == NULL) {
+        g_printerr("Failed to create app thread pool: %s\n", error->message);
+        g_error_free(error);
+        return 3;
+    }
+
+    GSList *sockets = balde_server_endpoint_get_sockets(worker->endpoint,
+        &error);
+    if (sockets == NULL) {
+        g_printerr("Failed to listen: %s\n", error->message);
+        g_error_free(error);
+        rv = 3;
+        goto point1;
+    }
+    for (GSList *l = sockets; l != NULL; l = g_slist_next(l))
+        balde_server_listen_socket(server, l->data);
+    g_slist_free_full(sockets, g_object_unref);
+
+    if (!balde_server_start(server, &error)) {
+        g_printerr("Failed to start server: %s\n", error->message);
+        g_error_free(error);
+        rv = 3;
+        goto point1;
+    }
+
+    if (balde_sapi_prefork_wait(worker->endpoint))
+        balde_server_drain(server, (gint64) drain_timeout * G_USEC_PER_SEC);
+
+point1:
+    balde_sapi_scgi_server_free(server);
+    return rv;
+}
+
+
 static gint
 balde_sapi_scgi_run(balde_app_t *app)
 {
-    // TODO: add unix socket support
     GError *error = NULL;
+    gint rv = 0;
     const gchar *final_host = host != NULL ? host : "127.0.0.1";
-    g_printerr(" * Running SCGI on %s:%d (threads: %d)\n", final_host, port,
-        max_threads);
-    GSocketService *service = g_threaded_socket_service_new(max_threads);
-    GInetAddress* addr_host = g_inet_address_new_from_string(final_host);
-    GSocketAddress *address = g_inet_socket_address_new(addr_host, port);
-    g_socket_listener_add_address(G_SOCKET_LISTENER(service), address,
-        G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_TCP, NULL, NULL, &error);
-    if (error != NULL) {
+    if (socket_path != NULL)
+        g_printerr(" * Running SCGI on unix:%s (workers: %d, server threads: "
+            "%d, app threads: %d)\n", socket_path, workers, max_threads_server,
+            max_threads);
+    else
+        g_printerr(" * Running SCGI on %s:%d (workers: %d, server threads: "
+            "%d, app threads: %d)\n", final_host, port, workers,
+            max_threads_server, max_threads);
+
+    balde_sapi_scgi_worker_t worker = {.app = app};
+    worker.endpoint = balde_server_endpoint_new(final_host, port, socket_path,
+        socket_mode, socket_owner, workers > 1, &error);
+    if (worker.endpoint == NULL) {
         g_printerr("Failed to listen: %s\n", error->message);
         g_error_free(error);
-        g_object_unref(service);
-        g_object_unref(addr_host);
-        g_object_unref(address);
-        g_free(host);
-        return 3;
+        rv = 3;
+        goto point1;
     }
-    g_signal_connect(service, "run", G_CALLBACK(balde_incoming_callback), app);
-    g_socket_service_start(service);
-    g_object_unref(service);
-    g_object_unref(addr_host);
-    g_object_unref(address);
-    GMainLoop *loop = g_main_loop_new(NULL, FALSE);
-    g_main_loop_run(loop);
+
+    rv = balde_sapi_prefork_run(workers, worker.endpoint,
+        (balde_prefork_func_t) balde_sapi_scgi_worker, &worker);
+
+    balde_server_endpoint_free(worker.endpoint);
+point1:
     g_free(host);
-    return 0;
+    g_free(socket_path);
+    g_free(socket_mode);
+    g_free(socket_owner);
+    return rv;
 }
 
 
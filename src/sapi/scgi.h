@@ -13,8 +13,17 @@
 #include <gio/gio.h>
 
 #include "../balde.h"
+#include "../requests.h"
+#include "server.h"
 
-balde_request_env_t* balde_sapi_scgi_parse_request(balde_app_t *app,
-    GInputStream *istream);
+#define BALDE_SAPI_SCGI_MAX_HEADERS_SIZE (1024 * 1024)
+#define BALDE_SAPI_SCGI_BODY_CHUNK_SIZE (1024 * 1024)
+
+balde_request_env_t* balde_sapi_scgi_parse_headers(gchar *data, gsize len);
+balde_request_env_t* balde_sapi_scgi_parse_netstring(gchar *data, gsize len);
+balde_server_t* balde_sapi_scgi_server_new(balde_app_t *app, guint io_threads,
+    guint app_threads, guint max_queued, guint queue_timeout,
+    gboolean persistent, GError **error);
+void balde_sapi_scgi_server_free(balde_server_t *server);
 
 #endif /* _BALDE_SAPI_SCGI_PRIVATE_H */
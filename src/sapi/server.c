@@ -0,0 +1,1616 @@
+/*
+ * balde: A microframework for C based on GLib and bad intentions.
+ * Copyright (C) 2013-2017 Rafael G. Martins <rafael@rafaelmartins.eng.br>
+ *
+ * This program can be distributed under the terms of the LGPL-2 License.
+ * See the file COPYING.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <glib.h>
+#include <glib-unix.h>
+#include <gio/gio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <pwd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif /* HAVE_SYS_EPOLL_H */
+
+#include "server.h"
+
+/*
+ * Event-driven connection handling for the embedded servers.
+ *
+ * A few I/O threads wait for events on non-blocking sockets (with epoll, if
+ * available), read whatever is available into per-connection buffers and let
+ * the protocol parse it. Protocols hand complete requests to application
+ * threads, that queue the responses back into the connection. Only the I/O
+ * thread that owns a connection touches its socket.
+ *
+ * Responses may be written to numbered streams, for protocols that multiplex
+ * requests on a connection. Each write is an atomic unit (e.g. a FastCGI
+ * record, possibly made of a header and a slice of the response), and the
+ * streams take turns on the wire, one unit at a time, so a big response
+ * doesn't hold back the others.
+ *
+ * A draining server stops accepting connections, and closes the others as
+ * soon as they are idle, so the requests in progress are finished.
+ *
+ * A peer that is done sending (e.g. after shutdown(SHUT_WR)) still gets the
+ * responses to the requests it sent, if the protocol knows when they are
+ * finished.
+ *
+ * Connections closed by the server linger for a while, with the write side
+ * shut down and the input discarded as it arrives, so a peer that is still
+ * sending gets the last response instead of a reset.
+ *
+ * With a timeout set, connections that make no progress in time are dropped,
+ * so slow or gone peers don't hold resources forever.
+ */
+
+#define BALDE_SERVER_LISTEN_BACKLOG 1024
+#define BALDE_SERVER_MAX_BUFFER_SIZE (4 * BALDE_SERVER_READ_SIZE)
+#define BALDE_SERVER_TIMEOUT_INTERVAL 1000
+#define BALDE_SERVER_LINGER_TIMEOUT 2000
+#define BALDE_SERVER_MAX_LINGER_SIZE (256 * 1024)
+
+#ifdef MSG_NOSIGNAL
+#define BALDE_SERVER_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define BALDE_SERVER_SEND_FLAGS 0
+#endif /* MSG_NOSIGNAL */
+
+typedef struct {
+    balde_server_handle_type_t type;
+    GSocket *socket;
+    gint fd;
+    gchar *path;
+} balde_server_listener_t;
+
+typedef struct {
+    gpointer handle;
+    gboolean readable;
+    gboolean writable;
+} balde_server_event_t;
+
+typedef struct {
+    guint id;
+    GQueue chunks;
+    GQueue units;  // number of chunks of each unit
+} balde_server_stream_t;
+
+struct _balde_server_io_t {
+    balde_server_handle_type_t type;
+    balde_server_t *server;
+    GThread *thread;
+#ifdef HAVE_SYS_EPOLL_H
+    gint epoll_fd;
+#else
+    GArray *poll_fds;
+    GPtrArray *poll_handles;
+#endif /* HAVE_SYS_EPOLL_H */
+    gint wakeup[2];
+    GAsyncQueue *incoming;
+    GAsyncQueue *pending;
+    GHashTable *connections;
+    GQueue lingering;  // by deadline
+    GQueue half_closed;
+    gint stop;
+    gint draining;
+    gboolean released;
+    gint64 next_expire;
+};
+
+struct _balde_server_endpoint_t {
+    GSocket *socket;
+    GSocketAddress *address;
+    gchar *path;
+};
+
+struct _balde_server_t {
+    const balde_server_protocol_t *protocol;
+    gpointer user_data;
+    guint n_io;
+    balde_server_io_t *io;
+    GSList *listeners;
+    guint next_io;
+    gboolean started;
+    gint64 timeout;
+
+    // drain state, protected by the mutex.
+    GMutex mutex;
+    GCond cond;
+    guint n_released;
+    guint n_running;
+    gint listeners_closed;
+};
+
+
+/*
+ * Poller. Only used from the I/O thread that owns it.
+ */
+
+#ifdef HAVE_SYS_EPOLL_H
+
+static gboolean
+balde_server_poller_init(balde_server_io_t *io, GError **error)
+{
+    io->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (io->epoll_fd < 0) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+            "Failed to create epoll instance: %s", g_strerror(errno));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+static void
+balde_server_poller_clear(balde_server_io_t *io)
+{
+    if (io->epoll_fd >= 0)
+        close(io->epoll_fd);
+    io->epoll_fd = -1;
+}
+
+
+static void
+balde_server_poller_add(balde_server_io_t *io, gint fd, gpointer handle,
+    gboolean exclusive)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+    // listeners are shared by all the I/O threads, wake up only one of them.
+    if (exclusive)
+        ev.events |= EPOLLEXCLUSIVE;
+#endif /* EPOLLEXCLUSIVE */
+    ev.data.ptr = handle;
+    epoll_ctl(io->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+
+static void
+balde_server_poller_mod(balde_server_io_t *io, gint fd, gpointer handle,
+    gboolean readable, gboolean writable)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = (readable ? EPOLLIN : 0) | (writable ? EPOLLOUT : 0);
+    ev.data.ptr = handle;
+    epoll_ctl(io->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+
+static void
+balde_server_poller_del(balde_server_io_t *io, gint fd)
+{
+    struct epoll_event ev;
+    epoll_ctl(io->epoll_fd, EPOLL_CTL_DEL, fd, &ev);
+}
+
+
+static gint
+balde_server_poller_wait(balde_server_io_t *io, balde_server_event_t *events,
+    gint timeout)
+{
+    struct epoll_event ev[BALDE_SERVER_MAX_EVENTS];
+    gint n = epoll_wait(io->epoll_fd, ev, BALDE_SERVER_MAX_EVENTS, timeout);
+    for (gint i = 0; i < n; i++) {
+        events[i].handle = ev[i].data.ptr;
+        events[i].readable = (ev[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0;
+        events[i].writable = (ev[i].events & EPOLLOUT) != 0;
+    }
+    return n;
+}
+
+#else
+
+static gboolean
+balde_server_poller_init(balde_server_io_t *io, GError **error)
+{
+    io->poll_fds = g_array_new(FALSE, FALSE, sizeof(struct pollfd));
+    io->poll_handles = g_ptr_array_new();
+    return TRUE;
+}
+
+
+static void
+balde_server_poller_clear(balde_server_io_t *io)
+{
+    if (io->poll_fds != NULL)
+        g_array_free(io->poll_fds, TRUE);
+    if (io->poll_handles != NULL)
+        g_ptr_array_free(io->poll_handles, TRUE);
+    io->poll_fds = NULL;
+    io->poll_handles = NULL;
+}
+
+
+static void
+balde_server_poller_add(balde_server_io_t *io, gint fd, gpointer handle,
+    gboolean exclusive)
+{
+    struct pollfd pfd = {fd, POLLIN, 0};
+    g_array_append_val(io->poll_fds, pfd);
+    g_ptr_array_add(io->poll_handles, handle);
+}
+
+
+static void
+balde_server_poller_mod(balde_server_io_t *io, gint fd, gpointer handle,
+    gboolean readable, gboolean writable)
+{
+    for (guint i = 0; i < io->poll_fds->len; i++) {
+        struct pollfd *pfd = &g_array_index(io->poll_fds, struct pollfd, i);
+        if (pfd->fd == fd) {
+            pfd->events = (readable ? POLLIN : 0) | (writable ? POLLOUT : 0);
+            return;
+        }
+    }
+}
+
+
+static void
+balde_server_poller_del(balde_server_io_t *io, gint fd)
+{
+    for (guint i = 0; i < io->poll_fds->len; i++) {
+        if (g_array_index(io->poll_fds, struct pollfd, i).fd == fd) {
+            g_array_remove_index_fast(io->poll_fds, i);
+            g_ptr_array_remove_index_fast(io->poll_handles, i);
+            return;
+        }
+    }
+}
+
+
+static gint
+balde_server_poller_wait(balde_server_io_t *io, balde_server_event_t *events,
+    gint timeout)
+{
+    struct pollfd *fds = (struct pollfd*) io->poll_fds->data;
+    gint rv = poll(fds, io->poll_fds->len, timeout);
+    gint n = 0;
+    for (guint i = 0; rv > 0 && i < io->poll_fds->len &&
+        n < BALDE_SERVER_MAX_EVENTS; i++)
+    {
+        if (fds[i].revents == 0)
+            continue;
+        events[n].handle = g_ptr_array_index(io->poll_handles, i);
+        events[n].readable = (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) != 0;
+        events[n].writable = (fds[i].revents & POLLOUT) != 0;
+        n++;
+    }
+    return rv < 0 ? rv : n;
+}
+
+#endif /* HAVE_SYS_EPOLL_H */
+
+
+/*
+ * Connections.
+ */
+
+static balde_server_connection_t*
+balde_server_connection_new(balde_server_t *server, gint fd)
+{
+    g_unix_set_fd_nonblocking(fd, TRUE, NULL);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    gint one = 1;
+
+    // this fails for unix sockets, and that's fine.
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#ifdef SO_NOSIGPIPE
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif /* SO_NOSIGPIPE */
+
+    balde_server_connection_t *conn = g_new0(balde_server_connection_t, 1);
+    conn->type = BALDE_SERVER_HANDLE_CONNECTION;
+    conn->ref_count = 1;
+    conn->fd = fd;
+    conn->server = server;
+    conn->last_active = g_get_monotonic_time();
+    g_mutex_init(&(conn->mutex));
+    g_cond_init(&(conn->drained));
+    g_queue_init(&(conn->output));
+    g_queue_init(&(conn->streams));
+    return conn;
+}
+
+
+static void
+balde_server_stream_free(balde_server_stream_t *stream)
+{
+    g_queue_foreach(&(stream->chunks), (GFunc) g_bytes_unref, NULL);
+    g_queue_clear(&(stream->chunks));
+    g_queue_clear(&(stream->units));
+    g_free(stream);
+}
+
+
+static void
+balde_server_connection_clear_output(balde_server_connection_t *conn)
+{
+    g_queue_foreach(&(conn->output), (GFunc) g_bytes_unref, NULL);
+    g_queue_clear(&(conn->output));
+    g_queue_foreach(&(conn->streams), (GFunc) balde_server_stream_free, NULL);
+    g_queue_clear(&(conn->streams));
+    conn->output_offset = 0;
+    conn->queued = 0;
+    g_cond_broadcast(&(conn->drained));
+}
+
+
+balde_server_connection_t*
+balde_server_connection_ref(balde_server_connection_t *conn)
+{
+    g_atomic_int_inc(&(conn->ref_count));
+    return conn;
+}
+
+
+void
+balde_server_connection_unref(balde_server_connection_t *conn)
+{
+    if (conn == NULL || !g_atomic_int_dec_and_test(&(conn->ref_count)))
+        return;
+    if (conn->data != NULL && conn->server->protocol->connection_free != NULL)
+        conn->server->protocol->connection_free(conn->data);
+    balde_server_connection_clear_output(conn);
+    g_free(conn->input.data);
+    g_mutex_clear(&(conn->mutex));
+    g_cond_clear(&(conn->drained));
+    g_free(conn);
+}
+
+
+static GPrivate current_io = G_PRIVATE_INIT(NULL);
+
+
+static void
+balde_server_io_wakeup(balde_server_io_t *io)
+{
+    // the I/O thread processes pending connections before waiting again.
+    if (g_private_get(&current_io) == io)
+        return;
+    while (write(io->wakeup[1], "", 1) < 0 && errno == EINTR);
+}
+
+
+static void
+balde_server_connection_schedule(balde_server_connection_t *conn)
+{
+    // must be called with the connection mutex locked.
+    if (conn->scheduled || conn->closed)
+        return;
+    conn->scheduled = TRUE;
+    g_async_queue_push(conn->io->pending, balde_server_connection_ref(conn));
+    balde_server_io_wakeup(conn->io);
+}
+
+
+void
+balde_server_connection_writev_stream(balde_server_connection_t *conn,
+    guint stream_id, GBytes **data, guint n_data)
+{
+    if (n_data == 0)
+        return;
+    g_mutex_lock(&(conn->mutex));
+    if (conn->closed || conn->closing) {
+        g_mutex_unlock(&(conn->mutex));
+        for (guint i = 0; i < n_data; i++)
+            g_bytes_unref(data[i]);
+        return;
+    }
+
+    // only streams with pending chunks are kept, so this list is short.
+    balde_server_stream_t *stream = NULL;
+    for (GList *l = conn->streams.head; l != NULL; l = g_list_next(l)) {
+        if (((balde_server_stream_t*) l->data)->id == stream_id) {
+            stream = l->data;
+            break;
+        }
+    }
+    if (stream == NULL) {
+        stream = g_new(balde_server_stream_t, 1);
+        stream->id = stream_id;
+        g_queue_init(&(stream->chunks));
+        g_queue_init(&(stream->units));
+        g_queue_push_tail(&(conn->streams), stream);
+    }
+    for (guint i = 0; i < n_data; i++) {
+        g_queue_push_tail(&(stream->chunks), data[i]);
+        conn->queued += g_bytes_get_size(data[i]);
+    }
+    g_queue_push_tail(&(stream->units), GUINT_TO_POINTER(n_data));
+    balde_server_connection_schedule(conn);
+    g_mutex_unlock(&(conn->mutex));
+}
+
+
+void
+balde_server_connection_write_stream(balde_server_connection_t *conn,
+    guint stream_id, GBytes *data)
+{
+    balde_server_connection_writev_stream(conn, stream_id, &data, 1);
+}
+
+
+gboolean
+balde_server_connection_wait_writable(balde_server_connection_t *conn)
+{
+    // blocks producers while too much output is queued. must not be called
+    // from the I/O threads.
+    g_mutex_lock(&(conn->mutex));
+    while (!conn->closed && !conn->closing &&
+        conn->queued >= BALDE_SERVER_MAX_QUEUED)
+    {
+        g_cond_wait(&(conn->drained), &(conn->mutex));
+    }
+    gboolean rv = !conn->closed && !conn->closing;
+    g_mutex_unlock(&(conn->mutex));
+    return rv;
+}
+
+
+void
+balde_server_connection_write(balde_server_connection_t *conn, GBytes *data)
+{
+    balde_server_connection_write_stream(conn, 0, data);
+}
+
+
+void
+balde_server_connection_close(balde_server_connection_t *conn)
+{
+    // the connection is closed by its I/O thread, after flushing the output.
+    g_mutex_lock(&(conn->mutex));
+    conn->closing = TRUE;
+    balde_server_connection_schedule(conn);
+    g_mutex_unlock(&(conn->mutex));
+}
+
+
+static void
+balde_server_connection_shutdown(balde_server_connection_t *conn)
+{
+    g_mutex_lock(&(conn->mutex));
+    if (conn->closed) {
+        g_mutex_unlock(&(conn->mutex));
+        return;
+    }
+    conn->closed = TRUE;
+    balde_server_connection_clear_output(conn);
+    balde_server_poller_del(conn->io, conn->fd);
+    close(conn->fd);
+    conn->fd = -1;
+    g_mutex_unlock(&(conn->mutex));
+
+    // drops the reference owned by the I/O thread.
+    g_hash_table_remove(conn->io->connections, conn);
+}
+
+
+static void
+balde_server_connection_linger(balde_server_connection_t *conn)
+{
+    // the peer may still be sending its request. closing the socket with
+    // unread input resets the connection, and the response may get lost, so
+    // the write side is shut down, and the socket is closed by the I/O
+    // thread when the peer is done, or sent too much, or took too long.
+    if (shutdown(conn->fd, SHUT_WR) < 0) {
+        balde_server_connection_shutdown(conn);
+        return;
+    }
+    conn->lingering = TRUE;
+    conn->linger_deadline = g_get_monotonic_time() +
+        BALDE_SERVER_LINGER_TIMEOUT * 1000;
+    g_queue_push_tail(&(conn->io->lingering), balde_server_connection_ref(conn));
+}
+
+
+static void
+balde_server_connection_discard(balde_server_connection_t *conn)
+{
+    gchar buf[4096];
+    gssize r;
+    while (conn->lingered < BALDE_SERVER_MAX_LINGER_SIZE) {
+        r = recv(conn->fd, buf, sizeof(buf), 0);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (r <= 0)
+            break;
+        conn->lingered += r;
+    }
+    balde_server_connection_shutdown(conn);
+}
+
+
+static void
+balde_server_connection_commit_output(balde_server_connection_t *conn)
+{
+    // must be called with the connection mutex locked. moves one unit of
+    // each stream to the wire, round-robin. units are only committed after
+    // the previous round is fully written, so every stream gets its turn.
+    guint n = conn->streams.length;
+    for (guint i = 0; i < n && conn->output.length < BALDE_SERVER_MAX_IOV; i++) {
+        balde_server_stream_t *stream = g_queue_pop_head(&(conn->streams));
+        guint n_chunks = GPOINTER_TO_UINT(g_queue_pop_head(&(stream->units)));
+        for (guint j = 0; j < n_chunks; j++)
+            g_queue_push_tail(&(conn->output),
+                g_queue_pop_head(&(stream->chunks)));
+        if (g_queue_is_empty(&(stream->chunks)))
+            balde_server_stream_free(stream);
+        else
+            g_queue_push_tail(&(conn->streams), stream);
+    }
+}
+
+
+static void
+balde_server_connection_flush(balde_server_connection_t *conn)
+{
+    struct iovec iov[BALDE_SERVER_MAX_IOV];
+
+    g_mutex_lock(&(conn->mutex));
+    if (conn->closed) {
+        g_mutex_unlock(&(conn->mutex));
+        return;
+    }
+
+    while (TRUE) {
+        if (g_queue_is_empty(&(conn->output)))
+            balde_server_connection_commit_output(conn);
+        if (g_queue_is_empty(&(conn->output)))
+            break;
+        gint n = 0;
+        for (GList *l = conn->output.head; l != NULL && n < BALDE_SERVER_MAX_IOV;
+            l = g_list_next(l), n++)
+        {
+            gsize size;
+            const guint8 *data = g_bytes_get_data(l->data, &size);
+            gsize offset = n == 0 ? conn->output_offset : 0;
+            iov[n].iov_base = (gpointer) (data + offset);
+            iov[n].iov_len = size - offset;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        gssize written = sendmsg(conn->fd, &msg, BALDE_SERVER_SEND_FLAGS);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            g_mutex_unlock(&(conn->mutex));
+            balde_server_connection_shutdown(conn);
+            return;
+        }
+
+        conn->last_active = g_get_monotonic_time();
+        conn->queued -= written;
+        if (conn->queued < BALDE_SERVER_MAX_QUEUED)
+            g_cond_broadcast(&(conn->drained));
+
+        gsize left = written;
+        while (left > 0) {
+            gsize size = g_bytes_get_size(g_queue_peek_head(&(conn->output)));
+            gsize remaining = size - conn->output_offset;
+            if (left < remaining) {
+                conn->output_offset += left;
+                break;
+            }
+            left -= remaining;
+            conn->output_offset = 0;
+            g_bytes_unref(g_queue_pop_head(&(conn->output)));
+        }
+
+        // drop empty buffers that didn't get a chance to be "written" above.
+        while (!g_queue_is_empty(&(conn->output)) &&
+            g_bytes_get_size(g_queue_peek_head(&(conn->output))) == 0)
+        {
+            g_bytes_unref(g_queue_pop_head(&(conn->output)));
+        }
+    }
+
+    gboolean empty = g_queue_is_empty(&(conn->output));
+    if (empty == conn->writing) {
+        conn->writing = !empty;
+        balde_server_poller_mod(conn->io, conn->fd, conn, !conn->eof,
+            conn->writing);
+    }
+    gboolean close_now = empty && conn->closing && !conn->lingering;
+    g_mutex_unlock(&(conn->mutex));
+
+    // there's nothing to linger for if the peer is done sending.
+    if (close_now && conn->eof)
+        balde_server_connection_shutdown(conn);
+    else if (close_now)
+        balde_server_connection_linger(conn);
+}
+
+
+static void
+balde_server_buffer_reserve(balde_server_buffer_t *buf)
+{
+    // consumed data is just skipped. the pending bytes (usually a partial
+    // record) are only moved to the front when there's no room left for a
+    // full read at the end.
+    if (buf->start == buf->end)
+        buf->start = buf->end = 0;
+    if (buf->size - buf->end >= BALDE_SERVER_READ_SIZE)
+        return;
+    if (buf->start > 0) {
+        memmove(buf->data, buf->data + buf->start, buf->end - buf->start);
+        buf->end -= buf->start;
+        buf->start = 0;
+    }
+    if (buf->size - buf->end < BALDE_SERVER_READ_SIZE) {
+        buf->size = buf->end + BALDE_SERVER_READ_SIZE;
+        buf->data = g_realloc(buf->data, buf->size);
+    }
+}
+
+
+static void
+balde_server_buffer_trim(balde_server_buffer_t *buf)
+{
+    // give back the memory grabbed by big records once they're consumed, so
+    // idle connections stay small.
+    if (buf->start == buf->end && buf->size > BALDE_SERVER_MAX_BUFFER_SIZE) {
+        g_free(buf->data);
+        buf->data = NULL;
+        buf->start = buf->end = buf->size = 0;
+    }
+}
+
+
+static void
+balde_server_connection_half_close(balde_server_connection_t *conn)
+{
+    // stops reading and parsing requests. the connection is closed by the
+    // I/O thread once the protocol is idle.
+    conn->eof = TRUE;
+    conn->input.start = conn->input.end;
+    conn->server->protocol->eof(conn);
+    g_mutex_lock(&(conn->mutex));
+    balde_server_poller_mod(conn->io, conn->fd, conn, FALSE, conn->writing);
+    g_mutex_unlock(&(conn->mutex));
+    g_queue_push_tail(&(conn->io->half_closed), balde_server_connection_ref(conn));
+}
+
+
+static void
+balde_server_connection_read(balde_server_connection_t *conn)
+{
+    if (conn->lingering) {
+        balde_server_connection_discard(conn);
+        return;
+    }
+
+    balde_server_buffer_t *buf = &(conn->input);
+    balde_server_buffer_reserve(buf);
+    gssize r;
+    do {
+        r = recv(conn->fd, buf->data + buf->end, buf->size - buf->end, 0);
+    } while (r < 0 && errno == EINTR);
+    if (r > 0) {
+        buf->end += r;
+        conn->last_active = g_get_monotonic_time();
+    }
+
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+
+    // EOF. the peer may only be done sending, and still wait for the
+    // responses.
+    if (r == 0 && !conn->eof && conn->server->protocol->eof != NULL) {
+        balde_server_connection_half_close(conn);
+        return;
+    }
+
+    // error, or EOF again (the poller only reports hangups by now). the peer
+    // is gone, so there's nobody to send the pending responses to.
+    if (r <= 0) {
+        balde_server_connection_shutdown(conn);
+        return;
+    }
+
+    if (!conn->server->protocol->read(conn)) {
+        balde_server_connection_shutdown(conn);
+        return;
+    }
+    balde_server_buffer_trim(buf);
+}
+
+
+/*
+ * I/O threads.
+ */
+
+static void
+balde_server_io_register(balde_server_io_t *io, balde_server_connection_t *conn)
+{
+    conn->io = io;
+    g_hash_table_add(io->connections, conn);
+    balde_server_poller_add(io, conn->fd, conn, FALSE);
+    if (conn->server->protocol->connection_new != NULL)
+        conn->data = conn->server->protocol->connection_new(conn);
+}
+
+
+static void
+balde_server_io_accept(balde_server_io_t *io, balde_server_listener_t *listener)
+{
+    for (guint i = 0; i < BALDE_SERVER_MAX_ACCEPTS; i++) {
+        gint fd = accept(listener->fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED)
+                g_printerr("server: error: failed to accept connection: %s\n",
+                    g_strerror(errno));
+            return;
+        }
+        balde_server_io_register(io, balde_server_connection_new(io->server, fd));
+    }
+}
+
+
+static void
+balde_server_io_process_pending(balde_server_io_t *io)
+{
+    balde_server_connection_t *conn;
+    while ((conn = g_async_queue_try_pop(io->incoming)) != NULL)
+        balde_server_io_register(io, conn);
+    while ((conn = g_async_queue_try_pop(io->pending)) != NULL) {
+        g_mutex_lock(&(conn->mutex));
+        conn->scheduled = FALSE;
+        g_mutex_unlock(&(conn->mutex));
+        balde_server_connection_flush(conn);
+        balde_server_connection_unref(conn);
+    }
+}
+
+
+static gboolean
+balde_server_io_drain(balde_server_io_t *io)
+{
+    // returns TRUE when the I/O thread has nothing left to do.
+    balde_server_t *server = io->server;
+    if (!io->released) {
+        for (GSList *l = server->listeners; l != NULL; l = g_slist_next(l))
+            balde_server_poller_del(io, ((balde_server_listener_t*) l->data)->fd);
+        io->released = TRUE;
+        g_mutex_lock(&(server->mutex));
+        server->n_released++;
+        g_cond_broadcast(&(server->cond));
+        g_mutex_unlock(&(server->mutex));
+    }
+
+    GHashTableIter iter;
+    balde_server_connection_t *conn;
+    g_hash_table_iter_init(&iter, io->connections);
+    while (g_hash_table_iter_next(&iter, (gpointer*) &conn, NULL)) {
+        g_mutex_lock(&(conn->mutex));
+        gboolean closing = conn->closing;
+        g_mutex_unlock(&(conn->mutex));
+        if (!closing && (server->protocol->idle == NULL ||
+                server->protocol->idle(conn)))
+            balde_server_connection_close(conn);
+    }
+
+    // connections accepted by balde_server_drain() are pushed before the
+    // listeners are closed.
+    return g_atomic_int_get(&(server->listeners_closed)) &&
+        g_hash_table_size(io->connections) == 0 &&
+        g_async_queue_length(io->incoming) <= 0;
+}
+
+
+static void
+balde_server_io_expire(balde_server_io_t *io, gint64 now)
+{
+    // dropped when the peer doesn't take the output, or doesn't send what
+    // the protocol waits for.
+    balde_server_t *server = io->server;
+    GSList *expired = NULL;
+    GHashTableIter iter;
+    balde_server_connection_t *conn;
+    g_hash_table_iter_init(&iter, io->connections);
+    while (g_hash_table_iter_next(&iter, (gpointer*) &conn, NULL)) {
+        if (now - conn->last_active < server->timeout)
+            continue;
+        g_mutex_lock(&(conn->mutex));
+        gboolean writing = conn->writing;
+        g_mutex_unlock(&(conn->mutex));
+        if (writing || (server->protocol->waiting != NULL &&
+                server->protocol->waiting(conn)))
+            expired = g_slist_prepend(expired, conn);
+    }
+    for (GSList *l = expired; l != NULL; l = g_slist_next(l))
+        balde_server_connection_shutdown(l->data);
+    g_slist_free(expired);
+}
+
+
+static void
+balde_server_io_close_half_closed(balde_server_io_t *io)
+{
+    // like draining, but for the connections whose peer is done sending.
+    GList *l = io->half_closed.head;
+    while (l != NULL) {
+        GList *next = g_list_next(l);
+        balde_server_connection_t *conn = l->data;
+        g_mutex_lock(&(conn->mutex));
+        gboolean closing = conn->closed || conn->closing;
+        g_mutex_unlock(&(conn->mutex));
+        if (closing || conn->server->protocol->idle == NULL ||
+            conn->server->protocol->idle(conn))
+        {
+            if (!closing)
+                balde_server_connection_close(conn);
+            g_queue_delete_link(&(io->half_closed), l);
+            balde_server_connection_unref(conn);
+        }
+        l = next;
+    }
+}
+
+
+static void
+balde_server_io_linger_expire(balde_server_io_t *io, gint64 now)
+{
+    // lingering connections are queued in the order they were closed, so
+    // the earliest deadlines come first.
+    balde_server_connection_t *conn;
+    while ((conn = g_queue_peek_head(&(io->lingering))) != NULL) {
+        if (!conn->closed && now < conn->linger_deadline)
+            return;
+        g_queue_pop_head(&(io->lingering));
+        balde_server_connection_shutdown(conn);
+        balde_server_connection_unref(conn);
+    }
+}
+
+
+static gint
+balde_server_io_wait_timeout(balde_server_io_t *io, gboolean draining)
+{
+    // milliseconds until the poller should wake up on its own, or -1.
+    gint rv = draining || !g_queue_is_empty(&(io->half_closed)) ?
+        BALDE_SERVER_DRAIN_INTERVAL : -1;
+    if (io->server->timeout > 0) {
+        gint interval = MAX(1, MIN(BALDE_SERVER_TIMEOUT_INTERVAL,
+            io->server->timeout / 4000));
+        rv = rv < 0 ? interval : MIN(rv, interval);
+    }
+    balde_server_connection_t *conn = g_queue_peek_head(&(io->lingering));
+    if (conn != NULL) {
+        gint64 left = conn->linger_deadline - g_get_monotonic_time();
+        gint interval = MAX(1, MIN(BALDE_SERVER_LINGER_TIMEOUT, left / 1000 + 1));
+        rv = rv < 0 ? interval : MIN(rv, interval);
+    }
+    return rv;
+}
+
+
+static gpointer
+balde_server_io_run(balde_server_io_t *io)
+{
+    balde_server_event_t events[BALDE_SERVER_MAX_EVENTS];
+    balde_server_connection_t *conn;
+    gchar buf[64];
+
+    g_private_set(&current_io, io);
+
+    while (!g_atomic_int_get(&(io->stop))) {
+        gboolean draining = g_atomic_int_get(&(io->draining));
+        gint n = balde_server_poller_wait(io, events,
+            balde_server_io_wait_timeout(io, draining));
+        if (n < 0 && errno != EINTR) {
+            g_printerr("server: error: failed to wait for events: %s\n",
+                g_strerror(errno));
+            break;
+        }
+        for (gint i = 0; i < n; i++) {
+            balde_server_handle_type_t *type = events[i].handle;
+            switch (*type) {
+                case BALDE_SERVER_HANDLE_LISTENER:
+                    balde_server_io_accept(io, events[i].handle);
+                    break;
+                case BALDE_SERVER_HANDLE_WAKEUP:
+                    while (read(io->wakeup[0], buf, sizeof(buf)) > 0);
+                    break;
+                case BALDE_SERVER_HANDLE_CONNECTION:
+                    conn = balde_server_connection_ref(events[i].handle);
+                    if (events[i].writable)
+                        balde_server_connection_flush(conn);
+                    if (events[i].readable && !conn->closed)
+                        balde_server_connection_read(conn);
+                    balde_server_connection_unref(conn);
+                    break;
+            }
+        }
+        balde_server_io_close_half_closed(io);
+        balde_server_io_process_pending(io);
+        balde_server_io_linger_expire(io, g_get_monotonic_time());
+        if (io->server->timeout > 0) {
+            gint64 now = g_get_monotonic_time();
+            if (now >= io->next_expire) {
+                balde_server_io_expire(io, now);
+                io->next_expire = now +
+                    balde_server_io_wait_timeout(io, FALSE) * 1000;
+            }
+        }
+        if (draining && balde_server_io_drain(io))
+            break;
+    }
+
+    GList *conns = g_hash_table_get_keys(io->connections);
+    for (GList *l = conns; l != NULL; l = g_list_next(l))
+        balde_server_connection_shutdown(l->data);
+    g_list_free(conns);
+    g_queue_foreach(&(io->lingering), (GFunc) balde_server_connection_unref,
+        NULL);
+    g_queue_clear(&(io->lingering));
+    g_queue_foreach(&(io->half_closed), (GFunc) balde_server_connection_unref,
+        NULL);
+    g_queue_clear(&(io->half_closed));
+
+    g_mutex_lock(&(io->server->mutex));
+    io->server->n_running--;
+    g_cond_broadcast(&(io->server->cond));
+    g_mutex_unlock(&(io->server->mutex));
+    return NULL;
+}
+
+
+/*
+ * Server.
+ */
+
+balde_server_t*
+balde_server_new(const balde_server_protocol_t *protocol, gpointer user_data,
+    guint io_threads)
+{
+    balde_server_t *server = g_new0(balde_server_t, 1);
+    server->protocol = protocol;
+    server->user_data = user_data;
+    server->n_io = io_threads > 0 ? io_threads : 1;
+    server->io = g_new0(balde_server_io_t, server->n_io);
+    g_mutex_init(&(server->mutex));
+    g_cond_init(&(server->cond));
+    for (guint i = 0; i < server->n_io; i++) {
+        server->io[i].type = BALDE_SERVER_HANDLE_WAKEUP;
+        server->io[i].server = server;
+        server->io[i].wakeup[0] = -1;
+        server->io[i].wakeup[1] = -1;
+        g_queue_init(&(server->io[i].lingering));
+        g_queue_init(&(server->io[i].half_closed));
+#ifdef HAVE_SYS_EPOLL_H
+        server->io[i].epoll_fd = -1;
+#endif /* HAVE_SYS_EPOLL_H */
+    }
+    return server;
+}
+
+
+gpointer
+balde_server_get_user_data(balde_server_t *server)
+{
+    return server->user_data;
+}
+
+
+void
+balde_server_set_timeout(balde_server_t *server, gint64 timeout)
+{
+    // in microseconds, 0 disables it. must be set before starting the server.
+    server->timeout = timeout;
+}
+
+
+static void
+balde_server_add_listener(balde_server_t *server, GSocket *socket,
+    const gchar *path)
+{
+    balde_server_listener_t *listener = g_new(balde_server_listener_t, 1);
+    listener->type = BALDE_SERVER_HANDLE_LISTENER;
+    listener->socket = socket;
+    listener->fd = g_socket_get_fd(socket);
+    listener->path = g_strdup(path);
+    g_socket_set_blocking(socket, FALSE);
+    server->listeners = g_slist_append(server->listeners, listener);
+}
+
+
+static gboolean
+balde_server_socket_bind_reuseport(GSocket *socket, GSocketAddress *address,
+    GError **error)
+{
+#ifdef SO_REUSEPORT
+    // g_socket_bind() clears SO_REUSEPORT for TCP sockets.
+    gint fd = g_socket_get_fd(socket);
+    gint one = 1;
+    struct sockaddr_storage addr;
+    if (!g_socket_address_to_native(address, &addr, sizeof(addr), error))
+        return FALSE;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0 ||
+        bind(fd, (struct sockaddr*) &addr,
+            g_socket_address_get_native_size(address)) < 0)
+    {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+            "Failed to bind socket: %s", g_strerror(errno));
+        return FALSE;
+    }
+    return TRUE;
+#else
+    return g_socket_bind(socket, address, TRUE, error);
+#endif /* SO_REUSEPORT */
+}
+
+
+static GSocket*
+balde_server_socket_new_inet(GSocketAddress *address, gboolean reuseport,
+    gboolean listen, GError **error)
+{
+    GSocket *socket = g_socket_new(g_socket_address_get_family(address),
+        G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_TCP, error);
+    if (socket == NULL)
+        return NULL;
+    g_socket_set_listen_backlog(socket, BALDE_SERVER_LISTEN_BACKLOG);
+    if (reuseport) {
+        if (!balde_server_socket_bind_reuseport(socket, address, error))
+            goto point1;
+    }
+    else if (!g_socket_bind(socket, address, TRUE, error)) {
+        goto point1;
+    }
+    if (listen && !g_socket_listen(socket, error))
+        goto point1;
+    return socket;
+
+point1:
+    g_object_unref(socket);
+    return NULL;
+}
+
+
+static GSocketAddress*
+balde_server_address_new_inet(const gchar *host, guint16 port, GError **error)
+{
+    GInetAddress *addr_host = g_inet_address_new_from_string(host);
+    if (addr_host == NULL) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+            "Invalid host address: %s", host);
+        return NULL;
+    }
+    GSocketAddress *rv = g_inet_socket_address_new(addr_host, port);
+    g_object_unref(addr_host);
+    return rv;
+}
+
+
+gboolean
+balde_server_listen_inet(balde_server_t *server, const gchar *host,
+    guint16 port, GError **error)
+{
+    GSocketAddress *address = balde_server_address_new_inet(host, port, error);
+    if (address == NULL)
+        return FALSE;
+    GSocket *socket = balde_server_socket_new_inet(address, FALSE, TRUE, error);
+    g_object_unref(address);
+    if (socket == NULL)
+        return FALSE;
+    balde_server_add_listener(server, socket, NULL);
+    return TRUE;
+}
+
+
+static gboolean
+balde_server_socket_remove_stale(const gchar *path, struct sockaddr_un *addr,
+    GError **error)
+{
+    struct stat st;
+    if (lstat(path, &st) < 0)
+        return TRUE;
+    if (!S_ISSOCK(st.st_mode)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_EXISTS,
+            "File exists and is not a socket: %s", path);
+        return FALSE;
+    }
+
+    // a socket nobody listens to was left behind by a dead process.
+    gint fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+            "Failed to create socket: %s", g_strerror(errno));
+        return FALSE;
+    }
+    gint rv = connect(fd, (struct sockaddr*) addr, sizeof(*addr));
+    gint err = errno;
+    close(fd);
+    if (rv == 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_ADDRESS_IN_USE,
+            "Socket is in use by another process: %s", path);
+        return FALSE;
+    }
+    if (err == ECONNREFUSED && unlink(path) == 0)
+        return TRUE;
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+        "Failed to remove stale socket %s: %s", path, g_strerror(err));
+    return FALSE;
+}
+
+
+static gboolean
+balde_server_socket_set_owner(const gchar *path, const gchar *owner,
+    GError **error)
+{
+    // owner is "USER", "USER:GROUP" or ":GROUP".
+    gchar **pieces = g_strsplit(owner, ":", 2);
+    uid_t uid = -1;
+    gid_t gid = -1;
+    gboolean rv = FALSE;
+    if (pieces[0] != NULL && pieces[0][0] != '\0') {
+        struct passwd *pw = getpwnam(pieces[0]);
+        if (pw == NULL) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                "Invalid socket user: %s", pieces[0]);
+            goto point1;
+        }
+        uid = pw->pw_uid;
+    }
+    if (pieces[0] != NULL && pieces[1] != NULL && pieces[1][0] != '\0') {
+        struct group *gr = getgrnam(pieces[1]);
+        if (gr == NULL) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                "Invalid socket group: %s", pieces[1]);
+            goto point1;
+        }
+        gid = gr->gr_gid;
+    }
+    if (chown(path, uid, gid) < 0) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+            "Failed to change socket owner: %s", g_strerror(errno));
+        goto point1;
+    }
+    rv = TRUE;
+point1:
+    g_strfreev(pieces);
+    return rv;
+}
+
+
+GSocket*
+balde_server_socket_new_unix(const gchar *path, const gchar *mode,
+    const gchar *owner, GError **error)
+{
+    guint64 mode_ = BALDE_SERVER_SOCKET_MODE;
+    if (mode != NULL) {
+        gchar *endptr;
+        mode_ = g_ascii_strtoull(mode, &endptr, 8);
+        if (mode[0] == '\0' || *endptr != '\0' || mode_ > 0777) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                "Invalid socket mode: %s", mode);
+            return NULL;
+        }
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FILENAME_TOO_LONG,
+            "Socket path is too long: %s", path);
+        return NULL;
+    }
+    strcpy(addr.sun_path, path);
+
+    if (!balde_server_socket_remove_stale(path, &addr, error))
+        return NULL;
+
+    gint fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+            "Failed to create socket: %s", g_strerror(errno));
+        return NULL;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+            "Failed to bind socket %s: %s", path, g_strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    // permissions are set before listening, so nobody else can connect.
+    if (chmod(path, mode_) < 0) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+            "Failed to change socket mode: %s", g_strerror(errno));
+        goto point1;
+    }
+    if (owner != NULL && !balde_server_socket_set_owner(path, owner, error))
+        goto point1;
+    if (listen(fd, BALDE_SERVER_LISTEN_BACKLOG) < 0) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+            "Failed to listen on socket %s: %s", path, g_strerror(errno));
+        goto point1;
+    }
+
+    GSocket *rv = g_socket_new_from_fd(fd, error);
+    if (rv != NULL)
+        return rv;
+
+point1:
+    close(fd);
+    unlink(path);
+    return NULL;
+}
+
+
+gboolean
+balde_server_listen_unix(balde_server_t *server, const gchar *path,
+    const gchar *mode, const gchar *owner, GError **error)
+{
+    GSocket *socket = balde_server_socket_new_unix(path, mode, owner, error);
+    if (socket == NULL)
+        return FALSE;
+    balde_server_add_listener(server, socket, path);
+    return TRUE;
+}
+
+
+void
+balde_server_listen_socket(balde_server_t *server, GSocket *socket)
+{
+    balde_server_add_listener(server, g_object_ref(socket), NULL);
+}
+
+
+/*
+ * Endpoints.
+ *
+ * The address a SAPI was asked to listen on, opened once by the process that
+ * parsed the options, before forking workers, and shared by all of them.
+ * With SO_REUSEPORT, each worker also opens a TCP socket of its own, and the
+ * kernel spreads the connections between them.
+ *
+ * The shared socket is the one passed to a new process on reload, with its
+ * file descriptor number in BALDE_LISTEN_FD. It is always listening, so
+ * connections arriving in the meantime wait for the new process.
+ */
+
+static GSocket*
+balde_server_endpoint_inherit(GError **error)
+{
+    const gchar *fd_str = g_getenv(BALDE_SERVER_LISTEN_FD_ENV);
+    if (fd_str == NULL)
+        return NULL;
+    gchar *endptr;
+    gint64 fd = g_ascii_strtoll(fd_str, &endptr, 10);
+    struct stat st;
+    if (fd_str[0] == '\0' || *endptr != '\0' || fd < 0 || fd > G_MAXINT ||
+        fstat(fd, &st) < 0 || !S_ISSOCK(st.st_mode))
+    {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+            "Invalid inherited socket: %s", fd_str);
+        return NULL;
+    }
+
+    // the socket is ours now, and must not leak to other processes.
+    g_unsetenv(BALDE_SERVER_LISTEN_FD_ENV);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    GSocket *rv = g_socket_new_from_fd(fd, error);
+    if (rv != NULL && !g_socket_listen(rv, error)) {
+        g_object_unref(rv);
+        return NULL;
+    }
+    return rv;
+}
+
+
+balde_server_endpoint_t*
+balde_server_endpoint_new(const gchar *host, guint16 port, const gchar *path,
+    const gchar *mode, const gchar *owner, gboolean reuseport, GError **error)
+{
+#ifndef SO_REUSEPORT
+    reuseport = FALSE;
+#endif /* SO_REUSEPORT */
+
+    balde_server_endpoint_t *endpoint = g_new0(balde_server_endpoint_t, 1);
+    GError *tmp_error = NULL;
+    endpoint->socket = balde_server_endpoint_inherit(&tmp_error);
+    if (tmp_error != NULL) {
+        g_propagate_error(error, tmp_error);
+        goto point1;
+    }
+    if (endpoint->socket != NULL) {
+        g_printerr(" * Using inherited socket, instead of the configured "
+            "address\n");
+        endpoint->path = g_strdup(path);
+#ifdef SO_REUSEPORT
+        // a socket without SO_REUSEPORT can't be shared with new sockets.
+        gint value = 0;
+        socklen_t len = sizeof(value);
+        if (reuseport && getsockopt(g_socket_get_fd(endpoint->socket),
+                SOL_SOCKET, SO_REUSEPORT, &value, &len) == 0 && value)
+        {
+            endpoint->address = g_socket_get_local_address(endpoint->socket,
+                error);
+            if (endpoint->address == NULL)
+                goto point1;
+        }
+#endif /* SO_REUSEPORT */
+        return endpoint;
+    }
+
+    if (path != NULL) {
+        endpoint->socket = balde_server_socket_new_unix(path, mode, owner,
+            error);
+        if (endpoint->socket == NULL)
+            goto point1;
+        endpoint->path = g_strdup(path);
+        return endpoint;
+    }
+
+    GSocketAddress *address = balde_server_address_new_inet(host, port, error);
+    if (address == NULL)
+        goto point1;
+    endpoint->socket = balde_server_socket_new_inet(address, reuseport, TRUE,
+        error);
+    g_object_unref(address);
+    if (endpoint->socket == NULL)
+        goto point1;
+    if (reuseport) {
+        // the real address, in case an ephemeral port was requested.
+        endpoint->address = g_socket_get_local_address(endpoint->socket, error);
+        if (endpoint->address == NULL)
+            goto point1;
+    }
+    return endpoint;
+
+point1:
+    balde_server_endpoint_free(endpoint);
+    return NULL;
+}
+
+
+GSList*
+balde_server_endpoint_get_sockets(balde_server_endpoint_t *endpoint,
+    GError **error)
+{
+    GSList *rv = g_slist_append(NULL, g_object_ref(endpoint->socket));
+    if (endpoint->address == NULL)
+        return rv;
+    GSocket *socket = balde_server_socket_new_inet(endpoint->address, TRUE,
+        TRUE, error);
+    if (socket == NULL) {
+        g_slist_free_full(rv, g_object_unref);
+        return NULL;
+    }
+    return g_slist_append(rv, socket);
+}
+
+
+gint
+balde_server_endpoint_get_fd(balde_server_endpoint_t *endpoint)
+{
+    return g_socket_get_fd(endpoint->socket);
+}
+
+
+void
+balde_server_endpoint_release(balde_server_endpoint_t *endpoint)
+{
+    // the socket was passed to another process, that removes it when done.
+    g_free(endpoint->path);
+    endpoint->path = NULL;
+}
+
+
+void
+balde_server_endpoint_free(balde_server_endpoint_t *endpoint)
+{
+    if (endpoint == NULL)
+        return;
+    if (endpoint->socket != NULL) {
+        g_socket_close(endpoint->socket, NULL);
+        g_object_unref(endpoint->socket);
+        if (endpoint->path != NULL)
+            unlink(endpoint->path);
+    }
+    if (endpoint->address != NULL)
+        g_object_unref(endpoint->address);
+    g_free(endpoint->path);
+    g_free(endpoint);
+}
+
+
+gboolean
+balde_server_start(balde_server_t *server, GError **error)
+{
+    g_return_val_if_fail(!server->started, FALSE);
+
+    for (guint i = 0; i < server->n_io; i++) {
+        balde_server_io_t *io = &(server->io[i]);
+        if (!balde_server_poller_init(io, error))
+            return FALSE;
+        if (!g_unix_open_pipe(io->wakeup, FD_CLOEXEC, error))
+            return FALSE;
+        g_unix_set_fd_nonblocking(io->wakeup[0], TRUE, NULL);
+        g_unix_set_fd_nonblocking(io->wakeup[1], TRUE, NULL);
+        io->incoming = g_async_queue_new();
+        io->pending = g_async_queue_new();
+        io->connections = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+            (GDestroyNotify) balde_server_connection_unref, NULL);
+        balde_server_poller_add(io, io->wakeup[0], io, FALSE);
+        for (GSList *l = server->listeners; l != NULL; l = g_slist_next(l)) {
+            balde_server_listener_t *listener = l->data;
+            balde_server_poller_add(io, listener->fd, listener, TRUE);
+        }
+    }
+
+    server->started = TRUE;
+    server->n_running = server->n_io;
+    for (guint i = 0; i < server->n_io; i++)
+        server->io[i].thread = g_thread_new("balde-io",
+            (GThreadFunc) balde_server_io_run, &(server->io[i]));
+    return TRUE;
+}
+
+
+void
+balde_server_wait(balde_server_t *server)
+{
+    if (!server->started)
+        return;
+    for (guint i = 0; i < server->n_io; i++) {
+        if (server->io[i].thread != NULL)
+            g_thread_join(server->io[i].thread);
+        server->io[i].thread = NULL;
+    }
+    server->started = FALSE;
+}
+
+
+void
+balde_server_stop(balde_server_t *server)
+{
+    if (!server->started)
+        return;
+    for (guint i = 0; i < server->n_io; i++) {
+        g_atomic_int_set(&(server->io[i].stop), 1);
+        balde_server_io_wakeup(&(server->io[i]));
+    }
+    balde_server_wait(server);
+}
+
+
+void
+balde_server_drain(balde_server_t *server, gint64 timeout)
+{
+    if (!server->started)
+        return;
+    gint64 deadline = g_get_monotonic_time() + timeout;
+    for (guint i = 0; i < server->n_io; i++) {
+        g_atomic_int_set(&(server->io[i].draining), 1);
+        balde_server_io_wakeup(&(server->io[i]));
+    }
+
+    gboolean released = TRUE;
+    g_mutex_lock(&(server->mutex));
+    while (released && server->n_released < server->n_io)
+        released = g_cond_wait_until(&(server->cond), &(server->mutex), deadline);
+    g_mutex_unlock(&(server->mutex));
+    if (!released)
+        goto point1;
+
+    // connections waiting in the backlog would be reset when the listeners
+    // are closed. with SO_REUSEPORT, closing them is what makes the kernel
+    // stop sending connections our way.
+    for (GSList *l = server->listeners; l != NULL; l = g_slist_next(l)) {
+        balde_server_listener_t *listener = l->data;
+        gint fd;
+        while ((fd = accept(listener->fd, NULL, NULL)) >= 0 || errno == EINTR)
+            if (fd >= 0)
+                balde_server_add_connection(server, fd);
+        g_socket_close(listener->socket, NULL);
+    }
+    g_atomic_int_set(&(server->listeners_closed), 1);
+    for (guint i = 0; i < server->n_io; i++)
+        balde_server_io_wakeup(&(server->io[i]));
+
+    g_mutex_lock(&(server->mutex));
+    while (server->n_running > 0)
+        if (!g_cond_wait_until(&(server->cond), &(server->mutex), deadline))
+            break;
+    g_mutex_unlock(&(server->mutex));
+
+point1:
+
+    // whatever is still running past the deadline is dropped.
+    balde_server_stop(server);
+}
+
+
+void
+balde_server_add_connection(balde_server_t *server, gint fd)
+{
+    // connections are distributed to the I/O threads in round-robin.
+    balde_server_io_t *io = &(server->io[server->next_io++ % server->n_io]);
+    balde_server_connection_t *conn = balde_server_connection_new(server, fd);
+    g_async_queue_push(io->incoming, conn);
+    balde_server_io_wakeup(io);
+}
+
+
+void
+balde_server_free(balde_server_t *server)
+{
+    if (server == NULL)
+        return;
+    balde_server_stop(server);
+    for (guint i = 0; i < server->n_io; i++) {
+        balde_server_io_t *io = &(server->io[i]);
+        balde_server_poller_clear(io);
+        if (io->wakeup[0] >= 0)
+            close(io->wakeup[0]);
+        if (io->wakeup[1] >= 0)
+            close(io->wakeup[1]);
+        if (io->incoming != NULL) {
+            balde_server_connection_t *conn;
+            while ((conn = g_async_queue_try_pop(io->incoming)) != NULL) {
+                close(conn->fd);
+                balde_server_connection_unref(conn);
+            }
+            g_async_queue_unref(io->incoming);
+        }
+        if (io->pending != NULL) {
+            balde_server_connection_t *conn;
+            while ((conn = g_async_queue_try_pop(io->pending)) != NULL)
+                balde_server_connection_unref(conn);
+            g_async_queue_unref(io->pending);
+        }
+        if (io->connections != NULL)
+            g_hash_table_destroy(io->connections);
+    }
+    g_free(server->io);
+    for (GSList *l = server->listeners; l != NULL; l = g_slist_next(l)) {
+        balde_server_listener_t *listener = l->data;
+        g_socket_close(listener->socket, NULL);
+        g_object_unref(listener->socket);
+        if (listener->path != NULL)
+            unlink(listener->path);
+        g_free(listener->path);
+        g_free(listener);
+    }
+    g_slist_free(server->listeners);
+    g_mutex_clear(&(server->mutex));
+    g_cond_clear(&(server->cond));
+    g_free(server);
+}
@@ -0,0 +1,144 @@
+/*
+ * balde: A microframework for C based on GLib and bad intentions.
+ * Copyright (C) 2013-2017 Rafael G. Martins <rafael@rafaelmartins.eng.br>
+ *
+ * This program can be distributed under the terms of the LGPL-2 License.
+ * See the file COPYING.
+ */
+
+#ifndef _BALDE_SAPI_SERVER_PRIVATE_H
+#define _BALDE_SAPI_SERVER_PRIVATE_H
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#define BALDE_SERVER_READ_SIZE 16384
+#define BALDE_SERVER_MAX_EVENTS 64
+#define BALDE_SERVER_MAX_ACCEPTS 64
+#define BALDE_SERVER_MAX_IOV 64
+#define BALDE_SERVER_MAX_QUEUED (256 * 1024)
+#define BALDE_SERVER_SOCKET_MODE 0660
+#define BALDE_SERVER_DRAIN_INTERVAL 100
+#define BALDE_SERVER_LISTEN_FD_ENV "BALDE_LISTEN_FD"
+
+typedef struct _balde_server_t balde_server_t;
+typedef struct _balde_server_io_t balde_server_io_t;
+typedef struct _balde_server_connection_t balde_server_connection_t;
+typedef struct _balde_server_endpoint_t balde_server_endpoint_t;
+
+typedef struct {
+    guint8 *data;
+    gsize start;
+    gsize end;
+    gsize size;
+} balde_server_buffer_t;
+
+typedef enum {
+    BALDE_SERVER_HANDLE_LISTENER = 1,
+    BALDE_SERVER_HANDLE_WAKEUP,
+    BALDE_SERVER_HANDLE_CONNECTION,
+} balde_server_handle_type_t;
+
+typedef struct {
+
+    // called from the I/O thread when a connection is accepted. returns the
+    // protocol state of the connection, stored in conn->data.
+    gpointer (*connection_new) (balde_server_connection_t *conn);
+
+    // called from the I/O thread when new data is available in conn->input,
+    // between input.start and input.end. the protocol should consume what it
+    // can, advancing input.start, and return FALSE to drop the connection.
+    gboolean (*read) (balde_server_connection_t *conn);
+
+    // called from whatever thread releases the last connection reference.
+    void (*connection_free) (gpointer data);
+
+    // called from the I/O thread while the server drains. returns TRUE if
+    // the connection has no requests in progress, and can be closed.
+    gboolean (*idle) (balde_server_connection_t *conn);
+
+    // called from the I/O thread when the peer is done sending, after the
+    // unread input is discarded. the protocol should drop the request being
+    // received, if any, and the connection is closed once idle. without it,
+    // the connection is closed right away.
+    void (*eof) (balde_server_connection_t *conn);
+
+    // called from the I/O thread when the connection made no progress for
+    // longer than the server timeout. returns TRUE if the protocol waits for
+    // data from the peer (and not for the application), so the connection
+    // can be closed.
+    gboolean (*waiting) (balde_server_connection_t *conn);
+
+} balde_server_protocol_t;
+
+struct _balde_server_connection_t {
+    balde_server_handle_type_t type;
+    gint ref_count;
+    gint fd;
+    balde_server_t *server;
+    balde_server_io_t *io;
+    balde_server_buffer_t input;
+    gpointer data;
+    gint64 last_active;  // only used by the I/O thread
+    gboolean eof;        // ditto, the peer is done sending
+
+    // closed for writing, discarding the input until the peer is done. only
+    // used by the I/O thread.
+    gboolean lingering;
+    gint64 linger_deadline;
+    gsize lingered;
+
+    // everything below is protected by the mutex, because responses are
+    // written by application threads. output holds the chunks already
+    // committed to the wire, streams holds the chunks still waiting for their
+    // turn.
+    GMutex mutex;
+    GCond drained;
+    GQueue output;
+    GQueue streams;
+    gsize output_offset;
+    gsize queued;
+    gboolean closing;
+    gboolean closed;
+    gboolean scheduled;
+    gboolean writing;
+};
+
+balde_server_t* balde_server_new(const balde_server_protocol_t *protocol,
+    gpointer user_data, guint io_threads);
+gpointer balde_server_get_user_data(balde_server_t *server);
+void balde_server_set_timeout(balde_server_t *server, gint64 timeout);
+GSocket* balde_server_socket_new_unix(const gchar *path, const gchar *mode,
+    const gchar *owner, GError **error);
+gboolean balde_server_listen_inet(balde_server_t *server, const gchar *host,
+    guint16 port, GError **error);
+gboolean balde_server_listen_unix(balde_server_t *server, const gchar *path,
+    const gchar *mode, const gchar *owner, GError **error);
+void balde_server_listen_socket(balde_server_t *server, GSocket *socket);
+balde_server_endpoint_t* balde_server_endpoint_new(const gchar *host,
+    guint16 port, const gchar *path, const gchar *mode, const gchar *owner,
+    gboolean reuseport, GError **error);
+GSList* balde_server_endpoint_get_sockets(balde_server_endpoint_t *endpoint,
+    GError **error);
+gint balde_server_endpoint_get_fd(balde_server_endpoint_t *endpoint);
+void balde_server_endpoint_release(balde_server_endpoint_t *endpoint);
+void balde_server_endpoint_free(balde_server_endpoint_t *endpoint);
+gboolean balde_server_start(balde_server_t *server, GError **error);
+void balde_server_wait(balde_server_t *server);
+void balde_server_drain(balde_server_t *server, gint64 timeout);
+void balde_server_stop(balde_server_t *server);
+void balde_server_free(balde_server_t *server);
+void balde_server_add_connection(balde_server_t *server, gint fd);
+balde_server_connection_t* balde_server_connection_ref(
+    balde_server_connection_t *conn);
+void balde_server_connection_unref(balde_server_connection_t *conn);
+void balde_server_connection_write(balde_server_connection_t *conn,
+    GBytes *data);
+void balde_server_connection_write_stream(balde_server_connection_t *conn,
+    guint stream_id, GBytes *data);
+void balde_server_connection_writev_stream(balde_server_connection_t *conn,
+    guint stream_id, GBytes **data, guint n_data);
+gboolean balde_server_connection_wait_writable(balde_server_connection_t *conn);
+void balde_server_connection_close(balde_server_connection_t *conn);
+
+#endif /* _BALDE_SAPI_SERVER_PRIVATE_H */
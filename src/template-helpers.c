@@ -26,3 +26,14 @@ balde_tmpl_url_for(balde_app_t *app, balde_request_t *request,
     va_end(params);
     return rv;
 }
+
+
+BALDE_API void
+balde_tmpl_url_for_append(GString *str, balde_app_t *app,
+    balde_request_t *request, const gchar *endpoint, gboolean external, ...)
+{
+    va_list params;
+    va_start(params, external);
+    balde_app_url_for_appendv(str, app, request, endpoint, params);
+    va_end(params);
+}
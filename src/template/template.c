@@ -17,6 +17,24 @@
 #include "parser.h"
 
 
+// helpers that have a balde_tmpl_<name>_append() variant, that writes to the
+// template string directly instead of returning a newly allocated string.
+static const gchar *append_helpers[] = {
+    "url_for",
+    NULL,
+};
+
+
+static gboolean
+balde_template_is_append_helper(const gchar *name)
+{
+    for (guint i = 0; append_helpers[i] != NULL; i++)
+        if (0 == g_strcmp0(append_helpers[i], name))
+            return TRUE;
+    return FALSE;
+}
+
+
 void
 balde_template_build_state(const gchar *filename, balde_template_state_t **state)
 {
@@ -37,6 +55,9 @@ balde_template_build_state(const gchar *filename, balde_template_state_t **state
     g_free(template_source);
 
     gchar *tmp_str;
+    gchar *fn_call_end;
+    gboolean append;
+    balde_template_print_fn_call_block_t *fn_call;
 
     for (GList *tmp = blocks; tmp != NULL; tmp = g_list_next(tmp)) {
         balde_template_block_t *node = tmp->data;
@@ -82,20 +103,27 @@ balde_template_build_state(const gchar *filename, balde_template_state_t **state
                 g_string_append_printf((*state)->body, "%*s}\n", (*state)->indent, "");
                 break;
             case BALDE_TEMPLATE_PRINT_FN_CALL_BLOCK:
-                (*state)->declare_tmp = TRUE;
-                g_string_append_printf((*state)->body,
-                    "%*stmp = balde_tmpl_%s(app, request", (*state)->indent,
-                    "", ((balde_template_print_fn_call_block_t*) node->block)->name);
-                if (((balde_template_print_fn_call_block_t*) node->block)->args != NULL)
-                    g_string_append((*state)->body, ", ");
-                else
+                fn_call = node->block;
+                append = balde_template_is_append_helper(fn_call->name);
+                if (append) {
+                    g_string_append_printf((*state)->body,
+                        "%*sbalde_tmpl_%s_append(rv, app, request", (*state)->indent,
+                        "", fn_call->name);
+                    fn_call_end = g_strdup(");\n");
+                }
+                else {
+                    (*state)->declare_tmp = TRUE;
                     g_string_append_printf((*state)->body,
+                        "%*stmp = balde_tmpl_%s(app, request", (*state)->indent,
+                        "", fn_call->name);
+                    fn_call_end = g_strdup_printf(
                         ");\n"
                         "%*sg_string_append(rv, tmp);\n"
                         "%*sg_free(tmp);\n", (*state)->indent, "",
                         (*state)->indent, "");
-                for (GSList *tmp2 = ((balde_template_print_fn_call_block_t*) node->block)->args;
-                        tmp2 != NULL; tmp2 = g_slist_next(tmp2)) {
+                }
+                for (GSList *tmp2 = fn_call->args; tmp2 != NULL; tmp2 = g_slist_next(tmp2)) {
+                    g_string_append((*state)->body, ", ");
                     switch (((balde_template_fn_arg_t*) tmp2->data)->type) {
                         case BALDE_TEMPLATE_FN_ARG_STRING:
                         case BALDE_TEMPLATE_FN_ARG_INT:
@@ -111,15 +139,9 @@ balde_template_build_state(const gchar *filename, balde_template_state_t **state
                                 ((balde_template_fn_arg_t*) tmp2->data)->content);
                             break;
                     }
-                    if (g_slist_next(tmp2) == NULL)
-                        g_string_append_printf((*state)->body,
-                            ");\n"
-                            "%*sg_string_append(rv, tmp);\n"
-                            "%*sg_free(tmp);\n", (*state)->indent, "",
-                            (*state)->indent, "");
-                    else
-                        g_string_append((*state)->body, ", ");
                 }
+                g_string_append((*state)->body, fn_call_end);
+                g_free(fn_call_end);
                 break;
         }
     }
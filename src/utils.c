@@ -21,43 +21,93 @@
  * a URL-safe way.
  */
 
+static const gchar base64_alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+// the standard alphabet ('+' and '/') is accepted when decoding as well. like
+// in GLib, '=' is a zero sextet.
+static const gint8 base64_values[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, 62, -1, 63,
+    52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1,  0, -1, -1,
+    -1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+    15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, 63,
+    -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+    41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+
 gchar*
 balde_base64_encode(const guchar *data, gsize len)
 {
-    GRegex *re_plus = g_regex_new("\\+", 0, 0, NULL);
-    GRegex *re_slash = g_regex_new("/", 0, 0, NULL);
-    gchar *raw = g_base64_encode(data, len);
-    gchar *escaped_plus = g_regex_replace_literal(re_plus, raw, -1, 0,
-        "-", 0, NULL);
-    g_free(raw);
-    gchar *escaped_slash = g_regex_replace_literal(re_slash, escaped_plus,
-        -1, 0, "_", 0, NULL);
-    g_free(escaped_plus);
-    g_regex_unref(re_slash);
-    g_regex_unref(re_plus);
-    return escaped_slash;
+    gchar *rv = g_new(gchar, ((len + 2) / 3) * 4 + 1);
+    gchar *out = rv;
+    gsize i = 0;
+    for (; i + 2 < len; i += 3) {
+        guint32 v = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+        *out++ = base64_alphabet[(v >> 18) & 0x3f];
+        *out++ = base64_alphabet[(v >> 12) & 0x3f];
+        *out++ = base64_alphabet[(v >> 6) & 0x3f];
+        *out++ = base64_alphabet[v & 0x3f];
+    }
+    if (i < len) {
+        guint32 v = data[i] << 16;
+        if (i + 1 < len)
+            v |= data[i + 1] << 8;
+        *out++ = base64_alphabet[(v >> 18) & 0x3f];
+        *out++ = base64_alphabet[(v >> 12) & 0x3f];
+        *out++ = i + 1 < len ? base64_alphabet[(v >> 6) & 0x3f] : '=';
+        *out++ = '=';
+    }
+    *out = '\0';
+    return rv;
 }
 
 
 guchar*
 balde_base64_decode(const gchar *text, gsize *out_len)
 {
-    GRegex *re_dash = g_regex_new("\\-", 0, 0, NULL);
-    GRegex *re_underscore = g_regex_new("_", 0, 0, NULL);
-    gchar *unescaped_dash = g_regex_replace_literal(re_dash, text, -1, 0, "+",
-        0, NULL);
-    gchar *unescaped_underscore = g_regex_replace_literal(re_underscore,
-        unescaped_dash, -1, 0, "/", 0, NULL);
-    g_free(unescaped_dash);
-    guchar *raw = g_base64_decode(unescaped_underscore, out_len);
-    g_free(unescaped_underscore);
-    g_regex_unref(re_underscore);
-    g_regex_unref(re_dash);
-    return raw;
+    // like g_base64_decode(), unknown characters are skipped, an incomplete
+    // trailing group is dropped, and the result is always NUL-terminated.
+    gsize len = strlen(text);
+    guchar *rv = g_new(guchar, (len / 4) * 3 + 1);
+    guchar *out = rv;
+    guint32 v = 0;
+    guint n = 0;
+    gchar last[2] = {0, 0};
+    for (gsize i = 0; i < len; i++) {
+        gint8 c = base64_values[(guchar) text[i]];
+        if (c < 0)
+            continue;
+        last[1] = last[0];
+        last[0] = text[i];
+        v = (v << 6) | c;
+        if (++n == 4) {
+            // padding in the last two places of a group takes bytes out.
+            *out++ = (v >> 16) & 0xff;
+            if (last[1] != '=')
+                *out++ = (v >> 8) & 0xff;
+            if (last[0] != '=')
+                *out++ = v & 0xff;
+            v = 0;
+            n = 0;
+        }
+    }
+    *out = '\0';
+    *out_len = out - rv;
+    return rv;
 }
 
 
-
 /*
  * The following functions are provided to handle timestamps used to sign
  * cookies.
@@ -11,6 +11,7 @@
 #endif /* HAVE_CONFIG_H */
 
 #include <glib.h>
+#include <string.h>
 #include "../src/balde.h"
 #include "../src/app.h"
 #include "../src/requests.h"
@@ -207,6 +208,36 @@ test_app_add_url_rule(void)
 }
 
 
+void
+test_app_add_url_rule_with_empty_choices(void)
+{
+    const gchar *rules[] = {"/<any():page>/", "/<any(about, ):page>/", NULL};
+    for (guint j = 0; rules[j] != NULL; j++) {
+        balde_app_t *app = balde_app_init();
+        balde_app_add_url_rule(app, "arcoiro", rules[j], BALDE_HTTP_GET,
+            arcoiro_view);
+        g_assert(app->error != NULL);
+        g_assert_cmpint(app->error->code, ==, 500);
+        g_assert(g_slist_length(app->priv->views) == 1);
+        balde_app_free(app);
+    }
+}
+
+
+void
+test_app_add_url_rule_with_too_many_variables(void)
+{
+    balde_app_t *app = balde_app_init();
+    balde_app_add_url_rule(app, "arcoiro",
+        "/<a>/<b>/<c>/<d>/<e>/<f>/<g>/<h>/<i>/<j>/<k>/<l>/<m>/<n>/<o>/<p>/<q>/",
+        BALDE_HTTP_GET, arcoiro_view);
+    g_assert(app->error != NULL);
+    g_assert_cmpint(app->error->code, ==, 500);
+    g_assert(g_slist_length(app->priv->views) == 1);
+    balde_app_free(app);
+}
+
+
 void
 arcoiro_hook(balde_app_t *app, balde_request_t *req)
 {
@@ -232,6 +263,211 @@ test_app_add_before_request(void)
 }
 
 
+void
+test_app_freeze(void)
+{
+    balde_app_t *app = balde_app_init();
+    balde_app_add_before_request(app, arcoiro_hook);
+    g_assert(!app->priv->frozen);
+    g_assert(app->priv->before_request_funcs == NULL);
+    balde_app_freeze(app);
+    g_assert(app->priv->frozen);
+    g_assert(app->priv->before_request_funcs != NULL);
+    g_assert(app->priv->before_request_funcs[0] == arcoiro_hook);
+    g_assert(app->priv->before_request_funcs[1] == NULL);
+    balde_before_request_func_t *funcs = app->priv->before_request_funcs;
+    balde_app_freeze(app);
+    g_assert(app->priv->before_request_funcs == funcs);
+    balde_app_free(app);
+}
+
+
+static gpointer
+freeze_thread(balde_app_t *app)
+{
+    balde_app_freeze(app);
+    return app->priv->before_request_funcs;
+}
+
+
+void
+test_app_freeze_threads(void)
+{
+    // the first requests of an application not frozen yet may race to
+    // freeze it.
+    balde_app_t *app = balde_app_init();
+    balde_app_add_before_request(app, arcoiro_hook);
+    GThread *threads[8];
+    for (guint i = 0; i < G_N_ELEMENTS(threads); i++)
+        threads[i] = g_thread_new(NULL, (GThreadFunc) freeze_thread, app);
+    for (guint i = 0; i < G_N_ELEMENTS(threads); i++) {
+        balde_before_request_func_t *funcs = g_thread_join(threads[i]);
+        g_assert(funcs == app->priv->before_request_funcs);
+        g_assert(funcs[0] == arcoiro_hook);
+        g_assert(funcs[1] == NULL);
+    }
+    g_assert(app->priv->frozen);
+    balde_app_free(app);
+}
+
+
+void
+test_app_admission(void)
+{
+    balde_app_t *app = balde_app_init();
+    g_assert(balde_app_admission_enter(app, 2));
+    g_assert(balde_app_admission_enter(app, 2));
+    g_assert(!balde_app_admission_enter(app, 2));
+    g_assert_cmpint(balde_app_get_queued_requests(app), ==, 2);
+    g_assert_cmpint(balde_app_get_shed_requests(app), ==, 1);
+    g_assert(balde_app_admission_leave(app, 0));
+    g_assert(balde_app_admission_leave(app,
+        balde_app_admission_deadline(G_USEC_PER_SEC)));
+    g_assert_cmpint(balde_app_get_queued_requests(app), ==, 0);
+
+    // unbounded, and past the deadline.
+    for (guint i = 0; i < 10; i++)
+        g_assert(balde_app_admission_enter(app, 0));
+    g_assert(!balde_app_admission_leave(app, g_get_monotonic_time() - 1));
+    g_assert_cmpint(balde_app_get_queued_requests(app), ==, 9);
+    g_assert_cmpint(balde_app_get_shed_requests(app), ==, 2);
+    g_assert_cmpint(balde_app_admission_deadline(0), ==, 0);
+    balde_app_free(app);
+}
+
+
+void
+arcoiro_abort_hook(balde_app_t *app, balde_request_t *req)
+{
+    g_assert(app->copy);
+    balde_abort_set_error(app, 403);
+}
+
+
+void
+test_app_main_loop_before_request(void)
+{
+    balde_app_t *app = balde_app_init();
+    balde_app_add_url_rule(app, "arcoiro", "/arcoiro/", BALDE_HTTP_GET,
+        arcoiro_view);
+    balde_app_add_before_request(app, arcoiro_abort_hook);
+    balde_request_env_t *env = g_new(balde_request_env_t, 1);
+    env->script_name = NULL;
+    env->path_info = g_strdup("/arcoiro/");
+    env->server_name = NULL;
+    env->request_method = g_strdup("GET");
+    env->query_string = NULL;
+    env->headers = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    env->body = NULL;
+    env->https = FALSE;
+    env->storage = NULL;
+    env->cancellable = NULL;
+    balde_http_exception_code_t status_code = 0;
+    i = 0;
+    GString *rv = balde_app_main_loop(app, env, balde_response_render,
+        &status_code);
+    g_assert(rv != NULL);
+    g_string_free(rv, TRUE);
+    g_assert_cmpint(status_code, ==, 403);
+    g_assert(i == 0);
+    g_assert(app->priv->frozen);
+    g_assert(app->error == NULL);
+    balde_app_free(app);
+}
+
+
+gboolean
+stream_func(balde_app_t *app, balde_request_t *req, balde_response_t *resp,
+    gpointer user_data)
+{
+    gint *count = user_data;
+    gchar *chunk = g_strdup_printf("chunk%d,", (*count)++);
+    balde_response_append_body(resp, chunk);
+    g_free(chunk);
+    return *count < 3;
+}
+
+
+balde_response_t*
+stream_view(balde_app_t *app, balde_request_t *req)
+{
+    balde_response_t *resp = balde_make_response("start,");
+    balde_response_set_stream(resp, stream_func, g_new0(gint, 1), g_free);
+    return resp;
+}
+
+
+gboolean
+stream_writer(GBytes *data, gpointer user_data)
+{
+    GPtrArray *chunks = user_data;
+    gsize len;
+    const gchar *str = g_bytes_get_data(data, &len);
+    g_ptr_array_add(chunks, g_strndup(str, len));
+    g_bytes_unref(data);
+    return TRUE;
+}
+
+
+balde_request_env_t*
+stream_env(void)
+{
+    balde_request_env_t *env = g_new(balde_request_env_t, 1);
+    env->script_name = NULL;
+    env->path_info = g_strdup("/stream/");
+    env->server_name = NULL;
+    env->request_method = g_strdup("GET");
+    env->query_string = NULL;
+    env->headers = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    env->body = NULL;
+    env->https = FALSE;
+    env->storage = NULL;
+    env->cancellable = NULL;
+    return env;
+}
+
+
+void
+test_app_main_loop_stream(void)
+{
+    balde_app_t *app = balde_app_init();
+    balde_app_add_url_rule(app, "stream", "/stream/", BALDE_HTTP_GET,
+        stream_view);
+    GPtrArray *chunks = g_ptr_array_new_with_free_func(g_free);
+    balde_http_exception_code_t status_code = 0;
+    GString *rv = balde_app_main_loop_stream(app, stream_env(),
+        balde_response_render, stream_writer, chunks, &status_code);
+    g_assert(rv != NULL);
+    g_assert_cmpint(rv->len, ==, 0);
+    g_string_free(rv, TRUE);
+    g_assert_cmpint(status_code, ==, 200);
+    g_assert_cmpint(chunks->len, ==, 4);
+    g_assert(strstr(g_ptr_array_index(chunks, 0), "Content-Length") == NULL);
+    g_assert(g_str_has_suffix(g_ptr_array_index(chunks, 0), "\r\n\r\nstart,"));
+    g_assert_cmpstr(g_ptr_array_index(chunks, 1), ==, "chunk0,");
+    g_assert_cmpstr(g_ptr_array_index(chunks, 2), ==, "chunk1,");
+    g_assert_cmpstr(g_ptr_array_index(chunks, 3), ==, "chunk2,");
+    g_ptr_array_free(chunks, TRUE);
+    balde_app_free(app);
+}
+
+
+void
+test_app_main_loop_stream_unsupported(void)
+{
+    balde_app_t *app = balde_app_init();
+    balde_app_add_url_rule(app, "stream", "/stream/", BALDE_HTTP_GET,
+        stream_view);
+    GString *rv = balde_app_main_loop(app, stream_env(), balde_response_render,
+        NULL);
+    g_assert(rv != NULL);
+    g_assert(strstr(rv->str, "Content-Length: 27\r\n") != NULL);
+    g_assert(g_str_has_suffix(rv->str, "\r\n\r\nstart,chunk0,chunk1,chunk2,"));
+    g_string_free(rv, TRUE);
+    balde_app_free(app);
+}
+
+
 void
 test_app_get_view_from_endpoint(void)
 {
@@ -270,6 +506,22 @@ test_app_get_view_from_endpoint_not_found(void)
 }
 
 
+void
+test_app_get_view_from_endpoint_duplicated(void)
+{
+    balde_app_t *app = balde_app_init();
+    balde_app_add_url_rule(app, "arcoiro", "/arcoiro/", BALDE_HTTP_GET,
+        arcoiro_view);
+    balde_app_add_url_rule(app, "arcoiro", "/arcoiro2/", BALDE_HTTP_POST,
+        arcoiro_view);
+    balde_view_t *view = balde_app_get_view_from_endpoint(app, "arcoiro");
+    g_assert(view != NULL);
+    g_assert_cmpstr(view->url_rule->rule, ==, "/arcoiro/");
+    g_assert(balde_app_get_view_from_endpoint(app, NULL) == NULL);
+    balde_app_free(app);
+}
+
+
 void
 test_app_url_for(void)
 {
@@ -331,6 +583,33 @@ test_app_url_for_with_script_name(void)
 }
 
 
+void
+test_app_url_for_append(void)
+{
+    g_setenv("PATH_INFO", "/", TRUE);
+    g_setenv("REQUEST_METHOD", "GET", TRUE);
+    g_setenv("SCRIPT_NAME", "/foo bar", TRUE);
+    balde_app_t *app = balde_app_init();
+    balde_request_t *request = balde_make_request(app, balde_sapi_cgi_parse_request(app));
+    balde_app_add_url_rule(app, "arcoiro", "/arco iro/<bola>/<guda>/",
+        BALDE_HTTP_GET, arcoiro_view);
+    GString *str = g_string_new("<a href=\"");
+    g_assert(balde_app_url_for_append(str, app, request, "arcoiro", FALSE,
+        "chu\"nda", "gu/to"));
+    g_assert_cmpstr(str->str, ==,
+        "<a href=\"/foo%20bar/arco%20iro/chu%22nda/gu/to/");
+    g_assert(!balde_app_url_for_append(str, app, request, "bola", FALSE));
+    g_assert_cmpstr(str->str, ==,
+        "<a href=\"/foo%20bar/arco%20iro/chu%22nda/gu/to/");
+    g_string_free(str, TRUE);
+    balde_request_free(request);
+    balde_app_free(app);
+    g_unsetenv("SCRIPT_NAME");
+    g_unsetenv("REQUEST_METHOD");
+    g_unsetenv("PATH_INFO");
+}
+
+
 int
 main(int argc, char** argv)
 {
@@ -351,14 +630,29 @@ main(int argc, char** argv)
         test_app_set_user_data_with_destroyer);
     g_test_add_func("/app/free_user_data", test_app_free_user_data);
     g_test_add_func("/app/add_url_rule", test_app_add_url_rule);
+    g_test_add_func("/app/add_url_rule_with_too_many_variables",
+        test_app_add_url_rule_with_too_many_variables);
+    g_test_add_func("/app/add_url_rule_with_empty_choices",
+        test_app_add_url_rule_with_empty_choices);
     g_test_add_func("/app/add_before_request",
         test_app_add_before_request);
+    g_test_add_func("/app/freeze", test_app_freeze);
+    g_test_add_func("/app/freeze_threads", test_app_freeze_threads);
+    g_test_add_func("/app/admission", test_app_admission);
+    g_test_add_func("/app/main_loop_before_request",
+        test_app_main_loop_before_request);
+    g_test_add_func("/app/main_loop_stream", test_app_main_loop_stream);
+    g_test_add_func("/app/main_loop_stream_unsupported",
+        test_app_main_loop_stream_unsupported);
     g_test_add_func("/app/get_view_from_endpoint",
         test_app_get_view_from_endpoint);
     g_test_add_func("/app/get_view_from_endpoint_not_found",
         test_app_get_view_from_endpoint_not_found);
+    g_test_add_func("/app/get_view_from_endpoint_duplicated",
+        test_app_get_view_from_endpoint_duplicated);
     g_test_add_func("/app/url_for", test_app_url_for);
     g_test_add_func("/app/url_for_with_script_name",
         test_app_url_for_with_script_name);
+    g_test_add_func("/app/url_for_append", test_app_url_for_append);
     return g_test_run();
 }
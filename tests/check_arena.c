@@ -0,0 +1,133 @@
+/*
+ * balde: A microframework for C based on GLib and bad intentions.
+ * Copyright (C) 2013-2017 Rafael G. Martins <rafael@rafaelmartins.eng.br>
+ *
+ * This program can be distributed under the terms of the LGPL-2 License.
+ * See the file COPYING.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <glib.h>
+#include <string.h>
+#include "../src/arena.h"
+
+
+void
+test_arena_alloc(void)
+{
+    balde_arena_t *arena = balde_arena_new();
+    gchar *a = balde_arena_alloc(arena, 3);
+    gchar *b = balde_arena_alloc(arena, 5);
+    g_assert(a != NULL);
+    g_assert(b != NULL);
+    g_assert(a != b);
+    g_assert(((gsize) a) % sizeof(gpointer) == 0);
+    g_assert(((gsize) b) % sizeof(gpointer) == 0);
+    guint8 *c = balde_arena_alloc0(arena, 16);
+    for (guint i = 0; i < 16; i++)
+        g_assert(c[i] == 0);
+    balde_arena_free(arena);
+}
+
+
+void
+test_arena_alloc_big(void)
+{
+    balde_arena_t *arena = balde_arena_new();
+    gchar *a = balde_arena_strdup(arena, "bola");
+    gchar *b = balde_arena_alloc(arena, BALDE_ARENA_CHUNK_SIZE * 2);
+    memset(b, 'a', BALDE_ARENA_CHUNK_SIZE * 2);
+    gchar *c = balde_arena_strdup(arena, "guda");
+    g_assert_cmpstr(a, ==, "bola");
+    g_assert_cmpstr(c, ==, "guda");
+    for (guint i = 0; i < 1000; i++)
+        g_assert(balde_arena_alloc(arena, 100) != NULL);
+    g_assert_cmpstr(a, ==, "bola");
+    balde_arena_free(arena);
+}
+
+
+void
+test_arena_strdup(void)
+{
+    balde_arena_t *arena = balde_arena_new();
+    g_assert(balde_arena_strdup(arena, NULL) == NULL);
+    g_assert_cmpstr(balde_arena_strdup(arena, "bola"), ==, "bola");
+    g_assert_cmpstr(balde_arena_strndup(arena, "guda", 2), ==, "gu");
+    g_assert_cmpstr(balde_arena_ascii_strdown(arena, "Content-Type"), ==,
+        "content-type");
+    balde_arena_free(arena);
+}
+
+
+void
+test_arena_without_arena(void)
+{
+    gchar *a = balde_arena_strdup(NULL, "bola");
+    g_assert_cmpstr(a, ==, "bola");
+    balde_arena_release(NULL, a);
+    g_assert(balde_arena_destroy_notify(NULL) == g_free);
+    balde_arena_t *arena = balde_arena_new();
+    g_assert(balde_arena_destroy_notify(arena) == NULL);
+    balde_arena_free(arena);
+}
+
+
+void
+test_arena_reset(void)
+{
+    balde_arena_t *arena = balde_arena_new();
+    for (guint i = 0; i < 1000; i++)
+        balde_arena_alloc(arena, 100);
+    balde_arena_alloc(arena, BALDE_ARENA_CHUNK_SIZE * 2);
+    balde_arena_reset(arena);
+    g_assert(arena->chunks != NULL);
+    g_assert(arena->chunks->next == NULL);
+    g_assert(arena->chunks->used == 0);
+    g_assert_cmpint(arena->n_cached, ==, BALDE_ARENA_MAX_CACHED_CHUNKS);
+    g_assert(balde_arena_alloc(arena, 100) != NULL);
+    g_assert_cmpint(arena->chunks->used, >, 0);
+
+    // cached chunks are reused from their start.
+    for (guint i = 0; i < 1000; i++) {
+        guint8 *p = balde_arena_alloc(arena, 100);
+        balde_arena_chunk_t *chunk = arena->chunks;
+        g_assert(p >= (guint8*) chunk);
+        g_assert(p + 100 <= (guint8*) chunk + sizeof(balde_arena_chunk_t) +
+            2 * sizeof(gpointer) + chunk->size);
+        g_assert_cmpint(chunk->used, <=, chunk->size);
+    }
+    g_assert_cmpint(arena->n_cached, ==, 0);
+    balde_arena_free(arena);
+}
+
+
+void
+test_arena_thread_default(void)
+{
+    balde_arena_t *arena = balde_arena_get_thread_default();
+    g_assert(arena != NULL);
+    g_assert(balde_arena_get_thread_default() == arena);
+    g_assert(balde_arena_get_current() == NULL);
+    balde_arena_set_current(arena);
+    g_assert(balde_arena_get_current() == arena);
+    balde_arena_set_current(NULL);
+    g_assert(balde_arena_get_current() == NULL);
+}
+
+
+int
+main(int argc, char** argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/arena/alloc", test_arena_alloc);
+    g_test_add_func("/arena/alloc_big", test_arena_alloc_big);
+    g_test_add_func("/arena/strdup", test_arena_strdup);
+    g_test_add_func("/arena/without_arena", test_arena_without_arena);
+    g_test_add_func("/arena/reset", test_arena_reset);
+    g_test_add_func("/arena/thread_default", test_arena_thread_default);
+    return g_test_run();
+}
@@ -45,6 +45,18 @@ get_test_views(void)
 }
 
 
+balde_url_router_t*
+get_test_router(GSList *views)
+{
+    balde_url_router_t *router = balde_url_router_new();
+    for (GSList *tmp = views; tmp != NULL; tmp = g_slist_next(tmp)) {
+        balde_view_t *view = (balde_view_t*) tmp->data;
+        balde_url_router_add(router, view->url_rule->match, view);
+    }
+    return router;
+}
+
+
 void
 free_test_views(GSList* views)
 {
@@ -66,136 +78,155 @@ free_test_views(GSList* views)
 void
 test_url_match(void)
 {
-    GHashTable *matches = NULL;
+    balde_view_arg_t args[BALDE_URL_MAX_ARGS];
+    guint n_args = 0;
     balde_url_rule_match_t *m = balde_parse_url_rule("/lol/", NULL);
-    gboolean match = balde_url_match("/lol/", m, &matches);
+    gboolean match = balde_url_match("/lol/", m, args, &n_args);
     g_assert(match);
-    g_assert(g_hash_table_size(matches) == 0);
+    g_assert(n_args == 0);
     balde_free_url_rule_match(m);
-    g_hash_table_destroy(matches);
+    balde_view_args_clear(args, n_args);
 }
 
 
 void
 test_url_match_with_variable(void)
 {
-    GHashTable *matches = NULL;
+    balde_view_arg_t args[BALDE_URL_MAX_ARGS];
+    guint n_args = 0;
     balde_url_rule_match_t *m = balde_parse_url_rule("/lol/<asd>/", NULL);
-    gboolean match = balde_url_match("/lol/hehe/", m, &matches);
+    gboolean match = balde_url_match("/lol/hehe/", m, args, &n_args);
     g_assert(match);
-    g_assert(g_hash_table_size(matches) == 1);
-    g_assert_cmpstr(g_hash_table_lookup(matches, "asd"), ==, "hehe");
+    g_assert(n_args == 1);
+    g_assert_cmpstr(balde_view_args_lookup(args, n_args, "/lol/hehe/",
+        "asd"), ==, "hehe");
     balde_free_url_rule_match(m);
-    g_hash_table_destroy(matches);
+    balde_view_args_clear(args, n_args);
 }
 
 
 void
 test_url_match_with_null_path(void)
 {
-    GHashTable *matches = NULL;
+    balde_view_arg_t args[BALDE_URL_MAX_ARGS];
+    guint n_args = 0;
     balde_url_rule_match_t *m = balde_parse_url_rule("/", NULL);
-    gboolean match = balde_url_match(NULL, m, &matches);
+    gboolean match = balde_url_match(NULL, m, args, &n_args);
     g_assert(match);
-    g_assert(g_hash_table_size(matches) == 0);
+    g_assert(n_args == 0);
     balde_free_url_rule_match(m);
-    g_hash_table_destroy(matches);
+    balde_view_args_clear(args, n_args);
 }
 
 
 void
 test_url_match_with_empty_path(void)
 {
-    GHashTable *matches = NULL;
+    balde_view_arg_t args[BALDE_URL_MAX_ARGS];
+    guint n_args = 0;
     balde_url_rule_match_t *m = balde_parse_url_rule("/", NULL);
-    gboolean match = balde_url_match("", m, &matches);
+    gboolean match = balde_url_match("", m, args, &n_args);
     g_assert(match);
-    g_assert(g_hash_table_size(matches) == 0);
+    g_assert(n_args == 0);
     balde_free_url_rule_match(m);
-    g_hash_table_destroy(matches);
+    balde_view_args_clear(args, n_args);
 }
 
 
 void
 test_url_match_with_path_with_space(void)
 {
-    GHashTable *matches = NULL;
+    balde_view_arg_t args[BALDE_URL_MAX_ARGS];
+    guint n_args = 0;
     balde_url_rule_match_t *m = balde_parse_url_rule("/test/<lol>", NULL);
-    gboolean match = balde_url_match("/test/guda%20bola", m, &matches);
+    gboolean match = balde_url_match("/test/guda%20bola", m, args, &n_args);
     g_assert(match);
-    g_assert(g_hash_table_size(matches) == 1);
-    g_assert_cmpstr(g_hash_table_lookup(matches, "lol"), ==, "guda bola");
+    g_assert(n_args == 1);
+    g_assert_cmpstr(balde_view_args_lookup(args, n_args, "/test/guda%20bola",
+        "lol"), ==, "guda bola");
     balde_free_url_rule_match(m);
-    g_hash_table_destroy(matches);
+    balde_view_args_clear(args, n_args);
 }
 
 
 void
 test_url_match_without_trailing_slash(void)
 {
-    GHashTable *matches = NULL;
+    balde_view_arg_t args[BALDE_URL_MAX_ARGS];
+    guint n_args = 0;
     balde_url_rule_match_t *m = balde_parse_url_rule("/test/asd", NULL);
-    gboolean match = balde_url_match("/test/asd", m, &matches);
+    gboolean match = balde_url_match("/test/asd", m, args, &n_args);
     g_assert(match);
-    g_assert(g_hash_table_size(matches) == 0);
+    g_assert(n_args == 0);
     balde_free_url_rule_match(m);
-    g_hash_table_destroy(matches);
+    balde_view_args_clear(args, n_args);
 }
 
 
 void
 test_url_match_without_trailing_slash_with_variable(void)
 {
-    GHashTable *matches = NULL;
+    balde_view_arg_t args[BALDE_URL_MAX_ARGS];
+    guint n_args = 0;
     balde_url_rule_match_t *m = balde_parse_url_rule("/test/<lol>", NULL);
-    gboolean match = balde_url_match("/test/asd", m, &matches);
+    gboolean match = balde_url_match("/test/asd", m, args, &n_args);
     g_assert(match);
-    g_assert(g_hash_table_size(matches) == 1);
-    g_assert_cmpstr(g_hash_table_lookup(matches, "lol"), ==, "asd");
+    g_assert(n_args == 1);
+    g_assert_cmpstr(balde_view_args_lookup(args, n_args, "/test/asd",
+        "lol"), ==, "asd");
     balde_free_url_rule_match(m);
-    g_hash_table_destroy(matches);
+    balde_view_args_clear(args, n_args);
 }
 
 
 void
 test_url_match_with_multiple_matches(void)
 {
-    GHashTable *matches = NULL;
+    balde_view_arg_t args[BALDE_URL_MAX_ARGS];
+    guint n_args = 0;
     balde_url_rule_match_t *m = balde_parse_url_rule(
         "/test/<lol>/tset/<hehe1>/test/<xd>/", NULL);
-    gboolean match = balde_url_match("/test/foo/tset/bar/test/baz/", m, &matches);
+    gboolean match = balde_url_match("/test/foo/tset/bar/test/baz/", m,
+        args, &n_args);
     g_assert(match);
-    g_assert(g_hash_table_size(matches) == 3);
-    g_assert_cmpstr(g_hash_table_lookup(matches, "lol"), ==, "foo");
-    g_assert_cmpstr(g_hash_table_lookup(matches, "hehe1"), ==, "bar");
-    g_assert_cmpstr(g_hash_table_lookup(matches, "xd"), ==, "baz");
+    g_assert(n_args == 3);
+    g_assert_cmpstr(balde_view_args_lookup(args, n_args,
+        "/test/foo/tset/bar/test/baz/", "lol"), ==, "foo");
+    g_assert_cmpstr(balde_view_args_lookup(args, n_args,
+        "/test/foo/tset/bar/test/baz/", "hehe1"), ==, "bar");
+    g_assert_cmpstr(balde_view_args_lookup(args, n_args,
+        "/test/foo/tset/bar/test/baz/", "xd"), ==, "baz");
     balde_free_url_rule_match(m);
-    g_hash_table_destroy(matches);
+    balde_view_args_clear(args, n_args);
 }
 
 
 void
 test_url_match_with_path(void)
 {
-    GHashTable *matches = NULL;
+    balde_view_arg_t args[BALDE_URL_MAX_ARGS];
+    guint n_args = 0;
     balde_url_rule_match_t *m = balde_parse_url_rule("/foo/<path:p>/asd/", NULL);
-    gboolean match = balde_url_match("/foo/guda/bola/arcoiro/asd/", m, &matches);
+    gboolean match = balde_url_match("/foo/guda/bola/arcoiro/asd/", m,
+        args, &n_args);
     g_assert(match);
-    g_assert(g_hash_table_size(matches) == 1);
-    g_assert_cmpstr(g_hash_table_lookup(matches, "p"), ==, "guda/bola/arcoiro");
+    g_assert(n_args == 1);
+    g_assert_cmpstr(balde_view_args_lookup(args, n_args,
+        "/foo/guda/bola/arcoiro/asd/", "p"), ==, "guda/bola/arcoiro");
     balde_free_url_rule_match(m);
-    g_hash_table_destroy(matches);
+    balde_view_args_clear(args, n_args);
 }
 
 
 void
 test_url_no_match(void)
 {
-    GHashTable *matches = NULL;
+    balde_view_arg_t args[BALDE_URL_MAX_ARGS];
+    guint n_args = 0;
     balde_url_rule_match_t *m = balde_parse_url_rule("/test/fool/", NULL);
-    gboolean match = balde_url_match("/test/foo/", m, &matches);
+    gboolean match = balde_url_match("/test/foo/", m, args, &n_args);
     g_assert(!match);
-    g_assert(matches == NULL);
+    g_assert(n_args == 0);
     balde_free_url_rule_match(m);
 }
 
@@ -203,11 +234,12 @@ test_url_no_match(void)
 void
 test_url_no_match2(void)
 {
-    GHashTable *matches = NULL;
+    balde_view_arg_t args[BALDE_URL_MAX_ARGS];
+    guint n_args = 0;
     balde_url_rule_match_t *m = balde_parse_url_rule("/test/", NULL);
-    gboolean match = balde_url_match("/test/foo/", m, &matches);
+    gboolean match = balde_url_match("/test/foo/", m, args, &n_args);
     g_assert(!match);
-    g_assert(matches == NULL);
+    g_assert(n_args == 0);
     balde_free_url_rule_match(m);
 }
 
@@ -216,12 +248,17 @@ void
 test_url_rule(void)
 {
     GSList *views = get_test_views();
-    GHashTable *matches = NULL;
-    gchar* endpoint = balde_dispatch_from_path(views, "/user/arcoiro/", &matches);
-    g_assert_cmpstr(endpoint, ==, "user");
-    g_assert_cmpstr(g_hash_table_lookup(matches, "username"), ==, "arcoiro");
-    g_free(endpoint);
-    g_hash_table_destroy(matches);
+    balde_url_router_t *router = get_test_router(views);
+    balde_view_arg_t args[BALDE_URL_MAX_ARGS];
+    guint n_args = 0;
+    balde_view_t *view = balde_dispatch_from_path(router, "/user/arcoiro/",
+        args, &n_args);
+    g_assert(view != NULL);
+    g_assert_cmpstr(view->url_rule->endpoint, ==, "user");
+    g_assert_cmpstr(balde_view_args_lookup(args, n_args, "/user/arcoiro/",
+        "username"), ==, "arcoiro");
+    balde_view_args_clear(args, n_args);
+    balde_url_router_free(router);
     free_test_views(views);
 }
 
@@ -230,13 +267,17 @@ void
 test_url_rule_with_path(void)
 {
     GSList *views = get_test_views();
-    GHashTable *matches = NULL;
-    gchar* endpoint = balde_dispatch_from_path(views, "/foo/bola/arcoiro/bar/",
-        &matches);
-    g_assert_cmpstr(endpoint, ==, "path");
-    g_assert_cmpstr(g_hash_table_lookup(matches, "p"), ==, "bola/arcoiro");
-    g_free(endpoint);
-    g_hash_table_destroy(matches);
+    balde_url_router_t *router = get_test_router(views);
+    balde_view_arg_t args[BALDE_URL_MAX_ARGS];
+    guint n_args = 0;
+    balde_view_t *view = balde_dispatch_from_path(router, "/foo/bola/arcoiro/bar/",
+        args, &n_args);
+    g_assert(view != NULL);
+    g_assert_cmpstr(view->url_rule->endpoint, ==, "path");
+    g_assert_cmpstr(balde_view_args_lookup(args, n_args,
+        "/foo/bola/arcoiro/bar/", "p"), ==, "bola/arcoiro");
+    balde_view_args_clear(args, n_args);
+    balde_url_router_free(router);
     free_test_views(views);
 }
 
@@ -245,13 +286,17 @@ void
 test_url_rule_with_path_with_space(void)
 {
     GSList *views = get_test_views();
-    GHashTable *matches = NULL;
-    gchar* endpoint = balde_dispatch_from_path(views, "/user/joao%20guda/",
-        &matches);
-    g_assert_cmpstr(endpoint, ==, "user");
-    g_assert_cmpstr(g_hash_table_lookup(matches, "username"), ==, "joao guda");
-    g_free(endpoint);
-    g_hash_table_destroy(matches);
+    balde_url_router_t *router = get_test_router(views);
+    balde_view_arg_t args[BALDE_URL_MAX_ARGS];
+    guint n_args = 0;
+    balde_view_t *view = balde_dispatch_from_path(router, "/user/joao%20guda/",
+        args, &n_args);
+    g_assert(view != NULL);
+    g_assert_cmpstr(view->url_rule->endpoint, ==, "user");
+    g_assert_cmpstr(balde_view_args_lookup(args, n_args, "/user/joao%20guda/",
+        "username"), ==, "joao guda");
+    balde_view_args_clear(args, n_args);
+    balde_url_router_free(router);
     free_test_views(views);
 }
 
@@ -260,10 +305,14 @@ void
 test_url_rule_not_found(void)
 {
     GSList *views = get_test_views();
-    GHashTable *matches = NULL;
-    gchar* endpoint = balde_dispatch_from_path(views, "/bola/arcoiro/", &matches);
-    g_assert(endpoint == NULL);
-    g_assert(matches == NULL);
+    balde_url_router_t *router = get_test_router(views);
+    balde_view_arg_t args[BALDE_URL_MAX_ARGS];
+    guint n_args = 0;
+    balde_view_t *view = balde_dispatch_from_path(router, "/bola/arcoiro/",
+        args, &n_args);
+    g_assert(view == NULL);
+    g_assert(n_args == 0);
+    balde_url_router_free(router);
     free_test_views(views);
 }
 
@@ -272,16 +321,125 @@ void
 test_url_rule_with_multiple_methods(void)
 {
     GSList *views = get_test_views();
-    GHashTable *matches = NULL;
-    gchar* endpoint;
-    endpoint = balde_dispatch_from_path(views, "/policies/", &matches);
-    g_assert_cmpstr(endpoint, ==, "policy");
-    g_free(endpoint);
-    g_hash_table_destroy(matches);
+    balde_url_router_t *router = get_test_router(views);
+    balde_view_arg_t args[BALDE_URL_MAX_ARGS];
+    guint n_args = 0;
+    balde_view_t *view = balde_dispatch_from_path(router, "/policies/",
+        args, &n_args);
+    g_assert(view != NULL);
+    g_assert_cmpstr(view->url_rule->endpoint, ==, "policy");
+    balde_view_args_clear(args, n_args);
+    balde_url_router_free(router);
     free_test_views(views);
 }
 
 
+void
+test_url_router_first_rule_wins(void)
+{
+    balde_url_rule_match_t *m1 = balde_parse_url_rule("/user/<name>/", NULL);
+    balde_url_rule_match_t *m2 = balde_parse_url_rule("/user/admin/", NULL);
+    balde_url_rule_match_t *m3 = balde_parse_url_rule("/user/<path:p>/", NULL);
+    balde_url_router_t *router = balde_url_router_new();
+    balde_url_router_add(router, m1, "m1");
+    balde_url_router_add(router, m2, "m2");
+    balde_url_router_add(router, m3, "m3");
+    balde_view_arg_t args[BALDE_URL_MAX_ARGS];
+    guint n_args = 0;
+    g_assert_cmpstr(balde_url_router_match(router, "/user/admin/",
+        args, &n_args), ==,
+        "m1");
+    g_assert_cmpstr(balde_view_args_lookup(args, n_args, "/user/admin/",
+        "name"), ==, "admin");
+    balde_view_args_clear(args, n_args);
+    n_args = 0;
+    g_assert_cmpstr(balde_url_router_match(router, "/user/foo/bar/", args, &n_args),
+        ==, "m3");
+    g_assert_cmpstr(balde_view_args_lookup(args, n_args, "/user/foo/bar/",
+        "p"), ==, "foo/bar");
+    balde_view_args_clear(args, n_args);
+    n_args = 0;
+    g_assert(balde_url_router_match(router, "/user//", args, &n_args) == NULL);
+    g_assert(n_args == 0);
+    balde_url_router_free(router);
+    balde_free_url_rule_match(m1);
+    balde_free_url_rule_match(m2);
+    balde_free_url_rule_match(m3);
+}
+
+
+void
+test_url_router_backtracking(void)
+{
+    balde_url_rule_match_t *m1 = balde_parse_url_rule("/<name>.json", NULL);
+    balde_url_rule_match_t *m2 = balde_parse_url_rule("/foo/<path:a>/<path:b>", NULL);
+    balde_url_rule_match_t *m3 = balde_parse_url_rule("/", NULL);
+    balde_url_router_t *router = balde_url_router_new();
+    balde_url_router_add(router, m1, "m1");
+    balde_url_router_add(router, m2, "m2");
+    balde_url_router_add(router, m3, "m3");
+    balde_view_arg_t args[BALDE_URL_MAX_ARGS];
+    guint n_args = 0;
+    g_assert_cmpstr(balde_url_router_match(router, "/foo.bar.json", args, &n_args),
+        ==, "m1");
+    g_assert_cmpstr(balde_view_args_lookup(args, n_args, "/foo.bar.json",
+        "name"), ==, "foo.bar");
+    balde_view_args_clear(args, n_args);
+    n_args = 0;
+    g_assert_cmpstr(balde_url_router_match(router, "/foo/a/b/c", args, &n_args),
+        ==, "m2");
+    g_assert_cmpstr(balde_view_args_lookup(args, n_args, "/foo/a/b/c",
+        "a"), ==, "a");
+    g_assert_cmpstr(balde_view_args_lookup(args, n_args, "/foo/a/b/c",
+        "b"), ==, "b/c");
+    balde_view_args_clear(args, n_args);
+    n_args = 0;
+    g_assert_cmpstr(balde_url_router_match(router, NULL, args, &n_args), ==, "m3");
+    g_assert_cmpint(n_args, ==, 0);
+    balde_view_args_clear(args, n_args);
+    n_args = 0;
+    g_assert(balde_url_router_match(router, "/foo.json/", args, &n_args) == NULL);
+    balde_url_router_free(router);
+    balde_free_url_rule_match(m1);
+    balde_free_url_rule_match(m2);
+    balde_free_url_rule_match(m3);
+}
+
+
+void
+test_url_router_fallback(void)
+{
+    balde_url_rule_match_t *m1 = balde_parse_url_rule("/foo/<bola:bar>/", NULL);
+    balde_url_rule_match_t *m2 = balde_parse_url_rule("/foo/<bar>/", NULL);
+    balde_url_router_t *router = balde_url_router_new();
+    balde_url_router_add(router, m1, "m1");
+    balde_url_router_add(router, m2, "m2");
+    g_assert(router->fallbacks != NULL);
+    balde_view_arg_t args[BALDE_URL_MAX_ARGS];
+    guint n_args = 0;
+    g_assert_cmpstr(balde_url_router_match(router, "/foo/bola/", args, &n_args), ==,
+        "m2");
+    g_assert_cmpstr(balde_view_args_lookup(args, n_args, "/foo/bola/",
+        "bar"), ==, "bola");
+    balde_view_args_clear(args, n_args);
+    n_args = 0;
+    g_assert_cmpstr(balde_url_router_match(router, "/foo//", args, &n_args), ==,
+        "m1");
+    balde_view_args_clear(args, n_args);
+    balde_url_router_free(router);
+    balde_free_url_rule_match(m1);
+    balde_free_url_rule_match(m2);
+
+    // rules matched with their regexes convert their arguments too.
+    m1 = balde_parse_url_rule("/<int:bar>/<bola:foo>", NULL);
+    g_assert(balde_url_match("/123/", m1, args, &n_args));
+    g_assert_cmpint(n_args, ==, 1);
+    g_assert_cmpint(args[0].converted.i, ==, 123);
+    g_assert(!balde_url_match("/9223372036854775808/", m1, args, &n_args));
+    balde_free_url_rule_match(m1);
+}
+
+
 void
 test_http_method_str2enum(void)
 {
@@ -443,6 +601,158 @@ test_parse_url_rule(void)
 }
 
 
+void
+test_parse_url_rule_with_converters(void)
+{
+    balde_url_rule_match_t *match;
+    GError *error = NULL;
+    match = balde_parse_url_rule("/foo/<int:bar>/<float:baz>/<uuid:id>/", &error);
+    g_assert(error == NULL);
+    g_assert_cmpstr(g_regex_get_pattern(match->regex), ==,
+        "^/foo/(?P<bar>\\d+)/(?P<baz>\\d+\\.\\d+)/(?P<id>[A-Fa-f0-9]{8}-"
+        "[A-Fa-f0-9]{4}-[A-Fa-f0-9]{4}-[A-Fa-f0-9]{4}-[A-Fa-f0-9]{12})/$");
+    g_assert_cmpstr(match->pieces[0], ==, "/foo/");
+    g_assert_cmpstr(match->pieces[1], ==, "/");
+    g_assert_cmpstr(match->pieces[2], ==, "/");
+    g_assert_cmpstr(match->pieces[3], ==, "/");
+    g_assert(match->pieces[4] == NULL);
+    g_assert_cmpint(match->converters[0], ==, BALDE_URL_CONVERTER_INT);
+    g_assert_cmpint(match->converters[1], ==, BALDE_URL_CONVERTER_FLOAT);
+    g_assert_cmpint(match->converters[2], ==, BALDE_URL_CONVERTER_UUID);
+    g_assert_cmpint(match->converters[3], ==, 0);
+    g_assert(match->converter_args[0] == NULL);
+    g_assert_cmpstr(match->args[0], ==, "bar");
+    g_assert_cmpstr(match->args[1], ==, "baz");
+    g_assert_cmpstr(match->args[2], ==, "id");
+    g_assert(match->args[3] == NULL);
+    balde_free_url_rule_match(match);
+    match = balde_parse_url_rule("/<any(about, help.me):page>/<x>", &error);
+    g_assert(error == NULL);
+    g_assert_cmpstr(g_regex_get_pattern(match->regex), ==,
+        "^/(?P<page>about|help\\.me)/(?P<x>[^/]+)$");
+    g_assert_cmpstr(match->pieces[0], ==, "/");
+    g_assert_cmpstr(match->pieces[1], ==, "/");
+    g_assert_cmpstr(match->pieces[2], ==, "");
+    g_assert(match->pieces[3] == NULL);
+    g_assert_cmpint(match->converters[0], ==, BALDE_URL_CONVERTER_ANY);
+    g_assert_cmpint(match->converters[1], ==, BALDE_URL_CONVERTER_STRING);
+    g_assert_cmpstr(match->converter_args[0][0], ==, "about");
+    g_assert_cmpstr(match->converter_args[0][1], ==, "help.me");
+    g_assert(match->converter_args[0][2] == NULL);
+    g_assert(match->converter_args[1] == NULL);
+    g_assert_cmpstr(match->args[0], ==, "page");
+    g_assert_cmpstr(match->args[1], ==, "x");
+    g_assert(match->args[2] == NULL);
+    balde_free_url_rule_match(match);
+    match = balde_parse_url_rule("/<int(3):bar>/", &error);
+    g_assert(error == NULL);
+    g_assert_cmpint(match->converters[0], ==, BALDE_URL_CONVERTER_UNKNOWN);
+    balde_free_url_rule_match(match);
+}
+
+
+void
+test_url_router_converters(void)
+{
+    balde_url_rule_match_t *m1 = balde_parse_url_rule("/post/<int:id>/", NULL);
+    balde_url_rule_match_t *m2 = balde_parse_url_rule("/post/<float:id>/", NULL);
+    balde_url_rule_match_t *m3 = balde_parse_url_rule("/post/<uuid:id>/", NULL);
+    balde_url_rule_match_t *m4 = balde_parse_url_rule("/<any(about,help):page>/",
+        NULL);
+    balde_url_rule_match_t *m5 = balde_parse_url_rule("/post/<id>/", NULL);
+    balde_url_rule_match_t *m6 = balde_parse_url_rule("/v<int:a>.<int:b>", NULL);
+    balde_url_rule_match_t *m7 = balde_parse_url_rule("/n<int:a><int:b>", NULL);
+    balde_url_router_t *router = balde_url_router_new();
+    balde_url_router_add(router, m1, m1);
+    balde_url_router_add(router, m2, m2);
+    balde_url_router_add(router, m3, m3);
+    balde_url_router_add(router, m4, m4);
+    balde_url_router_add(router, m5, m5);
+    balde_url_router_add(router, m6, m6);
+    balde_url_router_add(router, m7, m7);
+    balde_view_arg_t args[BALDE_URL_MAX_ARGS];
+    guint n_args = 0;
+    g_assert(balde_url_router_match(router, "/post/123/", args, &n_args) == m1);
+    g_assert_cmpstr(balde_view_args_lookup(args, n_args, "/post/123/",
+        "id"), ==, "123");
+    balde_view_args_clear(args, n_args);
+    g_assert(balde_url_router_match(router, "/post/12.5/", args, &n_args) == m2);
+    g_assert_cmpstr(balde_view_args_lookup(args, n_args, "/post/12.5/",
+        "id"), ==, "12.5");
+    balde_view_args_clear(args, n_args);
+    g_assert(balde_url_router_match(router,
+        "/post/0E0DD4E5-0c4a-4d05-9bd4-3f0c3a4bc6a2/", args, &n_args) == m3);
+    g_assert_cmpstr(balde_view_args_lookup(args, n_args,
+        "/post/0E0DD4E5-0c4a-4d05-9bd4-3f0c3a4bc6a2/", "id"), ==,
+        "0E0DD4E5-0c4a-4d05-9bd4-3f0c3a4bc6a2");
+    balde_view_args_clear(args, n_args);
+    g_assert(balde_url_router_match(router,
+        "/post/0e0dd4e5-0c4a-4d05-9bd4-3f0c3a4bc6ag/", args, &n_args) == m5);
+    balde_view_args_clear(args, n_args);
+    g_assert(balde_url_router_match(router, "/post/12./", args, &n_args) == m5);
+    balde_view_args_clear(args, n_args);
+    g_assert(balde_url_router_match(router, "/post/-1/", args, &n_args) == m5);
+    balde_view_args_clear(args, n_args);
+    g_assert(balde_url_router_match(router, "/help/", args, &n_args) == m4);
+    g_assert_cmpstr(balde_view_args_lookup(args, n_args, "/help/",
+        "page"), ==, "help");
+    balde_view_args_clear(args, n_args);
+    n_args = 0;
+    g_assert(balde_url_router_match(router, "/helpme/", args, &n_args) == NULL);
+    g_assert(n_args == 0);
+    g_assert(balde_url_router_match(router, "/v1.20", args, &n_args) == m6);
+    g_assert_cmpstr(balde_view_args_lookup(args, n_args, "/v1.20",
+        "a"), ==, "1");
+    g_assert_cmpstr(balde_view_args_lookup(args, n_args, "/v1.20",
+        "b"), ==, "20");
+    balde_view_args_clear(args, n_args);
+    n_args = 0;
+    g_assert(balde_url_router_match(router, "/v1.x", args, &n_args) == NULL);
+    g_assert(n_args == 0);
+
+    // converted when matched. ints that don't fit in a gint64 don't match.
+    g_assert(balde_url_router_match(router, "/post/9223372036854775807/", args,
+        &n_args) == m1);
+    g_assert_cmpint(args[0].converter, ==, BALDE_URL_CONVERTER_INT);
+    g_assert_cmpint(args[0].converted.i, ==, G_MAXINT64);
+    g_assert(balde_url_router_match(router, "/post/9223372036854775808/", args,
+        &n_args) == m5);
+    g_assert_cmpint(args[0].converter, ==, BALDE_URL_CONVERTER_STRING);
+    g_assert(balde_url_router_match(router, "/post/0012.50/", args,
+        &n_args) == m2);
+    g_assert_cmpfloat(args[0].converted.f, ==, 12.5);
+    g_assert(balde_url_router_match(router, "/v9223372036854775808.1", args,
+        &n_args) == NULL);
+    g_assert(balde_url_router_match(router, "/n123", args, &n_args) == m7);
+    g_assert_cmpint(args[0].converted.i, ==, 12);
+    g_assert_cmpint(args[1].converted.i, ==, 3);
+
+    // shorter captures aren't tried to make an int fit, by the tree and by
+    // the regexes alike.
+    g_assert(balde_url_router_match(router, "/n99999999999999999999", args,
+        &n_args) == NULL);
+    g_assert(!balde_url_match("/n99999999999999999999", m7, args, &n_args));
+    g_assert(balde_url_match("/n999999999999999999", m7, args, &n_args));
+    g_assert_cmpint(args[0].converted.i, ==, 99999999999999999);
+    g_assert_cmpint(args[1].converted.i, ==, 9);
+
+    // long floats are converted too.
+    gchar *long_float = g_strdup_printf("/post/%s.5/",
+        "00000000000000000000000000000000000000000000000000000000000000000001");
+    g_assert(balde_url_router_match(router, long_float, args, &n_args) == m2);
+    g_assert_cmpfloat(args[0].converted.f, ==, 1.5);
+    g_free(long_float);
+    balde_url_router_free(router);
+    balde_free_url_rule_match(m1);
+    balde_free_url_rule_match(m2);
+    balde_free_url_rule_match(m3);
+    balde_free_url_rule_match(m4);
+    balde_free_url_rule_match(m5);
+    balde_free_url_rule_match(m6);
+    balde_free_url_rule_match(m7);
+}
+
+
 int
 main(int argc, char** argv)
 {
@@ -473,8 +783,16 @@ main(int argc, char** argv)
         test_url_rule_not_found);
     g_test_add_func("/routing/url_rule_with_multiple_methods",
         test_url_rule_with_multiple_methods);
+    g_test_add_func("/routing/url_router_first_rule_wins",
+        test_url_router_first_rule_wins);
+    g_test_add_func("/routing/url_router_backtracking",
+        test_url_router_backtracking);
+    g_test_add_func("/routing/url_router_fallback", test_url_router_fallback);
+    g_test_add_func("/routing/url_router_converters", test_url_router_converters);
     g_test_add_func("/routing/http_method_str2enum", test_http_method_str2enum);
     g_test_add_func("/routing/list_allowed_methods", test_list_allowed_methods);
     g_test_add_func("/routing/parse_url_rule", test_parse_url_rule);
+    g_test_add_func("/routing/parse_url_rule_with_converters",
+        test_parse_url_rule_with_converters);
     return g_test_run();
 }
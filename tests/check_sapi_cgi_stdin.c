@@ -58,6 +58,8 @@ test_form(void) {
     set_headers();
     balde_app_t *app = balde_app_init();
     balde_request_t *request = balde_make_request(app, balde_sapi_cgi_parse_request(app));
+    g_assert(request->priv->form == NULL);
+    g_assert_cmpstr(balde_request_get_form(request, "guda"), ==, "bola");
     g_assert(request->priv->form != NULL);
     g_assert(g_hash_table_size(request->priv->form) == 2);
     g_assert_cmpstr(g_hash_table_lookup(request->priv->form, "guda"), ==, "bola");
@@ -0,0 +1,1122 @@
+/*
+ * balde: A microframework for C based on GLib and bad intentions.
+ * Copyright (C) 2013-2017 Rafael G. Martins <rafael@rafaelmartins.eng.br>
+ *
+ * This program can be distributed under the terms of the LGPL-2 License.
+ * See the file COPYING.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "../src/balde.h"
+#include "../src/app.h"
+#include "../src/requests.h"
+#include "../src/sapi/fcgi.h"
+#include "../src/sapi/prefork.h"
+#include "../src/sapi/server.h"
+
+
+static void
+fcgi_add_param(GByteArray *ba, const gchar *key, const gchar *value)
+{
+    guint8 len[2] = {strlen(key), strlen(value)};
+    g_byte_array_append(ba, len, 2);
+    g_byte_array_append(ba, (guint8*) key, len[0]);
+    g_byte_array_append(ba, (guint8*) value, len[1]);
+}
+
+
+static void
+fcgi_add_begin_request(GByteArray *ba, guint16 request_id, guint16 role,
+    guint8 flags)
+{
+    guint8 body[] = {role >> 8, role & 0xff, flags, 0, 0, 0, 0, 0};
+    balde_sapi_fcgi_add_record(ba, request_id, 1, body, sizeof(body));
+}
+
+
+static void
+fcgi_add_params(GByteArray *ba, guint16 request_id, const gchar *path_info)
+{
+    GByteArray *params = g_byte_array_new();
+    fcgi_add_param(params, "REQUEST_METHOD", "GET");
+    fcgi_add_param(params, "PATH_INFO", path_info);
+    balde_sapi_fcgi_add_record(ba, request_id, 4, params->data, params->len);
+    g_byte_array_free(params, TRUE);
+}
+
+
+static gint
+fcgi_connect(balde_server_t *server)
+{
+    gint fds[2];
+    g_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    struct timeval tv = {5, 0};
+    setsockopt(fds[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    balde_server_add_connection(server, fds[1]);
+    return fds[0];
+}
+
+
+static gint
+fcgi_connect_tcp(balde_server_t *server)
+{
+    // loopback TCP connection, with the server side handed to the server.
+    gint l = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    g_assert(bind(l, (struct sockaddr*) &addr, sizeof(addr)) == 0);
+    g_assert(listen(l, 1) == 0);
+    g_assert(getsockname(l, (struct sockaddr*) &addr, &len) == 0);
+    gint fd = socket(AF_INET, SOCK_STREAM, 0);
+    g_assert(connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0);
+    gint one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    balde_server_add_connection(server, accept(l, NULL, NULL));
+    close(l);
+    return fd;
+}
+
+
+static gint
+fcgi_connect_unix(const gchar *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    gint fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+static void
+fcgi_send(gint fd, GByteArray *ba)
+{
+    g_assert_cmpint(write(fd, ba->data, ba->len), ==, ba->len);
+}
+
+
+// reads records until `end_requests` END_REQUEST records are received,
+// appending STDOUT contents to `stdout_` indexed by request id.
+static void
+fcgi_receive(gint fd, GString **stdout_, guint8 *status, guint end_requests)
+{
+    guint8 header[8];
+    guint8 content[0xffff + 0xff];
+    while (end_requests > 0) {
+        g_assert_cmpint(recv(fd, header, 8, MSG_WAITALL), ==, 8);
+        g_assert_cmpint(header[0], ==, 1);
+        guint16 id = (header[2] << 8) | header[3];
+        gsize len = ((header[4] << 8) | header[5]) + header[6];
+        if (len > 0)
+            g_assert_cmpint(recv(fd, content, len, MSG_WAITALL), ==, len);
+        switch (header[1]) {
+            case 6:  // FCGI_STDOUT
+                g_string_append_len(stdout_[id], (gchar*) content,
+                    (header[4] << 8) | header[5]);
+                break;
+            case 3:  // FCGI_END_REQUEST
+                status[id] = content[4];
+                end_requests--;
+                break;
+            default:
+                g_assert_not_reached();
+        }
+    }
+}
+
+
+static balde_response_t*
+path_view(balde_app_t *app, balde_request_t *request)
+{
+    return balde_make_response(request->path);
+}
+
+
+static balde_response_t*
+slow_view(balde_app_t *app, balde_request_t *request)
+{
+    g_usleep(200000);
+    return balde_make_response("slow");
+}
+
+
+static gint waiting_views = 0;
+
+
+static balde_response_t*
+wait_view(balde_app_t *app, balde_request_t *request)
+{
+    g_atomic_int_inc(&waiting_views);
+    g_assert(balde_request_get_cancellable(request) != NULL);
+    for (guint i = 0; i < 200 && !balde_request_is_aborted(request); i++)
+        g_usleep(10000);
+    return balde_make_response(balde_request_is_aborted(request) ? "aborted" :
+        "done");
+}
+
+
+static balde_response_t*
+big_view(balde_app_t *app, balde_request_t *request)
+{
+    gchar *body = g_strnfill(1024 * 1024, 'a');
+    balde_response_t *response = balde_make_response(body);
+    g_free(body);
+    return response;
+}
+
+
+static balde_response_t*
+body_view(balde_app_t *app, balde_request_t *request)
+{
+    GString *body = request->priv->body;
+    guint sum = 0;
+    for (gsize i = 0; body != NULL && i < body->len; i++)
+        sum += (guint8) body->str[i];
+    gchar *rv = g_strdup_printf("%zu %u", body != NULL ? body->len : 0, sum);
+    balde_response_t *response = balde_make_response(rv);
+    g_free(rv);
+    return response;
+}
+
+
+static gint produced = 0;
+
+static gboolean
+stream_func(balde_app_t *app, balde_request_t *request,
+    balde_response_t *response, gpointer user_data)
+{
+    gchar *chunk = g_strnfill(32 * 1024, 'a' + produced % 26);
+    balde_response_append_body(response, chunk);
+    g_free(chunk);
+    g_atomic_int_inc(&produced);
+    return g_atomic_int_get(&produced) < 128;
+}
+
+
+static balde_response_t*
+stream_view(balde_app_t *app, balde_request_t *request)
+{
+    balde_response_t *response = balde_make_response("");
+    balde_response_set_stream(response, stream_func, NULL, NULL);
+    return response;
+}
+
+
+void
+test_fcgi_parse_request(void)
+{
+    GByteArray *params = g_byte_array_new();
+    fcgi_add_param(params, "REQUEST_METHOD", "POST");
+    fcgi_add_param(params, "PATH_INFO", "/bola");
+    fcgi_add_param(params, "QUERY_STRING", "foo=bar");
+    fcgi_add_param(params, "GATEWAY_INTERFACE", "CGI/1.1");
+    fcgi_add_param(params, "HTTP_HOST", "example.com");
+    fcgi_add_param(params, "HTTP_X_FORWARDED_FOR", "127.0.0.1");
+    fcgi_add_param(params, "CONTENT_LENGTH", "6");
+    fcgi_add_param(params, "CONTENT_TYPE", "text/plain");
+    fcgi_add_param(params, "HTTPS", "on");
+    GString *body = g_string_new("XD=asdqwe");
+    balde_request_env_t *env = balde_sapi_fcgi_parse_request(params, body);
+    g_assert(env != NULL);
+    g_assert(env->storage != NULL);
+    g_assert_cmpstr(env->request_method, ==, "POST");
+    g_assert_cmpstr(env->path_info, ==, "/bola");
+    g_assert_cmpstr(env->query_string, ==, "foo=bar");
+    g_assert(env->server_name == NULL);
+    g_assert_cmpint(g_hash_table_size(env->headers), ==, 4);
+    g_assert_cmpstr(g_hash_table_lookup(env->headers, "host"), ==, "example.com");
+    g_assert_cmpstr(g_hash_table_lookup(env->headers, "x-forwarded-for"), ==,
+        "127.0.0.1");
+    g_assert_cmpstr(g_hash_table_lookup(env->headers, "content-length"), ==, "6");
+    g_assert_cmpstr(g_hash_table_lookup(env->headers, "content-type"), ==,
+        "text/plain");
+    g_assert(env->body == body);
+    g_assert_cmpstr(env->body->str, ==, "XD=asd");
+    g_assert(env->https);
+    balde_request_env_free(env);
+}
+
+
+void
+test_fcgi_parse_request_long_lengths(void)
+{
+    GByteArray *params = g_byte_array_new();
+    gchar *value = g_strnfill(300, 'a');
+    guint8 lengths[] = {0x80, 0, 0, 9, 0x80, 0, 0x01, 0x2c};
+    g_byte_array_append(params, lengths, sizeof(lengths));
+    g_byte_array_append(params, (guint8*) "PATH_INFO", 9);
+    g_byte_array_append(params, (guint8*) value, 300);
+    fcgi_add_param(params, "HTTP_A", "");
+    balde_request_env_t *env = balde_sapi_fcgi_parse_request(params,
+        g_string_new(NULL));
+    g_assert(env != NULL);
+    g_assert_cmpstr(env->path_info, ==, value);
+    g_assert_cmpstr(g_hash_table_lookup(env->headers, "a"), ==, "");
+    g_assert(env->body == NULL);
+    balde_request_env_free(env);
+    g_free(value);
+}
+
+
+void
+test_fcgi_parse_request_truncated(void)
+{
+    GByteArray *params = g_byte_array_new();
+    guint8 data[] = {0x80, 0, 0};
+    g_byte_array_append(params, data, sizeof(data));
+    g_assert(balde_sapi_fcgi_parse_request(params, g_string_new(NULL)) == NULL);
+
+    // value longer than the remaining data
+    params = g_byte_array_new();
+    fcgi_add_param(params, "PATH_INFO", "/bola");
+    g_byte_array_set_size(params, params->len - 1);
+    g_assert(balde_sapi_fcgi_parse_request(params, g_string_new(NULL)) == NULL);
+
+    params = g_byte_array_new();
+    fcgi_add_param(params, "PATH_INFO", "/bola");
+    guint8 key_only[] = {3};
+    g_byte_array_append(params, key_only, sizeof(key_only));
+    g_assert(balde_sapi_fcgi_parse_request(params, g_string_new(NULL)) == NULL);
+}
+
+
+void
+test_fcgi_add_record(void)
+{
+    GByteArray *ba = g_byte_array_new();
+    balde_sapi_fcgi_add_record(ba, 0x102, 6, (guint8*) "bola", 4);
+    g_assert_cmpint(ba->len, ==, 16);
+    guint8 expected[] = {1, 6, 1, 2, 0, 4, 4, 0, 'b', 'o', 'l', 'a', 0, 0, 0, 0};
+    g_assert(memcmp(ba->data, expected, 16) == 0);
+    balde_sapi_fcgi_add_record(ba, 1, 6, NULL, 0);
+    g_assert_cmpint(ba->len, ==, 24);
+    g_byte_array_free(ba, TRUE);
+}
+
+
+void
+test_fcgi_server(void)
+{
+    balde_app_t *app = balde_app_init();
+    balde_app_add_url_rule(app, "path", "/<path>", BALDE_HTTP_GET, path_view);
+    balde_server_t *server = balde_sapi_fcgi_server_new(app, 1, 2, 0, 0, NULL);
+    g_assert(server != NULL);
+    g_assert(balde_server_start(server, NULL));
+
+    gint fd = fcgi_connect(server);
+    GByteArray *ba = g_byte_array_new();
+    fcgi_add_begin_request(ba, 1, 1, 0);
+    fcgi_add_params(ba, 1, "/bola");
+    balde_sapi_fcgi_add_record(ba, 1, 4, NULL, 0);
+    balde_sapi_fcgi_add_record(ba, 1, 5, NULL, 0);
+    fcgi_send(fd, ba);
+    g_byte_array_free(ba, TRUE);
+
+    GString *out[2] = {g_string_new(NULL), g_string_new(NULL)};
+    guint8 status[2] = {0xff, 0xff};
+    fcgi_receive(fd, out, status, 1);
+    g_assert_cmpint(status[1], ==, 0);
+    g_assert(g_str_has_suffix(out[1]->str, "\r\n\r\n/bola"));
+
+    // without FCGI_KEEP_CONN, the connection is closed after the response.
+    guint8 c;
+    g_assert_cmpint(recv(fd, &c, 1, 0), ==, 0);
+    close(fd);
+
+    g_string_free(out[0], TRUE);
+    g_string_free(out[1], TRUE);
+    balde_sapi_fcgi_server_free(server);
+    balde_app_free(app);
+}
+
+
+void
+test_fcgi_server_multiplexed(void)
+{
+    balde_app_t *app = balde_app_init();
+    balde_app_add_url_rule(app, "path", "/<path>", BALDE_HTTP_GET, path_view);
+    balde_server_t *server = balde_sapi_fcgi_server_new(app, 2, 2, 0, 0, NULL);
+    g_assert(server != NULL);
+    g_assert(balde_server_start(server, NULL));
+
+    gint fd = fcgi_connect(server);
+    GByteArray *ba = g_byte_array_new();
+    fcgi_add_begin_request(ba, 1, 1, 1);
+    fcgi_add_begin_request(ba, 2, 1, 1);
+    fcgi_add_params(ba, 2, "/guda");
+    fcgi_add_params(ba, 1, "/bola");
+    balde_sapi_fcgi_add_record(ba, 1, 4, NULL, 0);
+    balde_sapi_fcgi_add_record(ba, 2, 4, NULL, 0);
+    balde_sapi_fcgi_add_record(ba, 2, 5, NULL, 0);
+
+    // the last record is split, to exercise partial reads.
+    fcgi_send(fd, ba);
+    g_byte_array_set_size(ba, 0);
+    balde_sapi_fcgi_add_record(ba, 1, 5, NULL, 0);
+    g_assert_cmpint(write(fd, ba->data, 3), ==, 3);
+    g_usleep(10000);
+    g_assert_cmpint(write(fd, ba->data + 3, ba->len - 3), ==, ba->len - 3);
+    g_byte_array_free(ba, TRUE);
+
+    GString *out[3] = {g_string_new(NULL), g_string_new(NULL), g_string_new(NULL)};
+    guint8 status[3] = {0xff, 0xff, 0xff};
+    fcgi_receive(fd, out, status, 2);
+    g_assert_cmpint(status[1], ==, 0);
+    g_assert_cmpint(status[2], ==, 0);
+    g_assert(g_str_has_suffix(out[1]->str, "\r\n\r\n/bola"));
+    g_assert(g_str_has_suffix(out[2]->str, "\r\n\r\n/guda"));
+
+    // unsupported roles are rejected, keeping the connection.
+    ba = g_byte_array_new();
+    fcgi_add_begin_request(ba, 1, 2, 1);
+    fcgi_send(fd, ba);
+    g_byte_array_free(ba, TRUE);
+    fcgi_receive(fd, out, status, 1);
+    g_assert_cmpint(status[1], ==, 3);
+    close(fd);
+
+    for (guint i = 0; i < 3; i++)
+        g_string_free(out[i], TRUE);
+    balde_sapi_fcgi_server_free(server);
+    balde_app_free(app);
+}
+
+
+void
+test_fcgi_server_big_body(void)
+{
+    balde_app_t *app = balde_app_init();
+    balde_app_add_url_rule(app, "body", "/body", BALDE_HTTP_POST, body_view);
+    balde_server_t *server = balde_sapi_fcgi_server_new(app, 1, 1, 0, 0, NULL);
+    g_assert(server != NULL);
+    g_assert(balde_server_start(server, NULL));
+
+    gint fd = fcgi_connect(server);
+    GByteArray *ba = g_byte_array_new();
+    fcgi_add_begin_request(ba, 1, 1, 0);
+    GByteArray *params = g_byte_array_new();
+    fcgi_add_param(params, "REQUEST_METHOD", "POST");
+    fcgi_add_param(params, "PATH_INFO", "/body");
+    fcgi_add_param(params, "CONTENT_LENGTH", "300000");
+    balde_sapi_fcgi_add_record(ba, 1, 4, params->data, params->len);
+    balde_sapi_fcgi_add_record(ba, 1, 4, NULL, 0);
+    g_byte_array_free(params, TRUE);
+
+    // a body spanning several records of different sizes, bigger than the
+    // read buffer.
+    guint8 *body = g_new(guint8, 300000);
+    guint sum = 0;
+    for (guint i = 0; i < 300000; i++) {
+        body[i] = i % 251;
+        sum += body[i];
+    }
+    guint sizes[] = {1, 0xffff, 7, 40000, 0xffff, 0xffff, 3};
+    guint pos = 0;
+    for (guint i = 0; pos < 300000; i++) {
+        guint size = i < G_N_ELEMENTS(sizes) ? sizes[i] : 0xffff;
+        size = MIN(size, 300000 - pos);
+        balde_sapi_fcgi_add_record(ba, 1, 5, body + pos, size);
+        pos += size;
+    }
+    balde_sapi_fcgi_add_record(ba, 1, 5, NULL, 0);
+    g_free(body);
+
+    // writes split at odd offsets, so records cross the read boundaries.
+    for (pos = 0; pos < ba->len;) {
+        guint size = MIN(ba->len - pos, 12345);
+        g_assert_cmpint(write(fd, ba->data + pos, size), ==, size);
+        pos += size;
+    }
+    g_byte_array_free(ba, TRUE);
+
+    GString *out[2] = {g_string_new(NULL), g_string_new(NULL)};
+    guint8 status[2] = {0xff, 0xff};
+    fcgi_receive(fd, out, status, 1);
+    gchar *expected = g_strdup_printf("\r\n\r\n300000 %u", sum);
+    g_assert(g_str_has_suffix(out[1]->str, expected));
+    g_free(expected);
+    close(fd);
+
+    g_string_free(out[0], TRUE);
+    g_string_free(out[1], TRUE);
+    balde_sapi_fcgi_server_free(server);
+    balde_app_free(app);
+}
+
+
+void
+test_fcgi_server_stream(void)
+{
+    balde_app_t *app = balde_app_init();
+    balde_app_add_url_rule(app, "stream", "/stream", BALDE_HTTP_GET, stream_view);
+    balde_server_t *server = balde_sapi_fcgi_server_new(app, 1, 1, 0, 0, NULL);
+    g_assert(server != NULL);
+    g_assert(balde_server_start(server, NULL));
+
+    g_atomic_int_set(&produced, 0);
+    gint fd = fcgi_connect(server);
+    GByteArray *ba = g_byte_array_new();
+    fcgi_add_begin_request(ba, 1, 1, 0);
+    fcgi_add_params(ba, 1, "/stream");
+    balde_sapi_fcgi_add_record(ba, 1, 4, NULL, 0);
+    balde_sapi_fcgi_add_record(ba, 1, 5, NULL, 0);
+    fcgi_send(fd, ba);
+    g_byte_array_free(ba, TRUE);
+
+    // the generator is blocked while the client doesn't read, way before
+    // producing the whole 4MB body.
+    g_usleep(200000);
+    gint before = g_atomic_int_get(&produced);
+    g_assert_cmpint(before, >, 0);
+    g_assert_cmpint(before, <, 64);
+
+    GString *out[2] = {g_string_new(NULL), g_string_new(NULL)};
+    guint8 status[2] = {0xff, 0xff};
+    fcgi_receive(fd, out, status, 1);
+    g_assert_cmpint(g_atomic_int_get(&produced), ==, 128);
+    g_assert_cmpint(status[1], ==, 0);
+    g_assert(strstr(out[1]->str, "Content-Length") == NULL);
+    gchar *body = strstr(out[1]->str, "\r\n\r\n") + 4;
+    g_assert_cmpint(strlen(body), ==, 128 * 32 * 1024);
+    for (guint i = 0; i < 128; i++)
+        g_assert_cmpint(body[i * 32 * 1024], ==, 'a' + i % 26);
+    close(fd);
+
+    g_string_free(out[0], TRUE);
+    g_string_free(out[1], TRUE);
+    balde_sapi_fcgi_server_free(server);
+    balde_app_free(app);
+}
+
+
+void
+test_fcgi_server_unix(void)
+{
+    balde_app_t *app = balde_app_init();
+    balde_app_add_url_rule(app, "path", "/<path>", BALDE_HTTP_GET, path_view);
+    gchar *dir = g_dir_make_tmp("balde-XXXXXX", NULL);
+    gchar *path = g_build_filename(dir, "fcgi.sock", NULL);
+
+    // stale socket, left behind by a dead process.
+    gint fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    g_assert(bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0);
+    close(fd);
+    g_assert(g_file_test(path, G_FILE_TEST_EXISTS));
+
+    GError *error = NULL;
+    balde_server_t *server = balde_sapi_fcgi_server_new(app, 1, 1, 0, 0, NULL);
+    g_assert(balde_server_listen_unix(server, path, "0600", NULL, &error));
+    g_assert_no_error(error);
+    struct stat st;
+    g_assert(stat(path, &st) == 0);
+    g_assert(S_ISSOCK(st.st_mode));
+    g_assert_cmpint(st.st_mode & 0777, ==, 0600);
+    g_assert(balde_server_start(server, NULL));
+
+    // a socket in use isn't replaced.
+    balde_server_t *server2 = balde_sapi_fcgi_server_new(app, 1, 1, 0, 0, NULL);
+    g_assert(!balde_server_listen_unix(server2, path, NULL, NULL, &error));
+    g_assert_error(error, G_IO_ERROR, G_IO_ERROR_ADDRESS_IN_USE);
+    g_clear_error(&error);
+    balde_sapi_fcgi_server_free(server2);
+
+    fd = fcgi_connect_unix(path);
+    g_assert_cmpint(fd, >=, 0);
+    GByteArray *ba = g_byte_array_new();
+    fcgi_add_begin_request(ba, 1, 1, 0);
+    fcgi_add_params(ba, 1, "/bola");
+    balde_sapi_fcgi_add_record(ba, 1, 4, NULL, 0);
+    balde_sapi_fcgi_add_record(ba, 1, 5, NULL, 0);
+    fcgi_send(fd, ba);
+    g_byte_array_free(ba, TRUE);
+    GString *out[2] = {g_string_new(NULL), g_string_new(NULL)};
+    guint8 status[2] = {0xff, 0xff};
+    fcgi_receive(fd, out, status, 1);
+    g_assert(g_str_has_suffix(out[1]->str, "\r\n\r\n/bola"));
+    close(fd);
+    g_string_free(out[0], TRUE);
+    g_string_free(out[1], TRUE);
+
+    balde_sapi_fcgi_server_free(server);
+    g_assert(!g_file_test(path, G_FILE_TEST_EXISTS));
+
+    // regular files are never removed.
+    g_assert(g_file_set_contents(path, "bola", -1, NULL));
+    server = balde_sapi_fcgi_server_new(app, 1, 1, 0, 0, NULL);
+    g_assert(!balde_server_listen_unix(server, path, NULL, NULL, &error));
+    g_assert_error(error, G_IO_ERROR, G_IO_ERROR_EXISTS);
+    g_clear_error(&error);
+    g_assert(g_file_test(path, G_FILE_TEST_IS_REGULAR));
+    g_unlink(path);
+
+    g_assert(!balde_server_listen_unix(server, path, "0999", NULL, &error));
+    g_assert_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT);
+    g_clear_error(&error);
+    g_assert(!balde_server_listen_unix(server, path, NULL,
+        "balde-nonexistent-user", &error));
+    g_assert_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT);
+    g_clear_error(&error);
+    g_assert(!g_file_test(path, G_FILE_TEST_EXISTS));
+    balde_sapi_fcgi_server_free(server);
+
+    g_rmdir(dir);
+    g_free(path);
+    g_free(dir);
+    balde_app_free(app);
+}
+
+
+typedef struct {
+    balde_app_t *app;
+    balde_server_endpoint_t *endpoint;
+} fcgi_worker_t;
+
+
+static gint
+fcgi_worker(fcgi_worker_t *worker)
+{
+    balde_server_t *server = balde_sapi_fcgi_server_new(worker->app, 1, 2, 0, 0, NULL);
+    GSList *sockets = balde_server_endpoint_get_sockets(worker->endpoint, NULL);
+    for (GSList *l = sockets; l != NULL; l = g_slist_next(l))
+        balde_server_listen_socket(server, l->data);
+    g_slist_free_full(sockets, g_object_unref);
+    g_assert(balde_server_start(server, NULL));
+    if (balde_sapi_prefork_wait(worker->endpoint))
+        balde_server_drain(server, 5 * G_USEC_PER_SEC);
+    balde_sapi_fcgi_server_free(server);
+    return 0;
+}
+
+
+void
+test_fcgi_server_workers(void)
+{
+    balde_app_t *app = balde_app_init();
+    balde_app_add_url_rule(app, "path", "/<path>", BALDE_HTTP_GET, path_view);
+    gchar *dir = g_dir_make_tmp("balde-XXXXXX", NULL);
+    gchar *path = g_build_filename(dir, "fcgi.sock", NULL);
+    fcgi_worker_t worker = {.app = app};
+    worker.endpoint = balde_server_endpoint_new(NULL, 0, path, NULL, NULL,
+        TRUE, NULL);
+    g_assert(worker.endpoint != NULL);
+
+    pid_t master = fork();
+    g_assert_cmpint(master, >=, 0);
+    if (master == 0)
+        _exit(balde_sapi_prefork_run(2, worker.endpoint,
+            (balde_prefork_func_t) fcgi_worker, &worker));
+
+    // the socket is listening already, connections wait for the workers.
+    for (guint i = 0; i < 10; i++) {
+        gint fd = fcgi_connect_unix(path);
+        g_assert_cmpint(fd, >=, 0);
+        struct timeval tv = {.tv_sec = 5};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        GByteArray *ba = g_byte_array_new();
+        fcgi_add_begin_request(ba, 1, 1, 0);
+        fcgi_add_params(ba, 1, "/bola");
+        balde_sapi_fcgi_add_record(ba, 1, 4, NULL, 0);
+        balde_sapi_fcgi_add_record(ba, 1, 5, NULL, 0);
+        fcgi_send(fd, ba);
+        g_byte_array_free(ba, TRUE);
+        GString *out[2] = {g_string_new(NULL), g_string_new(NULL)};
+        guint8 status[2] = {0xff, 0xff};
+        fcgi_receive(fd, out, status, 1);
+        g_assert_cmpint(status[1], ==, 0);
+        g_assert(g_str_has_suffix(out[1]->str, "\r\n\r\n/bola"));
+        g_string_free(out[0], TRUE);
+        g_string_free(out[1], TRUE);
+        close(fd);
+    }
+
+    // graceful stop, the workers are idle and exit right away.
+    gint status;
+    kill(master, SIGQUIT);
+    g_assert_cmpint(waitpid(master, &status, 0), ==, master);
+    g_assert(WIFEXITED(status));
+    g_assert_cmpint(WEXITSTATUS(status), ==, 0);
+
+    // only the process that opened the socket removes it.
+    g_assert(g_file_test(path, G_FILE_TEST_EXISTS));
+    balde_server_endpoint_free(worker.endpoint);
+    g_assert(!g_file_test(path, G_FILE_TEST_EXISTS));
+
+    g_rmdir(dir);
+    g_free(path);
+    g_free(dir);
+    balde_app_free(app);
+}
+
+
+static gint
+fcgi_send_request(const gchar *path, const gchar *path_info)
+{
+    gint fd = fcgi_connect_unix(path);
+    g_assert_cmpint(fd, >=, 0);
+    struct timeval tv = {.tv_sec = 5};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    GByteArray *ba = g_byte_array_new();
+    fcgi_add_begin_request(ba, 1, 1, 1);
+    fcgi_add_params(ba, 1, path_info);
+    balde_sapi_fcgi_add_record(ba, 1, 4, NULL, 0);
+    balde_sapi_fcgi_add_record(ba, 1, 5, NULL, 0);
+    fcgi_send(fd, ba);
+    g_byte_array_free(ba, TRUE);
+    return fd;
+}
+
+
+void
+test_fcgi_server_drain(void)
+{
+    balde_app_t *app = balde_app_init();
+    balde_app_add_url_rule(app, "slow", "/slow", BALDE_HTTP_GET, slow_view);
+    gchar *dir = g_dir_make_tmp("balde-XXXXXX", NULL);
+    gchar *path = g_build_filename(dir, "fcgi.sock", NULL);
+    balde_server_t *server = balde_sapi_fcgi_server_new(app, 1, 2, 0, 0, NULL);
+    g_assert(balde_server_listen_unix(server, path, NULL, NULL, NULL));
+    g_assert(balde_server_start(server, NULL));
+
+    gint idle = fcgi_connect_unix(path);
+    gint fd = fcgi_send_request(path, "/slow");
+    g_usleep(50000);
+
+    // the request in progress is finished, the connections are closed.
+    gint64 start = g_get_monotonic_time();
+    balde_server_drain(server, 5 * G_USEC_PER_SEC);
+    g_assert_cmpint(g_get_monotonic_time() - start, <, 4 * G_USEC_PER_SEC);
+    GString *out[2] = {g_string_new(NULL), g_string_new(NULL)};
+    guint8 status[2] = {0xff, 0xff};
+    fcgi_receive(fd, out, status, 1);
+    g_assert_cmpint(status[1], ==, 0);
+    g_assert(g_str_has_suffix(out[1]->str, "\r\n\r\nslow"));
+    gchar c;
+    g_assert_cmpint(read(fd, &c, 1), ==, 0);
+    g_assert_cmpint(read(idle, &c, 1), ==, 0);
+    close(fd);
+    close(idle);
+    g_string_free(out[0], TRUE);
+    g_string_free(out[1], TRUE);
+
+    // not listening anymore.
+    g_assert_cmpint(fcgi_connect_unix(path), ==, -1);
+    balde_sapi_fcgi_server_free(server);
+
+    // requests past the deadline are dropped.
+    server = balde_sapi_fcgi_server_new(app, 1, 2, 0, 0, NULL);
+    g_assert(balde_server_listen_unix(server, path, NULL, NULL, NULL));
+    g_assert(balde_server_start(server, NULL));
+    fd = fcgi_send_request(path, "/slow");
+    g_usleep(50000);
+    start = g_get_monotonic_time();
+    balde_server_drain(server, 10000);
+    g_assert_cmpint(g_get_monotonic_time() - start, <, 100000);
+    g_assert_cmpint(read(fd, &c, 1), ==, 0);
+    close(fd);
+    balde_sapi_fcgi_server_free(server);
+
+    g_rmdir(dir);
+    g_free(path);
+    g_free(dir);
+    balde_app_free(app);
+}
+
+
+static void
+fcgi_send_slow_requests(gint fd, guint16 first, guint16 last)
+{
+    GByteArray *ba = g_byte_array_new();
+    for (guint16 id = first; id <= last; id++) {
+        fcgi_add_begin_request(ba, id, 1, 1);
+        fcgi_add_params(ba, id, "/slow");
+        balde_sapi_fcgi_add_record(ba, id, 4, NULL, 0);
+        balde_sapi_fcgi_add_record(ba, id, 5, NULL, 0);
+    }
+    fcgi_send(fd, ba);
+    g_byte_array_free(ba, TRUE);
+}
+
+
+void
+test_fcgi_server_overloaded(void)
+{
+    balde_app_t *app = balde_app_init();
+    balde_app_add_url_rule(app, "slow", "/slow", BALDE_HTTP_GET, slow_view);
+    balde_server_t *server = balde_sapi_fcgi_server_new(app, 1, 1, 1, 0, NULL);
+    g_assert(balde_server_start(server, NULL));
+
+    // the first request keeps the only application thread busy, the second
+    // one fills the queue, the others are refused right away.
+    gint fd = fcgi_connect(server);
+    fcgi_send_slow_requests(fd, 1, 1);
+    g_usleep(50000);
+    fcgi_send_slow_requests(fd, 2, 4);
+    g_usleep(50000);
+    g_assert_cmpint(balde_app_get_queued_requests(app), ==, 1);
+    g_assert_cmpint(balde_app_get_shed_requests(app), ==, 2);
+
+    GString *out[5];
+    guint8 status[5] = {0xff, 0xff, 0xff, 0xff, 0xff};
+    for (guint i = 0; i < 5; i++)
+        out[i] = g_string_new(NULL);
+    fcgi_receive(fd, out, status, 4);
+    g_assert_cmpint(status[1], ==, 0);
+    g_assert_cmpint(status[2], ==, 0);
+    g_assert_cmpint(status[3], ==, 2);  // FCGI_OVERLOADED
+    g_assert_cmpint(status[4], ==, 2);
+    g_assert(g_str_has_suffix(out[2]->str, "\r\n\r\nslow"));
+    g_assert_cmpstr(out[3]->str, ==, "");
+    g_assert_cmpstr(out[4]->str, ==, "");
+    g_assert_cmpint(balde_app_get_queued_requests(app), ==, 0);
+    close(fd);
+    balde_sapi_fcgi_server_free(server);
+
+    // requests waiting longer than the budget are refused too.
+    server = balde_sapi_fcgi_server_new(app, 1, 1, 0, 50, NULL);
+    g_assert(balde_server_start(server, NULL));
+    fd = fcgi_connect(server);
+    fcgi_send_slow_requests(fd, 1, 2);
+    for (guint i = 0; i < 5; i++)
+        g_string_truncate(out[i], 0);
+    fcgi_receive(fd, out, status, 2);
+    g_assert_cmpint(status[1], ==, 0);
+    g_assert_cmpint(status[2], ==, 2);
+    g_assert_cmpstr(out[2]->str, ==, "");
+    g_assert_cmpint(balde_app_get_queued_requests(app), ==, 0);
+    g_assert_cmpint(balde_app_get_shed_requests(app), ==, 3);
+    close(fd);
+
+    for (guint i = 0; i < 5; i++)
+        g_string_free(out[i], TRUE);
+    balde_sapi_fcgi_server_free(server);
+    balde_app_free(app);
+}
+
+
+void
+test_fcgi_server_get_values(void)
+{
+    balde_app_t *app = balde_app_init();
+    balde_app_add_url_rule(app, "path", "/<path>", BALDE_HTTP_GET, path_view);
+    balde_server_t *server = balde_sapi_fcgi_server_new(app, 1, 3, 5, 0, NULL);
+    g_assert(balde_server_start(server, NULL));
+
+    gint fd = fcgi_connect(server);
+    GByteArray *ba = g_byte_array_new();
+    GByteArray *names = g_byte_array_new();
+    fcgi_add_param(names, "FCGI_MAX_CONNS", "");
+    fcgi_add_param(names, "FCGI_BOLA", "");
+    fcgi_add_param(names, "FCGI_MAX_REQS", "");
+    fcgi_add_param(names, "FCGI_MPXS_CONNS", "");
+    balde_sapi_fcgi_add_record(ba, 0, 9, names->data, names->len);
+    fcgi_send(fd, ba);
+    g_byte_array_set_size(ba, 0);
+
+    guint8 header[8];
+    gchar content[0xffff + 0xff];
+    g_assert_cmpint(recv(fd, header, 8, MSG_WAITALL), ==, 8);
+    g_assert_cmpint(header[1], ==, 10);  // FCGI_GET_VALUES_RESULT
+    g_assert_cmpint((header[2] << 8) | header[3], ==, 0);
+    gsize len = (header[4] << 8) | header[5];
+    g_assert_cmpint(recv(fd, content, len + header[6], MSG_WAITALL), ==,
+        len + header[6]);
+    const gchar expected[] =
+        "\x0e\x01" "FCGI_MAX_CONNS" "8"
+        "\x0d\x01" "FCGI_MAX_REQS" "8"
+        "\x0f\x01" "FCGI_MPXS_CONNS" "1";
+    g_assert_cmpint(len, ==, sizeof(expected) - 1);
+    g_assert(memcmp(content, expected, len) == 0);
+
+    // management records don't affect the connection.
+    fcgi_add_begin_request(ba, 1, 1, 0);
+    fcgi_add_params(ba, 1, "/bola");
+    balde_sapi_fcgi_add_record(ba, 1, 4, NULL, 0);
+    balde_sapi_fcgi_add_record(ba, 1, 5, NULL, 0);
+    fcgi_send(fd, ba);
+    GString *out[2] = {g_string_new(NULL), g_string_new(NULL)};
+    guint8 status[2] = {0xff, 0xff};
+    fcgi_receive(fd, out, status, 1);
+    g_assert(g_str_has_suffix(out[1]->str, "\r\n\r\n/bola"));
+    close(fd);
+
+    // malformed names drop the connection.
+    fd = fcgi_connect(server);
+    g_byte_array_set_size(ba, 0);
+    g_byte_array_set_size(names, names->len - 1);
+    balde_sapi_fcgi_add_record(ba, 0, 9, names->data, names->len);
+    fcgi_send(fd, ba);
+    g_assert_cmpint(recv(fd, header, 1, 0), ==, 0);
+    close(fd);
+
+    g_string_free(out[0], TRUE);
+    g_string_free(out[1], TRUE);
+    g_byte_array_free(names, TRUE);
+    g_byte_array_free(ba, TRUE);
+    balde_sapi_fcgi_server_free(server);
+    balde_app_free(app);
+}
+
+
+void
+test_fcgi_server_abort(void)
+{
+    balde_app_t *app = balde_app_init();
+    balde_app_add_url_rule(app, "wait", "/wait", BALDE_HTTP_GET, wait_view);
+    balde_app_add_url_rule(app, "path", "/<path>", BALDE_HTTP_GET, path_view);
+    balde_server_t *server = balde_sapi_fcgi_server_new(app, 1, 1, 0, 0, NULL);
+    g_assert(balde_server_start(server, NULL));
+
+    // 1 is running, 2 is waiting for the only application thread, 3 is still
+    // being received.
+    gint fd = fcgi_connect(server);
+    GByteArray *ba = g_byte_array_new();
+    for (guint16 id = 1; id <= 2; id++) {
+        fcgi_add_begin_request(ba, id, 1, 1);
+        fcgi_add_params(ba, id, "/wait");
+        balde_sapi_fcgi_add_record(ba, id, 4, NULL, 0);
+        balde_sapi_fcgi_add_record(ba, id, 5, NULL, 0);
+    }
+    fcgi_add_begin_request(ba, 3, 1, 1);
+    fcgi_add_params(ba, 3, "/wait");
+    fcgi_send(fd, ba);
+    g_byte_array_set_size(ba, 0);
+    g_usleep(100000);
+    g_assert_cmpint(g_atomic_int_get(&waiting_views), ==, 1);
+
+    gint64 start = g_get_monotonic_time();
+    for (guint16 id = 3; id >= 1; id--)
+        balde_sapi_fcgi_add_record(ba, id, 2, NULL, 0);  // FCGI_ABORT_REQUEST
+    fcgi_send(fd, ba);
+    g_byte_array_set_size(ba, 0);
+
+    GString *out[4];
+    guint8 status[4] = {0xff, 0xff, 0xff, 0xff};
+    for (guint i = 0; i < 4; i++)
+        out[i] = g_string_new(NULL);
+    fcgi_receive(fd, out, status, 3);
+    g_assert_cmpint(g_get_monotonic_time() - start, <, G_USEC_PER_SEC);
+    for (guint i = 1; i <= 3; i++) {
+        g_assert_cmpint(status[i], ==, 0);
+        g_assert_cmpstr(out[i]->str, ==, "");
+    }
+
+    // the queued request never ran, and the connection is still usable.
+    g_assert_cmpint(g_atomic_int_get(&waiting_views), ==, 1);
+    fcgi_add_begin_request(ba, 2, 1, 1);
+    fcgi_add_params(ba, 2, "/bola");
+    balde_sapi_fcgi_add_record(ba, 2, 4, NULL, 0);
+    balde_sapi_fcgi_add_record(ba, 2, 5, NULL, 0);
+    balde_sapi_fcgi_add_record(ba, 3, 2, NULL, 0);  // already finished
+    fcgi_send(fd, ba);
+    g_byte_array_free(ba, TRUE);
+    fcgi_receive(fd, out, status, 1);
+    g_assert(g_str_has_suffix(out[2]->str, "\r\n\r\n/bola"));
+    close(fd);
+
+    for (guint i = 0; i < 4; i++)
+        g_string_free(out[i], TRUE);
+    balde_sapi_fcgi_server_free(server);
+    balde_app_free(app);
+}
+
+
+static gdouble
+fcgi_round_trips(gint fd, guint requests)
+{
+    GByteArray *ba = g_byte_array_new();
+    fcgi_add_begin_request(ba, 1, 1, 1);
+    fcgi_add_params(ba, 1, "/bola");
+    balde_sapi_fcgi_add_record(ba, 1, 4, NULL, 0);
+    balde_sapi_fcgi_add_record(ba, 1, 5, NULL, 0);
+    GString *out[2] = {g_string_new(NULL), g_string_new(NULL)};
+    guint8 status[2] = {0xff, 0xff};
+    g_test_timer_start();
+    for (guint i = 0; i < requests; i++) {
+        fcgi_send(fd, ba);
+        fcgi_receive(fd, out, status, 1);
+        g_string_truncate(out[1], 0);
+    }
+    gdouble rv = g_test_timer_elapsed();
+    g_byte_array_free(ba, TRUE);
+    g_string_free(out[0], TRUE);
+    g_string_free(out[1], TRUE);
+    return rv;
+}
+
+
+void
+test_fcgi_server_unix_perf(void)
+{
+    balde_app_t *app = balde_app_init();
+    balde_app_add_url_rule(app, "path", "/<path>", BALDE_HTTP_GET, path_view);
+    balde_server_t *server = balde_sapi_fcgi_server_new(app, 1, 1, 0, 0, NULL);
+    g_assert(balde_server_start(server, NULL));
+    guint requests = g_test_perf() ? 20000 : 200;
+
+    // same server code path, only the transport changes.
+    gint fd = fcgi_connect_tcp(server);
+    gdouble tcp_time = fcgi_round_trips(fd, requests);
+    close(fd);
+    fd = fcgi_connect(server);
+    gdouble unix_time = fcgi_round_trips(fd, requests);
+    close(fd);
+
+    g_test_minimized_result(unix_time,
+        "%u requests: unix: %.3fs, tcp: %.3fs (%.2fx)", requests, unix_time,
+        tcp_time, unix_time > 0 ? tcp_time / unix_time : 0);
+
+    balde_sapi_fcgi_server_free(server);
+    balde_app_free(app);
+}
+
+
+void
+test_fcgi_server_bad_request(void)
+{
+    balde_app_t *app = balde_app_init();
+    balde_server_t *server = balde_sapi_fcgi_server_new(app, 1, 1, 0, 0, NULL);
+    g_assert(server != NULL);
+    g_assert(balde_server_start(server, NULL));
+
+    gint fd = fcgi_connect(server);
+    GByteArray *ba = g_byte_array_new();
+    fcgi_add_begin_request(ba, 1, 1, 0);
+    guint8 params[] = {0x80, 0, 0};
+    balde_sapi_fcgi_add_record(ba, 1, 4, params, sizeof(params));
+    balde_sapi_fcgi_add_record(ba, 1, 5, NULL, 0);
+    fcgi_send(fd, ba);
+    g_byte_array_free(ba, TRUE);
+
+    GString *out[2] = {g_string_new(NULL), g_string_new(NULL)};
+    guint8 status[2] = {0xff, 0xff};
+    fcgi_receive(fd, out, status, 1);
+    g_assert(g_str_has_prefix(out[1]->str, "Status: 400 BAD REQUEST\r\n"));
+    close(fd);
+
+    // the shared application context is untouched.
+    g_assert(app->error == NULL);
+
+    g_string_free(out[0], TRUE);
+    g_string_free(out[1], TRUE);
+    balde_sapi_fcgi_server_free(server);
+    balde_app_free(app);
+}
+
+
+void
+test_fcgi_server_interleaved(void)
+{
+    balde_app_t *app = balde_app_init();
+    balde_app_add_url_rule(app, "big", "/big/<id>", BALDE_HTTP_GET, big_view);
+    balde_server_t *server = balde_sapi_fcgi_server_new(app, 1, 2, 0, 0, NULL);
+    g_assert(server != NULL);
+    g_assert(balde_server_start(server, NULL));
+
+    gint fd = fcgi_connect(server);
+    GByteArray *ba = g_byte_array_new();
+    for (guint16 id = 1; id <= 2; id++) {
+        fcgi_add_begin_request(ba, id, 1, 1);
+        fcgi_add_params(ba, id, id == 1 ? "/big/1" : "/big/2");
+        balde_sapi_fcgi_add_record(ba, id, 4, NULL, 0);
+        balde_sapi_fcgi_add_record(ba, id, 5, NULL, 0);
+    }
+    fcgi_send(fd, ba);
+    g_byte_array_free(ba, TRUE);
+
+    // let both responses pile up in the server before reading. each one is
+    // bigger than the socket buffers.
+    g_usleep(200000);
+
+    guint8 header[8];
+    guint8 content[0xffff + 0xff];
+    guint stdout_records[3] = {0, 0, 0};
+    guint switches = 0;
+    guint16 last_id = 0;
+    guint end_requests = 0;
+    while (end_requests < 2) {
+        g_assert_cmpint(recv(fd, header, 8, MSG_WAITALL), ==, 8);
+        guint16 id = (header[2] << 8) | header[3];
+        gsize len = ((header[4] << 8) | header[5]) + header[6];
+        if (len > 0)
+            g_assert_cmpint(recv(fd, content, len, MSG_WAITALL), ==, len);
+        g_assert(id == 1 || id == 2);
+        if (header[1] == 3)
+            end_requests++;
+        else
+            stdout_records[id]++;
+        if (last_id != 0 && id != last_id)
+            switches++;
+        last_id = id;
+    }
+    close(fd);
+
+    g_assert_cmpint(stdout_records[1], ==, stdout_records[2]);
+    g_assert_cmpint(stdout_records[1], >=, 17);
+
+    // records taking turns on the connection, instead of one response after
+    // the other.
+    g_assert_cmpint(switches, >, 4);
+
+    balde_sapi_fcgi_server_free(server);
+    balde_app_free(app);
+}
+
+
+int
+main(int argc, char** argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/sapi/fcgi/parse_request", test_fcgi_parse_request);
+    g_test_add_func("/sapi/fcgi/parse_request_long_lengths",
+        test_fcgi_parse_request_long_lengths);
+    g_test_add_func("/sapi/fcgi/parse_request_truncated",
+        test_fcgi_parse_request_truncated);
+    g_test_add_func("/sapi/fcgi/add_record", test_fcgi_add_record);
+    g_test_add_func("/sapi/fcgi/server_workers", test_fcgi_server_workers);
+    g_test_add_func("/sapi/fcgi/server", test_fcgi_server);
+    g_test_add_func("/sapi/fcgi/server_multiplexed",
+        test_fcgi_server_multiplexed);
+    g_test_add_func("/sapi/fcgi/server_interleaved",
+        test_fcgi_server_interleaved);
+    g_test_add_func("/sapi/fcgi/server_big_body", test_fcgi_server_big_body);
+    g_test_add_func("/sapi/fcgi/server_stream", test_fcgi_server_stream);
+    g_test_add_func("/sapi/fcgi/server_unix", test_fcgi_server_unix);
+    g_test_add_func("/sapi/fcgi/server_unix_perf", test_fcgi_server_unix_perf);
+    g_test_add_func("/sapi/fcgi/server_drain", test_fcgi_server_drain);
+    g_test_add_func("/sapi/fcgi/server_overloaded",
+        test_fcgi_server_overloaded);
+    g_test_add_func("/sapi/fcgi/server_abort", test_fcgi_server_abort);
+    g_test_add_func("/sapi/fcgi/server_get_values",
+        test_fcgi_server_get_values);
+    g_test_add_func("/sapi/fcgi/server_bad_request",
+        test_fcgi_server_bad_request);
+    return g_test_run();
+}
@@ -12,79 +12,170 @@
 
 #include <glib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 #include "../src/balde.h"
 #include "../src/app.h"
 #include "../src/requests.h"
 #include "../src/responses.h"
 #include "../src/sapi/httpd.h"
+#include "../src/sapi/server.h"
 
 
-void
-test_httpd_parse_request(void)
+static gint
+http_connect(balde_server_t *server)
 {
-    balde_app_t *app = balde_app_init();
-    const gchar *test =
-        "GET /bola?foo=bar&baz=lol HTTP/1.1\r\n"
-        "Host: example.com\r\n"
-        "Location: /foo\r\n"
-        "Chunda: rs\r\n"
-        "Content-Length: 6\r\n"
-        "\r\n"
-        "XD=asd\r\n";
-    GInputStream *tmp = g_memory_input_stream_new_from_data (test, strlen(test), NULL);
-    balde_sapi_httpd_parser_data_t *data = balde_sapi_httpd_parse_request(app, tmp);
-    balde_request_env_t *req = data->env;
-    g_object_unref(tmp);
-    g_assert(req != NULL);
-    g_assert_cmpstr(req->request_method, ==, "GET");
-    g_assert_cmpstr(req->path_info, ==, "/bola");
-    g_assert_cmpstr(req->query_string, ==, "foo=bar&baz=lol");
-    g_assert(req->headers != NULL);
-    g_assert_cmpstr(g_hash_table_lookup(req->headers, "host"), ==, "example.com");
-    g_assert_cmpstr(g_hash_table_lookup(req->headers, "location"), ==, "/foo");
-    g_assert_cmpstr(g_hash_table_lookup(req->headers, "chunda"), ==, "rs");
-    g_assert_cmpstr(g_hash_table_lookup(req->headers, "content-length"), ==, "6");
-    g_assert_cmpstr(req->body->str, ==, "XD=asd");
-    g_assert_cmpint(req->body->len, ==, 6);
-    g_assert(!req->https);
-    g_free(data->request_line);
-    g_free(data);
-    balde_request_env_free(req);
-    balde_app_free(app);
+    gint fds[2];
+    g_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    struct timeval tv = {5, 0};
+    setsockopt(fds[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    balde_server_add_connection(server, fds[1]);
+    return fds[0];
 }
 
 
-void
-test_httpd_parse_request_without_query_string(void)
+static void
+http_send(gint fd, const gchar *str)
+{
+    g_assert_cmpint(write(fd, str, strlen(str)), ==, strlen(str));
+}
+
+
+// reads a response, up to the end of its body.
+static gchar*
+http_receive(gint fd)
+{
+    GString *rv = g_string_new(NULL);
+    gchar c;
+    while (!g_str_has_suffix(rv->str, "\r\n\r\n")) {
+        g_assert_cmpint(recv(fd, &c, 1, 0), ==, 1);
+        g_string_append_c(rv, c);
+    }
+    gchar *len = strstr(rv->str, "Content-Length: ");
+    gsize body_len = len != NULL ? g_ascii_strtoull(len + 16, NULL, 10) : 0;
+    gsize offset = rv->len;
+    g_string_set_size(rv, offset + body_len);
+    if (body_len > 0)
+        g_assert_cmpint(recv(fd, rv->str + offset, body_len, MSG_WAITALL), ==,
+            body_len);
+    return g_string_free(rv, FALSE);
+}
+
+
+// reads the chunks of a response body, up to the last one.
+static gchar*
+http_receive_chunks(gint fd)
+{
+    GString *rv = g_string_new(NULL);
+    while (TRUE) {
+        GString *line = g_string_new(NULL);
+        gchar c;
+        while (!g_str_has_suffix(line->str, "\r\n")) {
+            g_assert_cmpint(recv(fd, &c, 1, 0), ==, 1);
+            g_string_append_c(line, c);
+        }
+        gsize len = g_ascii_strtoull(line->str, NULL, 16);
+        g_string_free(line, TRUE);
+        gsize offset = rv->len;
+        g_string_set_size(rv, offset + len + 2);
+        g_assert_cmpint(recv(fd, rv->str + offset, len + 2, MSG_WAITALL), ==,
+            len + 2);
+        g_assert(rv->str[offset + len] == '\r' && rv->str[offset + len + 1] == '\n');
+        g_string_truncate(rv, offset + len);
+        if (len == 0)
+            break;
+    }
+    return g_string_free(rv, FALSE);
+}
+
+
+static void
+http_assert_closed(gint fd)
+{
+    gchar c;
+    g_assert_cmpint(recv(fd, &c, 1, 0), ==, 0);
+}
+
+
+static balde_response_t*
+path_view(balde_app_t *app, balde_request_t *request)
+{
+    return balde_make_response(request->path);
+}
+
+
+static balde_response_t*
+slow_view(balde_app_t *app, balde_request_t *request)
+{
+    g_usleep(300000);
+    return balde_make_response("slow");
+}
+
+
+static balde_response_t*
+body_view(balde_app_t *app, balde_request_t *request)
+{
+    GString *body = request->priv->body;
+    gchar *rv = g_strdup_printf("%zu %s", body != NULL ? body->len : 0,
+        body != NULL ? body->str : "");
+    balde_response_t *response = balde_make_response(rv);
+    g_free(rv);
+    return response;
+}
+
+
+static gboolean
+stream_func(balde_app_t *app, balde_request_t *request,
+    balde_response_t *response, gpointer user_data)
+{
+    gint *produced = user_data;
+    gchar *chunk = g_strnfill(4096, 'a' + *produced);
+    balde_response_append_body(response, chunk);
+    g_free(chunk);
+    return ++(*produced) < 8;
+}
+
+
+static balde_response_t*
+stream_view(balde_app_t *app, balde_request_t *request)
+{
+    balde_response_t *response = balde_make_response("bola");
+    balde_response_set_stream(response, stream_func, g_new0(gint, 1), g_free);
+    return response;
+}
+
+
+static balde_response_t*
+slow_stream_view(balde_app_t *app, balde_request_t *request)
+{
+    g_usleep(200000);
+    return stream_view(app, request);
+}
+
+
+static gint counted = 0;
+
+static balde_response_t*
+count_view(balde_app_t *app, balde_request_t *request)
+{
+    g_atomic_int_inc(&counted);
+    return balde_make_response("counted");
+}
+
+
+static balde_app_t*
+http_app_new(void)
 {
     balde_app_t *app = balde_app_init();
-    const gchar *test =
-        "GET /bola HTTP/1.1\r\n"
-        "Host: example.com\r\n"
-        "Location: /foo\r\n"
-        "Chunda: rs\r\n"
-        "Content-Length: 6\r\n"
-        "\r\n"
-        "XD=asd\r\n";
-    GInputStream *tmp = g_memory_input_stream_new_from_data (test, strlen(test), NULL);
-    balde_sapi_httpd_parser_data_t *data = balde_sapi_httpd_parse_request(app, tmp);
-    balde_request_env_t *req = data->env;
-    g_object_unref(tmp);
-    g_assert(req != NULL);
-    g_assert_cmpstr(req->request_method, ==, "GET");
-    g_assert_cmpstr(req->path_info, ==, "/bola");
-    g_assert_cmpstr(req->query_string, ==, "");
-    g_assert(req->headers != NULL);
-    g_assert_cmpstr(g_hash_table_lookup(req->headers, "host"), ==, "example.com");
-    g_assert_cmpstr(g_hash_table_lookup(req->headers, "location"), ==, "/foo");
-    g_assert_cmpstr(g_hash_table_lookup(req->headers, "chunda"), ==, "rs");
-    g_assert_cmpstr(g_hash_table_lookup(req->headers, "content-length"), ==, "6");
-    g_assert_cmpstr(req->body->str, ==, "XD=asd");
-    g_assert_cmpint(req->body->len, ==, 6);
-    g_free(data->request_line);
-    g_free(data);
-    balde_request_env_free(req);
-    balde_app_free(app);
+    balde_app_add_url_rule(app, "stream", "/stream", BALDE_HTTP_GET, stream_view);
+    balde_app_add_url_rule(app, "slow_stream", "/slow-stream", BALDE_HTTP_GET,
+        slow_stream_view);
+    balde_app_add_url_rule(app, "slow", "/slow", BALDE_HTTP_GET, slow_view);
+    balde_app_add_url_rule(app, "body", "/body", BALDE_HTTP_POST, body_view);
+    balde_app_add_url_rule(app, "count", "/count", BALDE_HTTP_POST, count_view);
+    balde_app_add_url_rule(app, "path", "/<path>", BALDE_HTTP_GET, path_view);
+    return app;
 }
 
 
@@ -94,9 +185,8 @@ test_httpd_response_render(void)
     balde_response_t *res = balde_make_response("lol");
     GString *out = balde_sapi_httpd_response_render(res, TRUE);
     g_assert_cmpstr(out->str, ==,
-        "HTTP/1.0 200 OK\r\n"
+        "HTTP/1.1 200 OK\r\n"
         "Date: Fri, 13 Feb 2009 23:31:30 GMT\r\n"
-        "Connection: close\r\n"
         "Content-Type: text/html; charset=utf-8\r\n"
         "Content-Length: 3\r\n"
         "\r\n"
@@ -113,9 +203,8 @@ test_httpd_response_render_with_custom_mime_type(void)
     balde_response_set_header(res, "content-type", "text/plain");
     GString *out = balde_sapi_httpd_response_render(res, TRUE);
     g_assert_cmpstr(out->str, ==,
-        "HTTP/1.0 200 OK\r\n"
+        "HTTP/1.1 200 OK\r\n"
         "Date: Fri, 13 Feb 2009 23:31:30 GMT\r\n"
-        "Connection: close\r\n"
         "Content-Type: text/plain\r\n"
         "Content-Length: 3\r\n"
         "\r\n"
@@ -134,13 +223,12 @@ test_httpd_response_render_with_multiple_cookies(void)
     balde_response_set_cookie(res, "xd", ":D", -1, -1, "/bola/", NULL, TRUE, FALSE);
     GString *out = balde_sapi_httpd_response_render(res, TRUE);
     g_assert_cmpstr(out->str, ==,
-        "HTTP/1.0 200 OK\r\n"
+        "HTTP/1.1 200 OK\r\n"
         "Date: Fri, 13 Feb 2009 23:31:30 GMT\r\n"
         "Set-Cookie: bola=\"guda\"; Expires=Fri, 13-Feb-2009 23:32:30 GMT; Max-Age=60; Path=/\r\n"
         "Set-Cookie: asd=\"qwe\"; HttpOnly; Path=/\r\n"
         "Set-Cookie: xd=\":D\"; Secure; Path=/bola/\r\n"
         "Content-Type: text/html; charset=utf-8\r\n"
-        "Connection: close\r\n"
         "Content-Length: 3\r\n"
         "\r\n"
         "lol");
@@ -155,9 +243,8 @@ test_httpd_response_render_without_body(void)
     balde_response_t *res = balde_make_response("lol");
     GString *out = balde_sapi_httpd_response_render(res, FALSE);
     g_assert_cmpstr(out->str, ==,
-        "HTTP/1.0 200 OK\r\n"
+        "HTTP/1.1 200 OK\r\n"
         "Date: Fri, 13 Feb 2009 23:31:30 GMT\r\n"
-        "Connection: close\r\n"
         "Content-Type: text/html; charset=utf-8\r\n"
         "Content-Length: 3\r\n"
         "\r\n");
@@ -166,6 +253,20 @@ test_httpd_response_render_without_body(void)
 }
 
 
+void
+test_httpd_response_render_stream(void)
+{
+    balde_response_t *res = stream_view(NULL, NULL);
+    GString *out = balde_sapi_httpd_response_render(res, TRUE);
+    g_assert(g_str_has_prefix(out->str, "HTTP/1.1 200 OK\r\n"));
+    g_assert(strstr(out->str, "Content-Length") == NULL);
+    g_assert(strstr(out->str, "Transfer-Encoding") == NULL);
+    g_assert(g_str_has_suffix(out->str, "\r\n\r\nbola"));
+    g_string_free(out, TRUE);
+    balde_response_free(res);
+}
+
+
 void
 test_httpd_response_render_exception(void)
 {
@@ -175,9 +276,8 @@ test_httpd_response_render_exception(void)
     g_assert(res != NULL);
     GString *out = balde_sapi_httpd_response_render(res, TRUE);
     g_assert_cmpstr(out->str, ==,
-        "HTTP/1.0 404 NOT FOUND\r\n"
+        "HTTP/1.1 404 NOT FOUND\r\n"
         "Date: Fri, 13 Feb 2009 23:31:30 GMT\r\n"
-        "Connection: close\r\n"
         "Content-Type: text/plain; charset=utf-8\r\n"
         "Content-Length: 136\r\n"
         "\r\n"
@@ -198,9 +298,8 @@ test_httpd_response_render_exception_without_body(void)
     g_assert(res != NULL);
     GString *out = balde_sapi_httpd_response_render(res, FALSE);
     g_assert_cmpstr(out->str, ==,
-        "HTTP/1.0 404 NOT FOUND\r\n"
+        "HTTP/1.1 404 NOT FOUND\r\n"
         "Date: Fri, 13 Feb 2009 23:31:30 GMT\r\n"
-        "Connection: close\r\n"
         "Content-Type: text/plain; charset=utf-8\r\n"
         "Content-Length: 136\r\n"
         "\r\n");
@@ -210,13 +309,581 @@ test_httpd_response_render_exception_without_body(void)
 }
 
 
+void
+test_httpd_parse_headers(void)
+{
+    gchar *test = g_strdup(
+        "POST /bola?foo=bar HTTP/1.0\r\n"
+        "Host:example.com\r\n"
+        "X-Stuff :  with spaces  \r\n"
+        "Connection: Keep-Alive\r\n"
+        "Content-Length: 6\r\n"
+        "\r\n");
+    balde_sapi_httpd_parser_data_t *data = balde_sapi_httpd_parse_headers(test,
+        strlen(test));
+    g_assert(data != NULL);
+    g_assert_cmpstr(data->request_line, ==, "POST /bola?foo=bar HTTP/1.0");
+    g_assert_cmpstr(data->env->request_method, ==, "POST");
+    g_assert_cmpstr(data->env->path_info, ==, "/bola");
+    g_assert_cmpstr(data->env->query_string, ==, "foo=bar");
+    g_assert_cmpstr(g_hash_table_lookup(data->env->headers, "host"), ==,
+        "example.com");
+    g_assert_cmpstr(g_hash_table_lookup(data->env->headers, "x-stuff"), ==,
+        "with spaces");
+    g_assert_cmpint(data->content_length, ==, 6);
+    g_assert(!data->chunked);
+    g_assert(data->http_1_0);
+    g_assert(data->keep_alive);
+    balde_sapi_httpd_parser_data_free(data);
+
+    test = g_strdup(
+        "POST /bola HTTP/1.1\r\n"
+        "Transfer-Encoding: Chunked\r\n"
+        "\r\n");
+    data = balde_sapi_httpd_parse_headers(test, strlen(test));
+    g_assert(data != NULL);
+    g_assert(data->chunked);
+    g_assert_cmpint(data->content_length, ==, 0);
+    balde_sapi_httpd_parser_data_free(data);
+
+    const gchar *bad[] = {
+        "GET /bola\r\n\r\n",
+        "GET /bola HTTP/2.0\r\n\r\n",
+        "GET /bola HTTP/1.1\r\nContent-Length: 1a\r\n\r\n",
+        "GET /bola HTTP/1.1\r\nX-Bola: a\r\n folded\r\n\r\n",
+        "POST /bola HTTP/1.1\r\nContent-Length: 6\r\n"
+            "Transfer-Encoding: chunked\r\n\r\n",
+        "POST /bola HTTP/1.0\r\nTransfer-Encoding: chunked\r\n\r\n",
+        NULL,
+    };
+    for (guint i = 0; bad[i] != NULL; i++)
+        g_assert(balde_sapi_httpd_parse_headers(g_strdup(bad[i]),
+            strlen(bad[i])) == NULL);
+}
+
+
+void
+test_httpd_parse_headers_without_query_string(void)
+{
+    gchar *test = g_strdup(
+        "GET /bola HTTP/1.1\r\n"
+        "Host: example.com\r\n"
+        "Location: /foo\r\n"
+        "Chunda: rs\r\n"
+        "Content-Length: 6\r\n"
+        "\r\n");
+    balde_sapi_httpd_parser_data_t *data = balde_sapi_httpd_parse_headers(test,
+        strlen(test));
+    g_assert(data != NULL);
+    balde_request_env_t *req = data->env;
+    g_assert_cmpstr(req->request_method, ==, "GET");
+    g_assert_cmpstr(req->path_info, ==, "/bola");
+    g_assert_cmpstr(req->query_string, ==, "");
+    g_assert(req->headers != NULL);
+    g_assert_cmpstr(g_hash_table_lookup(req->headers, "host"), ==, "example.com");
+    g_assert_cmpstr(g_hash_table_lookup(req->headers, "location"), ==, "/foo");
+    g_assert_cmpstr(g_hash_table_lookup(req->headers, "chunda"), ==, "rs");
+    g_assert_cmpstr(g_hash_table_lookup(req->headers, "content-length"), ==, "6");
+    g_assert(req->body == NULL);
+    g_assert(!req->https);
+    g_assert_cmpint(data->content_length, ==, 6);
+    g_assert(!data->http_1_0);
+    g_assert(data->keep_alive);
+    balde_sapi_httpd_parser_data_free(data);
+}
+
+
+void
+test_httpd_server_keep_alive(void)
+{
+    balde_app_t *app = http_app_new();
+    balde_server_t *server = balde_sapi_httpd_server_new(app, 1, 2, 0, 0, NULL);
+    g_assert(server != NULL);
+    g_assert(balde_server_start(server, NULL));
+
+    // HTTP/1.1 connections stay open.
+    gint fd = http_connect(server);
+    http_send(fd, "GET /bola HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    gchar *out = http_receive(fd);
+    g_assert(g_str_has_prefix(out, "HTTP/1.1 200 OK\r\n"));
+    g_assert(strstr(out, "Connection:") == NULL);
+    g_assert(g_str_has_suffix(out, "\r\n\r\n/bola"));
+    g_free(out);
+    http_send(fd, "GET /guda HTTP/1.1\r\nHost: localhost\r\n"
+        "Connection: close\r\n\r\n");
+    out = http_receive(fd);
+    g_assert(strstr(out, "\r\nConnection: close\r\n") != NULL);
+    g_assert(g_str_has_suffix(out, "\r\n\r\n/guda"));
+    g_free(out);
+    http_assert_closed(fd);
+    close(fd);
+
+    // HTTP/1.0 connections don't, unless asked to.
+    fd = http_connect(server);
+    http_send(fd, "GET /bola HTTP/1.0\r\nConnection: keep-alive\r\n\r\n");
+    out = http_receive(fd);
+    g_assert(strstr(out, "\r\nConnection: keep-alive\r\n") != NULL);
+    g_free(out);
+    http_send(fd, "GET /guda HTTP/1.0\r\n\r\n");
+    out = http_receive(fd);
+    g_assert(strstr(out, "\r\nConnection: close\r\n") != NULL);
+    g_assert(g_str_has_suffix(out, "\r\n\r\n/guda"));
+    g_free(out);
+    http_assert_closed(fd);
+    close(fd);
+
+    balde_sapi_httpd_server_free(server);
+    balde_app_free(app);
+}
+
+
+void
+test_httpd_server_pipelined(void)
+{
+    balde_app_t *app = http_app_new();
+    balde_server_t *server = balde_sapi_httpd_server_new(app, 1, 4, 0, 0, NULL);
+    g_assert(balde_server_start(server, NULL));
+
+    // requests sent back to back are answered in order, even if the first
+    // one is the slowest, and the body of one isn't taken for the next.
+    gint fd = http_connect(server);
+    http_send(fd,
+        "GET /slow HTTP/1.1\r\n\r\n"
+        "POST /body HTTP/1.1\r\nContent-Length: 6\r\n\r\nXD=asd"
+        "\r\n"  // stray empty line, ignored
+        "HEAD /bola HTTP/1.1\r\n\r\n"
+        "GET /guda HTTP/1.1\r\nConnection: close\r\n\r\n"
+        "GET /ignored HTTP/1.1\r\n\r\n");
+    gchar *out = http_receive(fd);
+    g_assert(g_str_has_suffix(out, "\r\n\r\nslow"));
+    g_free(out);
+    out = http_receive(fd);
+    g_assert(g_str_has_suffix(out, "\r\n\r\n6 XD=asd"));
+    g_free(out);
+
+    // responses to HEAD requests have a Content-Length, but no body.
+    GString *head = g_string_new(NULL);
+    gchar c;
+    while (!g_str_has_suffix(head->str, "\r\n\r\n")) {
+        g_assert_cmpint(recv(fd, &c, 1, 0), ==, 1);
+        g_string_append_c(head, c);
+    }
+    g_assert(strstr(head->str, "\r\nContent-Length: 5\r\n") != NULL);
+    g_string_free(head, TRUE);
+
+    out = http_receive(fd);
+    g_assert(g_str_has_suffix(out, "\r\n\r\n/guda"));
+    g_free(out);
+    http_assert_closed(fd);
+    close(fd);
+
+    balde_sapi_httpd_server_free(server);
+    balde_app_free(app);
+}
+
+
+void
+test_httpd_server_pipelined_after_close(void)
+{
+    balde_app_t *app = http_app_new();
+    balde_server_t *server = balde_sapi_httpd_server_new(app, 1, 4, 0, 0, NULL);
+    g_assert(balde_server_start(server, NULL));
+
+    // a streamed response to HTTP/1.0 ends with the connection, so the
+    // requests pipelined after it are never run.
+    g_atomic_int_set(&counted, 0);
+    gint fd = http_connect(server);
+    http_send(fd,
+        "GET /stream HTTP/1.0\r\nConnection: keep-alive\r\n\r\n"
+        "POST /count HTTP/1.1\r\n\r\n"
+        "POST /count HTTP/1.1\r\n\r\n");
+    GString *out = g_string_new(NULL);
+    gchar buf[4096];
+    gssize n;
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0)
+        g_string_append_len(out, buf, n);
+    g_assert_cmpint(n, ==, 0);
+    g_assert(g_str_has_prefix(out->str, "HTTP/1.1 200 OK\r\n"));
+    g_assert(strstr(out->str, "\r\nConnection: close\r\n") != NULL);
+    g_assert(strstr(out->str, "counted") == NULL);
+    g_string_free(out, TRUE);
+    close(fd);
+    g_usleep(100000);
+    g_assert_cmpint(g_atomic_int_get(&counted), ==, 0);
+
+    balde_sapi_httpd_server_free(server);
+    balde_app_free(app);
+
+    // requests refused because the application is overloaded close the
+    // connection too.
+    app = http_app_new();
+    server = balde_sapi_httpd_server_new(app, 1, 1, 1, 0, NULL);
+    g_assert(balde_server_start(server, NULL));
+    gint busy[2];
+    for (guint i = 0; i < 2; i++) {
+        busy[i] = http_connect(server);
+        http_send(busy[i], "GET /slow HTTP/1.1\r\n\r\n");
+        g_usleep(50000);
+    }
+    fd = http_connect(server);
+    http_send(fd,
+        "POST /count HTTP/1.1\r\n\r\n"
+        "POST /count HTTP/1.1\r\n\r\n");
+    gchar *res = http_receive(fd);
+    g_assert(g_str_has_prefix(res, "HTTP/1.1 503 SERVICE UNAVAILABLE\r\n"));
+    g_free(res);
+    http_assert_closed(fd);
+    close(fd);
+    for (guint i = 0; i < 2; i++) {
+        res = http_receive(busy[i]);
+        g_assert(g_str_has_suffix(res, "\r\n\r\nslow"));
+        g_free(res);
+        close(busy[i]);
+    }
+    g_usleep(100000);
+    g_assert_cmpint(g_atomic_int_get(&counted), ==, 0);
+
+    balde_sapi_httpd_server_free(server);
+    balde_app_free(app);
+}
+
+
+void
+test_httpd_server_half_closed(void)
+{
+    balde_app_t *app = http_app_new();
+    balde_server_t *server = balde_sapi_httpd_server_new(app, 1, 4, 0, 0, NULL);
+    g_assert(balde_server_start(server, NULL));
+
+    // clients that are done sending still get their responses, and then the
+    // connection is closed. an incomplete request is dropped.
+    gint fd = http_connect(server);
+    http_send(fd,
+        "GET /slow HTTP/1.1\r\n\r\n"
+        "GET /bola HTTP/1.1\r\n\r\n"
+        "POST /body HTTP/1.1\r\nContent-Length: 6\r\n\r\nXD");
+    g_assert(shutdown(fd, SHUT_WR) == 0);
+    gchar *out = http_receive(fd);
+    g_assert(g_str_has_suffix(out, "\r\n\r\nslow"));
+    g_free(out);
+    out = http_receive(fd);
+    g_assert(g_str_has_suffix(out, "\r\n\r\n/bola"));
+    g_free(out);
+    http_assert_closed(fd);
+    close(fd);
+
+    balde_sapi_httpd_server_free(server);
+    balde_app_free(app);
+}
+
+
+void
+test_httpd_server_body(void)
+{
+    balde_app_t *app = http_app_new();
+    balde_server_t *server = balde_sapi_httpd_server_new(app, 1, 2, 0, 0, NULL);
+    g_assert(balde_server_start(server, NULL));
+
+    // clients that ask for it get an interim response before sending the
+    // body, that may arrive in pieces.
+    gint fd = http_connect(server);
+    http_send(fd, "POST /body HTTP/1.1\r\nContent-Length: 14\r\n"
+        "Expect: 100-continue\r\n\r\n");
+    gchar *out = http_receive(fd);
+    g_assert_cmpstr(out, ==, "HTTP/1.1 100 Continue\r\n\r\n");
+    g_free(out);
+    http_send(fd, "XD=asd");
+    g_usleep(20000);
+    http_send(fd, "&foo=bar");
+    out = http_receive(fd);
+    g_assert(g_str_has_prefix(out, "HTTP/1.1 200 OK\r\n"));
+    g_assert(g_str_has_suffix(out, "\r\n\r\n14 XD=asd&foo=bar"));
+    g_free(out);
+    close(fd);
+
+    balde_sapi_httpd_server_free(server);
+    balde_app_free(app);
+}
+
+
+void
+test_httpd_server_chunked_body(void)
+{
+    balde_app_t *app = http_app_new();
+    balde_server_t *server = balde_sapi_httpd_server_new(app, 1, 2, 0, 0, NULL);
+    g_assert(balde_server_start(server, NULL));
+
+    // chunks may be split anywhere, and the connection is still usable after
+    // the trailer.
+    gint fd = http_connect(server);
+    http_send(fd, "POST /body HTTP/1.1\r\nTransfer-Encoding: chunked\r\n"
+        "Expect: 100-continue\r\n\r\n");
+    gchar *out = http_receive(fd);
+    g_assert_cmpstr(out, ==, "HTTP/1.1 100 Continue\r\n\r\n");
+    g_free(out);
+    const gchar *pieces[] = {"6;ext=1\r", "\nXD=", "asd\r\n8\r\n&foo=bar",
+        "\r\n0\r\nX-Trailer: ", "lol\r\n", "\r\n"};
+    for (guint i = 0; i < G_N_ELEMENTS(pieces); i++) {
+        http_send(fd, pieces[i]);
+        g_usleep(10000);
+    }
+    out = http_receive(fd);
+    g_assert(g_str_has_prefix(out, "HTTP/1.1 200 OK\r\n"));
+    g_assert(g_str_has_suffix(out, "\r\n\r\n14 XD=asd&foo=bar"));
+    g_free(out);
+    http_send(fd, "GET /bola HTTP/1.1\r\n\r\n");
+    out = http_receive(fd);
+    g_assert(g_str_has_suffix(out, "\r\n\r\n/bola"));
+    g_free(out);
+    close(fd);
+
+    // the chunk size is a promise.
+    fd = http_connect(server);
+    http_send(fd, "POST /body HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+        "3\r\nXD=asd\r\n0\r\n\r\n");
+    out = http_receive(fd);
+    g_assert(g_str_has_prefix(out, "HTTP/1.1 400 BAD REQUEST\r\n"));
+    g_free(out);
+    http_assert_closed(fd);
+    close(fd);
+
+    balde_sapi_httpd_server_free(server);
+    balde_app_free(app);
+}
+
+
+void
+test_httpd_server_stream(void)
+{
+    balde_app_t *app = http_app_new();
+    balde_server_t *server = balde_sapi_httpd_server_new(app, 1, 2, 0, 0, NULL);
+    g_assert(balde_server_start(server, NULL));
+
+    // HTTP/1.1 clients get the body in chunks, as produced, and the
+    // connection stays open.
+    gint fd = http_connect(server);
+    http_send(fd, "GET /stream HTTP/1.1\r\n\r\n");
+    gchar *out = http_receive(fd);
+    g_assert(g_str_has_prefix(out, "HTTP/1.1 200 OK\r\n"));
+    g_assert(strstr(out, "\r\nTransfer-Encoding: chunked\r\n") != NULL);
+    g_assert(strstr(out, "Content-Length") == NULL);
+    g_assert(strstr(out, "Connection:") == NULL);
+    g_free(out);
+    gchar *body = http_receive_chunks(fd);
+    g_assert_cmpint(strlen(body), ==, 4 + 8 * 4096);
+    g_assert(g_str_has_prefix(body, "bolaaaa"));
+    for (guint i = 0; i < 8; i++)
+        g_assert_cmpint(body[4 + i * 4096], ==, 'a' + i);
+    g_free(body);
+
+    // HEAD requests get the same headers, without chunks.
+    http_send(fd, "HEAD /stream HTTP/1.1\r\n\r\n");
+    out = http_receive(fd);
+    g_assert(strstr(out, "\r\nTransfer-Encoding: chunked\r\n") != NULL);
+    g_free(out);
+    http_send(fd, "GET /bola HTTP/1.1\r\nConnection: close\r\n\r\n");
+    out = http_receive(fd);
+    g_assert(g_str_has_suffix(out, "\r\n\r\n/bola"));
+    g_free(out);
+    http_assert_closed(fd);
+    close(fd);
+
+    // HTTP/1.0 clients get the body up to the end of the connection, even if
+    // they asked to keep it open.
+    fd = http_connect(server);
+    http_send(fd, "GET /stream HTTP/1.0\r\nConnection: keep-alive\r\n\r\n");
+    out = http_receive(fd);
+    g_assert(strstr(out, "\r\nConnection: close\r\n") != NULL);
+    g_assert(strstr(out, "Transfer-Encoding") == NULL);
+    g_free(out);
+    GString *rest = g_string_new(NULL);
+    gchar buf[4096];
+    gssize n;
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0)
+        g_string_append_len(rest, buf, n);
+    g_assert_cmpint(n, ==, 0);
+    g_assert_cmpint(rest->len, ==, 4 + 8 * 4096);
+    g_assert_cmpint(rest->str[rest->len - 1], ==, 'h');
+    g_string_free(rest, TRUE);
+    close(fd);
+
+    // clients gone before the response starts get nothing, and the server
+    // keeps going.
+    fd = http_connect(server);
+    http_send(fd, "GET /slow-stream HTTP/1.1\r\n\r\n");
+    close(fd);
+    g_usleep(400000);
+    fd = http_connect(server);
+    http_send(fd, "GET /bola HTTP/1.1\r\n\r\n");
+    out = http_receive(fd);
+    g_assert(g_str_has_suffix(out, "\r\n\r\n/bola"));
+    g_free(out);
+    close(fd);
+
+    balde_sapi_httpd_server_free(server);
+    balde_app_free(app);
+}
+
+
+void
+test_httpd_server_limits(void)
+{
+    balde_app_t *app = http_app_new();
+    balde_server_t *server = balde_sapi_httpd_server_new(app, 1, 2, 0, 0, NULL);
+    balde_sapi_httpd_server_set_limits(server, 128, 16);
+    g_assert(balde_server_start(server, NULL));
+
+    struct {
+        const gchar *request;
+        const gchar *status;
+    } tests[] = {
+        {"GET /bola\r\n\r\n", "400 BAD REQUEST"},
+        {"POST /body HTTP/1.1\r\nContent-Length: 17\r\n\r\n",
+            "413 REQUEST ENTITY TOO LARGE"},
+        {"POST /body HTTP/1.1\r\nTransfer-Encoding: gzip, chunked\r\n\r\n",
+            "501 NOT IMPLEMENTED"},
+        {"POST /body HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+            "zz\r\n", "400 BAD REQUEST"},
+        {"POST /body HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+            "2\r\nXDX\r\n", "400 BAD REQUEST"},
+        {"POST /body HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+            "8\r\n12345678\r\n9\r\n", "413 REQUEST ENTITY TOO LARGE"},
+        {"POST /body HTTP/1.1\r\nContent-Length: 1\r\nExpect: bola\r\n\r\n",
+            "417 EXPECTATION FAILED"},
+        {NULL, NULL},
+    };
+    for (guint i = 0; tests[i].request != NULL; i++) {
+        gint fd = http_connect(server);
+        http_send(fd, tests[i].request);
+        gchar *out = http_receive(fd);
+        g_assert(g_str_has_prefix(out + 9, tests[i].status));
+        g_assert(strstr(out, "\r\nConnection: close\r\n") != NULL);
+        g_free(out);
+        http_assert_closed(fd);
+        close(fd);
+    }
+
+    // oversized request lines and header blocks are refused without waiting
+    // for the rest.
+    gchar *long_path = g_strnfill(200, 'a');
+    gchar *long_headers = g_strnfill(200, 'a');
+    long_headers[3] = ':';
+    gchar *requests[] = {
+        g_strdup_printf("GET /%s", long_path),
+        g_strdup_printf("GET / HTTP/1.1\r\nX-%s\r\n", long_headers),
+    };
+    const gchar *statuses[] = {
+        "414 REQUEST URI TOO LONG",
+        "431 REQUEST HEADER FIELDS TOO LARGE",
+    };
+    for (guint i = 0; i < G_N_ELEMENTS(requests); i++) {
+        gint fd = http_connect(server);
+        http_send(fd, requests[i]);
+        gchar *out = http_receive(fd);
+        g_assert(g_str_has_prefix(out + 9, statuses[i]));
+        g_free(out);
+        http_assert_closed(fd);
+        close(fd);
+        g_free(requests[i]);
+    }
+    g_free(long_path);
+    g_free(long_headers);
+
+    // the shared application context is untouched.
+    g_assert(app->error == NULL);
+
+    balde_sapi_httpd_server_free(server);
+    balde_app_free(app);
+}
+
+
+void
+test_httpd_server_linger(void)
+{
+    balde_app_t *app = http_app_new();
+    balde_server_t *server = balde_sapi_httpd_server_new(app, 1, 2, 0, 0, NULL);
+    balde_sapi_httpd_server_set_limits(server, 128, 16);
+    g_assert(balde_server_start(server, NULL));
+
+    // the client keeps sending the body it was told not to send, and still
+    // gets the response.
+    gint fd = http_connect(server);
+    http_send(fd, "POST /body HTTP/1.1\r\nContent-Length: 1000000\r\n\r\n");
+    gchar *body = g_strnfill(4096, 'a');
+    for (guint i = 0; i < 16; i++)
+        g_assert_cmpint(send(fd, body, 4096, MSG_NOSIGNAL), ==, 4096);
+    gchar *out = http_receive(fd);
+    g_assert(g_str_has_prefix(out, "HTTP/1.1 413 REQUEST ENTITY TOO LARGE\r\n"));
+    g_free(out);
+    http_assert_closed(fd);
+    g_usleep(100000);
+    g_assert_cmpint(send(fd, body, 4096, MSG_NOSIGNAL), ==, 4096);
+
+    // the I/O thread is free for other connections meanwhile.
+    gint fd2 = http_connect(server);
+    http_send(fd2, "GET /bola HTTP/1.1\r\n\r\n");
+    out = http_receive(fd2);
+    g_assert(g_str_has_suffix(out, "\r\n\r\n/bola"));
+    g_free(out);
+    close(fd2);
+
+    // a client that never stops sending is cut off.
+    fd2 = http_connect(server);
+    http_send(fd2, "POST /body HTTP/1.1\r\nContent-Length: 1000000000\r\n\r\n");
+    gsize sent = 0;
+    while (sent < 4 * 1024 * 1024 && send(fd2, body, 4096, MSG_NOSIGNAL) > 0)
+        sent += 4096;
+    g_assert_cmpint(sent, <, 4 * 1024 * 1024);
+    close(fd2);
+
+    // and a client that neither sends nor closes is closed after a while.
+    g_usleep(2500000);
+    g_assert_cmpint(send(fd, body, 1, MSG_NOSIGNAL), <, 0);
+    close(fd);
+    g_free(body);
+
+    balde_sapi_httpd_server_free(server);
+    balde_app_free(app);
+}
+
+
+void
+test_httpd_server_timeout(void)
+{
+    balde_app_t *app = http_app_new();
+    balde_server_t *server = balde_sapi_httpd_server_new(app, 1, 2, 0, 0, NULL);
+    balde_server_set_timeout(server, 100000);
+    g_assert(balde_server_start(server, NULL));
+
+    // idle connections, and requests that never finish, are dropped.
+    gint fd = http_connect(server);
+    gint64 start = g_get_monotonic_time();
+    http_assert_closed(fd);
+    g_assert_cmpint(g_get_monotonic_time() - start, >=, 100000);
+    close(fd);
+    fd = http_connect(server);
+    http_send(fd, "GET /bola HTTP/1.1\r\nHost: loc");
+    http_assert_closed(fd);
+    close(fd);
+
+    // requests waiting for the application don't time out.
+    fd = http_connect(server);
+    http_send(fd, "GET /slow HTTP/1.1\r\n\r\n");
+    gchar *out = http_receive(fd);
+    g_assert(g_str_has_suffix(out, "\r\n\r\nslow"));
+    g_free(out);
+    http_assert_closed(fd);
+    close(fd);
+
+    balde_sapi_httpd_server_free(server);
+    balde_app_free(app);
+}
+
+
 int
 main(int argc, char** argv)
 {
     g_test_init(&argc, &argv, NULL);
-    g_test_add_func("/sapi/httpd/parse_request", test_httpd_parse_request);
-    g_test_add_func("/sapi/httpd/parse_request_without_query_string",
-        test_httpd_parse_request_without_query_string);
     g_test_add_func("/sapi/httpd/response_render", test_httpd_response_render);
     g_test_add_func("/sapi/httpd/response_render_with_custom_mime_type",
         test_httpd_response_render_with_custom_mime_type);
@@ -224,9 +891,29 @@ main(int argc, char** argv)
         test_httpd_response_render_with_multiple_cookies);
     g_test_add_func("/sapi/httpd/response_render_without_body",
         test_httpd_response_render_without_body);
+    g_test_add_func("/sapi/httpd/response_render_stream",
+        test_httpd_response_render_stream);
     g_test_add_func("/sapi/httpd/response_render_exception",
         test_httpd_response_render_exception);
     g_test_add_func("/sapi/httpd/response_render_exception_without_body",
         test_httpd_response_render_exception_without_body);
+    g_test_add_func("/sapi/httpd/parse_headers", test_httpd_parse_headers);
+    g_test_add_func("/sapi/httpd/parse_headers_without_query_string",
+        test_httpd_parse_headers_without_query_string);
+    g_test_add_func("/sapi/httpd/server_keep_alive",
+        test_httpd_server_keep_alive);
+    g_test_add_func("/sapi/httpd/server_pipelined",
+        test_httpd_server_pipelined);
+    g_test_add_func("/sapi/httpd/server_pipelined_after_close",
+        test_httpd_server_pipelined_after_close);
+    g_test_add_func("/sapi/httpd/server_half_closed",
+        test_httpd_server_half_closed);
+    g_test_add_func("/sapi/httpd/server_body", test_httpd_server_body);
+    g_test_add_func("/sapi/httpd/server_chunked_body",
+        test_httpd_server_chunked_body);
+    g_test_add_func("/sapi/httpd/server_stream", test_httpd_server_stream);
+    g_test_add_func("/sapi/httpd/server_limits", test_httpd_server_limits);
+    g_test_add_func("/sapi/httpd/server_linger", test_httpd_server_linger);
+    g_test_add_func("/sapi/httpd/server_timeout", test_httpd_server_timeout);
     return g_test_run();
 }
@@ -0,0 +1,325 @@
+/*
+ * balde: A microframework for C based on GLib and bad intentions.
+ * Copyright (C) 2013-2017 Rafael G. Martins <rafael@rafaelmartins.eng.br>
+ *
+ * This program can be distributed under the terms of the LGPL-2 License.
+ * See the file COPYING.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "../src/sapi.h"
+#include "../src/sapi/prefork.h"
+#include "../src/sapi/server.h"
+
+static gchar *program = NULL;
+
+
+static gint
+worker_return(gint *value)
+{
+    return *value;
+}
+
+
+void
+test_prefork_single(void)
+{
+    // a single worker runs in the calling process.
+    gint value = 42;
+    g_assert_cmpint(balde_sapi_prefork_run(1, NULL, (balde_prefork_func_t)
+        worker_return, &value), ==, 42);
+    g_assert_cmpint(balde_sapi_prefork_run(0, NULL, (balde_prefork_func_t)
+        worker_return, &value), ==, 42);
+}
+
+
+void
+test_prefork_fatal(void)
+{
+    gint value = BALDE_PREFORK_FATAL;
+    g_assert_cmpint(balde_sapi_prefork_run(4, NULL, (balde_prefork_func_t)
+        worker_return, &value), ==, BALDE_PREFORK_FATAL);
+}
+
+
+static gint
+worker_crash(const gchar *path)
+{
+    // each run leaves a mark. the first runs crash, then the worker gives up.
+    gint fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0600);
+    g_assert(write(fd, "x", 1) == 1);
+    close(fd);
+    struct stat st;
+    g_assert(stat(path, &st) == 0);
+    if (st.st_size <= 2)
+        kill(getpid(), SIGKILL);
+    return BALDE_PREFORK_FATAL;
+}
+
+
+void
+test_prefork_respawn(void)
+{
+    gchar *dir = g_dir_make_tmp("balde-XXXXXX", NULL);
+    gchar *path = g_build_filename(dir, "runs", NULL);
+    g_assert_cmpint(balde_sapi_prefork_run(2, NULL, (balde_prefork_func_t)
+        worker_crash, path), ==, BALDE_PREFORK_FATAL);
+    struct stat st;
+    g_assert(stat(path, &st) == 0);
+    g_assert_cmpint(st.st_size, >=, 3);
+    g_unlink(path);
+    g_rmdir(dir);
+    g_free(path);
+    g_free(dir);
+}
+
+
+static guint16
+socket_get_port(GSocket *socket)
+{
+    GSocketAddress *addr = g_socket_get_local_address(socket, NULL);
+    g_assert(addr != NULL);
+    guint16 rv = g_inet_socket_address_get_port(G_INET_SOCKET_ADDRESS(addr));
+    g_object_unref(addr);
+    return rv;
+}
+
+
+void
+test_prefork_endpoint_inet(void)
+{
+    GError *error = NULL;
+    balde_server_endpoint_t *endpoint = balde_server_endpoint_new("127.0.0.1",
+        0, NULL, NULL, NULL, FALSE, &error);
+    g_assert_no_error(error);
+    GSList *s1 = balde_server_endpoint_get_sockets(endpoint, NULL);
+    GSList *s2 = balde_server_endpoint_get_sockets(endpoint, NULL);
+    g_assert_cmpint(g_slist_length(s1), ==, 1);
+    g_assert_cmpint(g_slist_length(s2), ==, 1);
+    g_assert(s1->data == s2->data);
+    g_assert_cmpint(socket_get_port(s1->data), >, 0);
+    g_slist_free_full(s1, g_object_unref);
+    g_slist_free_full(s2, g_object_unref);
+    balde_server_endpoint_free(endpoint);
+
+    endpoint = balde_server_endpoint_new("bola", 0, NULL, NULL, NULL, FALSE,
+        &error);
+    g_assert(endpoint == NULL);
+    g_assert_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT);
+    g_clear_error(&error);
+}
+
+
+void
+test_prefork_endpoint_reuseport(void)
+{
+#ifdef SO_REUSEPORT
+    GError *error = NULL;
+    balde_server_endpoint_t *endpoint = balde_server_endpoint_new("127.0.0.1",
+        0, NULL, NULL, NULL, TRUE, &error);
+    g_assert_no_error(error);
+
+    // each worker gets the shared socket and one of its own, all of them on
+    // the same port.
+    GSList *s1 = balde_server_endpoint_get_sockets(endpoint, &error);
+    g_assert_no_error(error);
+    GSList *s2 = balde_server_endpoint_get_sockets(endpoint, &error);
+    g_assert_no_error(error);
+    g_assert_cmpint(g_slist_length(s1), ==, 2);
+    g_assert_cmpint(g_slist_length(s2), ==, 2);
+    g_assert(s1->data == s2->data);
+    g_assert(s1->next->data != s2->next->data);
+    guint16 port = socket_get_port(s1->data);
+    g_assert_cmpint(port, >, 0);
+    g_assert_cmpint(socket_get_port(s1->next->data), ==, port);
+    g_assert_cmpint(socket_get_port(s2->next->data), ==, port);
+
+    GSocketClient *client = g_socket_client_new();
+    GSocketConnection *conn = g_socket_client_connect_to_host(client,
+        "127.0.0.1", port, NULL, &error);
+    g_assert_no_error(error);
+    g_object_unref(conn);
+    g_object_unref(client);
+
+    g_slist_free_full(s1, g_object_unref);
+    g_slist_free_full(s2, g_object_unref);
+    balde_server_endpoint_free(endpoint);
+#endif /* SO_REUSEPORT */
+}
+
+
+void
+test_prefork_endpoint_unix(void)
+{
+    GError *error = NULL;
+    gchar *dir = g_dir_make_tmp("balde-XXXXXX", NULL);
+    gchar *path = g_build_filename(dir, "balde.sock", NULL);
+
+    // unix sockets are always shared, reuseport or not.
+    balde_server_endpoint_t *endpoint = balde_server_endpoint_new(NULL, 0,
+        path, NULL, NULL, TRUE, &error);
+    g_assert_no_error(error);
+    GSList *s1 = balde_server_endpoint_get_sockets(endpoint, NULL);
+    GSList *s2 = balde_server_endpoint_get_sockets(endpoint, NULL);
+    g_assert_cmpint(g_slist_length(s1), ==, 1);
+    g_assert(s1->data == s2->data);
+    g_slist_free_full(s1, g_object_unref);
+    g_slist_free_full(s2, g_object_unref);
+    g_assert(g_file_test(path, G_FILE_TEST_EXISTS));
+    balde_server_endpoint_free(endpoint);
+    g_assert(!g_file_test(path, G_FILE_TEST_EXISTS));
+
+    g_rmdir(dir);
+    g_free(path);
+    g_free(dir);
+}
+
+
+static gint
+worker_reload(balde_server_endpoint_t *endpoint)
+{
+    raise(SIGHUP);
+    return balde_sapi_prefork_wait(endpoint) ? 1 : 0;
+}
+
+
+static gint
+worker_reload_fail(balde_server_endpoint_t *endpoint)
+{
+    raise(SIGHUP);
+    raise(SIGTERM);
+    return balde_sapi_prefork_wait(endpoint) ? 1 : 0;
+}
+
+
+static gint
+worker_reloaded(balde_server_endpoint_t *endpoint)
+{
+    // answers a single connection, to prove it got the socket.
+    GSList *sockets = balde_server_endpoint_get_sockets(endpoint, NULL);
+    g_assert(sockets != NULL);
+    struct pollfd pfd = {g_socket_get_fd(sockets->data), POLLIN, 0};
+    g_assert_cmpint(poll(&pfd, 1, 10000), ==, 1);
+    gint fd = accept(pfd.fd, NULL, NULL);
+    g_assert_cmpint(fd, >=, 0);
+    g_assert_cmpint(send(fd, "new", 3, 0), ==, 3);
+    close(fd);
+    g_slist_free_full(sockets, g_object_unref);
+    return 0;
+}
+
+
+static gint
+reloaded_main(void)
+{
+    // we are the new process, started by test_prefork_reload().
+    balde_server_endpoint_t *endpoint = balde_server_endpoint_new(NULL, 0,
+        NULL, NULL, NULL, FALSE, NULL);
+    if (endpoint == NULL)
+        return 1;
+    gint rv = balde_sapi_prefork_run(1, endpoint, (balde_prefork_func_t)
+        worker_reloaded, endpoint);
+    balde_server_endpoint_free(endpoint);
+    return rv;
+}
+
+
+void
+test_prefork_reload(void)
+{
+    gchar *dir = g_dir_make_tmp("balde-XXXXXX", NULL);
+    gchar *path = g_build_filename(dir, "balde.sock", NULL);
+    balde_server_endpoint_t *endpoint = balde_server_endpoint_new(NULL, 0,
+        path, NULL, NULL, FALSE, NULL);
+    g_assert(endpoint != NULL);
+
+    gchar *argv[] = {program, NULL};
+    balde_sapi_set_argv(argv);
+    g_assert_cmpint(balde_sapi_prefork_run(1, endpoint, (balde_prefork_func_t)
+        worker_reload, endpoint), ==, 1);
+    balde_sapi_set_argv(NULL);
+
+    // the socket belongs to the new process now.
+    balde_server_endpoint_free(endpoint);
+    g_assert(g_file_test(path, G_FILE_TEST_EXISTS));
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    gint fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    g_assert(connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0);
+    gchar buf[4] = {0};
+    g_assert_cmpint(recv(fd, buf, 3, MSG_WAITALL), ==, 3);
+    g_assert_cmpstr(buf, ==, "new");
+    close(fd);
+
+    gint status;
+    g_assert_cmpint(wait(&status), >, 0);
+    g_assert(WIFEXITED(status));
+    g_assert_cmpint(WEXITSTATUS(status), ==, 0);
+
+    g_unlink(path);
+    g_rmdir(dir);
+    g_free(path);
+    g_free(dir);
+}
+
+
+void
+test_prefork_reload_fail(void)
+{
+    gchar *dir = g_dir_make_tmp("balde-XXXXXX", NULL);
+    gchar *path = g_build_filename(dir, "balde.sock", NULL);
+    balde_server_endpoint_t *endpoint = balde_server_endpoint_new(NULL, 0,
+        path, NULL, NULL, FALSE, NULL);
+    g_assert(endpoint != NULL);
+
+    // a new process that never gets ready doesn't replace us.
+    gchar *argv[] = {"false", NULL};
+    balde_sapi_set_argv(argv);
+    g_assert_cmpint(balde_sapi_prefork_run(1, endpoint, (balde_prefork_func_t)
+        worker_reload_fail, endpoint), ==, 0);
+    balde_sapi_set_argv(NULL);
+
+    balde_server_endpoint_free(endpoint);
+    g_assert(!g_file_test(path, G_FILE_TEST_EXISTS));
+
+    g_rmdir(dir);
+    g_free(path);
+    g_free(dir);
+}
+
+
+int
+main(int argc, char** argv)
+{
+    if (g_getenv(BALDE_SERVER_LISTEN_FD_ENV) != NULL)
+        return reloaded_main();
+    program = argv[0];
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/sapi/prefork/single", test_prefork_single);
+    g_test_add_func("/sapi/prefork/fatal", test_prefork_fatal);
+    g_test_add_func("/sapi/prefork/respawn", test_prefork_respawn);
+    g_test_add_func("/sapi/prefork/endpoint_inet", test_prefork_endpoint_inet);
+    g_test_add_func("/sapi/prefork/endpoint_reuseport",
+        test_prefork_endpoint_reuseport);
+    g_test_add_func("/sapi/prefork/endpoint_unix", test_prefork_endpoint_unix);
+    g_test_add_func("/sapi/prefork/reload", test_prefork_reload);
+    g_test_add_func("/sapi/prefork/reload_fail", test_prefork_reload_fail);
+    return g_test_run();
+}
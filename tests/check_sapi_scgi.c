@@ -12,18 +12,118 @@
 
 #include <glib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 #include "../src/balde.h"
 #include "../src/app.h"
 #include "../src/requests.h"
 #include "../src/sapi/scgi.h"
+#include "../src/sapi/server.h"
+
+
+static void
+scgi_add_request(GString *str, const gchar *method, const gchar *path_info,
+    const gchar *body)
+{
+    GString *headers = g_string_new(NULL);
+    g_string_append_printf(headers, "CONTENT_LENGTH%c%zu%c", 0,
+        body != NULL ? strlen(body) : 0, 0);
+    g_string_append_printf(headers, "SCGI%c1%c", 0, 0);
+    g_string_append_printf(headers, "REQUEST_METHOD%c%s%c", 0, method, 0);
+    g_string_append_printf(headers, "PATH_INFO%c%s%c", 0, path_info, 0);
+    g_string_append_printf(str, "%zu:", headers->len);
+    g_string_append_len(str, headers->str, headers->len);
+    g_string_append_c(str, ',');
+    if (body != NULL)
+        g_string_append(str, body);
+    g_string_free(headers, TRUE);
+}
+
+
+static gint
+scgi_connect(balde_server_t *server)
+{
+    gint fds[2];
+    g_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    struct timeval tv = {5, 0};
+    setsockopt(fds[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    balde_server_add_connection(server, fds[1]);
+    return fds[0];
+}
+
+
+static void
+scgi_send(gint fd, GString *str)
+{
+    g_assert_cmpint(write(fd, str->str, str->len), ==, str->len);
+}
+
+
+// reads a response, up to the end of its body.
+static gchar*
+scgi_receive(gint fd)
+{
+    GString *rv = g_string_new(NULL);
+    gchar c;
+    while (!g_str_has_suffix(rv->str, "\r\n\r\n")) {
+        g_assert_cmpint(recv(fd, &c, 1, 0), ==, 1);
+        g_string_append_c(rv, c);
+    }
+    gchar *len = strstr(rv->str, "Content-Length: ");
+    g_assert(len != NULL);
+    gsize body_len = g_ascii_strtoull(len + 16, NULL, 10);
+    gsize offset = rv->len;
+    g_string_set_size(rv, offset + body_len);
+    if (body_len > 0)
+        g_assert_cmpint(recv(fd, rv->str + offset, body_len, MSG_WAITALL), ==,
+            body_len);
+    return g_string_free(rv, FALSE);
+}
+
+
+static balde_response_t*
+path_view(balde_app_t *app, balde_request_t *request)
+{
+    return balde_make_response(request->path);
+}
+
+
+static balde_response_t*
+slow_view(balde_app_t *app, balde_request_t *request)
+{
+    g_usleep(200000);
+    return balde_make_response("slow");
+}
+
+
+static balde_response_t*
+body_view(balde_app_t *app, balde_request_t *request)
+{
+    GString *body = request->priv->body;
+    gchar *rv = g_strdup_printf("%zu %s", body != NULL ? body->len : 0,
+        body != NULL ? body->str : "");
+    balde_response_t *response = balde_make_response(rv);
+    g_free(rv);
+    return response;
+}
+
+
+// the netstring contents and its comma, as the server hands them over.
+static balde_request_env_t*
+scgi_parse_netstring(const gchar *netstring, gsize len)
+{
+    gchar *data = g_malloc(len + 1);
+    memcpy(data, netstring, len + 1);
+    return balde_sapi_scgi_parse_netstring(data, len);
+}
 
 
 void
-test_scgi_parse_request(void)
+test_scgi_parse_netstring(void)
 {
-    balde_app_t *app = balde_app_init();
     gchar *test = g_strdup_printf(
-        "136:CONTENT_LENGTH%c6%c"          // 14 + 1 + 2 = 17
+        "CONTENT_LENGTH%c6%c"              // 14 + 1 + 2 = 17
         "REQUEST_METHOD%cGET%c"            // 14 + 3 + 2 = 19
         "PATH_INFO%c/bola%c"               // 9 + 5 + 2 = 16
         "HTTP_HOST%cexample.com%c"         // 9 + 11 + 2 = 22
@@ -31,9 +131,7 @@ test_scgi_parse_request(void)
         "QUERY_STRING%cfoo=bar&baz=lol%c"  // 12 + 15 + 2 = 29
         "HTTP_CHUNDA%crs,"                 // 11 + 2 + 1 = 14
         "XD=asd\r\n", 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
-    GInputStream *tmp = g_memory_input_stream_new_from_data(test, 149, NULL);
-    balde_request_env_t *req = balde_sapi_scgi_parse_request(app, tmp);
-    g_object_unref(tmp);
+    balde_request_env_t *req = scgi_parse_netstring(test, 136);
     g_free(test);
     g_assert(req != NULL);
     g_assert_cmpstr(req->request_method, ==, "GET");
@@ -44,29 +142,24 @@ test_scgi_parse_request(void)
     g_assert_cmpstr(g_hash_table_lookup(req->headers, "location"), ==, "/foo");
     g_assert_cmpstr(g_hash_table_lookup(req->headers, "chunda"), ==, "rs");
     g_assert_cmpstr(g_hash_table_lookup(req->headers, "content-length"), ==, "6");
-    g_assert_cmpstr(req->body->str, ==, "XD=asd");
-    g_assert_cmpint(req->body->len, ==, 6);
+    g_assert(req->body == NULL);
     g_assert(!req->https);
     balde_request_env_free(req);
-    balde_app_free(app);
 }
 
 
 void
-test_scgi_parse_request_without_query_string(void)
+test_scgi_parse_netstring_without_query_string(void)
 {
-    balde_app_t *app = balde_app_init();
     gchar *test = g_strdup_printf(
-        "107:CONTENT_LENGTH%c6%c"   // 14 + 1 + 2 = 17
+        "CONTENT_LENGTH%c6%c"       // 14 + 1 + 2 = 17
         "REQUEST_METHOD%cGET%c"     // 14 + 3 + 2 = 19
         "PATH_INFO%c/bola%c"        // 9 + 5 + 2 = 16
         "HTTP_HOST%cexample.com%c"  // 9 + 11 + 2 = 22
         "HTTP_LOCATION%c/foo%c"     // 13 + 4 + 2 = 19
         "HTTP_CHUNDA%crs,"          // 11 + 2 + 1 = 14
         "XD=asd\r\n", 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
-    GInputStream *tmp = g_memory_input_stream_new_from_data(test, 120, NULL);
-    balde_request_env_t *req = balde_sapi_scgi_parse_request(app, tmp);
-    g_object_unref(tmp);
+    balde_request_env_t *req = scgi_parse_netstring(test, 107);
     g_free(test);
     g_assert(req != NULL);
     g_assert_cmpstr(req->request_method, ==, "GET");
@@ -77,9 +170,229 @@ test_scgi_parse_request_without_query_string(void)
     g_assert_cmpstr(g_hash_table_lookup(req->headers, "location"), ==, "/foo");
     g_assert_cmpstr(g_hash_table_lookup(req->headers, "chunda"), ==, "rs");
     g_assert_cmpstr(g_hash_table_lookup(req->headers, "content-length"), ==, "6");
-    g_assert_cmpstr(req->body->str, ==, "XD=asd");
-    g_assert_cmpint(req->body->len, ==, 6);
     balde_request_env_free(req);
+}
+
+
+void
+test_scgi_parse_netstring_bad(void)
+{
+    // no comma after the contents.
+    gchar test[] = "PATH_INFO\0/bola\0;";
+    g_assert(scgi_parse_netstring(test, 16) == NULL);
+}
+
+
+void
+test_scgi_parse_netstring_perf(void)
+{
+    // a request as big as what browsers send, with plenty of headers.
+    GString *headers = g_string_new(NULL);
+    g_string_append_len(headers, "CONTENT_LENGTH\0" "6\0", 17);
+    g_string_append_len(headers, "REQUEST_METHOD\0" "POST\0", 20);
+    g_string_append_len(headers, "PATH_INFO\0" "/bola\0", 16);
+    g_string_append_len(headers, "QUERY_STRING\0" "foo=bar\0", 21);
+    for (guint i = 0; i < 40; i++)
+        g_string_append_printf(headers, "HTTP_X_HEADER_%u%c"
+            "some reasonably long header value, number %u%c", i, 0, i, 0);
+    g_string_append_c(headers, ',');
+
+    // the copy is part of the work, the server does it for every request.
+    guint iterations = g_test_perf() ? 50000 : 500;
+    g_test_timer_start();
+    for (guint i = 0; i < iterations; i++) {
+        balde_request_env_t *req = scgi_parse_netstring(headers->str,
+            headers->len - 1);
+        g_assert(req != NULL);
+        g_assert_cmpint(g_hash_table_size(req->headers), ==, 41);
+        balde_request_env_free(req);
+    }
+    gdouble time = g_test_timer_elapsed();
+    g_test_minimized_result(time, "%u requests with %u headers: %.3fs",
+        iterations, 41, time);
+
+    g_string_free(headers, TRUE);
+}
+
+
+void
+test_scgi_server(void)
+{
+    balde_app_t *app = balde_app_init();
+    balde_app_add_url_rule(app, "path", "/<path>", BALDE_HTTP_GET, path_view);
+    balde_server_t *server = balde_sapi_scgi_server_new(app, 1, 2, 0, 0, FALSE,
+        NULL);
+    g_assert(server != NULL);
+    g_assert(balde_server_start(server, NULL));
+
+    gint fd = scgi_connect(server);
+    GString *req = g_string_new(NULL);
+    scgi_add_request(req, "GET", "/bola", NULL);
+    scgi_send(fd, req);
+    gchar *out = scgi_receive(fd);
+    g_assert(g_str_has_suffix(out, "\r\n\r\n/bola"));
+    g_free(out);
+
+    // the connection is closed after the response.
+    gchar c;
+    g_assert_cmpint(recv(fd, &c, 1, 0), ==, 0);
+    close(fd);
+
+    g_string_free(req, TRUE);
+    balde_sapi_scgi_server_free(server);
+    balde_app_free(app);
+}
+
+
+void
+test_scgi_server_split_request(void)
+{
+    balde_app_t *app = balde_app_init();
+    balde_app_add_url_rule(app, "body", "/body", BALDE_HTTP_POST, body_view);
+    balde_server_t *server = balde_sapi_scgi_server_new(app, 1, 2, 0, 0, FALSE,
+        NULL);
+    g_assert(balde_server_start(server, NULL));
+
+    // the request arrives in pieces, cut in the middle of the netstring
+    // length, of the headers and of the body.
+    gint fd = scgi_connect(server);
+    GString *req = g_string_new(NULL);
+    scgi_add_request(req, "POST", "/body", "XD=asd&foo=bar");
+    gsize cuts[] = {1, 20, req->len - 5, req->len};
+    gsize last = 0;
+    for (guint i = 0; i < G_N_ELEMENTS(cuts); i++) {
+        g_assert_cmpint(write(fd, req->str + last, cuts[i] - last), ==,
+            cuts[i] - last);
+        last = cuts[i];
+        g_usleep(20000);
+    }
+    gchar *out = scgi_receive(fd);
+    g_assert(g_str_has_suffix(out, "\r\n\r\n14 XD=asd&foo=bar"));
+    g_free(out);
+    close(fd);
+
+    g_string_free(req, TRUE);
+    balde_sapi_scgi_server_free(server);
+    balde_app_free(app);
+}
+
+
+void
+test_scgi_server_persistent(void)
+{
+    balde_app_t *app = balde_app_init();
+    balde_app_add_url_rule(app, "slow", "/slow", BALDE_HTTP_GET, slow_view);
+    balde_app_add_url_rule(app, "body", "/body", BALDE_HTTP_POST, body_view);
+    balde_app_add_url_rule(app, "path", "/<path>", BALDE_HTTP_GET, path_view);
+    balde_server_t *server = balde_sapi_scgi_server_new(app, 1, 4, 0, 0, TRUE,
+        NULL);
+    g_assert(balde_server_start(server, NULL));
+
+    // requests sent back to back are answered in order, even if the first
+    // one is the slowest.
+    gint fd = scgi_connect(server);
+    GString *req = g_string_new(NULL);
+    scgi_add_request(req, "GET", "/slow", NULL);
+    scgi_add_request(req, "POST", "/body", "XD=asd");
+    scgi_add_request(req, "GET", "/bola", NULL);
+    scgi_send(fd, req);
+    gchar *out = scgi_receive(fd);
+    g_assert(g_str_has_suffix(out, "\r\n\r\nslow"));
+    g_free(out);
+    out = scgi_receive(fd);
+    g_assert(g_str_has_suffix(out, "\r\n\r\n6 XD=asd"));
+    g_free(out);
+    out = scgi_receive(fd);
+    g_assert(g_str_has_suffix(out, "\r\n\r\n/bola"));
+    g_free(out);
+
+    // and the connection is still there for more.
+    g_string_truncate(req, 0);
+    scgi_add_request(req, "GET", "/guda", NULL);
+    scgi_send(fd, req);
+    out = scgi_receive(fd);
+    g_assert(g_str_has_suffix(out, "\r\n\r\n/guda"));
+    g_free(out);
+    close(fd);
+
+    g_string_free(req, TRUE);
+    balde_sapi_scgi_server_free(server);
+    balde_app_free(app);
+}
+
+
+void
+test_scgi_server_bad_request(void)
+{
+    balde_app_t *app = balde_app_init();
+    balde_app_add_url_rule(app, "path", "/<path>", BALDE_HTTP_GET, path_view);
+    balde_server_t *server = balde_sapi_scgi_server_new(app, 1, 1, 0, 0, TRUE,
+        NULL);
+    g_assert(balde_server_start(server, NULL));
+
+    // a good request, followed by garbage.
+    gint fd = scgi_connect(server);
+    GString *req = g_string_new(NULL);
+    scgi_add_request(req, "GET", "/bola", NULL);
+    g_string_append(req, "12345678:bola");
+    scgi_send(fd, req);
+    gchar *out = scgi_receive(fd);
+    g_assert(g_str_has_suffix(out, "\r\n\r\n/bola"));
+    g_free(out);
+    out = scgi_receive(fd);
+    g_assert(g_str_has_prefix(out, "Status: 400 BAD REQUEST\r\n"));
+    g_free(out);
+
+    // there's no telling where the next request starts, so it's over.
+    gchar c;
+    g_assert_cmpint(recv(fd, &c, 1, 0), ==, 0);
+    close(fd);
+
+    // the shared application context is untouched.
+    g_assert(app->error == NULL);
+
+    g_string_free(req, TRUE);
+    balde_sapi_scgi_server_free(server);
+    balde_app_free(app);
+}
+
+
+void
+test_scgi_server_overloaded(void)
+{
+    balde_app_t *app = balde_app_init();
+    balde_app_add_url_rule(app, "slow", "/slow", BALDE_HTTP_GET, slow_view);
+    balde_server_t *server = balde_sapi_scgi_server_new(app, 1, 1, 1, 0, FALSE,
+        NULL);
+    g_assert(balde_server_start(server, NULL));
+
+    // the first request keeps the only application thread busy, the second
+    // one fills the queue, the third one is refused right away.
+    GString *req = g_string_new(NULL);
+    scgi_add_request(req, "GET", "/slow", NULL);
+    gint fds[3];
+    for (guint i = 0; i < 3; i++) {
+        fds[i] = scgi_connect(server);
+        scgi_send(fds[i], req);
+        g_usleep(50000);
+    }
+    g_assert_cmpint(balde_app_get_queued_requests(app), ==, 1);
+    g_assert_cmpint(balde_app_get_shed_requests(app), ==, 1);
+
+    gchar *out = scgi_receive(fds[2]);
+    g_assert(g_str_has_prefix(out, "Status: 503 SERVICE UNAVAILABLE\r\n"));
+    g_free(out);
+    for (guint i = 0; i < 2; i++) {
+        out = scgi_receive(fds[i]);
+        g_assert(g_str_has_suffix(out, "\r\n\r\nslow"));
+        g_free(out);
+    }
+    for (guint i = 0; i < 3; i++)
+        close(fds[i]);
+    g_assert(app->error == NULL);
+
+    g_string_free(req, TRUE);
+    balde_sapi_scgi_server_free(server);
     balde_app_free(app);
 }
 
@@ -88,8 +401,19 @@ int
 main(int argc, char** argv)
 {
     g_test_init(&argc, &argv, NULL);
-    g_test_add_func("/sapi/scgi/parse_request", test_scgi_parse_request);
-    g_test_add_func("/sapi/scgi/parse_request_without_query_string",
-        test_scgi_parse_request_without_query_string);
+    g_test_add_func("/sapi/scgi/parse_netstring", test_scgi_parse_netstring);
+    g_test_add_func("/sapi/scgi/parse_netstring_without_query_string",
+        test_scgi_parse_netstring_without_query_string);
+    g_test_add_func("/sapi/scgi/parse_netstring_bad",
+        test_scgi_parse_netstring_bad);
+    g_test_add_func("/sapi/scgi/parse_netstring_perf",
+        test_scgi_parse_netstring_perf);
+    g_test_add_func("/sapi/scgi/server", test_scgi_server);
+    g_test_add_func("/sapi/scgi/server_split_request",
+        test_scgi_server_split_request);
+    g_test_add_func("/sapi/scgi/server_persistent", test_scgi_server_persistent);
+    g_test_add_func("/sapi/scgi/server_bad_request",
+        test_scgi_server_bad_request);
+    g_test_add_func("/sapi/scgi/server_overloaded", test_scgi_server_overloaded);
     return g_test_run();
 }
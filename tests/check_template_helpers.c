@@ -84,6 +84,30 @@ test_tmpl_url_for_with_script_name(void)
 }
 
 
+void
+test_tmpl_url_for_append(void)
+{
+    g_setenv("PATH_INFO", "/", TRUE);
+    g_setenv("REQUEST_METHOD", "GET", TRUE);
+    balde_app_t *app = balde_app_init();
+    balde_request_t *request = balde_make_request(app, balde_sapi_cgi_parse_request(app));
+    balde_app_add_url_rule(app, "arcoiro", "/arcoiro/<bola>/<guda>/",
+        BALDE_HTTP_GET, arcoiro_view);
+    GString *str = g_string_new("<p>");
+    balde_tmpl_url_for_append(str, app, request, "arcoiro", FALSE, "chunda", "guto");
+    g_string_append(str, "</p><p>");
+    balde_tmpl_url_for_append(str, app, request, "static", FALSE, "foo/jquery-min.js");
+    g_string_append(str, "</p>");
+    g_assert_cmpstr(str->str, ==,
+        "<p>/arcoiro/chunda/guto/</p><p>/static/foo/jquery-min.js</p>");
+    g_string_free(str, TRUE);
+    balde_request_free(request);
+    balde_app_free(app);
+    g_unsetenv("REQUEST_METHOD");
+    g_unsetenv("PATH_INFO");
+}
+
+
 int
 main(int argc, char** argv)
 {
@@ -91,5 +115,6 @@ main(int argc, char** argv)
     g_test_add_func("/template_helpers/url_for", test_tmpl_url_for);
     g_test_add_func("/template_helpers/url_for_with_script_name",
         test_tmpl_url_for_with_script_name);
+    g_test_add_func("/template_helpers/url_for_append", test_tmpl_url_for_append);
     return g_test_run();
 }
@@ -11,6 +11,7 @@
 #endif /* HAVE_CONFIG_H */
 
 #include <glib.h>
+#include <string.h>
 #include "../src/utils.h"
 
 
@@ -36,6 +37,54 @@ test_base64_decode(void)
 }
 
 
+void
+test_base64_roundtrip(void)
+{
+    guchar data[256];
+    for (guint i = 0; i < 256; i++)
+        data[i] = (guchar) (255 - i);
+    for (gsize len = 0; len < 256; len++) {
+        gchar *enc = balde_base64_encode(data, len);
+        gchar *expected = g_base64_encode(data, len);
+        g_strdelimit(expected, "+", '-');
+        g_strdelimit(expected, "/", '_');
+        g_assert_cmpstr(enc, ==, expected);
+        gsize out_len;
+        guchar *dec = balde_base64_decode(enc, &out_len);
+        g_assert_cmpint(out_len, ==, len);
+        g_assert(memcmp(dec, data, len) == 0);
+        g_assert(dec[out_len] == '\0');
+        g_free(dec);
+        g_free(expected);
+        g_free(enc);
+    }
+}
+
+
+void
+test_base64_decode_lenient(void)
+{
+    const gchar *inputs[] = {"Ym9sYQ==", "Ym9s\nYQ==", "Ym9sYQ", "Ym9sYQ=",
+        "Ym9sY", "Ym9s", "+/+/", "Y=9s", "Ym=sYQ==", "====", "=", "!@#$", "",
+        NULL};
+    for (guint i = 0; inputs[i] != NULL; i++) {
+        gsize len, expected_len;
+        guchar *t = balde_base64_decode(inputs[i], &len);
+        guchar *expected = g_base64_decode(inputs[i], &expected_len);
+        g_assert_cmpint(len, ==, expected_len);
+        g_assert(memcmp(t, expected, len) == 0);
+        g_assert(t[len] == '\0');
+        g_free(expected);
+        g_free(t);
+    }
+    gsize len;
+    guchar *t = balde_base64_decode("Ym9s\nYQ", &len);  // unpadded
+    g_assert_cmpint(len, ==, 3);
+    g_assert_cmpstr((gchar*) t, ==, "bol");
+    g_free(t);
+}
+
+
 void
 test_timestamp(void)
 {
@@ -86,6 +135,8 @@ main(int argc, char** argv)
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/utils/base64_encode", test_base64_encode);
     g_test_add_func("/utils/base64_decode", test_base64_decode);
+    g_test_add_func("/utils/base64_roundtrip", test_base64_roundtrip);
+    g_test_add_func("/utils/base64_decode_lenient", test_base64_decode_lenient);
     g_test_add_func("/utils/timestamp", test_timestamp);
     g_test_add_func("/utils/encoded_timestamp", test_encoded_timestamp);
     g_test_add_func("/utils/validate_timestamp", test_validate_timestamp);